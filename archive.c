@@ -0,0 +1,214 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Download of the inverter's energy archives, see archive.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "archive.h"
+#include "frame.h"
+#include "logger.h"
+
+//! most records in a packet
+#define ARCHIVE_PACKET_RECS  (FRAME_MAX_LEN / SMA_ARCHIVE_REC_LEN)
+
+void archive_init(archive_t *a, uint32_t cmd, uint32_t from, uint32_t to, archive_fn_t fn, void *arg)
+{
+    memset(a, 0, sizeof(*a));
+    a->cmd = cmd;
+    a->chunk_secs = cmd == SMA_CMD_ARCHIVE_MONTH ? 31 * 86400 : 86400;
+    a->next = a->flush = a->cursor = from;
+    // so that the chunk after the last can't wrap
+    a->to = to < UINT32_MAX ? to : UINT32_MAX - 1;
+    a->fn = fn;
+    a->arg = arg;
+}
+
+archive_chunk_t *archive_next(archive_t *a, int max_busy)
+{
+    archive_chunk_t *free_chunk = NULL;
+    int i, busy = 0;
+
+    for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	archive_chunk_t *c = &a->chunks[i];
+	if (c->state == ARCHIVE_SEND)
+	    return c;
+	if (c->state == ARCHIVE_FREE){
+	    if (free_chunk == NULL)
+		free_chunk = c;
+	} else
+	    busy++;
+    }
+    if (free_chunk == NULL || busy >= max_busy || a->next > a->to)
+	return NULL;
+    free_chunk->state = ARCHIVE_SEND;
+    free_chunk->start = a->next;
+    // chunks end with the day, or month, so that they're the same whatever the start of the range
+    free_chunk->end = a->next - a->next % a->chunk_secs + a->chunk_secs - 1;
+    if (free_chunk->end > a->to || free_chunk->end < free_chunk->start)
+	free_chunk->end = a->to;
+    free_chunk->next_fragment = -1;
+    free_chunk->tries = 0;
+    free_chunk->n = 0;
+    a->next = free_chunk->end + 1;
+    return free_chunk;
+}
+
+archive_chunk_t *archive_find(archive_t *a, uint16_t id)
+{
+    int i;
+
+    for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	if (a->chunks[i].state == ARCHIVE_WAIT && a->chunks[i].id == id)
+	    return &a->chunks[i];
+    }
+    return NULL;
+}
+
+//! save the resume cursor, replacing the file in one go so that it's never left half written
+static void archive_save_cursor(const archive_t *a)
+{
+    char tmp[256];
+    FILE *fp;
+
+    if (a->cursor_path == NULL)
+	return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", a->cursor_path);
+    if ((fp = fopen(tmp, "w")) == NULL){
+	LOGGER_FMT_ERROR("Could not write %s: %s", tmp, strerror(errno));
+	return;
+    }
+    fprintf(fp, "%u\n", a->cursor);
+    if (fclose(fp) != 0 || rename(tmp, a->cursor_path) < 0)
+	LOGGER_FMT_ERROR("Could not save the archive cursor to %s: %s", a->cursor_path, strerror(errno));
+}
+
+//! hand on the records of the completed chunks that are next in order of time
+static void archive_flush(archive_t *a)
+{
+    uint32_t cursor = a->cursor;
+    int i, j;
+
+    for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	archive_chunk_t *c = &a->chunks[i];
+	if (c->state != ARCHIVE_DONE || c->start != a->flush)
+	    continue;
+	for (j = 0; j < c->n; j++){
+	    if (c->recs[j].time < a->cursor)
+		continue;
+	    a->fn(&c->recs[j], a->arg);
+	    a->cursor = c->recs[j].time + 1;
+	}
+	a->flush = c->end + 1;
+	c->state = ARCHIVE_FREE;
+	// the next chunk may be any of them
+	i = -1;
+    }
+    if (a->cursor != cursor)
+	archive_save_cursor(a);
+}
+
+int archive_put(archive_t *a, archive_chunk_t *c, const unsigned char *frame, size_t len)
+{
+    sma_archive_rec_t recs[ARCHIVE_PACKET_RECS];
+    int fragment = sma_get_u16(frame + SMA_L2_FRAGMENT_OFF);
+    int n = 0, i, j;
+
+    if (c->next_fragment >= 0 && fragment != c->next_fragment){
+	LOGGER_FMT_INFO("archive %u: packet %i missed", c->start, c->next_fragment);
+	return -1;
+    }
+    // an error, eg no records in the range, leaves the chunk empty
+    if (sma_get_u16(frame + SMA_L2_ERROR_OFF) == 0 && (n = sma_archive_decode(frame, len, recs, ARCHIVE_PACKET_RECS)) < 0)
+	n = 0;
+    for (i = 0; i < n; i++){
+	if (recs[i].time < c->start || recs[i].time > c->end)
+	    continue;
+	if (c->n == ARCHIVE_CHUNK_RECS){
+	    LOGGER_FMT_ERROR("archive %u: more than %i records", c->start, ARCHIVE_CHUNK_RECS);
+	    return -1;
+	}
+	// kept in order of time, the inverter sending the newest first, dropping any repeated
+	for (j = c->n; j > 0 && c->recs[j - 1].time > recs[i].time; j--)
+	    ;
+	if (j > 0 && c->recs[j - 1].time == recs[i].time)
+	    continue;
+	memmove(c->recs + j + 1, c->recs + j, (c->n - j) * sizeof(*c->recs));
+	c->recs[j] = recs[i];
+	c->n++;
+    }
+    if (fragment > 0){
+	c->next_fragment = fragment - 1;
+	return 0;
+    }
+    c->state = ARCHIVE_DONE;
+    archive_flush(a);
+    return 0;
+}
+
+int archive_retry(archive_t *a, archive_chunk_t *c)
+{
+    if (++c->tries >= ARCHIVE_MAX_TRIES){
+	LOGGER_FMT_ERROR("archive %u: giving up after %i tries", c->start, c->tries);
+	return -1;
+    }
+    a->retries++;
+    c->state = ARCHIVE_SEND;
+    c->next_fragment = -1;
+    c->n = 0;
+    return 0;
+}
+
+int archive_damaged(archive_t *a, uint16_t id)
+{
+    archive_chunk_t *c = archive_find(a, id);
+    int i;
+
+    if (c != NULL && archive_retry(a, c) < 0)
+	return -1;
+    // those not yet answered are asked again without counting it as a try, as it was likely another's packet
+    for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	c = &a->chunks[i];
+	if (c->state == ARCHIVE_WAIT && c->next_fragment < 0){
+	    a->retries++;
+	    c->state = ARCHIVE_SEND;
+	}
+    }
+    return 0;
+}
+
+int archive_finished(const archive_t *a)
+{
+    int i;
+
+    for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	if (a->chunks[i].state != ARCHIVE_FREE)
+	    return 0;
+    }
+    return a->next > a->to;
+}
+
+int archive_load_cursor(const char *path, uint32_t *cursor)
+{
+    FILE *fp;
+    int ret = 1;
+
+    if ((fp = fopen(path, "r")) == NULL){
+	if (errno == ENOENT)
+	    return 0;
+	LOGGER_FMT_ERROR("Could not open %s: %s", path, strerror(errno));
+	return -1;
+    }
+    if (fscanf(fp, "%u", cursor) != 1){
+	LOGGER_FMT_ERROR("Bad archive cursor in %s", path);
+	ret = -1;
+    }
+    fclose(fp);
+    return ret;
+}
@@ -0,0 +1,158 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Download of the inverter's day or month archive of the total energy produced,
+// over a range of time.
+//
+// The range is split into chunks, a day of the day archive or a month of the
+// month archive, each fetched with one query whose reply comes in several
+// packets. The session (see session.h) keeps several chunks' queries awaiting
+// replies at once, and passes each packet of their replies, whose fcs it has
+// checked, to archive_put(). A chunk whose reply has a packet missing or
+// damaged, or that isn't answered in time, is asked for again.
+//
+// Chunks may be completed in any order, but their records are handed on in
+// order of time, each chunk once those before it have been. The resume cursor
+// is then moved on to just after the newest record handed on, and saved to the
+// cursor file, so a download that is interrupted starts again from there.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "sma.h"
+
+//! most chunks that are fetched at once
+#define ARCHIVE_MAX_CHUNKS   8
+//! most records in a chunk, being a day of 5 minute records, and one either side
+#define ARCHIVE_CHUNK_RECS   290
+//! times that a chunk is asked for before giving up
+#define ARCHIVE_MAX_TRIES    3
+
+// states of a chunk
+enum {
+    ARCHIVE_FREE,
+    //! to be asked for, or asked for again
+    ARCHIVE_SEND,
+    //! waiting for the packets of the reply
+    ARCHIVE_WAIT,
+    //! all packets received, waiting for the chunks before it
+    ARCHIVE_DONE,
+};
+
+//! called with the records of the archive, in order of time
+typedef void (*archive_fn_t)(const sma_archive_rec_t *rec, void *arg);
+
+//! a chunk of the range being downloaded
+typedef struct {
+    int state;
+    //! unix times of the first and last records asked for
+    uint32_t start;
+    uint32_t end;
+    //! packet id of the query, with SMA_PKT_ID_FLAG set
+    uint16_t id;
+    //! fragment count of the next packet expected, -1 before the first
+    int next_fragment;
+    int tries;
+    //! time by which the next packet must arrive, ms
+    int64_t deadline;
+    //! the records received
+    int n;
+    sma_archive_rec_t recs[ARCHIVE_CHUNK_RECS];
+} archive_chunk_t;
+
+//! a download
+typedef struct {
+    //! SMA_CMD_ARCHIVE_DAY or SMA_CMD_ARCHIVE_MONTH
+    uint32_t cmd;
+    //! seconds covered by each chunk
+    uint32_t chunk_secs;
+    //! start of the next chunk to be asked for, and end of the range
+    uint32_t next;
+    uint32_t to;
+    //! start of the chunk whose records are to be handed on next
+    uint32_t flush;
+    //! unix time from which records are still wanted, ie the resume cursor
+    uint32_t cursor;
+    //! file to which the cursor is saved, NULL for none
+    const char *cursor_path;
+    archive_fn_t fn;
+    void *arg;
+    //! counts of the packets with a bad fcs, and of the chunks asked for again
+    unsigned bad_fcs;
+    unsigned retries;
+    archive_chunk_t chunks[ARCHIVE_MAX_CHUNKS];
+} archive_t;
+
+/**
+ * Set up a download
+ *
+ * @param a The download
+ * @param cmd SMA_CMD_ARCHIVE_DAY or SMA_CMD_ARCHIVE_MONTH
+ * @param from Unix time of the first record wanted
+ * @param to Unix time of the last record wanted
+ * @param fn Called with each record
+ * @param arg Passed to fn
+ */
+void archive_init(archive_t *a, uint32_t cmd, uint32_t from, uint32_t to, archive_fn_t fn, void *arg);
+
+/**
+ * Get the next chunk that is to be asked for, starting a new one if there's room
+ *
+ * @param a The download
+ * @param max_busy Most chunks to be fetched at once, at most ARCHIVE_MAX_CHUNKS
+ *
+ * @return The chunk, or NULL if there is none to be asked for now
+ */
+archive_chunk_t *archive_next(archive_t *a, int max_busy);
+
+//! the chunk awaiting the reply with the passed packet id, or NULL if there is none
+archive_chunk_t *archive_find(archive_t *a, uint16_t id);
+
+/**
+ * Add the records in the passed packet of the reply to a chunk's query. If it's the last packet
+ * the chunk is complete and it and any after it that are complete are handed on.
+ *
+ * @param a The download
+ * @param c The chunk, from archive_find()
+ * @param frame The packet, unescaped, whose fcs has been checked
+ * @param len Length of the frame
+ *
+ * @return 0 on success, -1 if a packet has been missed or the chunk has too many records, in
+ * which case the chunk is to be asked for again with archive_retry()
+ */
+int archive_put(archive_t *a, archive_chunk_t *c, const unsigned char *frame, size_t len);
+
+/**
+ * Mark the passed chunk to be asked for again, discarding what has been received of it
+ *
+ * @return 0 on success, -1 if it has already been asked for ARCHIVE_MAX_TRIES times
+ */
+int archive_retry(archive_t *a, archive_chunk_t *c);
+
+/**
+ * Note that a packet with a bad fcs has been received. The chunk with the packet id it carries, which
+ * may itself be damaged, is asked for again, as are those of which no packet has yet been received,
+ * as the loss of the first packet of a reply can't otherwise be told.
+ *
+ * @return 0 on success, -1 if the chunk it was for has already been asked for ARCHIVE_MAX_TRIES times
+ */
+int archive_damaged(archive_t *a, uint16_t id);
+
+//! flag to indicate whether all of the records in the range have been handed on
+int archive_finished(const archive_t *a);
+
+/**
+ * Read the resume cursor from the passed file
+ *
+ * @param path The file
+ * @param cursor Set to the cursor, if the file exists
+ *
+ * @return 1 if the cursor was read, 0 if the file doesn't exist, -1 on error, which has been logged
+ */
+int archive_load_cursor(const char *path, uint32_t *cursor);
+
+#endif
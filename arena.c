@@ -0,0 +1,204 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Memory kept for as long as sbread runs, see arena.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+
+//! held while allocating
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+//! flag set by arena_seal()
+static int arena_sealed;
+//! count of the allocations asked for since
+static uint32_t arena_late;
+
+#ifdef SB_ARENA_INVERTERS
+#include "archive.h"
+#include "metrics.h"
+#include "shm.h"
+#include "store.h"
+#include "sweep.h"
+#include "trace.h"
+#include "upload.h"
+
+//! header of each allocation, holding the size asked for
+typedef union {
+    size_t size;
+    unsigned char align[ARENA_ALIGN];
+} arena_hdr_t;
+
+//! bytes taken by an allocation of the passed size
+#define ARENA_BLOCK(size) (sizeof(arena_hdr_t) + (((size_t)(size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1)))
+
+//! the inverters, each with its trace and store, as one array of each
+#define ARENA_INVERTERS_SIZE (ARENA_BLOCK(SB_ARENA_INVERTERS * sizeof(sweep_inverter_t)) + \
+			      ARENA_BLOCK(SB_ARENA_INVERTERS * sizeof(trace_t)) + \
+			      ARENA_BLOCK(SB_ARENA_INVERTERS * sizeof(store_t)))
+//! the metrics with their three pages, the shared memory segment, the uploader with its request body,
+//! and the archive download
+#define ARENA_SERVICES_SIZE (ARENA_BLOCK(sizeof(metrics_t)) + 3 * ARENA_BLOCK(METRICS_PAGE_SIZE) + \
+			     ARENA_BLOCK(sizeof(shm_t)) + ARENA_BLOCK(sizeof(upload_t)) + \
+			     ARENA_BLOCK(UPLOAD_BODY_SIZE) + ARENA_BLOCK(sizeof(archive_t)))
+#define ARENA_SIZE (ARENA_INVERTERS_SIZE + ARENA_SERVICES_SIZE)
+
+static unsigned char arena_mem[ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+//! bytes of the arena in use, and the most that have been
+static size_t arena_used, arena_peak;
+//! offset of the header of the last allocation, which may grow in place or be given back, SIZE_MAX for none
+static size_t arena_last = SIZE_MAX;
+
+//! take an allocation from the arena, with arena_lock held
+static void *arena_take(size_t size)
+{
+    arena_hdr_t *hdr;
+
+    if (ARENA_BLOCK(size) > ARENA_SIZE - arena_used){
+	LOGGER_FMT_ERROR("arena: out of memory, %lu bytes wanted, %lu free of %lu, more than SB_ARENA_INVERTERS=%i allows",
+			 (unsigned long)size, (unsigned long)(ARENA_SIZE - arena_used), (unsigned long)ARENA_SIZE,
+			 SB_ARENA_INVERTERS);
+	return NULL;
+    }
+    hdr = (arena_hdr_t *)(arena_mem + arena_used);
+    hdr->size = size;
+    arena_last = arena_used;
+    arena_used += ARENA_BLOCK(size);
+    if (arena_used > arena_peak)
+	arena_peak = arena_used;
+    memset(hdr + 1, 0, size);
+    return hdr + 1;
+}
+
+//! count, and log, an allocation asked for after arena_seal(), with arena_lock held
+static void arena_refuse(size_t size)
+{
+    arena_late++;
+    LOGGER_FMT_ERROR("arena: %lu bytes asked for after startup", (unsigned long)size);
+}
+
+void *arena_alloc(size_t size)
+{
+    void *p = NULL;
+
+    pthread_mutex_lock(&arena_lock);
+    if (arena_sealed)
+	arena_refuse(size);
+    else
+	p = arena_take(size);
+    pthread_mutex_unlock(&arena_lock);
+    return p;
+}
+
+void *arena_realloc(void *p, size_t size)
+{
+    arena_hdr_t *hdr = (arena_hdr_t *)p - 1;
+    void *q = NULL;
+
+    if (p == NULL)
+	return arena_alloc(size);
+    if (size <= hdr->size)
+	return p;
+    pthread_mutex_lock(&arena_lock);
+    if (arena_sealed){
+	arena_refuse(size);
+    } else if ((unsigned char *)hdr == arena_mem + arena_last && ARENA_BLOCK(size) <= ARENA_SIZE - arena_last){
+	// the last allocation, which can simply be extended
+	memset((unsigned char *)p + hdr->size, 0, size - hdr->size);
+	hdr->size = size;
+	arena_used = arena_last + ARENA_BLOCK(size);
+	if (arena_used > arena_peak)
+	    arena_peak = arena_used;
+	q = p;
+    } else if ((q = arena_take(size)) != NULL){
+	memcpy(q, p, hdr->size);
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return q;
+}
+
+void arena_free(void *p)
+{
+    if (p == NULL)
+	return;
+    pthread_mutex_lock(&arena_lock);
+    if ((unsigned char *)((arena_hdr_t *)p - 1) == arena_mem + arena_last){
+	arena_used = arena_last;
+	arena_last = SIZE_MAX;
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
+
+#else
+
+void *arena_alloc(size_t size)
+{
+    pthread_mutex_lock(&arena_lock);
+    arena_late += arena_sealed;
+    pthread_mutex_unlock(&arena_lock);
+    return calloc(1, size);
+}
+
+void *arena_realloc(void *p, size_t size)
+{
+    pthread_mutex_lock(&arena_lock);
+    arena_late += arena_sealed;
+    pthread_mutex_unlock(&arena_lock);
+    return realloc(p, size);
+}
+
+void arena_free(void *p)
+{
+    free(p);
+}
+
+#endif
+
+void arena_seal()
+{
+    pthread_mutex_lock(&arena_lock);
+    arena_sealed = 1;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+//! return the value in kB of the passed field of /proc/self/status, 0 if it's not there
+static size_t arena_status_kb(const char *status, const char *field)
+{
+    const char *p = strstr(status, field);
+    return p != NULL ? strtoul(p + strlen(field), NULL, 10) : 0;
+}
+
+void arena_stats(arena_stats_t *st)
+{
+    // read with read() rather than stdio, so as not to allocate
+    char status[2048];
+    ssize_t n = -1;
+    int fd;
+
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&arena_lock);
+#ifdef SB_ARENA_INVERTERS
+    st->size = ARENA_SIZE;
+    st->peak = arena_peak;
+    st->used = arena_used;
+#endif
+    st->late = arena_late;
+    pthread_mutex_unlock(&arena_lock);
+    if ((fd = open("/proc/self/status", O_RDONLY)) >= 0){
+	n = read(fd, status, sizeof(status) - 1);
+	close(fd);
+    }
+    if (n <= 0)
+	return;
+    status[n] = '\x0';
+    st->rss_kb = arena_status_kb(status, "\nVmRSS:");
+    st->peak_rss_kb = arena_status_kb(status, "\nVmHWM:");
+}
@@ -0,0 +1,77 @@
+#ifndef ARENA_H
+#define ARENA_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The memory that sbread keeps for as long as it runs: the inverters, their
+// traces and stores, the metrics, the uploader and the archive download.
+//
+// Normally this comes from the heap. Built with -DSB_ARENA_INVERTERS=n, the
+// fixed footprint build for routers with little memory (see 'make fixed'), it
+// comes instead from a static arena sized at compile time for n inverters, with
+// the buffers that would otherwise grow as need be allocated at the most they
+// can need. Once arena_seal() has been called, as sbread does before its first
+// poll, nothing more can be taken from the arena, so the memory used is fixed
+// from then on: anything that would still have been allocated fails, as if out
+// of memory, and is logged.
+//
+// Either way arena_stats() reports what has been used, and the resident set
+// size of the process.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! alignment of each allocation
+#define ARENA_ALIGN 16
+
+#ifdef SB_ARENA_INVERTERS
+//! most inverters that may be read, including those in the net of each
+#define ARENA_MAX_INVERTERS SB_ARENA_INVERTERS
+#else
+#define ARENA_MAX_INVERTERS INT_MAX
+#endif
+
+typedef struct {
+    //! bytes of the arena, 0 if built without one, the most of it used, and how much is in use
+    size_t size;
+    size_t peak;
+    size_t used;
+    //! allocations asked for since arena_seal(), which fail in the fixed footprint build
+    uint32_t late;
+    //! resident set size of the process, and the most it has been, in kB, 0 if not known
+    size_t rss_kb;
+    size_t peak_rss_kb;
+} arena_stats_t;
+
+/**
+ * Allocate zeroed memory
+ *
+ * @param size Bytes wanted
+ *
+ * @return The memory, aligned to ARENA_ALIGN, to be freed with arena_free(), or NULL if there's not
+ * enough, which has been logged in the fixed footprint build
+ */
+void *arena_alloc(size_t size);
+
+/**
+ * Change the size of memory from arena_alloc(), as realloc() would. In the fixed footprint build
+ * only the last allocation can grow in place, others are copied.
+ *
+ * @return The memory, or NULL if there's not enough, p being left as it was
+ */
+void *arena_realloc(void *p, size_t size);
+
+//! free memory from arena_alloc(), which may be NULL. In the fixed footprint build only the last allocation is given back.
+void arena_free(void *p);
+
+//! mark the end of startup, after which nothing more is to be allocated
+void arena_seal();
+
+//! fill in the passed stats
+void arena_stats(arena_stats_t *st);
+
+#endif
@@ -0,0 +1,117 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Byte stuffing of the level 2 part of frames, see codec.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+#include <string.h>
+
+#include "codec.h"
+
+size_t codec_unescape_ref(unsigned char *out, const unsigned char *in, size_t len)
+{
+    size_t i, o = 0;
+    for (i = 0; i < len; i++) {
+	if (in[i] == CODEC_ESC && i + 1 < len)
+	    out[o++] = in[++i] ^ CODEC_ESC_XOR;
+	else
+	    out[o++] = in[i];
+    }
+    return o;
+}
+
+size_t codec_unescape(unsigned char *out, const unsigned char *in, size_t len)
+{
+    const unsigned char *end = in + len;
+    unsigned char *o = out;
+
+    while (in < end) {
+	// copy the run up to the next escape byte in one go
+	const unsigned char *esc = memchr(in, CODEC_ESC, end - in);
+	size_t run = (esc ? esc : end) - in;
+	if (o != in)
+	    memmove(o, in, run);
+	o += run;
+	in += run;
+	if (esc == NULL)
+	    break;
+	if (esc + 1 < end) {
+	    *o++ = esc[1] ^ CODEC_ESC_XOR;
+	    in = esc + 2;
+	} else {
+	    *o++ = *esc;
+	    in = end;
+	}
+    }
+    return o - out;
+}
+
+size_t codec_escape_ref(unsigned char *out, const unsigned char *in, size_t len)
+{
+    size_t i, o = 0;
+    for (i = 0; i < len; i++) {
+	if (CODEC_NEEDS_ESC(in[i])) {
+	    out[o++] = CODEC_ESC;
+	    out[o++] = in[i] ^ CODEC_ESC_XOR;
+	} else {
+	    out[o++] = in[i];
+	}
+    }
+    return o;
+}
+
+// word at a time search, using the machine's native word size
+typedef unsigned long word_t;
+#define ONES  ((word_t)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+//! non zero if any byte of the word is zero
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+//! non zero if any byte of the word is equal to c
+#define HAS_BYTE(w, c) HAS_ZERO((w) ^ (ONES * (c)))
+//! non zero if any byte of the word needs to be escaped
+#define HAS_ESC(w) (HAS_BYTE(w, 0x7d) | HAS_BYTE(w, 0x7e) | HAS_BYTE(w, 0x11) | HAS_BYTE(w, 0x12) | HAS_BYTE(w, 0x13))
+
+//! return the number of bytes at the start of the passed data that do not need to be escaped
+static size_t clean_run(const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+    // byte at a time until aligned
+    while (i < len && ((uintptr_t)(in + i) & (sizeof(word_t) - 1))) {
+	if (CODEC_NEEDS_ESC(in[i]))
+	    return i;
+	i++;
+    }
+    // then a word at a time
+    while (i + sizeof(word_t) <= len) {
+	word_t w;
+	memcpy(&w, in + i, sizeof(w));
+	if (HAS_ESC(w))
+	    break;
+	i += sizeof(word_t);
+    }
+    // then find the byte in the word that needs escaping, or finish off the tail
+    while (i < len && !CODEC_NEEDS_ESC(in[i]))
+	i++;
+    return i;
+}
+
+size_t codec_escape(unsigned char *out, const unsigned char *in, size_t len)
+{
+    unsigned char *o = out;
+    size_t i = 0;
+
+    while (i < len) {
+	size_t run = clean_run(in + i, len - i);
+	memcpy(o, in + i, run);
+	o += run;
+	i += run;
+	if (i < len) {
+	    *o++ = CODEC_ESC;
+	    *o++ = in[i++] ^ CODEC_ESC_XOR;
+	}
+    }
+    return o - out;
+}
@@ -0,0 +1,57 @@
+#ifndef CODEC_H
+#define CODEC_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Byte stuffing of the level 2 part of the frames exchanged with the inverter.
+//
+// On the wire, each of the bytes 0x7d, 0x7e, 0x11, 0x12 and 0x13 is sent as the
+// escape byte 0x7d followed by the byte xor 0x20.
+//
+// The codec_xxx_ref() functions are the simple byte at a time versions, kept as the
+// reference for the faster versions, which search for the next byte to be escaped
+// (or the next escape byte) a word at a time and copy the runs in between in bulk.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+
+//! the escape byte
+#define CODEC_ESC      0x7d
+//! value that an escaped byte is xor'd with
+#define CODEC_ESC_XOR  0x20
+
+//! flag indicating whether the passed byte needs to be escaped
+#define CODEC_NEEDS_ESC(c) ((c) == 0x7d || (c) == 0x7e || (c) == 0x11 || (c) == 0x12 || (c) == 0x13)
+
+/**
+ * Unescape the passed data. The data may be unescaped in place, ie out == in.
+ * An escape byte at the very end of the data is copied as is.
+ *
+ * @param out Where the unescaped data is written, must have room for len bytes
+ * @param in The escaped data
+ * @param len The number of bytes of escaped data
+ *
+ * @return The number of bytes written to out
+ */
+size_t codec_unescape(unsigned char *out, const unsigned char *in, size_t len);
+
+/**
+ * Escape the passed data.
+ *
+ * @param out Where the escaped data is written, must have room for 2*len bytes, must not overlap in
+ * @param in The data to be escaped
+ * @param len The number of bytes of data
+ *
+ * @return The number of bytes written to out
+ */
+size_t codec_escape(unsigned char *out, const unsigned char *in, size_t len);
+
+//! reference version of codec_unescape()
+size_t codec_unescape_ref(unsigned char *out, const unsigned char *in, size_t len);
+
+//! reference version of codec_escape()
+size_t codec_escape_ref(unsigned char *out, const unsigned char *in, size_t len);
+
+#endif
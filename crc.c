@@ -9,6 +9,9 @@
 // 
 // This code is released to the public domain.
 // -----------------------------------------------------------------------------
+#include <pthread.h>
+#include <string.h>
+
 #include "crc.h"
 
 //! table containing precalculated crc values
@@ -48,11 +51,197 @@ static uint16_t crc_fcstab[256] = {
 };
 
 
-uint16_t crc_calc_crc(uint16_t fcs, unsigned char *cp, int len)
+uint16_t crc_calc_crc_ref(uint16_t fcs, const unsigned char *cp, int len)
 {
-    while (len--)
+    while (len-- > 0)
 	fcs = (fcs >> 8) ^ crc_fcstab[(fcs ^ *cp++) & 0xff];
     return (fcs);
 
 }
 
+//! tables for slicing-by-8: crc_slice8_tab[k][b] is the crc of byte b followed by k zero bytes
+static uint16_t crc_slice8_tab[8][256];
+
+//! fill in crc_slice8_tab, from crc_fcstab
+static void crc_slice8_init()
+{
+    int b, k;
+    for (b = 0; b < 256; b++)
+	crc_slice8_tab[0][b] = crc_fcstab[b];
+    for (k = 1; k < 8; k++)
+	for (b = 0; b < 256; b++)
+	    crc_slice8_tab[k][b] = (crc_slice8_tab[k-1][b] >> 8) ^ crc_fcstab[crc_slice8_tab[k-1][b] & 0xff];
+}
+
+static uint16_t crc_calc_crc_slice8(uint16_t fcs, const unsigned char *cp, int len)
+{
+    // bytes are read one at a time so that this works whatever the endianness
+    while (len >= 8) {
+	fcs = crc_slice8_tab[7][(fcs ^ cp[0]) & 0xff] ^
+	      crc_slice8_tab[6][((fcs >> 8) ^ cp[1]) & 0xff] ^
+	      crc_slice8_tab[5][cp[2]] ^
+	      crc_slice8_tab[4][cp[3]] ^
+	      crc_slice8_tab[3][cp[4]] ^
+	      crc_slice8_tab[2][cp[5]] ^
+	      crc_slice8_tab[1][cp[6]] ^
+	      crc_slice8_tab[0][cp[7]];
+	cp += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	fcs = (fcs >> 8) ^ crc_fcstab[(fcs ^ *cp++) & 0xff];
+    return fcs;
+}
+
+#ifdef CRC_HAVE_CLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+// The data is folded 128 bits at a time using carry-less multiplication, then the final
+// 128 bits are run through the table. The crc is bit reflected, so bit i of a 128 bit block
+// loaded from memory is the coefficient of x^(127-i), and the low 64 bits are the high order
+// half of the block. Folding a block A = H.x^64 + L forward over n bits is
+//   A.x^n = H.x^(n+64) + L.x^n, which mod P = H.(x^(n+63) mod P).x + L.(x^(n-1) mod P).x
+// and the reflected product of two 64 bit values lands one bit low, which supplies the factor x.
+
+//! fold constants for folding 4 blocks forward by 512 bits, and 1 block forward by 128 bits
+static __m128i crc_k512, crc_k128;
+
+//! return x^n mod P, where P is the crc polynomial x^16 + x^12 + x^5 + 1
+static uint32_t crc_xn_mod_p(int n)
+{
+    uint32_t r = 1;
+    while (n--) {
+	r <<= 1;
+	if (r & 0x10000)
+	    r ^= 0x11021;
+    }
+    return r;
+}
+
+//! return the bit reflected, 64 bit, form of x^n mod P
+static uint64_t crc_fold_const(int n)
+{
+    uint32_t k = crc_xn_mod_p(n);
+    uint64_t r = 0;
+    int d;
+    for (d = 0; d < 16; d++)
+	if (k & (1 << d))
+	    r |= (uint64_t)1 << (63 - d);
+    return r;
+}
+
+//! return non zero if the cpu supports the pclmulqdq instruction
+static int crc_clmul_supported()
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+	return 0;
+    return (c & bit_PCLMUL) && (d & bit_SSE2);
+}
+
+__attribute__((target("pclmul,sse2")))
+static void crc_clmul_init()
+{
+    crc_k512 = _mm_set_epi64x(crc_fold_const(511), crc_fold_const(575));
+    crc_k128 = _mm_set_epi64x(crc_fold_const(127), crc_fold_const(191));
+}
+
+//! fold x forward using the passed constants
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc_fold(__m128i x, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc_calc_crc_clmul(uint16_t fcs, const unsigned char *cp, int len)
+{
+    unsigned char tail[16];
+    __m128i x0, x1, x2, x3;
+
+    if (len < 64)
+	return crc_calc_crc_slice8(fcs, cp, len);
+
+    // the initial value of the crc is xor'd into the first 2 bytes
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)cp), _mm_cvtsi32_si128(fcs));
+    x1 = _mm_loadu_si128((const __m128i *)(cp + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(cp + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(cp + 48));
+    cp += 64;
+    len -= 64;
+    // 4 blocks at a time
+    while (len >= 64) {
+	x0 = _mm_xor_si128(crc_fold(x0, crc_k512), _mm_loadu_si128((const __m128i *)cp));
+	x1 = _mm_xor_si128(crc_fold(x1, crc_k512), _mm_loadu_si128((const __m128i *)(cp + 16)));
+	x2 = _mm_xor_si128(crc_fold(x2, crc_k512), _mm_loadu_si128((const __m128i *)(cp + 32)));
+	x3 = _mm_xor_si128(crc_fold(x3, crc_k512), _mm_loadu_si128((const __m128i *)(cp + 48)));
+	cp += 64;
+	len -= 64;
+    }
+    // combine the 4 blocks into 1
+    x1 = _mm_xor_si128(crc_fold(x0, crc_k128), x1);
+    x2 = _mm_xor_si128(crc_fold(x1, crc_k128), x2);
+    x0 = _mm_xor_si128(crc_fold(x2, crc_k128), x3);
+    // then 1 block at a time
+    while (len >= 16) {
+	x0 = _mm_xor_si128(crc_fold(x0, crc_k128), _mm_loadu_si128((const __m128i *)cp));
+	cp += 16;
+	len -= 16;
+    }
+    // the crc of the folded block is that of all the data so far
+    _mm_storeu_si128((__m128i *)tail, x0);
+    fcs = crc_calc_crc_slice8(0, tail, sizeof(tail));
+    return crc_calc_crc_slice8(fcs, cp, len);
+}
+#endif
+
+//! the implementation in use, chosen on first use
+static crc_impl_t crc_impl;
+//! name of the implementation in use
+static const char *crc_impl_name_str;
+//! so that the choice is only made once, by whichever thread gets there first
+static pthread_once_t crc_impl_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Choose the fastest implementation that the cpu supports
+ */
+static void crc_choose_impl()
+{
+    crc_slice8_init();
+    crc_impl = crc_calc_crc_slice8;
+    crc_impl_name_str = "slice8";
+#ifdef CRC_HAVE_CLMUL
+    if (crc_clmul_supported()) {
+	crc_clmul_init();
+	crc_impl = crc_calc_crc_clmul;
+	crc_impl_name_str = "clmul";
+    }
+#endif
+}
+
+const char *crc_impl_name()
+{
+    pthread_once(&crc_impl_once, crc_choose_impl);
+    return crc_impl_name_str;
+}
+
+crc_impl_t crc_get_impl(const char *name)
+{
+    pthread_once(&crc_impl_once, crc_choose_impl);
+    if (!strcmp(name, "ref"))
+	return crc_calc_crc_ref;
+    if (!strcmp(name, "slice8"))
+	return crc_calc_crc_slice8;
+#ifdef CRC_HAVE_CLMUL
+    if (!strcmp(name, "clmul") && crc_impl == crc_calc_crc_clmul)
+	return crc_calc_crc_clmul;
+#endif
+    return NULL;
+}
+
+uint16_t crc_calc_crc(uint16_t fcs, unsigned char *cp, int len)
+{
+    pthread_once(&crc_impl_once, crc_choose_impl);
+    return crc_impl(fcs, cp, len);
+}
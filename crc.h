@@ -16,9 +16,18 @@
 /* Initial FCS value    */
 #define CRC_PPPINITFCS16 0xffff 
 
+#if defined(__x86_64__) || defined(__i386__)
+//! the carry-less multiply implementation is available on x86, if the cpu supports it
+#define CRC_HAVE_CLMUL
+#endif
+
+//! signature of the crc implementations, parameters as for crc_calc_crc()
+typedef uint16_t (*crc_impl_t)(uint16_t fcs, const unsigned char *cp, int len);
+
 /** 
  * Calculate a new fcs given the current fcs and the new data.
  * This is the CRC as used by PPP (I think, possibly CRC CCITT 16)
+ * The fastest of the implementations below that the cpu supports is used.
  *
  * @param fcs The current value of the crc
  * @param cp  Pointer to the data on which crc will be calculated
@@ -28,5 +37,22 @@
  */
 uint16_t crc_calc_crc(uint16_t fcs, unsigned char *cp, int len);
 
+//! the reference implementation, a byte at a time table lookup
+uint16_t crc_calc_crc_ref(uint16_t fcs, const unsigned char *cp, int len);
+
+//! return the name of the implementation used by crc_calc_crc(), being one of "ref", "slice8", "clmul"
+const char *crc_impl_name();
+
+/**
+ * Get the named implementation: "ref", slicing-by-8 with 8 table lookups per 8 bytes, or folding 64 bytes
+ * at a time with the pclmulqdq instruction. The tables of the others are set up on first use, so they're
+ * only to be reached through here.
+ *
+ * @param name One of "ref", "slice8", "clmul"
+ *
+ * @return The implementation, or NULL if the name is unknown or the cpu does not support it
+ */
+crc_impl_t crc_get_impl(const char *name);
+
 
 #endif
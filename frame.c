@@ -0,0 +1,200 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Reassembly of the frames received from the inverter, see frame.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <string.h>
+
+#include "codec.h"
+#include "frame.h"
+
+#define FRAME_RING_MASK (FRAME_RING_SIZE - 1)
+
+void frame_ring_init(frame_ring_t *r)
+{
+    r->head = r->tail = 0;
+    r->frames = r->skipped = 0;
+}
+
+unsigned char *frame_ring_space(frame_ring_t *r, size_t *len)
+{
+    uint32_t used = r->head - r->tail;
+    uint32_t off = r->head & FRAME_RING_MASK;
+    uint32_t to_end = FRAME_RING_SIZE - off;
+    uint32_t space = FRAME_RING_SIZE - used;
+    *len = space < to_end ? space : to_end;
+    return r->buf + off;
+}
+
+void frame_ring_commit(frame_ring_t *r, size_t n)
+{
+    r->head += n;
+}
+
+size_t frame_ring_put(frame_ring_t *r, const unsigned char *data, size_t n)
+{
+    size_t done = 0;
+    while (done < n) {
+	size_t len;
+	unsigned char *p = frame_ring_space(r, &len);
+	if (len == 0)
+	    break;
+	if (len > n - done)
+	    len = n - done;
+	memcpy(p, data + done, len);
+	frame_ring_commit(r, len);
+	done += len;
+    }
+    return done;
+}
+
+//! return the byte at offset off from the tail of the ring
+static inline unsigned char peek(const frame_ring_t *r, uint32_t off)
+{
+    return r->buf[(r->tail + off) & FRAME_RING_MASK];
+}
+
+//! copy len bytes from offset from of the tail of the ring to out
+static void copy_out(const frame_ring_t *r, uint32_t from, unsigned char *out, uint32_t len)
+{
+    uint32_t off = (r->tail + from) & FRAME_RING_MASK;
+    uint32_t to_end = FRAME_RING_SIZE - off;
+    if (len <= to_end) {
+	memcpy(out, r->buf + off, len);
+    } else {
+	memcpy(out, r->buf + off, to_end);
+	memcpy(out + to_end, r->buf, len - to_end);
+    }
+}
+
+//! skip bytes until the tail of the ring is at a start of frame marker, or the ring is empty
+static void skip_to_sof(frame_ring_t *r)
+{
+    while (r->tail != r->head) {
+	uint32_t off = r->tail & FRAME_RING_MASK;
+	uint32_t used = r->head - r->tail;
+	uint32_t to_end = FRAME_RING_SIZE - off;
+	uint32_t len = used < to_end ? used : to_end;
+	const unsigned char *p = memchr(r->buf + off, FRAME_SOF, len);
+	uint32_t n = p ? (uint32_t)(p - (r->buf + off)) : len;
+	r->tail += n;
+	r->skipped += n;
+	if (p)
+	    return;
+    }
+}
+
+/**
+ * Check the level 1 header at offset off from the tail of the ring, of which at least 4 bytes are in the ring
+ *
+ * @return The length of the frame, 0 if it is not the start of a frame that we can handle
+ */
+static uint32_t frame_len_at(const frame_ring_t *r, uint32_t off, size_t out_size)
+{
+    unsigned char b0 = peek(r, off), b1 = peek(r, off + 1), b2 = peek(r, off + 2), b3 = peek(r, off + 3);
+    uint32_t len = b1 | (b2 << 8);
+    if (b0 != FRAME_SOF || (FRAME_SOF ^ b1 ^ b2) != b3 || len < FRAME_MIN_LEN || len > FRAME_MAX_LEN || len > out_size)
+	return 0;
+    return len;
+}
+
+//! return the level 1 command of the frame at offset off from the tail of the ring
+static inline uint16_t frame_cmd_at(const frame_ring_t *r, uint32_t off)
+{
+    return peek(r, off + FRAME_L1_CMD_OFF) | (peek(r, off + FRAME_L1_CMD_OFF + 1) << 8);
+}
+
+/**
+ * Find the end of the level 2 packet that starts in the frame of len bytes at the tail of the ring, whose
+ * level 1 command is FRAME_L1_CMD_PART, being the end of the frame of the following ones from the same
+ * address with command FRAME_L1_CMD_LAST
+ *
+ * @param n Set to the number of frames holding the packet
+ * @param total Set to the length of the frame holding the whole packet, escaped
+ *
+ * @return The offset of the end of the last frame from the tail, 0 if it isn't in the ring yet, or
+ * (uint32_t)-1 if the frames following are not the rest of the packet, or it is too long for out
+ */
+static uint32_t frame_packet_end(const frame_ring_t *r, uint32_t len, size_t out_size, uint32_t *n, uint32_t *total)
+{
+    uint32_t avail = r->head - r->tail;
+    uint32_t off = len, l, i;
+    uint16_t cmd;
+
+    *n = 1;
+    *total = len;
+    do {
+	if (avail < off + 4)
+	    return 0;
+	if ((l = frame_len_at(r, off, out_size)) <= FRAME_L1_HEADER_LEN || off + l > FRAME_RING_SIZE / 2)
+	    return (uint32_t)-1;
+	if (avail < off + l)
+	    return 0;
+	// the source address is that of the first frame
+	for (i = 4; i < 10 && peek(r, off + i) == peek(r, i); i++)
+	    ;
+	cmd = frame_cmd_at(r, off);
+	if (i < 10 || (cmd != FRAME_L1_CMD_PART && cmd != FRAME_L1_CMD_LAST))
+	    return (uint32_t)-1;
+	// rather than the start of the next packet
+	if (peek(r, off + FRAME_L1_HEADER_LEN) == FRAME_SOF && l > FRAME_L1_HEADER_LEN + 1)
+	    return (uint32_t)-1;
+	*total += l - FRAME_L1_HEADER_LEN;
+	if (*total > out_size)
+	    return (uint32_t)-1;
+	off += l;
+	(*n)++;
+    } while (cmd != FRAME_L1_CMD_LAST);
+    return off;
+}
+
+size_t frame_next(frame_ring_t *r, unsigned char *out, size_t out_size)
+{
+    for (;;) {
+	skip_to_sof(r);
+	uint32_t avail = r->head - r->tail;
+	if (avail < 4)
+	    return 0;
+	uint32_t len = frame_len_at(r, 0, out_size);
+	if (len == 0) {
+	    // not the start of a frame that we can handle, look for the next
+	    r->tail++;
+	    r->skipped++;
+	    continue;
+	}
+	if (avail < len)
+	    return 0;
+	copy_out(r, 0, out, len);
+	size_t out_len = FRAME_L1_HEADER_LEN + codec_unescape(out + FRAME_L1_HEADER_LEN, out + FRAME_L1_HEADER_LEN,
+							      len - FRAME_L1_HEADER_LEN);
+	if (frame_cmd_at(r, 0) == FRAME_L1_CMD_PART && out_len > FRAME_L2_LEN_OFF && out[FRAME_L1_HEADER_LEN] == FRAME_SOF &&
+	    FRAME_L2_LEN_OFF + 4 * (size_t)out[FRAME_L2_LEN_OFF] + 3 > out_len) {
+	    // the first part of a packet, with its fcs and closing 0x7e to follow, put it together with the rest
+	    uint32_t n, total, off, end = frame_packet_end(r, len, out_size, &n, &total);
+	    if (end == 0)
+		return 0;
+	    if (end == (uint32_t)-1) {
+		// the rest has been lost, and a part of a packet is as good as none
+		r->tail += len;
+		r->skipped += len;
+		continue;
+	    }
+	    copy_out(r, 0, out, len);
+	    for (total = len, off = len; off < end; off += len) {
+		len = frame_len_at(r, off, out_size);
+		copy_out(r, off + FRAME_L1_HEADER_LEN, out + total, len - FRAME_L1_HEADER_LEN);
+		total += len - FRAME_L1_HEADER_LEN;
+	    }
+	    r->tail += end;
+	    r->frames += n;
+	    return FRAME_L1_HEADER_LEN + codec_unescape(out + FRAME_L1_HEADER_LEN, out + FRAME_L1_HEADER_LEN,
+							 total - FRAME_L1_HEADER_LEN);
+	}
+	r->tail += len;
+	r->frames++;
+	return out_len;
+    }
+}
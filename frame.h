@@ -0,0 +1,103 @@
+#ifndef FRAME_H
+#define FRAME_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Reassembly of the frames received from the inverter.
+//
+// Bytes read from the socket are appended to a ring buffer, from which whole
+// frames are cut. Each frame starts with the 4 byte level 1 header:
+//   0x7E, length LSB, length MSB, checksum (being the xor of the first 3 bytes)
+// where length is the number of bytes in the frame as sent on the wire, ie escaped.
+// The level 2 part of the frame, from FRAME_L1_HEADER_LEN on, is unescaped as
+// the frame is cut.
+//
+// This means that a frame split across several reads, or several frames in
+// the one read, are handled. Bytes that do not start a valid header are skipped.
+//
+// A level 2 packet too long for one frame is sent in several, each with the
+// level 1 header of the first but for the length, checksum and command. The
+// command of the last is FRAME_L1_CMD_LAST, and of the others FRAME_L1_CMD_PART.
+// These are put back together as the one frame: the header of the first followed
+// by the level 2 parts of them all. The first part of a packet whose other
+// frames don't follow it is skipped. A frame with command FRAME_L1_CMD_PART may
+// instead hold a whole packet, with more packets of the reply to follow, so it is
+// only taken as the first part of one if the packet's length runs past its end.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+
+//! start of frame marker
+#define FRAME_SOF            0x7e
+//! size of the ring buffer, must be a power of 2 and larger than FRAME_MAX_LEN
+#define FRAME_RING_SIZE      4096
+//! length of the level 1 header, being start of frame, length, checksum, 2 addresses and command
+#define FRAME_L1_HEADER_LEN  18
+//! offset of the level 1 command, LSB first
+#define FRAME_L1_CMD_OFF     16
+//! level 1 command of a frame holding a whole level 2 packet, or the last part of one
+#define FRAME_L1_CMD_LAST    0x0001
+//! level 1 command of a frame holding a part of a level 2 packet, with more to follow
+#define FRAME_L1_CMD_PART    0x0008
+//! offset of the length of a level 2 packet, in 4 byte words counted from this byte (see sma.h)
+#define FRAME_L2_LEN_OFF     23
+//! the shortest frame that is accepted
+#define FRAME_MIN_LEN        FRAME_L1_HEADER_LEN
+//! the longest frame that is accepted, may be set at compile time
+#ifndef FRAME_MAX_LEN
+#define FRAME_MAX_LEN        1024
+#endif
+#if FRAME_MAX_LEN >= FRAME_RING_SIZE
+#error FRAME_MAX_LEN must be less than FRAME_RING_SIZE
+#endif
+
+typedef struct {
+    unsigned char buf[FRAME_RING_SIZE];
+    //! free running index at which the next byte received is to be written
+    uint32_t head;
+    //! free running index of the next byte to be examined
+    uint32_t tail;
+    //! count of the frames cut from the ring
+    uint32_t frames;
+    //! count of the bytes that were skipped because they did not start a valid frame
+    uint32_t skipped;
+} frame_ring_t;
+
+//! initialise, or empty, the passed ring
+void frame_ring_init(frame_ring_t *r);
+
+/**
+ * Get the space into which received data may be written directly, eg by recv()
+ *
+ * @param r The ring
+ * @param len Set to the number of bytes that may be written at the returned pointer
+ *
+ * @return Pointer to the space
+ */
+unsigned char *frame_ring_space(frame_ring_t *r, size_t *len);
+
+//! add n bytes, that have been written to the space returned by frame_ring_space(), to the ring
+void frame_ring_commit(frame_ring_t *r, size_t n);
+
+/**
+ * Copy the passed data into the ring
+ *
+ * @return The number of bytes copied, less than n if the ring is full
+ */
+size_t frame_ring_put(frame_ring_t *r, const unsigned char *data, size_t n);
+
+/**
+ * Cut the next complete frame from the ring, putting a level 2 packet sent in several frames back together
+ *
+ * @param r The ring
+ * @param out Where the frame is copied, with its level 2 part unescaped
+ * @param out_size Size of out, frames longer than this, escaped, are skipped
+ *
+ * @return Length of the unescaped frame, or 0 if there is not yet a complete frame in the ring
+ */
+size_t frame_next(frame_ring_t *r, unsigned char *out, size_t out_size);
+
+#endif
@@ -0,0 +1,113 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// libsma, see libsma.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "libsma.h"
+#include "script.h"
+#include "session.h"
+#include "transport.h"
+
+struct sma_handle {
+    transport_t tr;
+    script_prog_t prog;
+    sb_session_t s;
+    //! flag to indicate that the session is logged on, ie only the queries need to be run
+    int logged_on;
+};
+
+/**
+ * Convert a bluetooth address, eg 00:80:25:A6:77:60, to binary, LSB first as used by the inverter
+ *
+ * @return 0 on success, -1 if str is not of that form
+ */
+static int parse_bt_addr(const char *str, unsigned char *out)
+{
+    int i, c;
+    for (i=5; i>=0; i--){
+	if ((c = script_hex_byte(str)) < 0)
+	    return -1;
+	out[i] = c;
+	str += 2;
+	if (*str != (i ? ':' : '\x0'))
+	    return -1;
+	str++;
+    }
+    return 0;
+}
+
+sma_handle_t *sma_session_open(const sma_options_t *opt)
+{
+    sma_handle_t *h;
+    unsigned char bt_addr[6], serial[4];
+    const char *script = opt->script != NULL ? opt->script : SMA_SCRIPT_DEFAULT;
+
+    if (opt->address == NULL || parse_bt_addr(opt->address, bt_addr) < 0){
+	LOGGER_FMT_ERROR("Invalid inverter address %s", opt->address != NULL ? opt->address : "(none)");
+	return NULL;
+    }
+#ifdef SB_NO_BLUETOOTH
+    if (opt->tcp == NULL){
+	LOGGER_ERROR("Built without bluetooth, a tcp address is needed");
+	return NULL;
+    }
+#endif
+    sma_put_u32(serial, opt->serial);
+    if ((h = calloc(1, sizeof(*h))) == NULL){
+	LOGGER_ERROR("out of memory");
+	return NULL;
+    }
+    if (script_load(script, &h->prog) < 0){
+	free(h);
+	return NULL;
+    }
+#ifndef SB_NO_BLUETOOTH
+    if (opt->tcp == NULL)
+	transport_init_rfcomm(&h->tr, opt->address);
+    else
+#endif
+	transport_init_tcp(&h->tr, opt->tcp);
+    session_init(&h->s, &h->tr, bt_addr, serial, &h->prog);
+    h->s.display = opt->all ? DISPLAY_ALL : DISPLAY_BOTH;
+    if (opt->timeout_sec)
+	h->s.timeout_sec = opt->timeout_sec;
+    return h;
+}
+
+int sma_poll(sma_handle_t *h, sma_values_t *v)
+{
+    int ret;
+
+    if (h->logged_on){
+	ret = session_query(&h->s);
+    } else {
+	ret = session_connect(&h->s);
+	if (ret == 0)
+	    ret = session_logon_and_query(&h->s);
+    }
+    if (ret < 0){
+	// reconnect on the next poll
+	h->logged_on = 0;
+	session_close(&h->s);
+	return -1;
+    }
+    h->logged_on = 1;
+    *v = h->s.values;
+    return 0;
+}
+
+void sma_close(sma_handle_t *h)
+{
+    if (h == NULL)
+	return;
+    session_close(&h->s);
+    script_free(&h->prog);
+    free(h);
+}
@@ -0,0 +1,73 @@
+#ifndef LIBSMA_H
+#define LIBSMA_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// libsma: reading an inverter from within another program, without running
+// sbread.
+//
+// Each handle holds its own connection, session and compiled script, so any
+// number of inverters may be read from the one process, each handle from one
+// thread at a time. The logging level and file are shared by the process, as
+// set through logger.h.
+//
+//   sma_options_t opt = { .address = "00:80:25:A6:77:60", .serial = 0x9F04F97E };
+//   sma_handle_t *h = sma_session_open(&opt);
+//   sma_values_t v;
+//   if (h != NULL && sma_poll(h, &v) == 0)
+//       printf("%u W\n", v.ac_power);
+//   sma_close(h);
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "sma.h"
+
+//! the script used if none is given
+#define SMA_SCRIPT_DEFAULT "/etc/sbread.script"
+
+//! an open session with an inverter
+typedef struct sma_handle sma_handle_t;
+
+typedef struct {
+    //! bluetooth address of the inverter, eg 00:80:25:A6:77:60
+    const char *address;
+    //! its serial number, eg 0x9F04F97E for the 7E:F9:04:9F given to sbread
+    uint32_t serial;
+    //! the script, NULL for SMA_SCRIPT_DEFAULT
+    const char *script;
+    //! host:port to connect to instead of the inverter's bluetooth address, NULL for bluetooth
+    const char *tcp;
+    //! flag, non zero to read all the values, otherwise just the power and the day's energy
+    int all;
+    //! timeout in seconds for each reply, 0 for the default
+    unsigned timeout_sec;
+} sma_options_t;
+
+/**
+ * Open a session with an inverter. Nothing is sent to it until the first poll.
+ *
+ * @param opt The inverter and how it's to be read, only used during the call
+ *
+ * @return The handle, to be closed with sma_close(), or NULL on error, which has been logged
+ */
+sma_handle_t *sma_session_open(const sma_options_t *opt);
+
+/**
+ * Read the inverter. The connection is kept open after a successful poll, so that the next only
+ * has to rerun the queries, and is closed after an error, so that the next reconnects and logs
+ * on again.
+ *
+ * @param h The handle
+ * @param v Set to the values read
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int sma_poll(sma_handle_t *h, sma_values_t *v);
+
+//! close the connection if it's open, and free the handle, which may be NULL
+void sma_close(sma_handle_t *h);
+
+#endif
@@ -2,12 +2,247 @@
 // Copyright telecnatron.com. 2014.
 // $Id: $
 // -----------------------------------------------------------------------------
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "logger.h"
 
 unsigned char logger_level=LOGGER_LEVEL_INFO;
+int logger_fd=2;
+
+// kinds of message held in a slot
+enum {
+    //! text, written as it is
+    LOGGER_TEXT,
+    //! a prefix followed by data, written in hex
+    LOGGER_DATA,
+};
+
+//! a message in the ring
+typedef struct {
+    //! the position in the ring for which the slot is free, plus one once the message is in it
+    uint32_t seq;
+    unsigned char level;
+    unsigned char kind;
+    //! length of the prefix of a LOGGER_DATA message, and of the whole message
+    uint16_t prefix_len;
+    uint16_t len;
+    char msg[LOGGER_MSG_LEN];
+} logger_slot_t;
+
+//! the ring, positions in which count up, the next to be filled being at logger_tail
+static logger_slot_t logger_ring[LOGGER_SLOTS];
+static uint32_t logger_head, logger_tail;
+//! number of messages dropped as the ring was full, since last logged
+static uint32_t logger_dropped;
+//! flags set while the background thread is running, and to ask it to stop
+static int logger_async, logger_stop;
+static pthread_t logger_thread;
+//! flag set while the background thread waits for a message, on logger_wake, with logger_lock held to do so
+static int logger_waiting;
+static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_wake = PTHREAD_COND_INITIALIZER;
+
+//! longest line that a slot is formatted into: the level, the prefix, 3 characters a byte and a newline
+#define LOGGER_LINE_LEN (8 + LOGGER_MSG_LEN * 3 + 1)
+
+static const char logger_hex[] = "0123456789abcdef";
+
+//! write all of the passed buffer
+static void logger_write(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0 && (n = write(logger_fd, buf, len)) > 0){
+	buf += n;
+	len -= n;
+    }
+}
+
+/**
+ * Format the message in the passed slot as a line of the log
+ * @return The length of the line
+ */
+static size_t logger_format(const logger_slot_t *slot, char *line)
+{
+    const char *level = LOGGER_LEVEL_STR(slot->level);
+    size_t len = strlen(level);
+    int i;
+
+    memcpy(line, level, len);
+    line[len++] = ':';
+    line[len++] = ' ';
+    if (slot->kind == LOGGER_TEXT){
+	memcpy(line + len, slot->msg, slot->len);
+	len += slot->len;
+    } else {
+	memcpy(line + len, slot->msg, slot->prefix_len);
+	len += slot->prefix_len;
+	for (i = slot->prefix_len; i < slot->len; i++){
+	    line[len++] = logger_hex[(unsigned char)slot->msg[i] >> 4];
+	    line[len++] = logger_hex[slot->msg[i] & 0xf];
+	    line[len++] = ' ';
+	}
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+/**
+ * Get a slot of the ring to be filled, or if the background thread isn't running the passed one
+ * @return The slot, or NULL if the ring is full
+ */
+static logger_slot_t *logger_claim(logger_slot_t *local)
+{
+    uint32_t pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+    logger_slot_t *slot;
+
+    if (!__atomic_load_n(&logger_async, __ATOMIC_ACQUIRE))
+	return local;
+    for (;;){
+	slot = &logger_ring[pos & (LOGGER_SLOTS - 1)];
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq == pos){
+	    if (__atomic_compare_exchange_n(&logger_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return slot;
+	} else if ((int32_t)(seq - pos) < 0){
+	    // not yet written out
+	    __atomic_fetch_add(&logger_dropped, 1, __ATOMIC_RELAXED);
+	    return NULL;
+	} else
+	    pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+    }
+}
+
+//! hand on the filled slot, from logger_claim(), to the background thread, or write it now
+static void logger_commit(logger_slot_t *slot, logger_slot_t *local)
+{
+    char line[LOGGER_LINE_LEN];
+
+    if (slot == local){
+	logger_write(line, logger_format(slot, line));
+	return;
+    }
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    // the background thread either sees the message before it waits, or is woken for it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger_waiting, __ATOMIC_RELAXED)){
+	pthread_mutex_lock(&logger_lock);
+	pthread_cond_signal(&logger_wake);
+	pthread_mutex_unlock(&logger_lock);
+    }
+}
+
+//! flag to indicate whether there's a message in the ring to be written
+static int logger_ready()
+{
+    return __atomic_load_n(&logger_ring[logger_head & (LOGGER_SLOTS - 1)].seq, __ATOMIC_ACQUIRE) == logger_head + 1;
+}
+
+//! write the messages in the ring in as few writes as there's room for in buf
+static void logger_drain(char *buf, size_t size)
+{
+    size_t len = 0;
+    uint32_t dropped;
+
+    for (;;){
+	logger_slot_t *slot = &logger_ring[logger_head & (LOGGER_SLOTS - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger_head + 1)
+	    break;
+	if (size - len < LOGGER_LINE_LEN){
+	    logger_write(buf, len);
+	    len = 0;
+	}
+	len += logger_format(slot, buf + len);
+	__atomic_store_n(&slot->seq, logger_head + LOGGER_SLOTS, __ATOMIC_RELEASE);
+	logger_head++;
+    }
+    if ((dropped = __atomic_exchange_n(&logger_dropped, 0, __ATOMIC_RELAXED)) != 0){
+	int n;
+	if (size - len < LOGGER_LINE_LEN){
+	    logger_write(buf, len);
+	    len = 0;
+	}
+	n = snprintf(buf + len, size - len, "%s: %u log messages dropped\n", LOGGER_LEVEL_STR(LOGGER_LEVEL_WARN), dropped);
+	// snprintf() returns the length it would have written, not what fitted
+	if (n > 0)
+	    len += (size_t)n < size - len ? (size_t)n : size - len - 1;
+    }
+    logger_write(buf, len);
+}
+
+//! buffer that the messages are formatted into to be written, by the background thread while it runs
+static char logger_buf[4 * LOGGER_LINE_LEN];
+
+//! the background thread, writing the messages in the ring as they come until asked to stop
+static void *logger_flusher(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&logger_stop, __ATOMIC_ACQUIRE)){
+	logger_drain(logger_buf, sizeof(logger_buf));
+	pthread_mutex_lock(&logger_lock);
+	__atomic_store_n(&logger_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!logger_ready() && !__atomic_load_n(&logger_stop, __ATOMIC_ACQUIRE))
+	    pthread_cond_wait(&logger_wake, &logger_lock);
+	__atomic_store_n(&logger_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&logger_lock);
+    }
+    logger_drain(logger_buf, sizeof(logger_buf));
+    return NULL;
+}
+
+int logger_async_start()
+{
+    static int registered;
+    uint32_t i;
+
+    if (logger_async)
+	return 0;
+    for (i = 0; i < LOGGER_SLOTS; i++)
+	logger_ring[i].seq = logger_tail + i;
+    logger_head = logger_tail;
+    logger_stop = 0;
+    if (pthread_create(&logger_thread, NULL, logger_flusher, NULL) != 0){
+	LOGGER_ERROR("Could not start the logger thread");
+	return -1;
+    }
+    if (!registered){
+	atexit(logger_async_stop);
+	registered = 1;
+    }
+    __atomic_store_n(&logger_async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void logger_async_stop()
+{
+    int i;
+
+    if (!logger_async)
+	return;
+    // messages logged from now on are written directly, after those in the ring
+    __atomic_store_n(&logger_async, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&logger_lock);
+    __atomic_store_n(&logger_stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&logger_wake);
+    pthread_mutex_unlock(&logger_lock);
+    pthread_join(logger_thread, NULL);
+    // a slot claimed before the flag was cleared may have been filled since the thread's last look,
+    // or be still being filled, so give its thread a moment to finish
+    logger_drain(logger_buf, sizeof(logger_buf));
+    for (i = 0; i < 1000 && logger_head != __atomic_load_n(&logger_tail, __ATOMIC_ACQUIRE); i++){
+	sched_yield();
+	logger_drain(logger_buf, sizeof(logger_buf));
+    }
+}
 
 void logger_start(int level)
 {
@@ -32,38 +267,69 @@ void logger_end()
     fprintf(stderr,"\n");
 }
 
-/** 
+/**
  * Loge the passed message with passed level
  * @param level The log-level int
  * @param msg  The message to be logged
  */
 void logger_log(int level, char *msg)
 {
+    logger_slot_t local, *slot;
+    size_t len = strlen(msg);
+
     if(level > logger_level )
 	return;
-    logger_start(level);
-    fprintf(stderr,"%s", msg);
-    logger_end();
+    if ((slot = logger_claim(&local)) == NULL)
+	return;
+    slot->level = level;
+    slot->kind = LOGGER_TEXT;
+    slot->len = len < LOGGER_MSG_LEN ? len : LOGGER_MSG_LEN;
+    memcpy(slot->msg, msg, slot->len);
+    logger_commit(slot, &local);
 }
 
-/** 
+/**
  * Log a formatted message, with arguments similiar to printf
  * @param level The log level string
  * @param fmt The format, followed by arguments
  */
 void logger_fmt(int level, const char *fmt, ...)
 {
+    logger_slot_t local, *slot;
+    va_list args;
+    int len;
+
     if(level > logger_level)
 	return;
-    va_list args;
-    logger_start(level);
+    if ((slot = logger_claim(&local)) == NULL)
+	return;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    len = vsnprintf(slot->msg, LOGGER_MSG_LEN, fmt, args);
     va_end(args);
-    logger_end();
+    slot->level = level;
+    slot->kind = LOGGER_TEXT;
+    slot->len = len < 0 ? 0 : len < LOGGER_MSG_LEN ? len : LOGGER_MSG_LEN - 1;
+    logger_commit(slot, &local);
 }
 
+void logger_data(int level, const char *prefix, const unsigned char *data, unsigned len)
+{
+    logger_slot_t local, *slot;
+    size_t prefix_len = strlen(prefix);
 
-
-
-
+    if(level > logger_level)
+	return;
+    if ((slot = logger_claim(&local)) == NULL)
+	return;
+    if (prefix_len > LOGGER_MSG_LEN)
+	prefix_len = LOGGER_MSG_LEN;
+    if (len > LOGGER_MSG_LEN - prefix_len)
+	len = LOGGER_MSG_LEN - prefix_len;
+    slot->level = level;
+    slot->kind = LOGGER_DATA;
+    slot->prefix_len = prefix_len;
+    slot->len = prefix_len + len;
+    memcpy(slot->msg, prefix, prefix_len);
+    memcpy(slot->msg + prefix_len, data, len);
+    logger_commit(slot, &local);
+}
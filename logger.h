@@ -5,17 +5,30 @@
 // $Id: logger.h 125 2014-09-09 02:50:47Z steves $
 // -----------------------------------------------------------------------------
 
+// The most verbose level compiled in: calls to log at levels above it vanish from the build, eg
+// make DEFS=-DLOGGER_COMPILE_LEVEL=LOGGER_LEVEL_INFO leaves out all of the debug logging
+#ifndef LOGGER_COMPILE_LEVEL
+#define LOGGER_COMPILE_LEVEL LOGGER_LEVEL_DEBUG
+#endif
+
+// true if messages of the passed level are to be logged, checked before any arguments are evaluated
+#define LOGGER_ON(level) ((level) <= LOGGER_COMPILE_LEVEL && (level) <= logger_level)
+
 // macros to allow unformatted logging
-#define LOGGER_ERROR(msg) logger_log(LOGGER_LEVEL_ERROR, msg)
-#define LOGGER_WARN(msg) logger_log(LOGGER_LEVEL_WARN, msg)
-#define LOGGER_INFO(msg) logger_log(LOGGER_LEVEL_INFO, msg)
-#define LOGGER_DEBUG(msg) logger_log(LOGGER_LEVEL_DEBUG, msg)
+#define LOGGER_ERROR(msg) do { if (LOGGER_ON(LOGGER_LEVEL_ERROR)) logger_log(LOGGER_LEVEL_ERROR, msg); } while (0)
+#define LOGGER_WARN(msg)  do { if (LOGGER_ON(LOGGER_LEVEL_WARN)) logger_log(LOGGER_LEVEL_WARN, msg); } while (0)
+#define LOGGER_INFO(msg)  do { if (LOGGER_ON(LOGGER_LEVEL_INFO)) logger_log(LOGGER_LEVEL_INFO, msg); } while (0)
+#define LOGGER_DEBUG(msg) do { if (LOGGER_ON(LOGGER_LEVEL_DEBUG)) logger_log(LOGGER_LEVEL_DEBUG, msg); } while (0)
 
 // macros to allow formatted logging
-#define LOGGER_FMT_ERROR(fmt, msg...) logger_fmt(LOGGER_LEVEL_ERROR, fmt, msg)
-#define LOGGER_FMT_WARN(fmt, msg...)  logger_fmt(LOGGER_LEVEL_WARN, fmt, msg)
-#define LOGGER_FMT_INFO(fmt, msg...)  logger_fmt(LOGGER_LEVEL_INFO, fmt, msg)
-#define LOGGER_FMT_DEBUG(fmt, msg...) logger_fmt(LOGGER_LEVEL_DEBUG, fmt, msg)
+#define LOGGER_FMT_ERROR(fmt, msg...) do { if (LOGGER_ON(LOGGER_LEVEL_ERROR)) logger_fmt(LOGGER_LEVEL_ERROR, fmt, msg); } while (0)
+#define LOGGER_FMT_WARN(fmt, msg...)  do { if (LOGGER_ON(LOGGER_LEVEL_WARN)) logger_fmt(LOGGER_LEVEL_WARN, fmt, msg); } while (0)
+#define LOGGER_FMT_INFO(fmt, msg...)  do { if (LOGGER_ON(LOGGER_LEVEL_INFO)) logger_fmt(LOGGER_LEVEL_INFO, fmt, msg); } while (0)
+#define LOGGER_FMT_DEBUG(fmt, msg...) do { if (LOGGER_ON(LOGGER_LEVEL_DEBUG)) logger_fmt(LOGGER_LEVEL_DEBUG, fmt, msg); } while (0)
+
+// macro to log data as hex, after the passed prefix
+#define LOGGER_DATA_DEBUG(prefix, data, len) \
+    do { if (LOGGER_ON(LOGGER_LEVEL_DEBUG)) logger_data(LOGGER_LEVEL_DEBUG, prefix, data, len); } while (0)
 
 // set the logger level, level should be one of the LOGGER_LEVEL_xxx defines
 #define LOGGER_SET_LEVEL(level) logger_level = level
@@ -39,6 +52,30 @@ static const char *logger_level_str[]={
 
 // the current logger level
 extern unsigned char logger_level;
+// file descriptor to which messages are written, stderr by default
+extern int logger_fd;
+
+// Messages are written as they are logged, with one write each, until logger_async_start() is
+// called. From then on they are copied into a ring of LOGGER_SLOTS preallocated slots, without
+// locking, and a background thread formats the hex dumps and writes the messages in batches.
+// The thread sleeps while the ring is empty, to be woken by the next message.
+// Should the ring be full a message is dropped, and a count of those dropped is logged later.
+
+//! number of slots in the ring, a power of 2
+#define LOGGER_SLOTS 32
+//! longest message, or data logged by logger_data(), with its prefix. Longer ones are cut short.
+#define LOGGER_MSG_LEN 1088
+
+/**
+ * Start writing messages from a background thread. The messages still in the ring are written
+ * when the program exits.
+ * @return 0 on success, -1 if the thread couldn't be started, in which case messages are still
+ * written as they are logged
+ */
+int logger_async_start();
+
+//! write any messages in the ring and stop the background thread, if it was started
+void logger_async_stop();
 
 /** 
  * Log the passed message with passed level, message will only be logged
@@ -58,6 +95,18 @@ void logger_log(int level, char *msg);
 void logger_fmt(int level, const char *fmt, ...);
 
 
+/**
+ * Log the passed data in hex, after the prefix. Copied as it is, it is formatted as it is written.
+ * @param level The log-level int
+ * @param prefix Written before the data
+ * @param data The data
+ * @param len Number of bytes of data
+ */
+void logger_data(int level, const char *prefix, const unsigned char *data, unsigned len);
+
+// The parts of a message may be logged separately, with the following, for which they are written
+// directly rather than through the ring.
+
 //! Log the starting part of a log message
 void logger_start(int level);
 //! Log the ending part of a log message
@@ -0,0 +1,400 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Metrics of the inverters polled, served over HTTP, see metrics.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "metrics.h"
+
+static const double metrics_buckets[METRICS_N_BUCKETS] = METRICS_BUCKETS;
+
+//! append to the passed page as printf() would, growing it as need be
+static int metrics_printf(metrics_page_t *page, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    for (;;){
+	va_start(args, fmt);
+	n = vsnprintf(page->buf + page->len, page->size - page->len, fmt, args);
+	va_end(args);
+	if (n < 0)
+	    return -1;
+	if (page->len + n < page->size){
+	    page->len += n;
+	    return 0;
+	}
+	char *buf = arena_realloc(page->buf, page->size * 2 + n + 1);
+	if (buf == NULL)
+	    return -1;
+	page->buf = buf;
+	page->size = page->size * 2 + n + 1;
+    }
+}
+
+//! append the HELP and TYPE lines of a metric
+static int metrics_family(metrics_page_t *page, const char *name, const char *type, const char *help)
+{
+    return metrics_printf(page, "# HELP sbread_%s %s\n# TYPE sbread_%s %s\n", name, help, name, type);
+}
+
+//! append a counter of each link, at the passed offset in metrics_link_t and of the passed size
+static int metrics_link_counter(const metrics_t *m, metrics_page_t *page, const char *name, const char *help,
+				size_t off, size_t size)
+{
+    int i;
+
+    if (m->n_links == 0)
+	return 0;
+    if (metrics_family(page, name, "counter", help) < 0)
+	return -1;
+    for (i = 0; i < m->n_links; i++){
+	const unsigned char *p = (const unsigned char *)&m->links[i] + off;
+	uint64_t value = size == sizeof(uint64_t) ? *(const uint64_t *)p : *(const uint32_t *)p;
+	if (metrics_printf(page, "sbread_%s{addr=\"%s\"} %llu\n", name, m->links[i].addr, (unsigned long long)value) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+#define METRICS_LINK_COUNTER(m, page, name, help, field) \
+    metrics_link_counter(m, page, name, help, offsetof(metrics_link_t, field), sizeof(((metrics_link_t *)0)->field))
+
+int metrics_render(const metrics_t *m, metrics_page_t *page)
+{
+    int i, j, val, decimals;
+
+    page->len = 0;
+    if (page->buf == NULL){
+	if ((page->buf = arena_alloc(METRICS_PAGE_SIZE)) == NULL)
+	    return -1;
+	page->size = METRICS_PAGE_SIZE;
+    }
+    page->buf[0] = '\x0';
+
+    // the values of each inverter, by value
+    for (val = 0; val < SMA_VAL_COUNT; val++){
+	for (i = 0; i < m->n_inverters && !(m->inverters[i].values.have & SMA_HAVE(val)); i++)
+	    ;
+	if (i == m->n_inverters)
+	    continue;
+	if (metrics_family(page, sma_value_name(val), "gauge", "latest value read from the inverter") < 0)
+	    return -1;
+	for (; i < m->n_inverters; i++){
+	    const sma_values_t *v = &m->inverters[i].values;
+	    if (!(v->have & SMA_HAVE(val)))
+		continue;
+	    double value = sma_value_get(v, val, &decimals);
+	    if (metrics_printf(page, "sbread_%s{serial=\"%u\"} %.*f\n", sma_value_name(val), m->inverters[i].serial,
+			       decimals, value) < 0)
+		return -1;
+	}
+    }
+    if (m->n_inverters){
+	if (metrics_family(page, "last_read_time_seconds", "gauge", "unix time at which the inverter was last read") < 0)
+	    return -1;
+	for (i = 0; i < m->n_inverters; i++){
+	    if (metrics_printf(page, "sbread_last_read_time_seconds{serial=\"%u\"} %u\n", m->inverters[i].serial,
+			       m->inverters[i].time) < 0)
+		return -1;
+	}
+    }
+
+    // the counters of each connection
+    if (METRICS_LINK_COUNTER(m, page, "polls_total", "polls made", polls) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "poll_failures_total", "polls that failed", failures) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "connects_total", "connections made, the first and any reconnections", connects) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "timeouts_total", "replies not received in time", timeouts) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "bad_fcs_total", "frames dropped as their fcs, ie crc, was bad", bad_fcs) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "resends_total", "requests sent again as their reply was late", resends) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "recoveries_total", "polls carried on over a new connection after the link was lost",
+			     recoveries) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "received_bytes_total", "bytes received", bytes_in) < 0 ||
+	METRICS_LINK_COUNTER(m, page, "sent_bytes_total", "bytes sent", bytes_out) < 0)
+	return -1;
+    if (m->n_links){
+	if (metrics_family(page, "poll_duration_seconds", "histogram", "time taken by each poll") < 0)
+	    return -1;
+	for (i = 0; i < m->n_links; i++){
+	    const metrics_link_t *l = &m->links[i];
+	    uint32_t n = 0;
+	    for (j = 0; j < METRICS_N_BUCKETS; j++){
+		n += l->hist[j];
+		if (metrics_printf(page, "sbread_poll_duration_seconds_bucket{addr=\"%s\",le=\"%g\"} %u\n", l->addr,
+				   metrics_buckets[j], n) < 0)
+		    return -1;
+	    }
+	    if (metrics_printf(page, "sbread_poll_duration_seconds_bucket{addr=\"%s\",le=\"+Inf\"} %u\n"
+			       "sbread_poll_duration_seconds_sum{addr=\"%s\"} %.6f\n"
+			       "sbread_poll_duration_seconds_count{addr=\"%s\"} %u\n",
+			       l->addr, l->polls, l->addr, l->sum_sec, l->addr, l->polls) < 0)
+		return -1;
+	}
+    }
+    return 0;
+}
+
+//! the passed inverter's entry, added if it's new, or NULL if there's no room
+static metrics_inverter_t *metrics_inverter(metrics_t *m, uint32_t serial)
+{
+    int i;
+
+    for (i = 0; i < m->n_inverters; i++){
+	if (m->inverters[i].serial == serial)
+	    return &m->inverters[i];
+    }
+    if (m->n_inverters == METRICS_MAX_INVERTERS)
+	return NULL;
+    memset(&m->inverters[i], 0, sizeof(m->inverters[i]));
+    m->inverters[i].serial = serial;
+    m->n_inverters++;
+    return &m->inverters[i];
+}
+
+//! set the latest values of the passed inverter
+static void metrics_values(metrics_t *m, uint32_t serial, const sma_values_t *v, uint32_t now)
+{
+    metrics_inverter_t *inv = metrics_inverter(m, serial);
+
+    if (inv == NULL || v->have == 0)
+	return;
+    inv->values = *v;
+    inv->time = now;
+}
+
+void metrics_update(metrics_t *m, const sb_session_t *s, int ok, double poll_sec)
+{
+    metrics_link_t *l;
+    uint32_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < m->n_links && strcmp(m->links[i].addr, s->tr->addr) != 0; i++)
+	;
+    if (i == m->n_links){
+	if (m->n_links == METRICS_MAX_LINKS)
+	    return;
+	memset(&m->links[i], 0, sizeof(m->links[i]));
+	snprintf(m->links[i].addr, sizeof(m->links[i].addr), "%s", s->tr->addr);
+	m->n_links++;
+    }
+    l = &m->links[i];
+    l->polls++;
+    l->failures += !ok;
+    l->connects = s->connects;
+    l->timeouts = s->timeouts;
+    l->bad_fcs = s->bad_fcs;
+    l->resends = s->resends;
+    l->recoveries = s->recoveries;
+    l->bytes_in = s->tr->bytes_in;
+    l->bytes_out = s->tr->bytes_out;
+    for (i = 0; i < METRICS_N_BUCKETS && poll_sec > metrics_buckets[i]; i++)
+	;
+    l->hist[i]++;
+    l->sum_sec += poll_sec;
+    if (!ok)
+	return;
+    if (s->net){
+	for (i = 0; i < s->n_nodes; i++)
+	    metrics_values(m, sma_get_u32(s->nodes[i].addr + 2), &s->nodes[i].values, now);
+    } else
+	metrics_values(m, sma_get_u32(s->serial), &s->values, now);
+}
+
+int metrics_publish(metrics_t *m)
+{
+    metrics_page_t page;
+
+    if (metrics_render(m, &m->rendered) < 0){
+	LOGGER_ERROR("out of memory rendering the metrics");
+	return -1;
+    }
+    pthread_mutex_lock(&m->lock);
+    page = m->served;
+    m->served = m->rendered;
+    m->rendered = page;
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
+
+//! write all of the passed buffer to the client
+static int metrics_send(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0){
+	if ((n = send(fd, buf, len, MSG_NOSIGNAL)) <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+//! read the request of the passed client, and answer it
+static void metrics_serve(metrics_t *m, int fd)
+{
+    static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    char req[METRICS_REQUEST_MAX + 1], hdr[256], path[64];
+    struct timeval tv = { METRICS_IO_TIMEOUT_SEC, 0 };
+    size_t len = 0;
+    ssize_t n;
+    int hdr_len;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    // only the request line matters, but the headers are read so the client isn't reset
+    while (len < METRICS_REQUEST_MAX && (n = recv(fd, req + len, METRICS_REQUEST_MAX - len, 0)) > 0){
+	len += n;
+	req[len] = '\x0';
+	if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+	    break;
+    }
+    req[len] = '\x0';
+    if (sscanf(req, "GET %63s", path) != 1 || (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0)){
+	metrics_send(fd, not_found, sizeof(not_found) - 1);
+	return;
+    }
+    // copy the page, so as not to hold up the poller while it is written
+    pthread_mutex_lock(&m->lock);
+    if (m->sending.size < m->served.len){
+	char *buf = arena_realloc(m->sending.buf, m->served.len);
+	if (buf == NULL){
+	    pthread_mutex_unlock(&m->lock);
+	    return;
+	}
+	m->sending.buf = buf;
+	m->sending.size = m->served.len;
+    }
+    if (m->served.len)
+	memcpy(m->sending.buf, m->served.buf, m->served.len);
+    m->sending.len = m->served.len;
+    pthread_mutex_unlock(&m->lock);
+    hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)m->sending.len);
+    if (metrics_send(fd, hdr, hdr_len) == 0)
+	metrics_send(fd, m->sending.buf, m->sending.len);
+}
+
+//! the background thread, serving the page to each client in turn
+static void *metrics_thread(void *arg)
+{
+    metrics_t *m = arg;
+    int fd;
+
+    for (;;){
+	if ((fd = accept(m->fd, NULL, NULL)) < 0){
+	    if (errno != EINTR && errno != ECONNABORTED)
+		LOGGER_FMT_ERROR("metrics: accept failed: %s", strerror(errno));
+	    continue;
+	}
+	metrics_serve(m, fd);
+	close(fd);
+    }
+    return NULL;
+}
+
+//! open a socket listening on the passed address, as metrics_start()
+static int metrics_listen(metrics_t *m, const char *listen_addr)
+{
+    char host[TRANSPORT_ADDR_MAX];
+    const char *port;
+    struct addrinfo hints = { 0 }, *res, *ai;
+    int fd = -1, one = 1, ret;
+
+    if (strchr(listen_addr, '/') != NULL){
+	struct sockaddr_un sun = { 0 };
+	if (strlen(listen_addr) >= sizeof(sun.sun_path)){
+	    LOGGER_FMT_ERROR("metrics: socket path too long: %s", listen_addr);
+	    return -1;
+	}
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, listen_addr);
+	// left over from the last run
+	unlink(listen_addr);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 4) < 0){
+	    LOGGER_FMT_ERROR("metrics: could not listen on %s: %s", listen_addr, strerror(errno));
+	    if (fd >= 0)
+		close(fd);
+	    return -1;
+	}
+	strcpy(m->path, listen_addr);
+	return fd;
+    }
+    strncpy(host, listen_addr, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\x0';
+    char *colon = strrchr(host, ':');
+    if (colon != NULL){
+	*colon = '\x0';
+	port = colon + 1;
+    } else {
+	// a port alone is only listened on locally
+	strcpy(host, "localhost");
+	port = listen_addr;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) != 0){
+	LOGGER_FMT_ERROR("metrics: could not resolve %s: %s", listen_addr, gai_strerror(ret));
+	return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next){
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 4) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+	LOGGER_FMT_ERROR("metrics: could not listen on %s: %s", listen_addr, strerror(errno));
+    return fd;
+}
+
+int metrics_start(metrics_t *m, const char *listen_addr)
+{
+    metrics_page_t *pages[] = { &m->served, &m->rendered, &m->sending };
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    pthread_mutex_init(&m->lock, NULL);
+    // the pages are allocated now, before the first poll, so that in the fixed footprint build they need never grow
+    for (i = 0; i < 3; i++){
+	if ((pages[i]->buf = arena_alloc(METRICS_PAGE_SIZE)) == NULL){
+	    LOGGER_ERROR("metrics: out of memory");
+	    return -1;
+	}
+	pages[i]->size = METRICS_PAGE_SIZE;
+    }
+    if ((m->fd = metrics_listen(m, listen_addr)) < 0)
+	return -1;
+    if (pthread_create(&m->thread, NULL, metrics_thread, m) != 0){
+	LOGGER_ERROR("metrics: could not start the server thread");
+	close(m->fd);
+	m->fd = -1;
+	return -1;
+    }
+    pthread_detach(m->thread);
+    LOGGER_FMT_INFO("serving metrics on %s", listen_addr);
+    return 0;
+}
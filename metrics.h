@@ -0,0 +1,142 @@
+#ifndef METRICS_H
+#define METRICS_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Metrics of the inverters polled, served over HTTP in the Prometheus text
+// format, for sbread -daemon.
+//
+// After each poll the poller passes each session to metrics_update(), which
+// keeps the latest values of each inverter and the counters of each connection,
+// then calls metrics_publish(). That renders the page into a buffer of its own
+// and swaps it with the one being served. The page is served from a background
+// thread, which only holds the lock while copying it, so a scrape never waits
+// for the inverters and the poller never waits for a scrape.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "session.h"
+
+//! most connections, and inverters, that metrics are kept of, in the fixed footprint build those it's built for
+#ifdef SB_ARENA_INVERTERS
+#define METRICS_MAX_LINKS      SB_ARENA_INVERTERS
+#define METRICS_MAX_INVERTERS  SB_ARENA_INVERTERS
+#else
+#define METRICS_MAX_LINKS      32
+#define METRICS_MAX_INVERTERS  64
+#endif
+//! buckets of the poll latency histograms, seconds
+#define METRICS_BUCKETS        { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 }
+#define METRICS_N_BUCKETS      9
+//! most bytes of a page: the HELP and TYPE lines of each metric, a line of each value of each
+//! inverter, and the counters and histogram buckets of each connection
+#define METRICS_PAGE_MAX       ((SMA_VAL_COUNT + 11) * 200 + METRICS_MAX_INVERTERS * (SMA_VAL_COUNT + 1) * 100 + \
+				METRICS_MAX_LINKS * (9 + METRICS_N_BUCKETS + 3) * (100 + TRANSPORT_ADDR_MAX))
+//! bytes each page is allocated with to begin with, and grown from as need be. In the fixed footprint
+//! build, see arena.h, it can't be grown so is allocated at the most it can need.
+#ifdef SB_ARENA_INVERTERS
+#define METRICS_PAGE_SIZE      METRICS_PAGE_MAX
+#else
+#define METRICS_PAGE_SIZE      4096
+#endif
+//! most bytes of a request read
+#define METRICS_REQUEST_MAX    1024
+//! seconds allowed for a request to be read, and the page written
+#define METRICS_IO_TIMEOUT_SEC 2
+
+//! a connection to an inverter, or to the net of inverters reached through it
+typedef struct {
+    char addr[TRANSPORT_ADDR_MAX];
+    //! number of polls, and of those that failed
+    uint32_t polls;
+    uint32_t failures;
+    //! as the session's counters
+    uint32_t connects;
+    uint32_t timeouts;
+    uint32_t bad_fcs;
+    uint32_t resends;
+    uint32_t recoveries;
+    //! as the transport's counters
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    //! the poll latency histogram, each bucket counting the polls in it alone
+    uint32_t hist[METRICS_N_BUCKETS + 1];
+    double sum_sec;
+} metrics_link_t;
+
+//! the latest values of an inverter
+typedef struct {
+    uint32_t serial;
+    sma_values_t values;
+    //! unix time of the poll that read them
+    uint32_t time;
+} metrics_inverter_t;
+
+//! a page, as rendered or served
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} metrics_page_t;
+
+typedef struct {
+    //! the listening socket, -1 if not listening
+    int fd;
+    //! path of the unix socket listened on, empty for tcp
+    char path[TRANSPORT_ADDR_MAX];
+    pthread_t thread;
+    //! held while swapping the page served, and copying it to be served
+    pthread_mutex_t lock;
+    //! the page being served, and that rendered by metrics_publish(), which are swapped
+    metrics_page_t served;
+    metrics_page_t rendered;
+    //! the copy of the page being written to a client, only used by the background thread
+    metrics_page_t sending;
+    metrics_link_t links[METRICS_MAX_LINKS];
+    int n_links;
+    metrics_inverter_t inverters[METRICS_MAX_INVERTERS];
+    int n_inverters;
+} metrics_t;
+
+/**
+ * Start serving metrics, which are empty until the first metrics_publish()
+ *
+ * @param m The metrics
+ * @param listen_addr Where to listen: [host:]port for tcp, localhost if no host is given, or the
+ * path of a unix socket, being any address with a / in it
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int metrics_start(metrics_t *m, const char *listen_addr);
+
+/**
+ * Add the results of a poll of a session to the metrics
+ *
+ * @param m The metrics
+ * @param s The session, whose values are those of the inverter, or with s->net set of each
+ * inverter in the net
+ * @param ok Flag to indicate whether the poll succeeded
+ * @param poll_sec Time taken by the poll
+ */
+void metrics_update(metrics_t *m, const sb_session_t *s, int ok, double poll_sec);
+
+/**
+ * Render the metrics as the page to be served from now on
+ *
+ * @return 0 on success, -1 if out of memory, in which case the last page is still served
+ */
+int metrics_publish(metrics_t *m);
+
+/**
+ * Render the metrics into the passed page, in the Prometheus text format
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int metrics_render(const metrics_t *m, metrics_page_t *page);
+
+#endif
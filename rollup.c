@@ -0,0 +1,223 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Rollups of the readings of an inverter, see rollup.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "rollup.h"
+
+//! the tiers, finest first: 5 minutes for a week, hours for three months and days for ten years
+static const struct {
+    uint32_t step;
+    uint32_t n_buckets;
+} rollup_tiers[ROLLUP_TIERS] = {
+    { 300, 7 * 288 },
+    { 3600, 93 * 24 },
+    { 86400, 3660 },
+};
+
+//! the buckets of the passed tier
+static rollup_bucket_t *rollup_buckets(const rollup_t *r, int tier)
+{
+    return (rollup_bucket_t *)((unsigned char *)r->map + r->hdr->tiers[tier].offset);
+}
+
+//! return the size of the rollup file
+static size_t rollup_size()
+{
+    size_t len = sizeof(rollup_hdr_t);
+    int i;
+
+    for (i = 0; i < ROLLUP_TIERS; i++)
+	len += rollup_tiers[i].n_buckets * sizeof(rollup_bucket_t);
+    return len;
+}
+
+//! check that the header of the mapped file is that of the file we'd create
+static int rollup_check(const rollup_t *r)
+{
+    const rollup_hdr_t *hdr = r->hdr;
+    size_t offset = sizeof(rollup_hdr_t);
+    int i;
+
+    if (hdr->magic != ROLLUP_MAGIC || hdr->version != ROLLUP_VERSION || hdr->n_tiers != ROLLUP_TIERS)
+	return -1;
+    for (i = 0; i < ROLLUP_TIERS; i++){
+	if (hdr->tiers[i].step != rollup_tiers[i].step || hdr->tiers[i].n_buckets != rollup_tiers[i].n_buckets ||
+	    hdr->tiers[i].offset != offset)
+	    return -1;
+	offset += rollup_tiers[i].n_buckets * sizeof(rollup_bucket_t);
+    }
+    return 0;
+}
+
+int rollup_open(rollup_t *r, const char *path)
+{
+    struct stat sb;
+    struct tm tm;
+    time_t now = time(NULL);
+    size_t offset = sizeof(rollup_hdr_t);
+    int i;
+
+    r->map = NULL;
+    r->hdr = NULL;
+    r->map_len = rollup_size();
+    if ((r->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0){
+	LOGGER_FMT_ERROR("Could not open %s: %s", path, strerror(errno));
+	return -1;
+    }
+    if (fstat(r->fd, &sb) < 0 || (sb.st_size != r->map_len && ftruncate(r->fd, r->map_len) < 0)){
+	LOGGER_FMT_ERROR("Could not size %s: %s", path, strerror(errno));
+	rollup_close(r);
+	return -1;
+    }
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->map == MAP_FAILED){
+	LOGGER_FMT_ERROR("Could not map %s: %s", path, strerror(errno));
+	r->map = NULL;
+	rollup_close(r);
+	return -1;
+    }
+    r->hdr = r->map;
+    if (sb.st_size == r->map_len && rollup_check(r) == 0)
+	return 0;
+    if (sb.st_size != 0)
+	LOGGER_FMT_WARN("Rollups in %s are of another layout, starting again", path);
+    // a new file, or an old layout: the rollups will be rebuilt from new readings on
+    memset(r->map, 0, r->map_len);
+    r->hdr->version = ROLLUP_VERSION;
+    r->hdr->n_tiers = ROLLUP_TIERS;
+    // kept, so that the buckets don't move when daylight saving starts or ends
+    if (localtime_r(&now, &tm) != NULL)
+	r->hdr->utc_offset = tm.tm_gmtoff;
+    for (i = 0; i < ROLLUP_TIERS; i++){
+	r->hdr->tiers[i].step = rollup_tiers[i].step;
+	r->hdr->tiers[i].n_buckets = rollup_tiers[i].n_buckets;
+	r->hdr->tiers[i].offset = offset;
+	offset += rollup_tiers[i].n_buckets * sizeof(rollup_bucket_t);
+    }
+    r->hdr->magic = ROLLUP_MAGIC;
+    return 1;
+}
+
+void rollup_close(rollup_t *r)
+{
+    if (r->map != NULL){
+	msync(r->map, r->map_len, MS_SYNC);
+	munmap(r->map, r->map_len);
+    }
+    if (r->fd >= 0)
+	close(r->fd);
+    r->map = NULL;
+    r->hdr = NULL;
+    r->fd = -1;
+}
+
+uint32_t rollup_align(const rollup_t *r, uint32_t time, uint32_t step)
+{
+    int64_t offset = r->hdr != NULL ? r->hdr->utc_offset : 0;
+
+    // the offset is in (-step, step), so the sum is never negative
+    offset = offset % step + step;
+    return time - (uint32_t)((time + offset) % step);
+}
+
+void rollup_bucket_clear(rollup_bucket_t *b, uint32_t start)
+{
+    memset(b, 0, sizeof(*b));
+    b->start = start;
+}
+
+void rollup_bucket_merge(rollup_bucket_t *b, const rollup_bucket_t *from)
+{
+    if (from->n){
+	if (b->n == 0 || from->min_w < b->min_w)
+	    b->min_w = from->min_w;
+	if (b->n == 0 || from->max_w > b->max_w)
+	    b->max_w = from->max_w;
+	b->n += from->n;
+	b->sum_w += from->sum_w;
+    }
+    b->wh += from->wh;
+}
+
+uint32_t rollup_energy(rollup_hdr_t *hdr, uint32_t time, const sma_values_t *v)
+{
+    uint32_t wh = 0;
+
+    if (v->have & SMA_HAVE(SMA_VAL_TOTAL_WH)){
+	if ((hdr->last_have & SMA_HAVE(SMA_VAL_TOTAL_WH)) && v->total_wh >= hdr->last_total_wh)
+	    wh = v->total_wh - hdr->last_total_wh;
+    } else if (v->have & SMA_HAVE(SMA_VAL_DAY_WH)){
+	// the day's energy restarts in the morning, before which the inverter sleeps
+	if (hdr->last_have & SMA_HAVE(SMA_VAL_DAY_WH))
+	    wh = v->day_wh >= hdr->last_day_wh ? v->day_wh - hdr->last_day_wh : v->day_wh;
+    }
+    hdr->last_have = v->have & (SMA_HAVE(SMA_VAL_TOTAL_WH) | SMA_HAVE(SMA_VAL_DAY_WH));
+    hdr->last_total_wh = v->total_wh;
+    hdr->last_day_wh = v->day_wh;
+    hdr->last_time = time;
+    return wh;
+}
+
+void rollup_add(rollup_t *r, uint32_t time, const sma_values_t *v)
+{
+    rollup_bucket_t reading;
+    int i;
+
+    if (r->hdr == NULL)
+	return;
+    rollup_bucket_clear(&reading, 0);
+    reading.wh = rollup_energy(r->hdr, time, v);
+    if (v->have & SMA_HAVE(SMA_VAL_AC_POWER)){
+	reading.n = 1;
+	reading.min_w = reading.max_w = reading.sum_w = v->ac_power;
+    }
+    for (i = 0; i < ROLLUP_TIERS; i++){
+	uint32_t step = r->hdr->tiers[i].step, start = rollup_align(r, time, step);
+	rollup_bucket_t *b = rollup_buckets(r, i) + (start / step) % r->hdr->tiers[i].n_buckets;
+	// a bucket from the ring's last time round is recycled
+	if (b->start != start || (b->n == 0 && b->wh == 0))
+	    rollup_bucket_clear(b, start);
+	rollup_bucket_merge(b, &reading);
+    }
+}
+
+const rollup_bucket_t *rollup_find(const rollup_t *r, int tier, uint32_t start)
+{
+    const rollup_bucket_t *b = rollup_buckets(r, tier) + (start / r->hdr->tiers[tier].step) % r->hdr->tiers[tier].n_buckets;
+
+    if (b->start != start || (b->n == 0 && b->wh == 0))
+	return NULL;
+    return b;
+}
+
+int rollup_tier_for(const rollup_t *r, uint32_t from, uint32_t step)
+{
+    int i;
+
+    if (r->hdr == NULL)
+	return -1;
+    for (i = ROLLUP_TIERS - 1; i >= 0; i--){
+	const rollup_tier_t *t = &r->hdr->tiers[i];
+	uint32_t newest = rollup_align(r, r->hdr->last_time, t->step);
+	if (step % t->step != 0)
+	    continue;
+	// the oldest bucket still in the ring
+	if (newest < (t->n_buckets - 1) * t->step || from >= newest - (t->n_buckets - 1) * t->step)
+	    return i;
+    }
+    return -1;
+}
@@ -0,0 +1,146 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Rollups of the readings of an inverter: the minimum, maximum and average AC
+// power and the energy produced over 5 minutes, an hour and a day.
+//
+// The rollups are kept in one file beside the inverter's store segments,
+// <name>.rollup, which is mmap'd and updated as each reading is appended. Each
+// tier is a ring of buckets indexed by (start / step) % n_buckets, so a bucket
+// is recycled once the ring has gone round. The buckets are aligned to local
+// time, by the offset from UTC when the file was created, so that a day runs
+// from midnight to midnight where the inverter is.
+//
+// The energy of a reading is the increase in the total energy counter since
+// the previous reading, or if that's not present, in the energy produced today,
+// which restarts each morning.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "sma.h"
+
+//! 'SBRU' - magic number at the start of a rollup file
+#define ROLLUP_MAGIC     0x55524253
+//! version of the file layout, bump whenever it changes
+#define ROLLUP_VERSION   2
+//! number of tiers
+#define ROLLUP_TIERS     3
+
+//! the readings of one bucket, or of a step of a query
+typedef struct {
+    //! unix time of the start of the bucket
+    uint32_t start;
+    //! number of power readings
+    uint32_t n;
+    //! minimum and maximum AC power (W)
+    int32_t min_w;
+    int32_t max_w;
+    //! sum of the AC power readings, for the average
+    int64_t sum_w;
+    //! energy produced (Wh)
+    uint32_t wh;
+    uint32_t pad;
+} rollup_bucket_t;
+
+//! a tier, as stored in the file
+typedef struct {
+    //! seconds covered by each bucket
+    uint32_t step;
+    uint32_t n_buckets;
+    //! offset of the buckets from the start of the file
+    uint32_t offset;
+    uint32_t pad;
+} rollup_tier_t;
+
+//! header at the start of the rollup file
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t n_tiers;
+    //! unix time of the last reading added
+    uint32_t last_time;
+    //! SMA_HAVE() flags of the energy counters of the last reading, the counters follow
+    uint32_t last_have;
+    //! seconds east of UTC of the local time the buckets are aligned to
+    int32_t utc_offset;
+    uint32_t pad;
+    uint64_t last_total_wh;
+    uint64_t last_day_wh;
+    rollup_tier_t tiers[ROLLUP_TIERS];
+} rollup_hdr_t;
+
+//! a rollup file, mapped
+typedef struct {
+    int fd;
+    void *map;
+    size_t map_len;
+    rollup_hdr_t *hdr;
+} rollup_t;
+
+/**
+ * Open the rollup file at path, creating it if need be
+ *
+ * @return 0 on success, 1 if the file was new or of another layout and has been started again,
+ *         or -1 on error, which has been logged
+ */
+int rollup_open(rollup_t *r, const char *path);
+
+//! add the passed reading, of the passed time, which must not be before the last reading's
+void rollup_add(rollup_t *r, uint32_t time, const sma_values_t *v);
+
+//! close the rollup file
+void rollup_close(rollup_t *r);
+
+/**
+ * Get the start of the step holding the passed time, the steps being aligned to the local time of the rollups
+ *
+ * @param r The rollup file, if it isn't open the steps are aligned to UTC
+ * @param time Unix time
+ * @param step Length of the step in seconds
+ *
+ * @return Unix time of the start of the step
+ */
+uint32_t rollup_align(const rollup_t *r, uint32_t time, uint32_t step);
+
+//! clear the passed bucket, setting its start time
+void rollup_bucket_clear(rollup_bucket_t *b, uint32_t start);
+
+//! add the readings of bucket from to those of bucket b
+void rollup_bucket_merge(rollup_bucket_t *b, const rollup_bucket_t *from);
+
+/**
+ * Get the energy produced since the last reading, and make the passed reading the last
+ *
+ * @param hdr Holds the counters of the last reading
+ * @param time Time of the reading
+ * @param v The reading
+ *
+ * @return The energy (Wh), 0 if it isn't known
+ */
+uint32_t rollup_energy(rollup_hdr_t *hdr, uint32_t time, const sma_values_t *v);
+
+/**
+ * Find the bucket of a tier that starts at the passed time
+ *
+ * @param r The rollup file
+ * @param tier Index of the tier
+ * @param start Unix time of the start of the bucket, as from rollup_align()
+ *
+ * @return The bucket, or NULL if it has no readings or has been recycled
+ */
+const rollup_bucket_t *rollup_find(const rollup_t *r, int tier, uint32_t start);
+
+/**
+ * Get the coarsest tier whose buckets fit evenly in steps of the passed length, and which still
+ * holds the buckets from the passed time on
+ *
+ * @return Index of the tier, or -1 if there isn't one
+ */
+int rollup_tier_for(const rollup_t *r, uint32_t from, uint32_t step);
+
+#endif
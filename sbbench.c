@@ -0,0 +1,2453 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Benchmarks for the protocol code, run on the host rather than the router
+// where possible. Usage: sbbench [benchmark ...], with no arguments all are run.
+//
+// The session benchmark runs whole sessions against the simulated inverter
+// (see sim.h), using the script sbread.script in the current directory. The
+// daemon benchmark polls it over the one session, as sbread -daemon does.
+// To build on a host without the bluetooth headers use:
+//   make bench CC=gcc INCLUDE_DIR=/usr/include DEFS=-DSB_NO_BLUETOOTH LDFLAGS=
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "arena.h"
+#include "archive.h"
+#include "crc.h"
+#include "frame.h"
+#include "libsma.h"
+#include "logger.h"
+#include "metrics.h"
+#include "sched.h"
+#include "script.h"
+#include "session.h"
+#include "shm.h"
+#include "sim.h"
+#include "sma.h"
+#include "store.h"
+#include "sweep.h"
+#include "trace.h"
+#include "transport.h"
+#include "upload.h"
+
+//! minimum time in seconds over which each function is timed
+#define BENCH_MIN_SEC 0.5
+//! size of the simulated session that is decoded, being the concatenation of the recorded frames
+#define BENCH_SESSION_LEN (64 * 1024)
+//! the script run by the session benchmark
+#define BENCH_SCRIPT "sbread.script"
+
+// frames as recorded from an inverter: replies to the spot AC and energy queries, and one packet of a
+// day archive download. Note that the inverter's serial number 7E:F9:04:9F needs escaping.
+static const unsigned char spot_ac_reply[] = {
+    0x7e, 0x96, 0x00, 0xe8, 0x60, 0x77, 0xa6, 0x25, 0x80, 0x00, 0x1d, 0x7e, 0x3c, 0x13, 0x15, 0x00,
+    0x01, 0x00, 0x7e, 0xff, 0x03, 0x60, 0x65, 0x1e, 0x90, 0x78, 0x00, 0x50, 0xd0, 0x92, 0x39, 0x00,
+    0xa0, 0x8a, 0x00, 0x9f, 0x04, 0xf9, 0x7d, 0x5e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x80,
+    0x01, 0x02, 0x00, 0x51, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x26, 0x01,
+    0xa3, 0xf1, 0x40, 0x54, 0x05, 0x0c, 0x00, 0x00, 0x05, 0x0c, 0x00, 0x00, 0x05, 0x0c, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x40, 0x46, 0x01, 0xa3, 0xf1, 0x40, 0x54,
+    0x03, 0x04, 0x00, 0x00, 0x03, 0x04, 0x00, 0x00, 0x03, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+    0x00, 0x00, 0x00, 0x80, 0x00, 0x57, 0x46, 0x01, 0xa3, 0xf1, 0x40, 0x54, 0x8a, 0x7d, 0x33, 0x00,
+    0x00, 0x8a, 0x7d, 0x33, 0x00, 0x00, 0x8a, 0x7d, 0x33, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00,
+    0x00, 0x00, 0x80, 0x35, 0x3b, 0x7e,
+};
+static const unsigned char energy_reply[] = {
+    0x7e, 0x61, 0x00, 0x1f, 0x60, 0x77, 0xa6, 0x25, 0x80, 0x00, 0x1d, 0x7e, 0x3c, 0x13, 0x15, 0x00,
+    0x01, 0x00, 0x7e, 0xff, 0x03, 0x60, 0x65, 0x7d, 0x31, 0x90, 0x78, 0x00, 0x50, 0xd0, 0x92, 0x39,
+    0x00, 0xa0, 0x8a, 0x00, 0x9f, 0x04, 0xf9, 0x7d, 0x5e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x26,
+    0x80, 0x01, 0x02, 0x00, 0x54, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x26,
+    0x00, 0xa3, 0xf1, 0x40, 0x54, 0x0b, 0x4d, 0x4d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x22, 0x26,
+    0x00, 0xa3, 0xf1, 0x40, 0x54, 0x5a, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7d, 0x32, 0x84,
+    0x7e,
+};
+static const unsigned char archive_reply[] = {
+    0x7e, 0x20, 0x02, 0x5c, 0x60, 0x77, 0xa6, 0x25, 0x80, 0x00, 0x1d, 0x7e, 0x3c, 0x13, 0x15, 0x00,
+    0x08, 0x00, 0x7e, 0xff, 0x03, 0x60, 0x65, 0x81, 0xa0, 0x78, 0x00, 0x50, 0xd0, 0x92, 0x39, 0x00,
+    0xa0, 0x8a, 0x00, 0x9f, 0x04, 0xf9, 0x7d, 0x5e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x33, 0x80,
+    0x01, 0x02, 0x00, 0x70, 0x00, 0x00, 0x00, 0x00, 0x27, 0x00, 0x00, 0x00, 0xa3, 0xf1, 0x40, 0x54,
+    0xd9, 0x27, 0x4f, 0x01, 0x00, 0x00, 0x00, 0x00, 0x77, 0xf0, 0x40, 0x54, 0x14, 0x9b, 0x51, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x4b, 0xef, 0x40, 0x54, 0x9b, 0x4b, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x1f, 0xee, 0x40, 0x54, 0x2b, 0x36, 0x50, 0x01, 0x00, 0x00, 0x00, 0x00, 0xf3, 0xec, 0x40, 0x54,
+    0x5c, 0x0b, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0xc7, 0xeb, 0x40, 0x54, 0xb3, 0xc6, 0x4d, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x9b, 0xea, 0x40, 0x54, 0x77, 0x5b, 0x4d, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x6f, 0xe9, 0x40, 0x54, 0x7c, 0x01, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0x43, 0xe8, 0x40, 0x54,
+    0xa8, 0x53, 0x4f, 0x01, 0x00, 0x00, 0x00, 0x00, 0x17, 0xe7, 0x40, 0x54, 0x81, 0xa8, 0x51, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0xeb, 0xe5, 0x40, 0x54, 0x68, 0x20, 0x4f, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0xbf, 0xe4, 0x40, 0x54, 0x31, 0xc9, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x00, 0x93, 0xe3, 0x40, 0x54,
+    0x99, 0x03, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0x67, 0xe2, 0x40, 0x54, 0x6a, 0x94, 0x51, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x3b, 0xe1, 0x40, 0x54, 0x25, 0xa6, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x0f, 0xe0, 0x40, 0x54, 0x7d, 0x32, 0x10, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0xe3, 0xde, 0x40,
+    0x54, 0xd4, 0x6d, 0x50, 0x01, 0x00, 0x00, 0x00, 0x00, 0xb7, 0xdd, 0x40, 0x54, 0xf6, 0x74, 0x4e,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x8b, 0xdc, 0x40, 0x54, 0x79, 0x1b, 0x4f, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x5f, 0xdb, 0x40, 0x54, 0x05, 0x77, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x00, 0x33, 0xda, 0x40,
+    0x54, 0xf9, 0x6f, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0x07, 0xd9, 0x40, 0x54, 0x17, 0x5f, 0x50,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0xdb, 0xd7, 0x40, 0x54, 0x85, 0x5f, 0x4d, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0xaf, 0xd6, 0x40, 0x54, 0xa2, 0xc3, 0x4d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x83, 0xd5, 0x40,
+    0x54, 0xf3, 0x86, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x00, 0x57, 0xd4, 0x40, 0x54, 0x21, 0x98, 0x4d,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x2b, 0xd3, 0x40, 0x54, 0x7f, 0xa9, 0x4f, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0xff, 0xd1, 0x40, 0x54, 0x03, 0x80, 0x4d, 0x01, 0x00, 0x00, 0x00, 0x00, 0xd3, 0xd0, 0x40,
+    0x54, 0x4b, 0x68, 0x4f, 0x01, 0x00, 0x00, 0x00, 0x00, 0xa7, 0xcf, 0x40, 0x54, 0xb0, 0x08, 0x51,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x7b, 0xce, 0x40, 0x54, 0x52, 0x5a, 0x50, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x4f, 0xcd, 0x40, 0x54, 0xdc, 0xaa, 0x50, 0x01, 0x00, 0x00, 0x00, 0x00, 0x23, 0xcc, 0x40,
+    0x54, 0x62, 0x69, 0x50, 0x01, 0x00, 0x00, 0x00, 0x00, 0xf7, 0xca, 0x40, 0x54, 0x15, 0xcf, 0x50,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0xcb, 0xc9, 0x40, 0x54, 0x3c, 0x53, 0x4e, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x9f, 0xc8, 0x40, 0x54, 0x15, 0x2d, 0x50, 0x01, 0x00, 0x00, 0x00, 0x00, 0x73, 0xc7, 0x40,
+    0x54, 0x16, 0x08, 0x4e, 0x01, 0x00, 0x00, 0x00, 0x00, 0x47, 0xc6, 0x40, 0x54, 0xfe, 0x89, 0x4d,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x1b, 0xc5, 0x40, 0x54, 0xf6, 0x56, 0x4e, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0xef, 0xc3, 0x40, 0x54, 0x05, 0x36, 0x51, 0x01, 0x00, 0x00, 0x00, 0x00, 0x18, 0x7f, 0x7e,
+};
+
+//! the recorded frames
+static const struct {
+    const unsigned char *data;
+    size_t len;
+} recorded[] = {
+    { spot_ac_reply, sizeof(spot_ac_reply) },
+    { energy_reply, sizeof(energy_reply) },
+    { archive_reply, sizeof(archive_reply) },
+};
+#define N_RECORDED (sizeof(recorded)/sizeof(*recorded))
+
+//! return the current value of the monotonic clock in seconds
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//! template of the temporary directory made by a benchmark, and the size of the array holding it
+#define BENCH_DIR "/tmp/sbbench-XXXXXX"
+
+/**
+ * Make a temporary directory for the named benchmark
+ * @param dir Set to the directory, sizeof(BENCH_DIR) long
+ * @param path If not NULL, set to the path of the file name in the directory, STORE_PATH_MAX long
+ * @return 0 on success, -1 on failure
+ */
+static int bench_mkdir(const char *bench, char *dir, char *path, const char *name)
+{
+    strcpy(dir, BENCH_DIR);
+    if (mkdtemp(dir) == NULL) {
+	fprintf(stderr, "%s: could not create %s: %s\n", bench, dir, strerror(errno));
+	return -1;
+    }
+    if (path != NULL)
+	snprintf(path, STORE_PATH_MAX, "%s/%s", dir, name);
+    return 0;
+}
+
+//! remove the passed temporary directory and whatever the benchmark left in it
+static void bench_rmdir(const char *dir)
+{
+    char path[STORE_PATH_MAX];
+    struct dirent *e;
+    DIR *d;
+
+    if ((d = opendir(dir)) != NULL) {
+	while ((e = readdir(d)) != NULL) {
+	    if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	    }
+	}
+	closedir(d);
+    }
+    rmdir(dir);
+}
+
+/**
+ * Compile the benchmark's script and set up the config of a simulated inverter, logging only errors.
+ * prog may be passed to bench_sim_close() whether or not this succeeds.
+ * @param tr If not NULL, connected to a simulator running with cfg, which may still be changed
+ * @param s If not NULL, set up for a session over tr
+ * @return 0 on success, -1 on failure
+ */
+static int bench_sim_open(script_prog_t *prog, sim_config_t *cfg, transport_t *tr, sb_session_t *s)
+{
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    memset(prog, 0, sizeof(*prog));
+    if (script_compile(BENCH_SCRIPT, prog) < 0)
+	return -1;
+    sim_config_init(cfg, prog);
+    if (tr != NULL)
+	transport_init_socketpair(tr, sim_start, cfg);
+    if (s != NULL)
+	session_init(s, tr, cfg->sb_bt_addr, cfg->serial, prog);
+    return 0;
+}
+
+//! wait for the simulator threads, which use prog and their configs, to exit, then free prog
+static void bench_sim_close(script_prog_t *prog)
+{
+    sim_wait();
+    script_free(prog);
+}
+
+//! the file that what's logged goes to while bench_log_capture() is in effect, -1 when it isn't
+static int bench_log = -1;
+
+/**
+ * Log to a temporary file rather than stderr, around the part of a benchmark that causes errors
+ * on purpose, so that a run that passes shows none
+ * @return 0 on success, -1 on failure
+ */
+static int bench_log_capture(const char *bench)
+{
+    char path[] = "/tmp/sbbench-log-XXXXXX";
+
+    if ((bench_log = mkstemp(path)) < 0) {
+	fprintf(stderr, "%s: could not create %s: %s\n", bench, path, strerror(errno));
+	return -1;
+    }
+    unlink(path);
+    logger_fd = bench_log;
+    return 0;
+}
+
+/**
+ * Log to stderr again, copying what was captured there if the benchmark failed. Does nothing if
+ * not capturing, so may be called on any way out of a benchmark.
+ * @param expect If not NULL, the lines holding it are counted
+ * @return The number of lines captured holding expect
+ */
+static int bench_log_release(const char *expect, int failed)
+{
+    char line[1024];
+    FILE *fp;
+    int n = 0;
+
+    if (bench_log < 0)
+	return 0;
+    logger_fd = 2;
+    if (lseek(bench_log, 0, SEEK_SET) < 0 || (fp = fdopen(bench_log, "r")) == NULL) {
+	close(bench_log);
+	bench_log = -1;
+	return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (failed)
+	    fputs(line, stderr);
+	if (expect != NULL && strstr(line, expect) != NULL)
+	    n++;
+    }
+    fclose(fp);
+    bench_log = -1;
+    return n;
+}
+
+//! signature of the codec functions being timed
+typedef size_t (*codec_fn_t)(unsigned char *out, const unsigned char *in, size_t len);
+
+/**
+ * Time the passed codec function, running it repeatedly for at least BENCH_MIN_SEC
+ * @return The throughput in MB/s of input
+ */
+static double time_codec(codec_fn_t fn, unsigned char *out, const unsigned char *in, size_t len)
+{
+    unsigned long runs = 0;
+    double start = now_sec(), elapsed;
+    do {
+	fn(out, in, len);
+	runs++;
+    } while ((elapsed = now_sec() - start) < BENCH_MIN_SEC);
+    return (double)len * runs / elapsed / 1e6;
+}
+
+//! benchmark the escape and unescape functions on the level 2 parts of the recorded frames
+static int bench_codec()
+{
+    unsigned char *wire = malloc(BENCH_SESSION_LEN + FRAME_MAX_LEN);
+    unsigned char *plain = malloc(BENCH_SESSION_LEN + FRAME_MAX_LEN);
+    unsigned char *out = malloc(2 * (BENCH_SESSION_LEN + FRAME_MAX_LEN));
+    size_t wire_len = 0, plain_len, n, i;
+    int ret = -1;
+
+    if (wire == NULL || plain == NULL || out == NULL) {
+	fprintf(stderr, "out of memory\n");
+	goto done;
+    }
+    // make up a session of escaped data from the level 2 part of the recorded frames
+    for (i = 0; wire_len < BENCH_SESSION_LEN; i = (i + 1) % N_RECORDED) {
+	size_t l2_len = recorded[i].len - FRAME_L1_HEADER_LEN - 2;
+	memcpy(wire + wire_len, recorded[i].data + FRAME_L1_HEADER_LEN + 1, l2_len);
+	wire_len += l2_len;
+    }
+
+    // check that the fast versions agree with the reference versions
+    plain_len = codec_unescape_ref(plain, wire, wire_len);
+    n = codec_unescape(out, wire, wire_len);
+    if (n != plain_len || memcmp(out, plain, n)) {
+	fprintf(stderr, "codec: codec_unescape() does not match codec_unescape_ref()\n");
+	goto done;
+    }
+    n = codec_escape(out, plain, plain_len);
+    if (n != wire_len || memcmp(out, wire, n)) {
+	fprintf(stderr, "codec: codec_escape() does not match codec_escape_ref()\n");
+	goto done;
+    }
+
+    printf("codec: %lu escaped bytes, %lu unescaped\n", (unsigned long)wire_len, (unsigned long)plain_len);
+    printf("codec: unescape ref  %8.1f MB/s\n", time_codec(codec_unescape_ref, out, wire, wire_len));
+    printf("codec: unescape fast %8.1f MB/s\n", time_codec(codec_unescape, out, wire, wire_len));
+    printf("codec: escape ref    %8.1f MB/s\n", time_codec(codec_escape_ref, out, plain, plain_len));
+    printf("codec: escape fast   %8.1f MB/s\n", time_codec(codec_escape, out, plain, plain_len));
+    ret = 0;
+
+ done:
+    free(wire);
+    free(plain);
+    free(out);
+    return ret;
+}
+
+// crc test vectors, being the level 2 part of frames in sbread.script, each followed by its fcs
+static const unsigned char crc_vec_init[] = { // script line 14
+    0xff, 0x03, 0x60, 0x65, 0x09, 0xa0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x78, 0x00,
+    0x50, 0xd0, 0x92, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x80, 0x00, 0x02, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xa9, 0x20,
+};
+static const unsigned char crc_vec_net[] = { // script line 15
+    0xff, 0x03, 0x60, 0x65, 0x08, 0xa0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x03, 0x78, 0x00,
+    0x50, 0xd0, 0x92, 0x39, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x0e, 0x01, 0xfd, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0x42, 0x0b,
+};
+static const unsigned char crc_vec_net_reply[] = { // script line 16
+    0xff, 0x03, 0x60, 0x65, 0x13, 0x90, 0x78, 0x00, 0x50, 0xd0, 0x92, 0x39, 0x00, 0x00, 0x8a, 0x00,
+    0x9f, 0x04, 0xf9, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x80, 0x01, 0x02, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00,
+    0xe0, 0x71, 0x00, 0x20, 0x01, 0x00, 0x8a, 0x00, 0x9f, 0x04, 0xf9, 0x7e, 0x00, 0x00, 0x0a, 0x00,
+    0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+    0xbd, 0x8d,
+};
+static const unsigned char crc_vec_pow[] = { // script line 18
+    0xff, 0x03, 0x60, 0x65, 0x09, 0xa0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x78, 0x00,
+    0x50, 0xd0, 0x92, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x80, 0x00, 0x02, 0x00, 0x51,
+    0x00, 0x00, 0x20, 0x00, 0xff, 0xff, 0x50, 0x00, 0x76, 0xce,
+};
+static const unsigned char crc_vec_dtot[] = { // script line 21
+    0xff, 0x03, 0x60, 0x65, 0x09, 0xa0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x78, 0x00,
+    0x50, 0xd0, 0x92, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x26, 0x80, 0x00, 0x02, 0x00, 0x54,
+    0x00, 0x00, 0x20, 0x00, 0xff, 0xff, 0x50, 0x00, 0x35, 0x86,
+};
+
+//! the crc test vectors
+static const struct {
+    const unsigned char *data;
+    size_t len;
+} crc_vectors[] = {
+    { crc_vec_init, sizeof(crc_vec_init) },
+    { crc_vec_net, sizeof(crc_vec_net) },
+    { crc_vec_net_reply, sizeof(crc_vec_net_reply) },
+    { crc_vec_pow, sizeof(crc_vec_pow) },
+    { crc_vec_dtot, sizeof(crc_vec_dtot) },
+};
+#define N_CRC_VECTORS (sizeof(crc_vectors)/sizeof(*crc_vectors))
+
+//! the crc implementations, those not supported by the cpu are skipped
+static const char *crc_impls[] = { "ref", "slice8", "clmul" };
+#define N_CRC_IMPLS (sizeof(crc_impls)/sizeof(*crc_impls))
+
+//! check the crc implementations against the test vectors and the reference, then time them
+static int bench_crc()
+{
+    unsigned char *data = malloc(BENCH_SESSION_LEN + 16);
+    size_t i, v;
+    int ret = -1;
+
+    if (data == NULL) {
+	fprintf(stderr, "out of memory\n");
+	return -1;
+    }
+    for (i = 0; i < BENCH_SESSION_LEN + 16; i++)
+	data[i] = rand();
+
+    printf("crc: crc_calc_crc() is using %s\n", crc_impl_name());
+    for (i = 0; i < N_CRC_IMPLS; i++) {
+	crc_impl_t fn = crc_get_impl(crc_impls[i]);
+	if (fn == NULL) {
+	    printf("crc: %-6s not supported\n", crc_impls[i]);
+	    continue;
+	}
+	// the test vectors, the fcs is sent LSB first
+	for (v = 0; v < N_CRC_VECTORS; v++) {
+	    size_t len = crc_vectors[v].len - 2;
+	    const unsigned char *fcs = crc_vectors[v].data + len;
+	    uint16_t crc = fn(CRC_PPPINITFCS16, crc_vectors[v].data, len) ^ 0xffff;
+	    if (crc != (fcs[0] | (fcs[1] << 8))) {
+		fprintf(stderr, "crc: %s fails test vector %lu\n", crc_impls[i], (unsigned long)v);
+		goto done;
+	    }
+	}
+	// every length up to 1K, at each alignment, against the reference
+	for (v = 0; v < 1024; v++) {
+	    size_t off = v % 16;
+	    if (fn(CRC_PPPINITFCS16, data + off, v) != crc_calc_crc_ref(CRC_PPPINITFCS16, data + off, v)) {
+		fprintf(stderr, "crc: %s differs from ref for length %lu\n", crc_impls[i], (unsigned long)v);
+		goto done;
+	    }
+	}
+	// throughput, for frame sized and session sized data
+	size_t sizes[] = { 64, 1024, BENCH_SESSION_LEN };
+	for (v = 0; v < sizeof(sizes)/sizeof(*sizes); v++) {
+	    unsigned long runs = 0;
+	    volatile uint16_t sink = 0;
+	    double start = now_sec(), elapsed;
+	    do {
+		sink ^= fn(CRC_PPPINITFCS16, data, sizes[v]);
+		runs++;
+	    } while ((elapsed = now_sec() - start) < BENCH_MIN_SEC);
+	    printf("crc: %-6s %6lu bytes %8.1f MB/s\n", crc_impls[i], (unsigned long)sizes[v],
+		   (double)sizes[v] * runs / elapsed / 1e6);
+	}
+    }
+    ret = 0;
+
+ done:
+    free(data);
+    return ret;
+}
+
+/**
+ * Check that the passed recorded frame, split over several level 1 frames, is put back together by frame_next()
+ * @param whole The frame unescaped, as frame_next() is to return it
+ * @return 0 if it is, -1 if not, which has been reported
+ */
+static int bench_split(frame_ring_t *ring, const unsigned char *rec, size_t rec_len, const unsigned char *whole,
+		       size_t whole_len)
+{
+    unsigned char wire[3 * FRAME_MAX_LEN], out[FRAME_MAX_LEN];
+    size_t cuts[] = { 0, 0x40, 0x70, rec_len }, len = 0, n = 0, i;
+
+    // each frame has the level 1 header of the recorded one, and a piece of its level 2 part
+    for (i = 0; i + 1 < sizeof(cuts)/sizeof(*cuts); i++) {
+	size_t start = i ? cuts[i] : FRAME_L1_HEADER_LEN;
+	n = FRAME_L1_HEADER_LEN + cuts[i + 1] - start;
+	memcpy(wire + len, rec, FRAME_L1_HEADER_LEN);
+	memcpy(wire + len + FRAME_L1_HEADER_LEN, rec + start, cuts[i + 1] - start);
+	wire[len + 1] = n & 0xff;
+	wire[len + 2] = n >> 8;
+	wire[len + 3] = FRAME_SOF ^ wire[len + 1] ^ wire[len + 2];
+	wire[len + FRAME_L1_CMD_OFF] = i + 2 < sizeof(cuts)/sizeof(*cuts) ? FRAME_L1_CMD_PART : FRAME_L1_CMD_LAST;
+	len += n;
+    }
+    frame_ring_init(ring);
+    // a byte at a time, so the parts are looked at before the rest has come
+    for (i = 0; i < len; i++) {
+	frame_ring_put(ring, wire + i, 1);
+	if ((n = frame_next(ring, out, sizeof(out))) != 0 && i + 1 < len) {
+	    fprintf(stderr, "sma: part of a split frame returned as a frame\n");
+	    return -1;
+	}
+    }
+    if (n != whole_len || memcmp(out + FRAME_L1_HEADER_LEN, whole + FRAME_L1_HEADER_LEN, n - FRAME_L1_HEADER_LEN) ||
+	ring->frames != 3) {
+	fprintf(stderr, "sma: split frame not put back together\n");
+	return -1;
+    }
+    return 0;
+}
+
+//! check the data record decoder on the recorded frames, then time it
+static int bench_sma()
+{
+    unsigned char frames[N_RECORDED][FRAME_MAX_LEN];
+    size_t lens[N_RECORDED], i;
+    sma_archive_rec_t recs[SIM_ARCHIVE_RECS];
+    frame_ring_t ring;
+    sma_values_t v;
+
+    // unescape the recorded frames
+    frame_ring_init(&ring);
+    for (i = 0; i < N_RECORDED; i++) {
+	frame_ring_put(&ring, recorded[i].data, recorded[i].len);
+	if ((lens[i] = frame_next(&ring, frames[i], sizeof(frames[i]))) == 0) {
+	    fprintf(stderr, "sma: recorded frame %lu is not a frame\n", (unsigned long)i);
+	    return -1;
+	}
+    }
+    // the spot AC reply again, split over 3 frames as by an inverter
+    if (bench_split(&ring, spot_ac_reply, sizeof(spot_ac_reply), frames[0], lens[0]) < 0)
+	return -1;
+
+    sma_values_clear(&v);
+    if (sma_decode(frames[0], lens[0], &v) != 3 || sma_decode(frames[1], lens[1], &v) != 2 ||
+	sma_decode(frames[2], lens[2], &v) != -1) {
+	fprintf(stderr, "sma: wrong number of records decoded\n");
+	return -1;
+    }
+    if (v.have != (SMA_HAVE(SMA_VAL_AC_POWER) | SMA_HAVE(SMA_VAL_AC_POWER_L1) | SMA_HAVE(SMA_VAL_GRID_FREQ) |
+		   SMA_HAVE(SMA_VAL_TOTAL_WH) | SMA_HAVE(SMA_VAL_DAY_WH)) ||
+	v.ac_power != 3077 || v.ac_phase_power[0] != 1027 || v.grid_freq != 5002 ||
+	v.total_wh != 21843211 || v.day_wh != 13402) {
+	fprintf(stderr, "sma: wrong values decoded\n");
+	return -1;
+    }
+    for (i = 0; i < N_RECORDED; i++) {
+	if (!sma_check_fcs(frames[i], lens[i])) {
+	    fprintf(stderr, "sma: recorded frame %lu has a bad fcs\n", (unsigned long)i);
+	    return -1;
+	}
+    }
+    if (sma_archive_decode(frames[2], lens[2], recs, SIM_ARCHIVE_RECS) != SIM_ARCHIVE_RECS ||
+	recs[0].time != 0x5440f1a3 || recs[0].total_wh != 0x014f27d9 || recs[1].time != recs[0].time - 300) {
+	fprintf(stderr, "sma: wrong archive records decoded\n");
+	return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+	unsigned long runs = 0;
+	double start = now_sec(), elapsed;
+	do {
+	    sma_decode(frames[i], lens[i], &v);
+	    runs++;
+	} while ((elapsed = now_sec() - start) < BENCH_MIN_SEC);
+	printf("sma: decode %s reply %8.1f ns\n", i ? "energy " : "spot ac", elapsed / runs * 1e9);
+    }
+    return 0;
+}
+
+//! the simulator settings that sessions are run with
+static const struct {
+    const char *name;
+    //! microseconds after each request that the simulator replies
+    unsigned delay_us;
+    //! size of the pieces the simulator sends each reply in, 0 for whole frames
+    unsigned frag;
+    //! number of sessions to run
+    unsigned sessions;
+    //! DISPLAY_BOTH to query with the script, DISPLAY_ALL to query for every value
+    int display;
+    //! most data records in each packet of a reply to sbread -all, 0 for no limit
+    unsigned max_records;
+    //! the session's pipeline_depth, the number of sbread -all queries sent at once
+    uint8_t depth;
+    //! if non zero, the number of inverters in the simulated net, all of which are read as sbread -net
+    unsigned net_size;
+    //! if non zero, the longest level 1 frame that a reply is split into, else SIM_L1_MAX as by the inverter
+    unsigned l1_max;
+} session_runs[] = {
+    { "whole frames", 0, 0, 5000, DISPLAY_BOTH, 0, 1, 0, 0 },
+    { "7 byte fragments", 0, 7, 5000, DISPLAY_BOTH, 0, 1, 0, 0 },
+    { "1ms reply delay", 1000, 0, 500, DISPLAY_BOTH, 0, 1, 0, 0 },
+    { "all values", 0, 0, 5000, DISPLAY_ALL, 0, SESSION_MAX_PENDING, 0, 0 },
+    { "all, 2 per packet", 0, 0, 5000, DISPLAY_ALL, 2, SESSION_MAX_PENDING, 0, 0 },
+    { "all, 40 byte frames", 0, 0, 5000, DISPLAY_ALL, 0, SESSION_MAX_PENDING, 0, 40 },
+    { "all, 40, frags of 7", 0, 7, 5000, DISPLAY_ALL, 0, SESSION_MAX_PENDING, 0, 40 },
+    { "all, 1ms, 1 at once", 1000, 0, 500, DISPLAY_ALL, 0, 1, 0, 0 },
+    { "all, 1ms, pipelined", 1000, 0, 500, DISPLAY_ALL, 0, SESSION_MAX_PENDING, 0, 0 },
+    { "net of 4, 1ms", 1000, 0, 200, DISPLAY_BOTH, 0, SESSION_MAX_PENDING, 4, 0 },
+};
+//! milliseconds allowed for the simulated net to identify itself
+#define BENCH_DISCOVER_MS 20
+#define N_SESSION_RUNS (sizeof(session_runs)/sizeof(*session_runs))
+
+//! return the cpu time used by the calling thread in seconds
+static double thread_cpu_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+//! check that the session read the values of the simulated inverter, return 0 if so
+static int session_check(const sb_session_t *s, const sim_config_t *cfg, int display)
+{
+    int i, decimals;
+
+    if (s->net) {
+	// each of the inverters in the net, which has k W more power than the first
+	if (s->n_nodes != (int)cfg->net_size)
+	    return -1;
+	for (i = 0; i < s->n_nodes; i++) {
+	    unsigned k = (unsigned char)(s->nodes[i].addr[2] - cfg->serial[0]);
+	    if (k >= cfg->net_size || s->nodes[i].bt_addr[0] != (unsigned char)(cfg->sb_bt_addr[0] + k) ||
+		s->nodes[i].values.ac_power != cfg->values.ac_power + (int)k || s->nodes[i].values.day_wh != cfg->values.day_wh)
+		return -1;
+	}
+	return 0;
+    }
+    if (display != DISPLAY_ALL)
+	return s->currentpower == cfg->values.ac_power && s->values.day_wh == cfg->values.day_wh ? 0 : -1;
+    if (s->values.have != cfg->values.have)
+	return -1;
+    for (i = 0; i < SMA_VAL_COUNT; i++) {
+	if (sma_value_get(&s->values, i, &decimals) != sma_value_get(&cfg->values, i, &decimals))
+	    return -1;
+    }
+    return 0;
+}
+
+/**
+ * Run whole sessions, connect, logon, query and close, against the simulated inverter.
+ * The cpu time is that of the thread running the session, so excludes the simulator.
+ */
+static int bench_session()
+{
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    double *lat = NULL;
+    size_t i, r;
+    int ret = -1;
+
+    if (bench_sim_open(&prog, &cfg, &tr, &s) < 0)
+	goto done;
+    s.discover_ms = BENCH_DISCOVER_MS;
+
+    for (r = 0; r < N_SESSION_RUNS; r++) {
+	unsigned n = session_runs[r].sessions;
+	double cpu = 0;
+	uint32_t reads = tr.reads;
+	if ((lat = realloc(lat, n * sizeof(*lat))) == NULL) {
+	    fprintf(stderr, "out of memory\n");
+	    goto done;
+	}
+	cfg.delay_us = session_runs[r].delay_us;
+	cfg.frag = session_runs[r].frag;
+	cfg.max_records = session_runs[r].max_records;
+	cfg.l1_max = session_runs[r].l1_max ? session_runs[r].l1_max : SIM_L1_MAX;
+	s.display = session_runs[r].display;
+	s.pipeline_depth = session_runs[r].depth;
+	cfg.net_size = session_runs[r].net_size ? session_runs[r].net_size : 1;
+	s.net = session_runs[r].net_size != 0;
+	for (i = 0; i < n; i++) {
+	    double start = now_sec(), cpu_start = thread_cpu_sec();
+	    s.currentpower = 0;
+	    s.dtotal = 0;
+	    if (session_connect(&s) < 0 || session_logon_and_query(&s) < 0) {
+		fprintf(stderr, "session: %s: session %lu failed at script line %u\n", session_runs[r].name,
+			(unsigned long)i, s.script_line_num);
+		session_close(&s);
+		goto done;
+	    }
+	    session_close(&s);
+	    lat[i] = now_sec() - start;
+	    cpu += thread_cpu_sec() - cpu_start;
+	    if (session_check(&s, &cfg, session_runs[r].display) < 0) {
+		fprintf(stderr, "session: %s: read %i W, %.3f kWh (values %08x), expected %i W, %.3f kWh (values %08x)\n",
+			session_runs[r].name, s.currentpower, s.dtotal, s.values.have, cfg.values.ac_power,
+			cfg.values.day_wh / 1000.0, cfg.values.have);
+		goto done;
+	    }
+	}
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	printf("session: %-19s %5u sessions  p50 %8.1f us  p99 %8.1f us  cpu %6.1f us/session  %4.1f reads/session\n",
+	       session_runs[r].name, n, lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6, cpu / n * 1e6,
+	       (double)(tr.reads - reads) / n);
+    }
+    ret = 0;
+
+ done:
+    bench_sim_close(&prog);
+    free(lat);
+    return ret;
+}
+
+//! polls made by the daemon benchmark with each display, and the simulated reply delay, us
+#define BENCH_DAEMON_POLLS 100
+#define BENCH_DAEMON_DELAY_US 1000
+
+/**
+ * Poll the simulated inverter as sbread -daemon does, checking that the session stays logged on over the
+ * one connection, and that once it's closed for the night the next poll connects and logs on again
+ */
+static int bench_daemon()
+{
+    static const int displays[] = { DISPLAY_BOTH, DISPLAY_ALL };
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    unsigned connects, logons, c, l;
+    double first, start;
+    int logged_on, d, i, ret = -1;
+
+    if (bench_sim_open(&prog, &cfg, &tr, NULL) < 0) {
+	bench_sim_close(&prog);
+	return -1;
+    }
+    cfg.delay_us = BENCH_DAEMON_DELAY_US;
+    for (d = 0; d < 2; d++) {
+	session_init(&s, &tr, cfg.sb_bt_addr, cfg.serial, &prog);
+	s.display = displays[d];
+	logged_on = 0;
+	sim_counts(&connects, &logons);
+	start = now_sec();
+	for (i = 0; i < BENCH_DAEMON_POLLS; i++) {
+	    s.currentpower = 0;
+	    s.dtotal = 0;
+	    sma_values_clear(&s.values);
+	    if (session_poll(&s, &logged_on) != (i == 0) || session_check(&s, &cfg, displays[d]) < 0) {
+		fprintf(stderr, "daemon: poll %i failed at script line %u\n", i, s.script_line_num);
+		goto close;
+	    }
+	    if (i == 0) {
+		first = now_sec() - start;
+		start = now_sec();
+	    }
+	}
+	sim_counts(&c, &l);
+	if (s.connects != 1 || c - connects != 1 || l - logons != 1) {
+	    fprintf(stderr, "daemon: %u connects and %u logons in %i polls, expected 1\n", c - connects, l - logons,
+		    BENCH_DAEMON_POLLS);
+	    goto close;
+	}
+	printf("daemon: %-5s %i polls  1 connect  1 logon  first poll %8.1f us  then %8.1f us/poll\n",
+	       displays[d] == DISPLAY_ALL ? "all" : "power", BENCH_DAEMON_POLLS, first * 1e6,
+	       (now_sec() - start) / (BENCH_DAEMON_POLLS - 1) * 1e6);
+
+	// as when the schedule lets the inverter sleep for the night
+	logged_on = 0;
+	session_close(&s);
+	if (session_poll(&s, &logged_on) != 1 || session_poll(&s, &logged_on) != 0) {
+	    fprintf(stderr, "daemon: poll after the night failed at script line %u\n", s.script_line_num);
+	    goto close;
+	}
+	sim_counts(&connects, &logons);
+	if (s.connects != 2 || connects - c != 1 || logons - l != 1) {
+	    fprintf(stderr, "daemon: %u connects and %u logons after the night, expected 1\n", connects - c, logons - l);
+	    goto close;
+	}
+	session_close(&s);
+    }
+    ret = 0;
+
+ close:
+    session_close(&s);
+    bench_sim_close(&prog);
+    return ret;
+}
+
+//! number of simulated inverters read by the sweep benchmark
+#define BENCH_SWEEP_INVERTERS 12
+//! number of times they are read
+#define BENCH_SWEEPS 20
+//! the simulated reply delay, us
+#define BENCH_SWEEP_DELAY_US 2000
+
+/**
+ * Read a number of simulated inverters, each with a reply delay, one after another as separate runs
+ * of sbread would, then all at once with sweep_run()
+ */
+static int bench_sweep()
+{
+    script_prog_t prog;
+    sim_config_t cfg;
+    sweep_inverter_t *inv;
+    double start, seq = 0, swept = 0;
+    int i, j, ret = -1;
+
+    if ((inv = calloc(BENCH_SWEEP_INVERTERS, sizeof(*inv))) == NULL) {
+	fprintf(stderr, "out of memory\n");
+	return -1;
+    }
+    if (bench_sim_open(&prog, &cfg, NULL, NULL) < 0)
+	goto done;
+    cfg.delay_us = BENCH_SWEEP_DELAY_US;
+    for (i = 0; i < BENCH_SWEEP_INVERTERS; i++) {
+	transport_init_socketpair(&inv[i].tr, sim_start, &cfg);
+	session_init(&inv[i].s, &inv[i].tr, cfg.sb_bt_addr, cfg.serial, &prog);
+	inv[i].s.display = DISPLAY_BOTH;
+    }
+
+    for (j = 0; j < BENCH_SWEEPS; j++) {
+	start = now_sec();
+	for (i = 0; i < BENCH_SWEEP_INVERTERS; i++) {
+	    sb_session_t *s = &inv[i].s;
+	    if (session_connect(s) < 0 || session_logon_and_query(s) < 0 || session_check(s, &cfg, DISPLAY_BOTH) < 0) {
+		fprintf(stderr, "sweep: inverter %i failed at script line %u, sweep %i\n", i, s->script_line_num, j);
+		session_close(s);
+		goto done;
+	    }
+	    session_close(s);
+	}
+	seq += now_sec() - start;
+
+	start = now_sec();
+	if (sweep_run(inv, BENCH_SWEEP_INVERTERS) != BENCH_SWEEP_INVERTERS) {
+	    fprintf(stderr, "sweep: not all inverters were read\n");
+	    goto done;
+	}
+	swept += now_sec() - start;
+	for (i = 0; i < BENCH_SWEEP_INVERTERS; i++) {
+	    if (session_check(&inv[i].s, &cfg, DISPLAY_BOTH) < 0) {
+		fprintf(stderr, "sweep: inverter %i read %i W, %.3f kWh\n", i, inv[i].s.currentpower, inv[i].s.dtotal);
+		goto done;
+	    }
+	}
+    }
+    printf("sweep: %i inverters, %ius reply delay  one at a time %8.2f ms  all at once %8.2f ms\n",
+	   BENCH_SWEEP_INVERTERS, BENCH_SWEEP_DELAY_US, seq / BENCH_SWEEPS * 1e3, swept / BENCH_SWEEPS * 1e3);
+    ret = 0;
+
+ done:
+    bench_sim_close(&prog);
+    free(inv);
+    return ret;
+}
+
+//! records in each segment of the store benchmark, small so that segments are rotated
+#define BENCH_STORE_SEG_RECORDS 256
+//! segments of the store benchmark kept
+#define BENCH_STORE_SEGS 4
+//! readings appended by the store benchmark
+#define BENCH_STORE_RECORDS 5000
+//! a night without readings is left after each day of this many readings
+#define BENCH_STORE_DAY 300
+
+//! the time of the passed reading of the store benchmark: a minute apart, with a 20 hour night after each day
+static uint32_t store_time(int i)
+{
+    return 1400000000 + 60 * i + (i / BENCH_STORE_DAY) * 72000;
+}
+
+/**
+ * Read the readings of the store benchmark that lie between the passed times, checking that
+ * they are those appended
+ * @return The number of readings, or -1 on error
+ */
+static int store_check(const store_t *st, uint32_t from, uint32_t to)
+{
+    store_iter_t it;
+    sma_values_t v;
+    uint32_t t;
+    int n = 0, first = -1;
+
+    store_iter_init(&it, st, from, to);
+    while (store_iter_next(&it, &t, &v)) {
+	if (first < 0)
+	    first = v.ac_power;
+	if (v.ac_power != first + n || t != store_time(v.ac_power) || t < from || t > to ||
+	    v.have != (SMA_HAVE(SMA_VAL_AC_POWER) | SMA_HAVE(SMA_VAL_TOTAL_WH)) ||
+	    v.total_wh != 3000000000u + v.ac_power) {
+	    fprintf(stderr, "store: wrong reading %i read at %u\n", n, t);
+	    store_iter_end(&it);
+	    return -1;
+	}
+	n++;
+    }
+    store_iter_end(&it);
+    return n;
+}
+
+//! the steps of a query, as collected by store_collect()
+typedef struct {
+    rollup_bucket_t b[256];
+    int n;
+} store_steps_t;
+
+//! store_query_fn_t collecting the steps of a query
+static void store_collect(const rollup_bucket_t *b, void *arg)
+{
+    store_steps_t *steps = arg;
+    if (steps->n < 256)
+	steps->b[steps->n] = *b;
+    steps->n++;
+}
+
+//! store_query_fn_t that does nothing
+static void store_discard(const rollup_bucket_t *b, void *arg)
+{
+}
+
+/**
+ * Check that a query answered from the rollups agrees with the readings themselves
+ * @return 0 if it does, -1 if not
+ */
+static int store_check_rollup(const store_t *st, uint32_t from, uint32_t to)
+{
+    store_steps_t rolled, raw;
+    int i;
+
+    rolled.n = raw.n = 0;
+    from = rollup_align(&st->rollup, from, 3600);
+    to = rollup_align(&st->rollup, to, 3600) + 3599;
+    // steps of an hour come from the hourly rollup, those of 2 minutes from the readings
+    if (store_query(st, from, to, 3600, store_collect, &rolled) != 3600 ||
+	store_query(st, from, to, 120, store_collect, &raw) != 0 || rolled.n > 256 || raw.n > 256) {
+	fprintf(stderr, "store: query not answered from the rollup expected\n");
+	return -1;
+    }
+    for (i = 0; i < rolled.n; i++) {
+	rollup_bucket_t sum;
+	int j;
+	rollup_bucket_clear(&sum, rolled.b[i].start);
+	for (j = 0; j < raw.n; j++) {
+	    if (raw.b[j].start >= rolled.b[i].start && raw.b[j].start < rolled.b[i].start + 3600)
+		rollup_bucket_merge(&sum, &raw.b[j]);
+	}
+	// a reading a minute, each with 1 Wh more than the last, the first of which isn't counted
+	if (sum.n != rolled.b[i].n || sum.min_w != rolled.b[i].min_w || sum.max_w != rolled.b[i].max_w ||
+	    sum.sum_w != rolled.b[i].sum_w || rolled.b[i].wh != rolled.b[i].n || sum.wh != sum.n - (i == 0)) {
+	    fprintf(stderr, "store: rollup of %u doesn't match the readings\n", rolled.b[i].start);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Append readings to a store in a temporary directory, with segments small enough that they
+ * are rotated, check that those kept can be read back by time, then time appending and finding
+ */
+static int bench_store()
+{
+    char dir[sizeof(BENCH_DIR)];
+    store_t st;
+    sma_values_t v;
+    double start, append, find;
+    unsigned long runs = 0;
+    int i, n, ret = -1;
+
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    if (bench_mkdir("store", dir, NULL, NULL) < 0)
+	return -1;
+    if (store_open(&st, dir, "2130248863", BENCH_STORE_SEGS * store_seg_size(BENCH_STORE_SEG_RECORDS),
+		   BENCH_STORE_SEG_RECORDS) < 0)
+	goto done;
+    sma_values_clear(&v);
+    start = now_sec();
+    for (i = 0; i < BENCH_STORE_RECORDS; i++) {
+	v.have = 0;
+	sma_value_set(&v, SMA_VAL_AC_POWER, i);
+	sma_value_set(&v, SMA_VAL_TOTAL_WH, 3000000000u + i);
+	if (store_append(&st, store_time(i), &v) < 0)
+	    goto done;
+    }
+    append = now_sec() - start;
+    // reopened, it carries on where it left off
+    store_close(&st);
+    if (store_open(&st, dir, "2130248863", BENCH_STORE_SEGS * store_seg_size(BENCH_STORE_SEG_RECORDS),
+		   BENCH_STORE_SEG_RECORDS) < 0)
+	goto done;
+    sma_value_set(&v, SMA_VAL_AC_POWER, i);
+    sma_value_set(&v, SMA_VAL_TOTAL_WH, 3000000000u + i);
+    if (store_append(&st, store_time(i), &v) < 0)
+	goto done;
+
+    // the oldest segments have been deleted, keeping the newest readings
+    if (st.last_seq - st.first_seq + 1 != BENCH_STORE_SEGS) {
+	fprintf(stderr, "store: %u segments kept\n", st.last_seq - st.first_seq + 1);
+	goto close;
+    }
+    n = (BENCH_STORE_RECORDS + 1) % BENCH_STORE_SEG_RECORDS + (BENCH_STORE_SEGS - 1) * BENCH_STORE_SEG_RECORDS;
+    if (store_check(&st, 0, UINT32_MAX) != n) {
+	fprintf(stderr, "store: wrong number of readings kept\n");
+	goto close;
+    }
+    // a range across a night and a segment boundary, and one starting in a night
+    i = BENCH_STORE_RECORDS - 300;
+    if (store_check(&st, store_time(i), store_time(i + 200)) != 201 ||
+	store_check(&st, store_time(4499) + 3600, store_time(4509)) != 10 ||
+	store_check(&st, store_time(BENCH_STORE_RECORDS) + 1, UINT32_MAX) != 0) {
+	fprintf(stderr, "store: wrong readings found by time\n");
+	goto close;
+    }
+    // the hours around a segment boundary, and those after a night
+    if (store_check_rollup(&st, store_time(4540), store_time(4700)) < 0 ||
+	store_check_rollup(&st, store_time(4499) + 3600, store_time(4600)) < 0)
+	goto close;
+
+    start = now_sec();
+    do {
+	store_check(&st, store_time(BENCH_STORE_RECORDS - 100 - runs % 800), store_time(BENCH_STORE_RECORDS - 100 - runs % 800));
+	runs++;
+    } while ((find = now_sec() - start) < BENCH_MIN_SEC);
+    printf("store: append %8.1f ns  find a reading %8.1f ns\n", append / BENCH_STORE_RECORDS * 1e9, find / runs * 1e9);
+    for (i = 0; i < 2; i++) {
+	runs = 0;
+	start = now_sec();
+	do {
+	    store_query(&st, store_time(BENCH_STORE_RECORDS - 800), store_time(BENCH_STORE_RECORDS), i ? 3599 : 3600,
+			store_discard, NULL);
+	    runs++;
+	} while ((find = now_sec() - start) < BENCH_MIN_SEC);
+	printf("store: query 800 readings hourly from %s %8.1f us\n", i ? "readings" : "rollups ", find / runs * 1e6);
+    }
+    ret = 0;
+
+ close:
+    store_close(&st);
+ done:
+    bench_rmdir(dir);
+    return ret;
+}
+
+//! the simulated reply delay of the archive benchmark, us
+#define BENCH_ARCHIVE_DELAY_US 2000
+//! every this many'th archive packet is damaged
+#define BENCH_ARCHIVE_CORRUPT 23
+//! days of the day archive downloaded
+#define BENCH_ARCHIVE_DAYS 7
+
+//! the records of an archive download, as checked by archive_check()
+typedef struct {
+    const sim_config_t *cfg;
+    uint32_t step;
+    //! time of the next record expected
+    uint32_t next;
+    int n;
+    int bad;
+} archive_recs_t;
+
+//! archive_fn_t checking that each record is the next expected from the simulator
+static void archive_check(const sma_archive_rec_t *rec, void *arg)
+{
+    archive_recs_t *r = arg;
+
+    if (rec->time != r->next || rec->total_wh != sim_archive_wh(r->cfg, 0, rec->time))
+	r->bad++;
+    r->next = rec->time + r->step;
+    r->n++;
+}
+
+/**
+ * Download the day archive of the simulated inverter, with some of its packets damaged, in two
+ * goes, the second carrying on from the cursor file left by the first. Check that every record
+ * is received once, in order, then time downloads one chunk at a time and pipelined.
+ */
+static int bench_archive()
+{
+    char dir[sizeof(BENCH_DIR)], path[STORE_PATH_MAX];
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    archive_t *a = NULL;
+    archive_recs_t r;
+    uint32_t now = time(NULL), from = now - BENCH_ARCHIVE_DAYS * 86400, mid = from + BENCH_ARCHIVE_DAYS * 86400 / 2;
+    uint32_t cursor = 0;
+    double start, elapsed[2];
+    int i, ret = -1;
+
+    if (bench_mkdir("archive", dir, path, "2130248863-day.cursor") < 0)
+	return -1;
+    if (bench_sim_open(&prog, &cfg, &tr, &s) < 0)
+	goto done;
+    if ((a = malloc(sizeof(*a))) == NULL) {
+	fprintf(stderr, "out of memory\n");
+	goto done;
+    }
+    cfg.corrupt = BENCH_ARCHIVE_CORRUPT;
+    cfg.delay_us = BENCH_ARCHIVE_DELAY_US;
+
+    // the first half, then the rest from the cursor saved
+    memset(&r, 0, sizeof(r));
+    r.cfg = &cfg;
+    r.step = SMA_ARCHIVE_DAY_STEP;
+    r.next = from + (SMA_ARCHIVE_DAY_STEP - from % SMA_ARCHIVE_DAY_STEP) % SMA_ARCHIVE_DAY_STEP;
+    for (i = 0; i < 2; i++) {
+	if (i && archive_load_cursor(path, &cursor) != 1) {
+	    fprintf(stderr, "archive: no cursor saved\n");
+	    goto done;
+	}
+	archive_init(a, SMA_CMD_ARCHIVE_DAY, i ? cursor : from, i ? now : mid, archive_check, &r);
+	a->cursor_path = path;
+	if (session_connect(&s) < 0 || session_archive(&s, a) < 0) {
+	    fprintf(stderr, "archive: download failed\n");
+	    session_close(&s);
+	    goto done;
+	}
+	session_close(&s);
+    }
+    // each record having been the one after the last, it's enough that the last is the newest
+    if (r.bad || r.next != now - now % SMA_ARCHIVE_DAY_STEP + SMA_ARCHIVE_DAY_STEP || a->bad_fcs == 0) {
+	fprintf(stderr, "archive: %i records, %i out of order or wrong, %u bad packets\n", r.n, r.bad, a->bad_fcs);
+	goto done;
+    }
+    printf("archive: %i days, %i records  %u bad packets, %u chunks asked for again\n", BENCH_ARCHIVE_DAYS, r.n,
+	   a->bad_fcs, a->retries);
+
+    // the whole range, without damage, a chunk at a time and pipelined
+    cfg.corrupt = 0;
+    for (i = 0; i < 2; i++) {
+	s.pipeline_depth = i ? SESSION_MAX_PENDING : 1;
+	memset(&r, 0, sizeof(r));
+	r.cfg = &cfg;
+	r.step = SMA_ARCHIVE_DAY_STEP;
+	r.next = from + (SMA_ARCHIVE_DAY_STEP - from % SMA_ARCHIVE_DAY_STEP) % SMA_ARCHIVE_DAY_STEP;
+	archive_init(a, SMA_CMD_ARCHIVE_DAY, from, now, archive_check, &r);
+	if (session_connect(&s) < 0) {
+	    fprintf(stderr, "archive: connect failed\n");
+	    goto done;
+	}
+	start = now_sec();
+	if (session_archive(&s, a) < 0 || r.bad) {
+	    fprintf(stderr, "archive: download failed\n");
+	    session_close(&s);
+	    goto done;
+	}
+	elapsed[i] = now_sec() - start;
+	session_close(&s);
+    }
+    printf("archive: %ius reply delay  one chunk at a time %8.2f ms  pipelined %8.2f ms\n", BENCH_ARCHIVE_DELAY_US,
+	   elapsed[0] * 1e3, elapsed[1] * 1e3);
+    ret = 0;
+
+ done:
+    bench_sim_close(&prog);
+    free(a);
+    bench_rmdir(dir);
+    return ret;
+}
+
+//! sessions run by the trace benchmark, traced and not
+#define BENCH_TRACE_SESSIONS 2000
+
+/**
+ * Run sessions against the simulator traced, checking that the reads and bytes counted by the
+ * trace are those made, and show the histograms. Then time sessions with and without the trace.
+ */
+static int bench_trace()
+{
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    trace_t *t = NULL;
+    double elapsed[2];
+    int i, j, ret = -1;
+
+    if (bench_sim_open(&prog, &cfg, &tr, &s) < 0)
+	goto done;
+    if ((t = malloc(sizeof(*t))) == NULL) {
+	fprintf(stderr, "out of memory\n");
+	goto done;
+    }
+    s.display = DISPLAY_BOTH;
+
+    for (i = 0; i < 2; i++) {
+	double start = now_sec();
+	trace_init(t);
+	s.trace = i ? t : NULL;
+	for (j = 0; j < BENCH_TRACE_SESSIONS; j++) {
+	    uint64_t bytes = tr.bytes_in;
+	    uint32_t reads = tr.reads;
+	    uint64_t trace_bytes = 0, trace_reads = 0;
+	    int k;
+	    trace_run(t);
+	    if (session_connect(&s) < 0 || session_logon_and_query(&s) < 0) {
+		fprintf(stderr, "trace: session %i failed at script line %u\n", j, s.script_line_num);
+		session_close(&s);
+		goto done;
+	    }
+	    session_close(&s);
+	    for (k = 0; k < t->n_events; k++) {
+		trace_bytes += t->events[k].bytes;
+		trace_reads += t->events[k].reads;
+	    }
+	    if (i && (trace_bytes != tr.bytes_in - bytes || trace_reads != tr.reads - reads)) {
+		fprintf(stderr, "trace: counted %lu bytes in %lu reads, made %lu in %lu\n", (unsigned long)trace_bytes,
+			(unsigned long)trace_reads, (unsigned long)(tr.bytes_in - bytes), (unsigned long)(tr.reads - reads));
+		goto done;
+	    }
+	}
+	elapsed[i] = now_sec() - start;
+    }
+    trace_print(t, stdout);
+    printf("trace: session untraced %8.1f us  traced %8.1f us\n", elapsed[0] / BENCH_TRACE_SESSIONS * 1e6,
+	   elapsed[1] / BENCH_TRACE_SESSIONS * 1e6);
+    ret = 0;
+
+ done:
+    bench_sim_close(&prog);
+    free(t);
+    return ret;
+}
+
+//! polls made by the metrics benchmark, and scrapes
+#define BENCH_METRICS_POLLS 20
+#define BENCH_METRICS_SCRAPES 200
+
+//! fetch the metrics from the unix socket at the passed path into buf, returning the length or -1
+static int metrics_scrape(const char *path, char *buf, size_t size)
+{
+    static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    struct sockaddr_un sun = { 0 };
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || write(fd, req, sizeof(req) - 1) < 0) {
+	close(fd);
+	return -1;
+    }
+    while (len < size - 1 && (n = read(fd, buf + len, size - 1 - len)) > 0)
+	len += n;
+    buf[len] = '\x0';
+    close(fd);
+    return len;
+}
+
+/**
+ * Poll the simulated inverter, publishing the metrics after each poll and serving them on a unix
+ * socket, check the page scraped, then time scrapes and publishing
+ */
+static int bench_metrics()
+{
+    static char page[64 * 1024];
+    char dir[sizeof(BENCH_DIR)], path[STORE_PATH_MAX], line[128];
+    static metrics_t m;
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    double start, scrape, publish;
+    int i, ret = -1;
+
+    if (bench_mkdir("metrics", dir, path, "metrics.sock") < 0)
+	return -1;
+    if (bench_sim_open(&prog, &cfg, &tr, &s) < 0 || metrics_start(&m, path) < 0)
+	goto done;
+    s.display = DISPLAY_ALL;
+    for (i = 0; i < BENCH_METRICS_POLLS; i++) {
+	int64_t poll_start = transport_now_ms();
+	int ok = session_connect(&s) == 0 && session_logon_and_query(&s) == 0;
+	session_close(&s);
+	metrics_update(&m, &s, ok, (transport_now_ms() - poll_start) / 1000.0);
+	if (metrics_publish(&m) < 0)
+	    goto done;
+    }
+    if (metrics_scrape(path, page, sizeof(page)) < 0 || strncmp(page, "HTTP/1.0 200 OK", 15) != 0) {
+	fprintf(stderr, "metrics: could not scrape %s\n", path);
+	goto done;
+    }
+    snprintf(line, sizeof(line), "\nsbread_ac_power{serial=\"%u\"} %i\n", sma_get_u32(cfg.serial), cfg.values.ac_power);
+    if (strstr(page, line) == NULL) {
+	fprintf(stderr, "metrics: no %s in the page\n", line + 1);
+	goto done;
+    }
+    snprintf(line, sizeof(line), "\nsbread_poll_duration_seconds_count{addr=\"%s\"} %u\n", tr.addr, BENCH_METRICS_POLLS);
+    if (strstr(page, line) == NULL || strstr(page, "\nsbread_timeouts_total{") == NULL) {
+	fprintf(stderr, "metrics: no %s in the page\n", line + 1);
+	goto done;
+    }
+
+    start = now_sec();
+    for (i = 0; i < BENCH_METRICS_SCRAPES; i++) {
+	if (metrics_scrape(path, page, sizeof(page)) < 0)
+	    goto done;
+    }
+    scrape = now_sec() - start;
+    start = now_sec();
+    for (i = 0; i < BENCH_METRICS_SCRAPES; i++)
+	metrics_publish(&m);
+    publish = now_sec() - start;
+    printf("metrics: %lu byte page  scrape %8.1f us  publish %8.1f us\n", (unsigned long)m.served.len,
+	   scrape / BENCH_METRICS_SCRAPES * 1e6, publish / BENCH_METRICS_SCRAPES * 1e6);
+    ret = 0;
+
+ done:
+    bench_sim_close(&prog);
+    bench_rmdir(dir);
+    return ret;
+}
+
+//! messages logged by the logger benchmark, half of them lines and half hex dumps of a frame
+#define BENCH_LOG_MESSAGES 2048
+//! pause in microseconds after each burst of them, long enough for the logger's background thread to catch up
+#define BENCH_LOG_PAUSE_US 30000
+
+/**
+ * Log the benchmark's messages in bursts that fit in the logger's ring, optionally pausing after
+ * each for the background thread to catch up
+ * @return The time taken, less the pauses
+ */
+static double log_messages(const unsigned char *frame, size_t len, int pause)
+{
+    double elapsed = 0, start;
+    int i, j;
+
+    for (i = 0; i < BENCH_LOG_MESSAGES; i += LOGGER_SLOTS) {
+	start = now_sec();
+	for (j = i; j < i + LOGGER_SLOTS; j += 2) {
+	    LOGGER_FMT_DEBUG("received %i bytes", j);
+	    LOGGER_DATA_DEBUG("received:    ", frame, len);
+	}
+	elapsed += now_sec() - start;
+	if (pause)
+	    usleep(BENCH_LOG_PAUSE_US);
+    }
+    return elapsed;
+}
+
+/**
+ * Log messages to a file, as they are logged and through the ring, checking that the same is
+ * written, and time logging each way and with the level set so that they aren't logged
+ */
+static int bench_logger()
+{
+    char path[] = "/tmp/sbbench-XXXXXX";
+    double elapsed[2], off;
+    char *text[2] = { NULL, NULL };
+    off_t size[2];
+    int i, ret = -1;
+
+    if ((logger_fd = mkstemp(path)) < 0) {
+	fprintf(stderr, "logger: could not create %s\n", path);
+	logger_fd = 2;
+	return -1;
+    }
+    unlink(path);
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_DEBUG);
+    for (i = 0; i < 2; i++) {
+	size[i] = lseek(logger_fd, 0, SEEK_END);
+	if (i && logger_async_start() < 0)
+	    goto done;
+	elapsed[i] = log_messages(archive_reply, sizeof(archive_reply), i);
+	logger_async_stop();
+	size[i] = lseek(logger_fd, 0, SEEK_END) - size[i];
+	if ((text[i] = malloc(size[i])) == NULL || pread(logger_fd, text[i], size[i], lseek(logger_fd, 0, SEEK_END) - size[i]) != size[i]) {
+	    fprintf(stderr, "logger: could not read back the log\n");
+	    goto done;
+	}
+    }
+    if (size[0] != size[1] || memcmp(text[0], text[1], size[0]) != 0) {
+	fprintf(stderr, "logger: the log written through the ring differs\n");
+	goto done;
+    }
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    off = log_messages(archive_reply, sizeof(archive_reply), 0);
+    printf("logger: written directly %8.1f ns  through the ring %8.1f ns  not logged %6.1f ns  /message\n",
+	   elapsed[0] / BENCH_LOG_MESSAGES * 1e9, elapsed[1] / BENCH_LOG_MESSAGES * 1e9, off / BENCH_LOG_MESSAGES * 1e9);
+    ret = 0;
+
+ done:
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    logger_async_stop();
+    free(text[0]);
+    free(text[1]);
+    close(logger_fd);
+    logger_fd = 2;
+    return ret;
+}
+
+//! inverters published by the shm benchmark, and reads made
+#define BENCH_SHM_INVERTERS 4
+#define BENCH_SHM_READS     1000000
+
+//! the shm benchmark's publisher, stopped by clearing run
+struct shm_publisher {
+    shm_t *shm;
+    volatile int run;
+    uint32_t published;
+};
+
+//! fill the passed values with ones that all follow from n, so that a torn reading can be told
+static void shm_values(sma_values_t *v, uint32_t n)
+{
+    int i;
+
+    sma_values_clear(v);
+    for (i = 0; i < SMA_VAL_COUNT; i++)
+	sma_value_set(v, i, n + i);
+}
+
+//! publish readings of each of the inverters, as fast as it can, until stopped
+static void *shm_publish_thread(void *arg)
+{
+    struct shm_publisher *p = arg;
+    sma_values_t v;
+    uint32_t n;
+
+    for (n = 1; p->run; n++) {
+	shm_values(&v, n);
+	shm_publish(p->shm, 1000 + n % BENCH_SHM_INVERTERS, n, &v);
+    }
+    p->published = n - 1;
+    return NULL;
+}
+
+/**
+ * Time reads of the latest values of the inverters from shared memory, then read them while they
+ * are published as fast as can be, checking that no reading is torn
+ */
+static int bench_shm()
+{
+    char name[32];
+    shm_t pub, rd;
+    struct shm_publisher p;
+    pthread_t thread;
+    shm_reading_t r;
+    sma_values_t v;
+    double start, idle;
+    int i, torn = 0, ret = -1;
+
+    snprintf(name, sizeof(name), "/sbbench-%i", (int)getpid());
+    if (shm_create(&pub, name) < 0 || shm_open_reader(&rd, name) < 0) {
+	fprintf(stderr, "shm: could not create %s: %s\n", name, strerror(errno));
+	shm_unlink(name);
+	return -1;
+    }
+    for (i = 0; i < BENCH_SHM_INVERTERS; i++) {
+	shm_values(&v, i);
+	shm_publish(&pub, 1000 + i, i, &v);
+    }
+    if (shm_count(&rd) != BENCH_SHM_INVERTERS || shm_find(&rd, 1002) != 2 || shm_find(&rd, 999) != -1 ||
+	shm_read(&rd, 2, &r) < 0 || r.serial != 1002 || r.values.ac_power != 2) {
+	fprintf(stderr, "shm: readings not as published\n");
+	goto done;
+    }
+    start = now_sec();
+    for (i = 0; i < BENCH_SHM_READS; i++)
+	shm_read(&rd, i % BENCH_SHM_INVERTERS, &r);
+    idle = now_sec() - start;
+
+    p.shm = &pub;
+    p.run = 1;
+    if (pthread_create(&thread, NULL, shm_publish_thread, &p) != 0)
+	goto done;
+    for (i = 0; i < BENCH_SHM_READS; i++) {
+	if (shm_read(&rd, i % BENCH_SHM_INVERTERS, &r) < 0)
+	    continue;
+	shm_values(&v, r.time);
+	if (r.serial != 1000 + r.time % BENCH_SHM_INVERTERS || memcmp(&r.values, &v, sizeof(v)) != 0)
+	    torn++;
+    }
+    p.run = 0;
+    pthread_join(thread, NULL);
+    if (torn) {
+	fprintf(stderr, "shm: %i of %i readings torn\n", torn, BENCH_SHM_READS);
+	goto done;
+    }
+    printf("shm: read %8.1f ns  %i reads while publishing flat out, %u published, none torn\n",
+	   idle / BENCH_SHM_READS * 1e9, BENCH_SHM_READS, p.published);
+    ret = 0;
+
+ done:
+    shm_close(&rd);
+    shm_close(&pub);
+    shm_unlink(name);
+    return ret;
+}
+
+//! sessions run by the cache benchmark with and without the cached link values, and their reply delay
+#define BENCH_CACHE_SESSIONS 200
+#define BENCH_CACHE_DELAY_US 1000
+
+//! run a session against the simulator, connect, logon, query and close, checking the values read
+static int cache_session(sb_session_t *s, const sim_config_t *cfg)
+{
+    int ret = session_connect(s) == 0 && session_logon_and_query(s) == 0 && session_check(s, cfg, DISPLAY_BOTH) == 0;
+
+    session_close(s);
+    return ret ? 0 : -1;
+}
+
+/**
+ * Run sessions that go straight to the logon with the link values kept in a session cache file,
+ * checking that fewer frames are exchanged, and that a logon the inverter doesn't take falls back
+ * to setting up the link. Then time sessions with and without the cache.
+ */
+static int bench_cache()
+{
+    char dir[sizeof(BENCH_DIR)], path[STORE_PATH_MAX];
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    uint64_t bytes[2];
+    double elapsed[2];
+    int i, j, ret = -1;
+
+    if (bench_mkdir("cache", dir, path, "sbread.cache") < 0)
+	return -1;
+    if (bench_sim_open(&prog, &cfg, &tr, NULL) < 0)
+	goto done;
+    if (prog.hdr->logon_start == 0 || prog.ops[prog.hdr->logon_start].line != 14) {
+	fprintf(stderr, "cache: logon found at op %u, expected script line 14\n", prog.hdr->logon_start);
+	goto done;
+    }
+    cfg.delay_us = BENCH_CACHE_DELAY_US;
+
+    // without, then with, the link values cached
+    for (i = 0; i < 2; i++) {
+	double start;
+	session_init(&s, &tr, cfg.sb_bt_addr, cfg.serial, &prog);
+	s.display = DISPLAY_BOTH;
+	if (i && session_cache_load(&s, path) != 1) {
+	    fprintf(stderr, "cache: the link values saved were not loaded\n");
+	    goto done;
+	}
+	bytes[i] = tr.bytes_out;
+	start = now_sec();
+	for (j = 0; j < BENCH_CACHE_SESSIONS; j++) {
+	    if (cache_session(&s, &cfg) < 0) {
+		fprintf(stderr, "cache: session %i failed at script line %u\n", j, s.script_line_num);
+		goto done;
+	    }
+	}
+	elapsed[i] = now_sec() - start;
+	bytes[i] = tr.bytes_out - bytes[i];
+	if (s.connects != BENCH_CACHE_SESSIONS || s.cached != i) {
+	    fprintf(stderr, "cache: %u connects, expected %u\n", s.connects, BENCH_CACHE_SESSIONS);
+	    goto done;
+	}
+	if (!i && session_cache_save(&s, path) < 0)
+	    goto done;
+    }
+    if (bytes[1] >= bytes[0]) {
+	fprintf(stderr, "cache: sent %lu bytes with the link values cached, %lu without\n", (unsigned long)bytes[1],
+		(unsigned long)bytes[0]);
+	goto done;
+    }
+
+    // an inverter that doesn't take the logon straight away, the logon timing out
+    cfg.reject_shortcut = 1;
+    session_init(&s, &tr, cfg.sb_bt_addr, cfg.serial, &prog);
+    s.display = DISPLAY_BOTH;
+    s.timeout_sec = 1;
+    if (bench_log_capture("cache") < 0)
+	goto done;
+    if (session_cache_load(&s, path) != 1 || cache_session(&s, &cfg) < 0 || s.cached || s.connects != 2) {
+	fprintf(stderr, "cache: no fall back to setting up the link when the logon wasn't taken\n");
+	goto done;
+    }
+    if (bench_log_release("Timeout reading", 0) == 0) {
+	fprintf(stderr, "cache: the logon not taken logged no timeout\n");
+	goto done;
+    }
+    printf("cache: %ius reply delay  link set up %8.1f us %5.0f bytes  cached %8.1f us %5.0f bytes  /session\n",
+	   BENCH_CACHE_DELAY_US, elapsed[0] / BENCH_CACHE_SESSIONS * 1e6, (double)bytes[0] / BENCH_CACHE_SESSIONS,
+	   elapsed[1] / BENCH_CACHE_SESSIONS * 1e6, (double)bytes[1] / BENCH_CACHE_SESSIONS);
+    ret = 0;
+
+ done:
+    bench_log_release(NULL, 1);
+    bench_sim_close(&prog);
+    bench_rmdir(dir);
+    return ret;
+}
+
+//! readings sent by the upload benchmark, and spooled while the server is down
+#define BENCH_UPLOAD_READINGS 2000
+#define BENCH_UPLOAD_OUTAGE   300
+//! requests the stand-in server answers on each connection before closing it without a word
+#define BENCH_UPLOAD_KEEP     8
+//! curl runs timed, one per reading as sbrun.pl did
+#define BENCH_UPLOAD_SPAWNS   50
+#define BENCH_UPLOAD_CURL     "/usr/bin/curl"
+
+//! the stand-in web server of the upload benchmark, answering POSTs with status, one connection at a time
+struct upload_server {
+    int fd;
+    int port;
+    volatile int status;
+    volatile int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    //! connections, requests and readings received, and the time of the last reading
+    uint32_t connects;
+    uint32_t posts;
+    uint32_t lines;
+    uint32_t last_time;
+    //! readings received out of order, or more than once
+    uint32_t disorder;
+    //! requests of form data with the power, and the power in the last
+    uint32_t forms;
+    int powernow;
+};
+
+//! read the requests on the passed connection, counting the readings in each, and answer them
+static void upload_serve(struct upload_server *srv, int fd)
+{
+    static char buf[256 * 1024];
+    char *end, *line, *p;
+    size_t len = 0, body;
+    ssize_t n;
+    int reqs;
+
+    for (reqs = 0; reqs < BENCH_UPLOAD_KEEP; reqs++) {
+	buf[len] = '\x0';
+	while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+	    if (len == sizeof(buf) - 1 || (n = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+		return;
+	    len += n;
+	    buf[len] = '\x0';
+	}
+	end += 4;
+	if ((p = strstr(buf, "\r\nContent-Length:")) == NULL || p > end)
+	    return;
+	body = strtoul(p + 17, NULL, 10);
+	while (len < end - buf + body) {
+	    if (len == sizeof(buf) - 1 || (n = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0)
+		return;
+	    len += n;
+	}
+	pthread_mutex_lock(&srv->lock);
+	srv->posts++;
+	if (strstr(buf, "\r\nContent-Type: application/x-www-form-urlencoded\r\n") != NULL &&
+	    sscanf(end, "powernow=%i", &srv->powernow) == 1)
+	    srv->forms++;
+	// each reading a line, bar curl's one
+	for (line = end; srv->status == 200 && line < end + body; line = p + 1) {
+	    unsigned t;
+	    srv->lines++;
+	    if ((p = memchr(line, '\n', end + body - line)) == NULL)
+		break;
+	    if (strncmp(line, "serial=", 7) == 0 && sscanf(strchr(line, '&'), "&time=%u", &t) == 1) {
+		srv->disorder += t <= srv->last_time;
+		srv->last_time = t;
+	    }
+	}
+	pthread_mutex_unlock(&srv->lock);
+	n = snprintf(buf, sizeof(buf), "HTTP/1.1 %i %s\r\nContent-Length: 3\r\n\r\nok\n", srv->status,
+		     srv->status == 200 ? "OK" : "Service Unavailable");
+	if (write(fd, buf, n) != n)
+	    return;
+	// any of the next request read with this one
+	len -= end - buf + body;
+	memmove(buf, end + body, len);
+    }
+}
+
+static void *upload_server_thread(void *arg)
+{
+    struct upload_server *srv = arg;
+    int fd;
+
+    while ((fd = accept(srv->fd, NULL, NULL)) >= 0 && !srv->stop) {
+	pthread_mutex_lock(&srv->lock);
+	srv->connects++;
+	pthread_mutex_unlock(&srv->lock);
+	upload_serve(srv, fd);
+	close(fd);
+    }
+    if (fd >= 0)
+	close(fd);
+    return NULL;
+}
+
+//! start the stand-in server on a port of localhost
+static int upload_server_start(struct upload_server *srv)
+{
+    struct sockaddr_in sin = { 0 };
+    socklen_t len = sizeof(sin);
+
+    memset(srv, 0, sizeof(*srv));
+    srv->status = 200;
+    pthread_mutex_init(&srv->lock, NULL);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((srv->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(srv->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	listen(srv->fd, 8) < 0 || getsockname(srv->fd, (struct sockaddr *)&sin, &len) < 0 ||
+	pthread_create(&srv->thread, NULL, upload_server_thread, srv) != 0) {
+	fprintf(stderr, "upload: could not start the server: %s\n", strerror(errno));
+	if (srv->fd >= 0)
+	    close(srv->fd);
+	return -1;
+    }
+    srv->port = ntohs(sin.sin_port);
+    return 0;
+}
+
+static void upload_server_stop(struct upload_server *srv)
+{
+    srv->stop = 1;
+    shutdown(srv->fd, SHUT_RDWR);
+    pthread_join(srv->thread, NULL);
+    close(srv->fd);
+}
+
+//! spool n readings for upload, numbered from first
+static int upload_readings(upload_t *u, uint32_t first, int n)
+{
+    sma_values_t v;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	sma_values_clear(&v);
+	sma_value_set(&v, SMA_VAL_AC_POWER, first + i);
+	sma_value_set(&v, SMA_VAL_DAY_WH, 10 * (first + i));
+	if (upload_append(u, 2130248863u, 1400000000u + first + i, &v) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+//! wait up to a few seconds for the server to have received the passed number of readings
+static int upload_wait(struct upload_server *srv, uint32_t lines)
+{
+    uint32_t got;
+    int i;
+
+    for (i = 0; i < 5000; i++) {
+	pthread_mutex_lock(&srv->lock);
+	got = srv->lines;
+	pthread_mutex_unlock(&srv->lock);
+	if (got >= lines)
+	    return 0;
+	usleep(1000);
+    }
+    fprintf(stderr, "upload: the server received %u readings, expected %u\n", got, lines);
+    return -1;
+}
+
+//! wait up to a few seconds for the uploader to have taken all of the readings sent off its spool
+static int upload_drained(upload_t *u)
+{
+    int i;
+
+    for (i = 0; i < 5000 && upload_pending(u) != 0; i++)
+	usleep(1000);
+    if (upload_pending(u) == 0)
+	return 0;
+    fprintf(stderr, "upload: %u readings still in the spool\n", upload_pending(u));
+    return -1;
+}
+
+/**
+ * Upload readings to a stand-in web server from the background thread, checking that they arrive
+ * in order, batched over few connections. Then check that readings spooled while the server is
+ * down are kept across a restart and sent once it's back, and that a full spool keeps the newest.
+ * Check that by default each reading is sent as the form data report.php expects. Also time running
+ * curl for each reading, as sbrun.pl did.
+ */
+static int bench_upload()
+{
+    char dir[sizeof(BENCH_DIR)], path[STORE_PATH_MAX], url[64], data[32];
+    struct upload_server srv;
+    static upload_t u;
+    sma_values_t empty;
+    double start, send, spawn = 0;
+    uint32_t posts, connects;
+    int i, ret = -1;
+
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    sma_values_clear(&empty);
+    if (bench_mkdir("upload", dir, path, "sbread.spool") < 0)
+	return -1;
+    if (upload_server_start(&srv) < 0)
+	goto rm;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%i/report.php", srv.port);
+    if (access(BENCH_UPLOAD_CURL, X_OK) == 0) {
+	start = now_sec();
+	for (i = 0; i < BENCH_UPLOAD_SPAWNS; i++) {
+	    pid_t pid;
+	    snprintf(data, sizeof(data), "powernow=%i", i);
+	    if ((pid = fork()) == 0) {
+		execl(BENCH_UPLOAD_CURL, "curl", "-s", "-o", "/dev/null", "--data", data, url, (char *)NULL);
+		_exit(127);
+	    }
+	    if (pid < 0 || waitpid(pid, NULL, 0) < 0)
+		goto stop;
+	}
+	spawn = now_sec() - start;
+    }
+    srv.posts = srv.lines = srv.connects = 0;
+
+    if (upload_open(&u, url, path, 0, UPLOAD_FORMAT_LINES) < 0)
+	goto stop;
+    u.backoff_min_ms = 20;
+    start = now_sec();
+    if (upload_start(&u) < 0 || upload_readings(&u, 0, BENCH_UPLOAD_READINGS) < 0 ||
+	upload_wait(&srv, BENCH_UPLOAD_READINGS) < 0)
+	goto close;
+    send = now_sec() - start;
+    posts = srv.posts;
+    connects = srv.connects;
+    // the last batch is only taken off the spool once its answer has been read
+    if (upload_drained(&u) < 0)
+	goto close;
+
+    // the server goes down, and sbread is restarted while it is
+    if (bench_log_capture("upload") < 0)
+	goto close;
+    srv.status = 503;
+    if (upload_readings(&u, BENCH_UPLOAD_READINGS, BENCH_UPLOAD_OUTAGE) < 0)
+	goto close;
+    usleep(100000);
+    upload_close(&u);
+    if (u.failures == 0 || bench_log_release("status 503", 0) == 0) {
+	fprintf(stderr, "upload: the server being down went unnoticed\n");
+	goto stop;
+    }
+    if (upload_open(&u, url, path, 0, UPLOAD_FORMAT_LINES) < 0)
+	goto stop;
+    if (upload_pending(&u) != BENCH_UPLOAD_OUTAGE) {
+	fprintf(stderr, "upload: %u readings kept in the spool, expected %u\n", upload_pending(&u), BENCH_UPLOAD_OUTAGE);
+	goto close;
+    }
+    srv.status = 200;
+    if (upload_flush(&u) < 0 || upload_pending(&u) != 0 || upload_wait(&srv, BENCH_UPLOAD_READINGS + BENCH_UPLOAD_OUTAGE) < 0)
+	goto close;
+    upload_close(&u);
+
+    // a spool with room for few readings drops the oldest
+    if (upload_open(&u, url, path, 2 * UPLOAD_BATCH * sizeof(upload_rec_t), UPLOAD_FORMAT_LINES) < 0)
+	goto stop;
+    if (upload_readings(&u, BENCH_UPLOAD_READINGS + BENCH_UPLOAD_OUTAGE, 1000) < 0 || upload_flush(&u) < 0)
+	goto close;
+    if (u.dropped == 0 || srv.last_time != 1400000000u + BENCH_UPLOAD_READINGS + BENCH_UPLOAD_OUTAGE + 999 ||
+	srv.lines != BENCH_UPLOAD_READINGS + BENCH_UPLOAD_OUTAGE + 1000 - u.dropped) {
+	fprintf(stderr, "upload: %u readings dropped from the full spool, %u received\n", u.dropped, srv.lines);
+	goto close;
+    }
+    if (srv.disorder) {
+	fprintf(stderr, "upload: %u readings received out of order or twice\n", srv.disorder);
+	goto close;
+    }
+    upload_close(&u);
+
+    // by default each reading is POSTed as powernow=, those without the power being skipped
+    if (upload_open(&u, url, path, 0, UPLOAD_FORMAT_FORM) < 0)
+	goto stop;
+    srv.posts = srv.forms = 0;
+    if (upload_readings(&u, 0, 10) < 0 || upload_append(&u, 2130248863u, 1400000010u, &empty) < 0 ||
+	upload_flush(&u) < 0)
+	goto close;
+    if (srv.posts != 10 || srv.forms != 10 || srv.powernow != 9 || upload_pending(&u) != 0) {
+	fprintf(stderr, "upload: %u of %u POSTs were powernow=, the last %i\n", srv.forms, srv.posts, srv.powernow);
+	goto close;
+    }
+
+    printf("upload: %i readings in %u POSTs over %u connections %8.1f us/reading", BENCH_UPLOAD_READINGS, posts,
+	   connects, send / BENCH_UPLOAD_READINGS * 1e6);
+    if (spawn > 0)
+	printf("  curl %8.1f us/reading", spawn / BENCH_UPLOAD_SPAWNS * 1e6);
+    printf("\n");
+    ret = 0;
+
+ close:
+    upload_close(&u);
+ stop:
+    bench_log_release(NULL, 1);
+    upload_server_stop(&srv);
+ rm:
+    bench_rmdir(dir);
+    return ret;
+}
+
+//! handles polled at once by the lib benchmark, each in its own thread, and polls of each
+#define BENCH_LIB_HANDLES 4
+#define BENCH_LIB_POLLS   500
+
+//! a simulated inverter reached over tcp on localhost, as libsma is given a host:port
+struct lib_sim {
+    sim_config_t cfg;
+    int fd;
+    int port;
+    pthread_t thread;
+};
+
+//! a handle, and the thread polling it
+struct lib_poller {
+    struct lib_sim *sim;
+    sma_options_t opt;
+    char address[18];
+    char tcp[32];
+    //! time of the first poll, which logs on, and of the rest, which only query
+    double logon;
+    double query;
+    int ret;
+    pthread_t thread;
+};
+
+//! run the simulator on each connection accepted
+static void *lib_sim_thread(void *arg)
+{
+    struct lib_sim *sim = arg;
+    int fd, one = 1;
+
+    while ((fd = accept(sim->fd, NULL, NULL)) >= 0) {
+	// the simulator writes each frame as it's made up, as the bluetooth link would take it
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	sim_start(fd, &sim->cfg);
+    }
+    return NULL;
+}
+
+static int lib_sim_start(struct lib_sim *sim)
+{
+    struct sockaddr_in sin = { 0 };
+    socklen_t len = sizeof(sin);
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((sim->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(sim->fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	listen(sim->fd, 8) < 0 || getsockname(sim->fd, (struct sockaddr *)&sin, &len) < 0 ||
+	pthread_create(&sim->thread, NULL, lib_sim_thread, sim) != 0) {
+	fprintf(stderr, "lib: could not start the simulator: %s\n", strerror(errno));
+	if (sim->fd >= 0)
+	    close(sim->fd);
+	return -1;
+    }
+    sim->port = ntohs(sin.sin_port);
+    return 0;
+}
+
+static void lib_sim_stop(struct lib_sim *sim)
+{
+    shutdown(sim->fd, SHUT_RDWR);
+    pthread_join(sim->thread, NULL);
+    close(sim->fd);
+}
+
+//! return 0 if the passed values are all those of the simulated inverter
+static int lib_check(const sma_values_t *v, const sim_config_t *cfg)
+{
+    int i, decimals;
+
+    if (v->have != cfg->values.have)
+	return -1;
+    for (i = 0; i < SMA_VAL_COUNT; i++) {
+	if (sma_value_get(v, i, &decimals) != sma_value_get(&cfg->values, i, &decimals))
+	    return -1;
+    }
+    return 0;
+}
+
+//! open a handle on the poller's inverter and poll it, checking the values each time
+static void *lib_poll_thread(void *arg)
+{
+    struct lib_poller *p = arg;
+    sma_handle_t *h;
+    sma_values_t v;
+    double start;
+    int i;
+
+    p->ret = -1;
+    if ((h = sma_session_open(&p->opt)) == NULL)
+	return NULL;
+    for (i = 0; i < BENCH_LIB_POLLS; i++) {
+	start = now_sec();
+	memset(&v, 0, sizeof(v));
+	if (sma_poll(h, &v) < 0 || lib_check(&v, &p->sim->cfg) < 0) {
+	    fprintf(stderr, "lib: %s poll %i failed, or read %i W, expected %i W\n", p->tcp, i, v.ac_power,
+		    p->sim->cfg.values.ac_power);
+	    goto close;
+	}
+	if (i == 0)
+	    p->logon = now_sec() - start;
+	else
+	    p->query += now_sec() - start;
+    }
+    p->ret = 0;
+
+ close:
+    sma_close(h);
+    return NULL;
+}
+
+/**
+ * Poll a number of simulated inverters at once through libsma, a handle and a thread each, each
+ * inverter with its own values so that any state shared between the handles shows up as wrong values
+ */
+static int bench_lib()
+{
+    static struct lib_sim sims[BENCH_LIB_HANDLES];
+    static struct lib_poller pollers[BENCH_LIB_HANDLES];
+    script_prog_t prog;
+    double logon = 0, query = 0, start, wall;
+    int i, started = 0, ret = -1;
+
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    if (script_compile(BENCH_SCRIPT, &prog) < 0)
+	return -1;
+    for (i = 0; i < BENCH_LIB_HANDLES; i++) {
+	struct lib_poller *p = &pollers[i];
+	const unsigned char *a = sims[i].cfg.sb_bt_addr;
+	sim_config_init(&sims[i].cfg, &prog);
+	sims[i].cfg.values.ac_power += 100 * i;
+	sims[i].cfg.values.day_wh += 1000 * i;
+	if (lib_sim_start(&sims[i]) < 0)
+	    goto stop;
+	started++;
+	memset(p, 0, sizeof(*p));
+	p->sim = &sims[i];
+	snprintf(p->address, sizeof(p->address), "%02X:%02X:%02X:%02X:%02X:%02X", a[5], a[4], a[3], a[2], a[1], a[0]);
+	snprintf(p->tcp, sizeof(p->tcp), "127.0.0.1:%i", sims[i].port);
+	p->opt.address = p->address;
+	p->opt.serial = sma_get_u32(sims[i].cfg.serial);
+	p->opt.script = BENCH_SCRIPT;
+	p->opt.tcp = p->tcp;
+	p->opt.all = 1;
+	p->opt.timeout_sec = 1;
+    }
+
+    start = now_sec();
+    for (i = 0; i < BENCH_LIB_HANDLES; i++) {
+	if (pthread_create(&pollers[i].thread, NULL, lib_poll_thread, &pollers[i]) != 0) {
+	    fprintf(stderr, "lib: could not start a poller\n");
+	    break;
+	}
+    }
+    while (--i >= 0)
+	pthread_join(pollers[i].thread, NULL);
+    wall = now_sec() - start;
+    ret = 0;
+    for (i = 0; i < BENCH_LIB_HANDLES; i++) {
+	ret |= pollers[i].ret;
+	logon += pollers[i].logon;
+	query += pollers[i].query;
+    }
+    if (ret == 0)
+	printf("lib: %i handles at once %5i polls each  logon %8.1f us  query %8.1f us/poll  %8.1f polls/s\n",
+	       BENCH_LIB_HANDLES, BENCH_LIB_POLLS, logon / BENCH_LIB_HANDLES * 1e6,
+	       query / (BENCH_LIB_HANDLES * (BENCH_LIB_POLLS - 1)) * 1e6, BENCH_LIB_HANDLES * BENCH_LIB_POLLS / wall);
+
+ stop:
+    for (i = 0; i < started; i++)
+	lib_sim_stop(&sims[i]);
+    bench_sim_close(&prog);
+    return ret;
+}
+
+//! polls made by the memory benchmark after the first, which logs on, as a daemon would
+#define BENCH_MEM_POLLS 2000
+
+//! return the bytes of the heap in use, 0 if they can't be told
+static size_t heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Poll the simulated inverter as the daemon does, with the metrics rendered after each poll, checking
+ * that once the first poll is over the heap doesn't grow, and show the memory used
+ */
+static int bench_mem()
+{
+    static metrics_t m;
+    metrics_page_t page = { 0 };
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    arena_stats_t st;
+    size_t heap;
+    int i, ret = -1;
+
+    if (bench_sim_open(&prog, &cfg, &tr, &s) < 0) {
+	bench_sim_close(&prog);
+	return -1;
+    }
+    s.display = DISPLAY_ALL;
+    if (session_connect(&s) < 0 || session_logon_and_query(&s) < 0) {
+	fprintf(stderr, "mem: logon failed at script line %u\n", s.script_line_num);
+	goto close;
+    }
+    metrics_update(&m, &s, 1, 0.01);
+    if (metrics_render(&m, &page) < 0)
+	goto close;
+
+    heap = heap_in_use();
+    for (i = 0; i < BENCH_MEM_POLLS; i++) {
+	if (session_query(&s) < 0 || session_check(&s, &cfg, DISPLAY_ALL) < 0) {
+	    fprintf(stderr, "mem: poll %i failed\n", i);
+	    goto close;
+	}
+	metrics_update(&m, &s, 1, 0.01);
+	if (metrics_render(&m, &page) < 0)
+	    goto close;
+    }
+    if (heap_in_use() != heap) {
+	fprintf(stderr, "mem: the heap grew by %ld bytes over %i polls\n", (long)(heap_in_use() - heap), BENCH_MEM_POLLS);
+	goto close;
+    }
+    arena_stats(&st);
+    printf("mem: %i polls, heap unchanged  rss %lu kB  peak %lu kB  each inverter: session %lu, connection %lu, "
+	   "trace %lu, store %lu bytes\n", BENCH_MEM_POLLS, (unsigned long)st.rss_kb, (unsigned long)st.peak_rss_kb,
+	   (unsigned long)sizeof(sb_session_t), (unsigned long)sizeof(transport_t), (unsigned long)sizeof(trace_t),
+	   (unsigned long)sizeof(store_t));
+    ret = 0;
+
+ close:
+    session_close(&s);
+    bench_sim_close(&prog);
+    arena_free(page.buf);
+    return ret;
+}
+
+//! unix time of the passed UTC date and time
+static time_t utc(int year, int mon, int day, int hour, int min)
+{
+    struct tm tm = { 0 };
+
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    return timegm(&tm);
+}
+
+//! seconds the times of sunrise and sunset worked out may be out by
+#define BENCH_SUN_SEC 300
+//! the place the day is simulated at, and its offset from UTC
+#define BENCH_SCHED_LAT -33.87
+#define BENCH_SCHED_LON 151.21
+#define BENCH_SCHED_UTC_OFFSET (10 * 3600)
+//! peak power of the simulated inverter, in W
+#define BENCH_SCHED_PEAK_W 5000
+
+//! AC power of the simulated inverter at the passed time: a sine from sunrise to sunset with clouds passing around noon
+static int32_t sched_power(time_t t)
+{
+    time_t rise, set;
+    int hour = (t + BENCH_SCHED_UTC_OFFSET) % 86400 / 3600;
+    double p;
+
+    if (sched_sun(BENCH_SCHED_LAT, BENCH_SCHED_LON, t, &rise, &set) != 0 || t <= rise || t >= set)
+	return 0;
+    p = BENCH_SCHED_PEAK_W * sin(M_PI * (t - rise) / (set - rise));
+    // a cloud over the panels for some of each two minutes, from 10:00 to 14:00
+    if (hour >= 10 && hour < 14 && ((uint32_t)(t / 97) * 2654435761u) >> 30 == 0)
+	p *= 0.3;
+    return p;
+}
+
+/**
+ * Poll the simulated inverter for the two days from the passed time, every min_sec to max_sec
+ * seconds, and if located not at night, the polls failing while it's asleep. Show how many polls
+ * were made and how far the power last read was from the actual power, on average over the daylight.
+ * @param error Set to that average, in W
+ * @return The polls made
+ */
+static int sched_day(time_t from, unsigned min_sec, unsigned max_sec, int located, double *error)
+{
+    time_t t, next = from, end = from + 2 * 86400;
+    int32_t power, last = 0;
+    int polls = 0, failed = 0, daylight = 0;
+    sched_t sc;
+    char name[40];
+
+    sched_init(&sc, min_sec, max_sec);
+    sc.seed = 1;
+    if (located) {
+	sc.located = 1;
+	sc.lat = BENCH_SCHED_LAT;
+	sc.lon = BENCH_SCHED_LON;
+    }
+    *error = 0;
+    for (t = from; t < end; t++) {
+	power = sched_power(t);
+	if (t == next) {
+	    polls++;
+	    if (power > 0)
+		last = power;
+	    else
+		failed++;
+	    next += sched_next(&sc, t, power > 0, power);
+	}
+	if (power > 0) {
+	    *error += abs(power - last);
+	    daylight++;
+	}
+    }
+    *error /= daylight;
+    if (min_sec == max_sec)
+	snprintf(name, sizeof(name), "every %u s%s", min_sec, located ? ", located" : "");
+    else
+	snprintf(name, sizeof(name), "adaptive %u-%u s%s", min_sec, max_sec, located ? ", located" : "");
+    printf("sched: %-28s %6i polls  %5i failed  error %6.1f W\n", name, polls, failed, *error);
+    return polls;
+}
+
+/**
+ * Check the times of sunrise and sunset against those published, and the backoff after failed polls,
+ * then compare the polls made over a simulated summer's day, and how closely they follow the power,
+ * with fixed and adaptive intervals
+ */
+static int bench_sched()
+{
+    static const struct {
+	const char *name;
+	double lat, lon;
+	int year, mon, day;
+	//! sunrise and sunset, UTC, days from the one given
+	int rise_day, rise_hour, rise_min;
+	int set_day, set_hour, set_min;
+    } places[] = {
+	{ "London", 51.51, -0.13, 2014, 6, 21, 0, 3, 43, 0, 20, 21 },
+	{ "London", 51.51, -0.13, 2014, 12, 21, 0, 8, 4, 0, 15, 53 },
+	{ "Sydney", -33.87, 151.21, 2014, 6, 21, -1, 21, 0, 0, 6, 54 },
+	{ "Sydney", -33.87, 151.21, 2014, 12, 21, -1, 18, 42, 0, 9, 6 },
+    };
+    sched_t sc;
+    time_t rise, set, want_rise, want_set, noon, midnight;
+    unsigned wait, base;
+    double error, sparse_error, adaptive_error;
+    int i, fixed, adaptive;
+
+    LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
+    for (i = 0; i < sizeof(places) / sizeof(*places); i++) {
+	// local solar noon
+	noon = utc(places[i].year, places[i].mon, places[i].day, 12, 0) - (time_t)(places[i].lon * 240);
+	want_rise = utc(places[i].year, places[i].mon, places[i].day + places[i].rise_day, places[i].rise_hour, places[i].rise_min);
+	want_set = utc(places[i].year, places[i].mon, places[i].day + places[i].set_day, places[i].set_hour, places[i].set_min);
+	if (sched_sun(places[i].lat, places[i].lon, noon, &rise, &set) != 0 ||
+	    labs(rise - want_rise) > BENCH_SUN_SEC || labs(set - want_set) > BENCH_SUN_SEC) {
+	    fprintf(stderr, "sched: sunrise and sunset at %s on %i-%02i-%02i out by %li and %li s\n", places[i].name,
+		    places[i].year, places[i].mon, places[i].day, (long)(rise - want_rise), (long)(set - want_set));
+	    return -1;
+	}
+    }
+    // the midnight sun, and the polar night, at Tromso
+    if (sched_sun(69.65, 18.96, utc(2014, 6, 21, 12, 0), &rise, &set) != 1 ||
+	sched_sun(69.65, 18.96, utc(2014, 12, 21, 12, 0), &rise, &set) != -1) {
+	fprintf(stderr, "sched: the sun sets in June, or rises in December, at Tromso\n");
+	return -1;
+    }
+
+    sched_init(&sc, 10, 300);
+    sc.seed = 1;
+    printf("sched: backoff");
+    for (i = 0; i < 10; i++) {
+	base = SCHED_RETRY_MIN_SEC << i;
+	if (base > sc.max_sec)
+	    base = sc.max_sec;
+	wait = sched_next(&sc, utc(2014, 12, 21, 2, 0), 0, 0);
+	printf(" %u", wait);
+	if (wait < base - base / 2 || wait > base) {
+	    printf("\n");
+	    fprintf(stderr, "sched: wait %u after %i failures, expecting %u to %u\n", wait, i + 1, base - base / 2, base);
+	    return -1;
+	}
+    }
+    printf(" s\n");
+
+    // from local midnight on a summer's day. The adaptive polls should be fewer than at the default interval,
+    // and follow the power more closely than as many at a fixed interval.
+    midnight = utc(2014, 12, 21, 0, 0) - BENCH_SCHED_UTC_OFFSET;
+    sched_day(midnight, 60, 60, 0, &error);
+    fixed = sched_day(midnight, 60, 60, 1, &error);
+    sched_day(midnight, 180, 180, 1, &sparse_error);
+    adaptive = sched_day(midnight, 10, 300, 1, &adaptive_error);
+    if (adaptive >= fixed || adaptive_error >= sparse_error) {
+	fprintf(stderr, "sched: %i adaptive polls, error %.1f W, no better than at a fixed interval\n", adaptive, adaptive_error);
+	return -1;
+    }
+    return 0;
+}
+
+//! polls made by the recover benchmark over a link that loses one in BENCH_RECOVER_DROP frames, each made
+//! as sbrun.pl does with up to BENCH_RECOVER_RUNS runs of sbread, BENCH_RECOVER_PAUSE_SEC apart
+#define BENCH_RECOVER_POLLS     20
+#define BENCH_RECOVER_DROP      10
+#define BENCH_RECOVER_RUNS      6
+#define BENCH_RECOVER_PAUSE_SEC 5
+//! the wait before a request is sent again, and the simulated reply delay
+#define BENCH_RECOVER_RESEND_MS 50
+#define BENCH_RECOVER_DELAY_US  1000
+
+//! the polls made by the recover benchmark: what is read, and the wait before a request is sent again, 0 for never
+static const struct {
+    const char *name;
+    int display;
+    unsigned resend_ms;
+} recover_runs[] = {
+    { "rerun", DISPLAY_BOTH, 0 },
+    { "resend", DISPLAY_BOTH, BENCH_RECOVER_RESEND_MS },
+    { "all, resend", DISPLAY_ALL, BENCH_RECOVER_RESEND_MS },
+};
+#define N_RECOVER_RUNS (sizeof(recover_runs)/sizeof(*recover_runs))
+
+/**
+ * Poll over a lossy link, once by running the whole session again after a failure, as sbrun.pl does
+ * sbread, then with the requests whose replies were lost sent again, checking that the worst poll is
+ * the quicker for it and that the trace counts the resends. Then check that a link that dies part way
+ * through the query section is carried on with over a new connection, from where it died.
+ */
+static int bench_recover()
+{
+    script_prog_t prog;
+    sim_config_t cfg;
+    transport_t tr;
+    sb_session_t s;
+    trace_t *t = NULL;
+    double worst[N_RECOVER_RUNS], start;
+    int i, j, k, runs, ret = -1;
+
+    // the replies lost time out
+    if (bench_sim_open(&prog, &cfg, &tr, NULL) < 0 || bench_log_capture("recover") < 0)
+	goto done;
+    if ((t = malloc(sizeof(*t))) == NULL) {
+	fprintf(stderr, "out of memory\n");
+	goto done;
+    }
+    cfg.delay_us = BENCH_RECOVER_DELAY_US;
+    cfg.drop = BENCH_RECOVER_DROP;
+
+    for (i = 0; i < N_RECOVER_RUNS; i++) {
+	uint64_t trace_resends = 0;
+	double sum = 0;
+	int failed = 0, reruns = 0;
+	session_init(&s, &tr, cfg.sb_bt_addr, cfg.serial, &prog);
+	s.display = recover_runs[i].display;
+	s.timeout_sec = 1;
+	s.resend_ms = recover_runs[i].resend_ms;
+	s.reconnects = s.resend_ms ? SESSION_RECONNECTS : 0;
+	s.trace = t;
+	trace_init(t);
+	worst[i] = 0;
+	for (j = 0; j < BENCH_RECOVER_POLLS; j++) {
+	    double sec;
+	    start = now_sec();
+	    for (runs = 1; runs <= BENCH_RECOVER_RUNS; runs++) {
+		int ok;
+		trace_run(t);
+		ok = session_connect(&s) == 0 && session_logon_and_query(&s) == 0;
+		session_close(&s);
+		for (k = 0; k < t->n_events; k++)
+		    trace_resends += t->events[k].resends;
+		if (ok)
+		    break;
+	    }
+	    if (runs > BENCH_RECOVER_RUNS) {
+		failed++;
+		runs--;
+	    } else if (session_check(&s, &cfg, recover_runs[i].display) < 0) {
+		fprintf(stderr, "recover: %s: poll %i read the wrong values\n", recover_runs[i].name, j);
+		goto done;
+	    }
+	    reruns += runs - 1;
+	    // with the pauses between the runs
+	    sec = now_sec() - start + (runs - 1) * BENCH_RECOVER_PAUSE_SEC;
+	    sum += sec;
+	    if (sec > worst[i])
+		worst[i] = sec;
+	}
+	if (trace_resends != s.resends || (s.resend_ms != 0) != (s.resends != 0)) {
+	    fprintf(stderr, "recover: %s: %u requests sent again, %lu traced\n", recover_runs[i].name, s.resends,
+		    (unsigned long)trace_resends);
+	    goto done;
+	}
+	printf("recover: 1 in %i lost  %-12s %3i polls  mean %6.2f s  worst %6.2f s  %3i reruns  %2i failed  %4u resent  %2u reconnected\n",
+	       BENCH_RECOVER_DROP, recover_runs[i].name, BENCH_RECOVER_POLLS, sum / BENCH_RECOVER_POLLS, worst[i], reruns,
+	       failed, s.resends, s.recoveries);
+	if (s.resend_ms && failed) {
+	    fprintf(stderr, "recover: %s: %i polls failed\n", recover_runs[i].name, failed);
+	    goto done;
+	}
+    }
+    if (worst[1] >= worst[0]) {
+	fprintf(stderr, "recover: the worst poll took %.2f s with resends, %.2f s without\n", worst[1], worst[0]);
+	goto done;
+    }
+
+    // a link that dies at the second request of the query section, on each connection, so carrying on
+    // over a new connection is all that reads the energy
+    cfg.drop = 0;
+    cfg.fade = 2;
+    for (i = 0; i < 2; i++) {
+	int ok;
+	session_init(&s, &tr, cfg.sb_bt_addr, cfg.serial, &prog);
+	s.display = DISPLAY_BOTH;
+	s.timeout_sec = 1;
+	s.resend_ms = BENCH_RECOVER_RESEND_MS;
+	s.reconnects = i;
+	start = now_sec();
+	ok = session_connect(&s) == 0 && session_logon_and_query(&s) == 0 && session_check(&s, &cfg, DISPLAY_BOTH) == 0;
+	session_close(&s);
+	if (ok != i || s.connects != 1u + i || s.recoveries != (unsigned)i) {
+	    fprintf(stderr, "recover: link lost with %i reconnects: %s, %u connects\n", i, ok ? "read" : "failed",
+		    s.connects);
+	    goto done;
+	}
+    }
+    if (bench_log_release("Timeout reading", 0) == 0) {
+	fprintf(stderr, "recover: the replies lost logged no timeouts\n");
+	goto done;
+    }
+    printf("recover: link lost at the energy query  read in %6.2f s  %u connects  %u resent\n", now_sec() - start,
+	   s.connects, s.resends);
+    ret = 0;
+
+ done:
+    bench_log_release(NULL, 1);
+    bench_sim_close(&prog);
+    free(t);
+    return ret;
+}
+
+//! the benchmarks
+static const struct {
+    const char *name;
+    int (*fn)();
+} benchmarks[] = {
+    { "codec", bench_codec },
+    { "crc", bench_crc },
+    { "sma", bench_sma },
+    { "session", bench_session },
+    { "daemon", bench_daemon },
+    { "sweep", bench_sweep },
+    { "store", bench_store },
+    { "archive", bench_archive },
+    { "logger", bench_logger },
+    { "trace", bench_trace },
+    { "metrics", bench_metrics },
+    { "shm", bench_shm },
+    { "cache", bench_cache },
+    { "upload", bench_upload },
+    { "lib", bench_lib },
+    { "mem", bench_mem },
+    { "sched", bench_sched },
+    { "recover", bench_recover },
+};
+#define N_BENCHMARKS (sizeof(benchmarks)/sizeof(*benchmarks))
+
+int main(int argc, char **argv)
+{
+    int i, j, ret = 0;
+
+    if (argc < 2) {
+	for (j = 0; j < N_BENCHMARKS; j++)
+	    if (benchmarks[j].fn() < 0)
+		ret = 1;
+	return ret;
+    }
+    for (i = 1; i < argc; i++) {
+	for (j = 0; j < N_BENCHMARKS; j++) {
+	    if (!strcmp(argv[i], benchmarks[j].name))
+		break;
+	}
+	if (j == N_BENCHMARKS) {
+	    fprintf(stderr, "Usage: %s [benchmark ...]\nWhere benchmark is one of:", argv[0]);
+	    for (j = 0; j < N_BENCHMARKS; j++)
+		fprintf(stderr, " %s", benchmarks[j].name);
+	    fprintf(stderr, "\n");
+	    return 1;
+	}
+	if (benchmarks[j].fn() < 0)
+	    ret = 1;
+    }
+    return ret;
+}
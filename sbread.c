@@ -9,118 +9,70 @@
 // 
 // This code is released to the public domain.
 // -----------------------------------------------------------------------------
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
 #include <errno.h>
 #include <libgen.h> // for basename()
-#include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "archive.h"
 #include "logger.h"
-#include "crc.h"
+#include "metrics.h"
+#include "sched.h"
+#include "script.h"
+#include "session.h"
+#include "shm.h"
+#include "sma.h"
+#include "store.h"
+#include "sweep.h"
+#include "trace.h"
+#include "transport.h"
+#include "upload.h"
 
 
 // globals
-//! These are the 'macro' string that may be contained in the sb.ini script file
-char *accepted_strings[] = {
-"$END",
-"$ADDR",
-"$TIME",
-"$SER",
-"$CRC",
-"$POW",
-"$DTOT",
-"$ADD2",
-"$CHAN"
-};
-
-// flag to indicate the output messages should be verbose
-int verbose ;
-// buffer for holding the characters read from XXX (script file?)
-unsigned char fl[1024] ;
-// index into the buffer of current character
-int cc;
-// timeout in seconds for reading from socket
-uint8_t sb_sock_read_timeout_sec = 7;
+// what is displayed, DISPLAY_xxx, and so read
+uint8_t display_flag=DISPLAY_POWER;
+// number of -all queries sent before waiting for their replies
+uint8_t pipelineDepth=SESSION_MAX_PENDING;
+// milliseconds waited for a reply before its request is sent again, 0 for never
+unsigned resendMs=SESSION_RESEND_MS;
 // name of the script file
 char scriptFNameDefault[]="/etc/sbread.script";
 char *scriptFName = scriptFNameDefault;
-
-// flag to indicate whether instantaneous power, energy so far today, or both should be displayed
-#define DISPLAY_POWER     0
-#define DISPLAY_ENERGY    1
-#define DISPLAY_BOTH      2
-uint8_t display_flag=DISPLAY_POWER;
-
-
-//! calculate the crc  for current data
-void tryfcs16(unsigned char *cp, int len)
-{
-    uint16_t trialfcs;
-    int i;	 
-
-    /* add on output */
-    if (verbose ==1){
-	printf("String to calculate FCS\n");	 
-	for (i=0;i<len;i++) 
-	    printf("%02X ",cp[i]);
-	printf("\n\n");
-    }	
-    trialfcs = crc_calc_crc( CRC_PPPINITFCS16, cp, len );
-    trialfcs ^= 0xffff;               /* complement */
-    fl[cc] = (trialfcs & 0x00ff);    /* least significant byte first */
-    fl[cc+1] = ((trialfcs >> 8) & 0x00ff);
-    cc = cc + 2;
-    if (verbose == 1) printf("FCS = %x%x\n",(trialfcs & 0x00ff),((trialfcs >> 8) & 0x00ff)); 
-}
-
-//! convert something or another
-unsigned char conv(char *nn)
-{
-    unsigned char tt=0,res=0;
-    int i;   
-    
-    for(i=0;i<2;i++){
-	switch(nn[i]){
-	    case 65:
-		tt = 10;
-		break;
-	    case 66:
-		tt = 11;
-		break;
-	    case 67:
-		tt = 12;
-		break;
-	    case 68:
-		tt = 13;
-		break;
-	    case 69:
-		tt = 14;
-		break;
-	    case 70:
-		tt = 15;
-		break;
-	    default:
-		tt = nn[i] - 48;
-	}
-	res = res + (tt * pow(16,1-i));
-    }
-    return res;
-}
-
-int select_str(char *s)
-{
-    int i;
-    for (i=0; i < sizeof(accepted_strings)/sizeof(*accepted_strings);i++)
-	if (!strcmp(s, accepted_strings[i])) return i;
-    return -1;
-}
+// directory in which the readings are stored, NULL if they're not
+char *storeDir = NULL;
+// bytes of flash the readings of each inverter may take up, 0 for the default
+size_t storeBudget = 0;
+// the stores of the inverters read so far, kept open between polls, and how many there is room for
+store_t *stores = NULL;
+int n_stores = 0;
+int max_stores = 0;
+// what is shown of the time taken by each step of a session, TRACE_SHOW_xxx, 0 for nothing
+#define TRACE_SHOW_RUNS 1
+#define TRACE_SHOW_HIST 2
+int traceShow = 0;
+// set by SIGUSR1 to have the trace histograms shown after the next poll
+volatile sig_atomic_t traceRequested = 0;
+// flag to show the memory used, at the end or in daemon mode on SIGUSR1
+int memShow = 0;
+// set by SIGUSR1 to have the memory used shown right away, or after the poll under way
+volatile sig_atomic_t memRequested = 0;
+// set by SIGTERM or SIGINT to have the daemon stop after the poll under way
+volatile sig_atomic_t stopRequested = 0;
+// the metrics served in daemon mode, NULL if they're not
+metrics_t *metrics = NULL;
+// the shared memory segment the latest readings are published in, NULL if they're not
+shm_t *shm = NULL;
+// file in which the link values of the inverter are kept between runs, NULL if they're not
+char *cacheFName = NULL;
+// the uploader the readings are spooled to, NULL if they're not uploaded
+upload_t *uploader = NULL;
 
 /** 
  * Display info on commandline parameters
@@ -129,85 +81,826 @@ int select_str(char *s)
  */
 void usage(char* exePath)
 {
-    fprintf(stderr,"Usage: %s -address XX:XX:XX:XX:XX:XX -serial XX:XX:XX:XX [-script /path/to/script] [-v] [-vv] [-d] [-b]\nWhere:\n",basename(exePath));
+    fprintf(stderr,"Usage: %s {-address XX:XX:XX:XX:XX:XX -serial XX:XX:XX:XX | -inverters file} [-script /path/to/script] [-v] [-vv] [-d] [-b] [-all [-pipeline N]] [-net] [-resend ms] [-daemon [-interval N] [-adaptive N] [-location lat,lon]]\n\t[-tcp host:port | -replay file [-replay-fast]] [-record file] [-store dir [-store-budget kB]]\n\t[-archive day|month [-from time] [-cursor file]] [-trace run|hist] [-metrics [host:]port|path] [-shm [/name]] [-cache file]\n\t[-upload url [-upload-format form|lines] [-spool file]] [-mem]\n       %s -shm-read [/name] [-serial XX:XX:XX:XX] [-d] [-b] [-all]\n       %s query -h for querying the stored readings\nWhere:\n",basename(exePath),basename(exePath),basename(exePath));
     fprintf(stderr,"\t-address  specifies the bluetooth of the inverter. eg -address 00:80:25:A6:77:60\n");
     fprintf(stderr,"\t-serial   specifies the serial number of the inverter converted to hexidecimal. \n");
     fprintf(stderr,"\t	         eg: Inverter with s/n 2130248863 would be -serial 7E:F9:04:9F\n");
+    fprintf(stderr,"\t-inverters read all of the inverters listed in file at once, rather than the one given by -address\n\t\t\t  and -serial. Each line of the file has an address and serial number, eg\n\t\t\t  00:80:25:A6:77:60 7E:F9:04:9F\n\t\t\t  and the results are displayed one line per inverter, preceded by its address.\n");
     fprintf(stderr,"\t-script   (optional) specifies the path to the script file.\n\t\t\t  If not present, default script file %s is used.\n", scriptFName);
     fprintf(stderr,"\t-d        display total energy produced so far today (in kWh), instead of current power\n");
     fprintf(stderr,"\t-b        display both current power and energy produced so far today. eg: 3077,13.40\n");
+    fprintf(stderr,"\t-all      display every value that the inverter has, as name=value pairs. The values are\n\t\t\t  fetched with one query each for AC, DC and energy values rather than by the script.\n");
+    fprintf(stderr,"\t-pipeline number of -all queries sent before waiting for their replies, 1 to %i, default %i.\n\t\t\t  Use 1 if the inverter drops queries sent back to back.\n", SESSION_MAX_PENDING, SESSION_MAX_PENDING);
+    fprintf(stderr,"\t-resend   milliseconds to wait for a reply before sending the request again, with twice the wait\n\t\t\t  each time, default %i, 0 for never. Should the link still be lost while reading the values,\n\t\t\t  the inverter is reconnected to and read from where it was lost.\n", SESSION_RESEND_MS);
+    fprintf(stderr,"\t-net      read every inverter in the bluetooth net of the one connected to, through the one\n\t\t\t  connection. The results are displayed one line per inverter, preceded by its address.\n");
+    fprintf(stderr,"\t-daemon   keep the connection open and display a new reading every interval seconds.\n\t\t\t  The connection is only reopened after an error, which is retried after %i seconds,\n\t\t\t  then after twice as long each time it fails again, up to interval.\n", SCHED_RETRY_MIN_SEC);
+    fprintf(stderr,"\t-interval seconds between readings in daemon mode, default 60\n");
+    fprintf(stderr,"\t-adaptive in daemon mode, read as often as every N seconds while the power is changing by more than\n\t\t\t  %i%%, backing off to every interval seconds while it's steady\n", SCHED_CHANGE_PCT);
+    fprintf(stderr,"\t-location latitude,longitude of the inverters in degrees, north and east positive, so that in\n\t\t\t  daemon mode they're not read from %i minutes after sunset until %i minutes before\n\t\t\t  sunrise, the connection being closed. eg -location -33.87,151.21\n", SCHED_TWILIGHT_SEC / 60, SCHED_TWILIGHT_SEC / 60);
+    fprintf(stderr,"\t-tcp      connect to the inverter via a bluetooth to IP bridge at host:port rather than directly\n");
+    fprintf(stderr,"\t-replay   replay the session recorded in file rather than connecting to the inverter\n");
+    fprintf(stderr,"\t-replay-fast replay the recorded data as fast as possible rather than with the recorded delays\n");
+    fprintf(stderr,"\t-record   record the data exchanged with the inverter to file, for later use with -replay\n");
+    fprintf(stderr,"\t-store    also append each reading to the store of its inverter in dir, named by its serial number\n");
+    fprintf(stderr,"\t-store-budget kilobytes of flash the readings of each inverter may take up, default %i.\n\t\t\t  The oldest are deleted to make room.\n", STORE_BUDGET / 1024);
+    fprintf(stderr,"\t-archive  download the inverter's day archive of the total energy every 5 minutes, or its month\n\t\t\t  archive of it every day, rather than reading its current values. The records are\n\t\t\t  displayed as time,Wh and with -store are also appended to the store <serial>-day or\n\t\t\t  <serial>-month.\n");
+    fprintf(stderr,"\t-from     start of the archive download, as a unix time or YYYY-MM-DD[THH:MM[:SS]] UTC. By default\n\t\t\t  just after the last record downloaded before, as saved in the cursor file, or failing\n\t\t\t  that a day, or a year, ago.\n");
+    fprintf(stderr,"\t-cursor   file in which the time of the last record downloaded is kept, so that an interrupted\n\t\t\t  download carries on from there. Default <serial>-day.cursor or <serial>-month.cursor\n\t\t\t  in the -store directory.\n");
+    fprintf(stderr,"\t-trace    show the time taken by connecting and by each line of the script, with the bytes read\n\t\t\t  and the reads made, on stderr. With run they're shown for each run, with hist as\n\t\t\t  percentiles over all of the runs at the end, or in daemon mode on SIGUSR1.\n");
+    fprintf(stderr,"\t-metrics  in daemon mode, serve the latest values of each inverter and counters of the polls over\n\t\t\t  HTTP in the Prometheus text format, on port, on localhost unless host is given, or on\n\t\t\t  the unix socket path. eg -metrics 9150\n");
+    fprintf(stderr,"\t-shm      in daemon mode, publish the latest values of each inverter in the POSIX shared memory\n\t\t\t  segment /name, default %s, for other programs to read without polling the inverters\n", SHM_NAME_DEFAULT);
+    fprintf(stderr,"\t-shm-read display the latest values published with -shm, of the inverter given by -serial, or of\n\t\t\t  each inverter preceded by its serial number, rather than reading the inverter\n");
+    fprintf(stderr,"\t-cache    keep the bluetooth channel and our address, as set up with the inverter, in file, and\n\t\t\t  on later runs go straight to the logon with them, only setting up the link again if the\n\t\t\t  inverter doesn't take it. Not with -inverters. eg -cache /tmp/sbread.cache\n");
+    fprintf(stderr,"\t-upload   also POST each reading to url, http://host[:port][/path], over one connection.\n\t\t\t  The readings are spooled to a file first, and kept there until the server has taken\n\t\t\t  them, so that none are lost while it can't be reached. In daemon mode they're sent as\n\t\t\t  they're read, otherwise before exiting, those that can't be being left for the next run.\n");
+    fprintf(stderr,"\t-upload-format form, the default, POSTs the AC power of each reading as powernow=3077, as\n\t\t\t  sbrun.pl did. lines POSTs batches of readings, each a line with all of its values as\n\t\t\t  form data, eg serial=2130248863&time=1412345678&ac_power=3077&day_wh=13400\n");
+    fprintf(stderr,"\t-spool    the spool file of the readings to be uploaded, default %s. Put it on flash to\n\t\t\t  keep them across reboots.\n", UPLOAD_SPOOL_DEFAULT);
+    fprintf(stderr,"\t-mem      show the memory used on stderr: the resident set size and its peak, how much of the\n\t\t\t  arena is used in the fixed footprint build, and what each inverter takes. In daemon mode\n\t\t\t  it's shown on SIGUSR1.\n");
     fprintf(stderr,"\t-v        specifies that verbose messages will be displayed while the program runs.\n\t\t\t  Use -vv for very verbose (debug)messages.\n");
     fprintf(stderr,"\t-h        display this help message\n\n");
 }
 
-//! log the passed data, but only if logger_level is set to debug
-void log_data_debug(char* prefix, unsigned char* data, unsigned len){
-    if(logger_level == LOGGER_LEVEL_DEBUG) {
-	logger_start(LOGGER_LEVEL_DEBUG);
-	logger_output(prefix);
-	for (int i=0;i<len;i++) 
-	    logger_fmt_output("%02x ",data[i]);
-	logger_end();
+/** 
+ * Convert a string of colon separated hex bytes, eg 00:80:25:A6:77:60, to binary.
+ * Note that the inverter protocol uses LSB first, so the bytes are stored in reverse order.
+ * @param str The string to be converted
+ * @param out Where the bytes are to be stored
+ * @param n The number of bytes expected
+ * @return 0 on success, -1 if str is not of the expected form
+ */
+int parse_hex_bytes(const char *str, unsigned char *out, int n)
+{
+    int i, c;
+    for (i=n-1; i>=0; i--){
+	if ((c = script_hex_byte(str)) < 0)
+	    return -1;
+	out[i] = c;
+	str += 2;
+	if (*str != (i ? ':' : '\x0'))
+	    return -1;
+	str++;
+    }
+    return 0;
+}
+
+//! display the passed values, as specified by display_flag
+void display_results(const sma_values_t *v)
+{
+    if(display_flag== DISPLAY_BOTH)
+	printf("%i,%.2f\n",v->ac_power,v->day_wh/1000.0);
+    else if(display_flag== DISPLAY_POWER)
+	printf("%i\n",v->ac_power);
+    else if(display_flag== DISPLAY_ENERGY)
+	printf("%.2f\n",v->day_wh/1000.0);
+    else if(display_flag== DISPLAY_ALL){
+	int i, decimals;
+	const char *sep = "";
+	for(i=0;i<SMA_VAL_COUNT;i++){
+	    if(!(v->have & SMA_HAVE(i)))
+		continue;
+	    double value = sma_value_get(v, i, &decimals);
+	    printf("%s%s=%.*f", sep, sma_value_name(i), decimals, value);
+	    sep = " ";
+	}
+	printf("\n");
+    }
+    fflush(stdout);
+}
+
+/**
+ * Display the results of a poll of the passed session: of the inverter, or if the session
+ * is reading the whole net, of each inverter in it preceded by its bluetooth address
+ */
+void display_session(const sb_session_t *s)
+{
+    int i;
+
+    if(!s->net){
+	display_results(&s->values);
+	return;
+    }
+    for(i=0;i<s->n_nodes;i++){
+	const unsigned char *a = s->nodes[i].bt_addr;
+	printf("%02X:%02X:%02X:%02X:%02X:%02X ", a[5], a[4], a[3], a[2], a[1], a[0]);
+	display_results(&s->nodes[i].values);
     }
 }
 
+/**
+ * Append the passed values to the store of the inverter with the passed serial number, opening
+ * it if this is its first reading
+ */
+void store_values(uint32_t serial, const sma_values_t *v)
+{
+    char name[16];
+    int i;
+
+    snprintf(name, sizeof(name), "%u", serial);
+    for(i=0;i<n_stores;i++){
+	if(strcmp(stores[i].name, name) == 0)
+	    break;
+    }
+    if(i == n_stores){
+	if(n_stores == max_stores){
+	    LOGGER_FMT_ERROR("Could not store the reading of %s: no room for more than %i inverters", name, max_stores);
+	    return;
+	}
+	if(store_open(&stores[i], storeDir, name, storeBudget, 0) < 0)
+	    return;
+	n_stores++;
+    }
+    // the inverter's own time of the reading, if it gave one
+    store_append(&stores[i], v->time ? v->time : (uint32_t)time(NULL), v);
+}
+
+//! store the results of a poll of the passed session, if a store directory was given
+void store_session(const sb_session_t *s)
+{
+    int i;
+
+    if(storeDir == NULL)
+	return;
+    if(!s->net){
+	store_values(sma_get_u32(s->serial), &s->values);
+	return;
+    }
+    for(i=0;i<s->n_nodes;i++)
+	store_values(sma_get_u32(s->nodes[i].addr + 2), &s->nodes[i].values);
+}
+
+/**
+ * Publish the results of a poll of the passed session in shared memory, if they're being published:
+ * of the inverter, or of each inverter in its net
+ */
+void publish_session(const sb_session_t *s)
+{
+    uint32_t now = time(NULL);
+    int i, ret = 0;
+
+    if(shm == NULL)
+	return;
+    if(!s->net)
+	ret = shm_publish(shm, sma_get_u32(s->serial), now, &s->values);
+    for(i=0;s->net && i<s->n_nodes && ret==0;i++)
+	ret = shm_publish(shm, sma_get_u32(s->nodes[i].addr + 2), now, &s->nodes[i].values);
+    if(ret < 0)
+	LOGGER_FMT_ERROR("Could not publish the values: no room for more than %i inverters", SHM_MAX_INVERTERS);
+}
+
+/**
+ * Spool the results of a poll of the passed session to be uploaded, if they're being uploaded:
+ * of the inverter, or of each inverter in its net
+ */
+void upload_session(const sb_session_t *s)
+{
+    uint32_t now = time(NULL);
+    int i;
+
+    if(uploader == NULL)
+	return;
+    if(!s->net){
+	upload_append(uploader, sma_get_u32(s->serial), s->values.time ? s->values.time : now, &s->values);
+	return;
+    }
+    for(i=0;i<s->n_nodes;i++){
+	const sma_values_t *v = &s->nodes[i].values;
+	upload_append(uploader, sma_get_u32(s->nodes[i].addr + 2), v->time ? v->time : now, v);
+    }
+}
+
+//! return the AC power read by a poll of the passed session, in total over its net if that was read
+int32_t total_power(const sb_session_t *s)
+{
+    int32_t power = 0;
+    int i;
+
+    if(!s->net)
+	return s->values.ac_power;
+    for(i=0;i<s->n_nodes;i++)
+	power += s->nodes[i].values.ac_power;
+    return power;
+}
+
+//! send the readings spooled to be uploaded before exiting, those that can't be being left for the next run
+void close_upload()
+{
+    if(uploader == NULL)
+	return;
+    if(!uploader->running && upload_flush(uploader) < 0)
+	LOGGER_FMT_WARN("%u readings left in %s to be sent on the next run", upload_pending(uploader), uploader->spool_path);
+    upload_close(uploader);
+    arena_free(uploader);
+    uploader = NULL;
+}
+
+/**
+ * Allocate the stores of up to n inverters, if a store directory was given, before the first poll
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int alloc_stores(int n)
+{
+    if(storeDir == NULL)
+	return 0;
+    if(n > ARENA_MAX_INVERTERS)
+	n = ARENA_MAX_INVERTERS;
+    if((stores = arena_alloc(n * sizeof(*stores))) == NULL){
+	LOGGER_ERROR("out of memory");
+	return -1;
+    }
+    max_stores = n;
+    return 0;
+}
+
+//! close the stores opened by store_values()
+void close_stores()
+{
+    int i;
+
+    for(i=0;i<n_stores;i++)
+	store_close(&stores[i]);
+    arena_free(stores);
+    stores = NULL;
+    n_stores = 0;
+    max_stores = 0;
+}
+
+//! keep the link values of the passed session, which has logged on, in the session cache, if there is one
+void cache_session(const sb_session_t *s)
+{
+    if(cacheFName != NULL)
+	session_cache_save(s, cacheFName);
+}
+
+//! return the current value of the monotonic clock in seconds
+time_t monotonic_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+//! SIGUSR1 handler: have the trace histograms shown after the next poll, and the memory used now
+void report_signal(int sig)
+{
+    traceRequested = 1;
+    memRequested = 1;
+}
+
+//! SIGTERM and SIGINT handler: have the daemon stop, so that it exits as at the end of a run
+void stop_signal(int sig)
+{
+    stopRequested = 1;
+}
+
+/**
+ * Show the memory used with -mem, if it's the last poll or it has been asked for with SIGUSR1
+ * @param last Flag to indicate that this is the last poll
+ */
+void mem_show(int last)
+{
+    arena_stats_t st;
+
+    if(!memShow || (!last && !memRequested))
+	return;
+    memRequested = 0;
+    arena_stats(&st);
+    fprintf(stderr, "memory: rss %lu kB, peak %lu kB", (unsigned long)st.rss_kb, (unsigned long)st.peak_rss_kb);
+    if(st.size)
+	fprintf(stderr, ", arena %lu of %lu bytes in use, at most %lu", (unsigned long)st.used, (unsigned long)st.size,
+		(unsigned long)st.peak);
+    fprintf(stderr, ", %u allocations after startup\n", st.late);
+    fprintf(stderr, "memory: each inverter %lu bytes: session %lu, connection %lu, trace %lu, store %lu\n",
+	    (unsigned long)(sizeof(sb_session_t) + sizeof(transport_t) + (traceShow ? sizeof(trace_t) : 0) +
+			    (storeDir != NULL ? sizeof(store_t) : 0)),
+	    (unsigned long)sizeof(sb_session_t), (unsigned long)sizeof(transport_t),
+	    (unsigned long)(traceShow ? sizeof(trace_t) : 0), (unsigned long)(storeDir != NULL ? sizeof(store_t) : 0));
+}
+
+//! start tracing a new run of the passed session, if it's being traced
+void trace_start(sb_session_t *s)
+{
+    if(s->trace != NULL)
+	trace_run(s->trace);
+}
+
+/**
+ * Show the trace of the session's last run with -trace run, or with -trace hist its histograms if
+ * it's the last run or they have been asked for with SIGUSR1
+ * @param s The session
+ * @param name Shown before the trace, NULL for none
+ * @param last Flag to indicate that this is the last run
+ */
+void trace_show(const sb_session_t *s, const char *name, int last)
+{
+    if(s->trace == NULL || (traceShow == TRACE_SHOW_HIST && !last && !traceRequested))
+	return;
+    if(name != NULL)
+	fprintf(stderr, "%s ", name);
+    if(traceShow == TRACE_SHOW_RUNS)
+	trace_dump(s->trace, stderr);
+    else
+	trace_print(s->trace, stderr);
+}
+
+/**
+ * Sleep until the time of the next poll, or until asked to stop. A SIGUSR1 cuts the sleep short,
+ * so sleep again until it's time, showing the memory used right away if asked for
+ * @param next_poll Monotonic time of the next poll, set to now if that has already passed
+ */
+void wait_poll(time_t *next_poll)
+{
+    time_t now;
+
+    while((now = monotonic_sec()) < *next_poll && !stopRequested){
+	sleep(*next_poll - now);
+	mem_show(0);
+    }
+    if(now > *next_poll)
+	*next_poll = now;
+}
+
+/** 
+ * Poll the inverter when the passed schedule says to, displaying the results after each poll.
+ * The connection is kept open and only the query section of the script is rerun, unless
+ * there was an error, or the inverter has gone to sleep for the night, in which case the
+ * connection is reopened and the whole script rerun.
+ * Returns once SIGTERM or SIGINT has been received, having closed the session.
+ * @param s The session, not connected
+ * @param sc The schedule
+ */
+void run_daemon(sb_session_t *s, sched_t *sc)
+{
+    // flag to indicate whether the session is logged on, ie only the query section needs to be run
+    int logged_on = 0;
+    time_t next_poll = monotonic_sec();
+
+    while(!stopRequested){
+	int ret;
+	int64_t start = transport_now_ms();
+	trace_start(s);
+	ret = session_poll(s, &logged_on);
+	if(ret == 1)
+	    cache_session(s);
+	if(ret >= 0){
+	    display_session(s);
+	    store_session(s);
+	    publish_session(s);
+	    upload_session(s);
+	}
+	trace_show(s, NULL, 0);
+	traceRequested = 0;
+	if(metrics != NULL){
+	    metrics_update(metrics, s, ret >= 0, (transport_now_ms() - start) / 1000.0);
+	    metrics_publish(metrics);
+	}
+	mem_show(0);
+	// wait until it's time for the next poll, letting the inverter sleep at night
+	next_poll += sched_next(sc, time(NULL), ret >= 0, total_power(s));
+	if(sc->dormant && logged_on){
+	    logged_on = 0;
+	    session_close(s);
+	}
+	wait_poll(&next_poll);
+    }
+    LOGGER_INFO("stopping");
+    session_close(s);
+}
+
+/**
+ * Read the list of inverters to be swept from the passed file, one per line as the bluetooth
+ * address followed by the serial number, eg 00:80:25:A6:77:60 7E:F9:04:9F. Blank lines and
+ * those starting with # are ignored.
+ * @param fname The file
+ * @param prog The compiled script
+ * @param net Flag, non zero to read every inverter in the net of each one listed
+ * @param n Set to the number of inverters
+ * @return The inverters, each with its rfcomm transport and session initialised, to be freed
+ * with arena_free(), or NULL on error, which has been logged
+ */
+sweep_inverter_t *read_inverters(const char *fname, const script_prog_t *prog, int net, int *n)
+{
+    FILE *fp;
+    char line[128], addr[18], ser[12];
+    unsigned char bt_addr[6], serial[4];
+    sweep_inverter_t *inv = NULL;
+    int lines = 0, line_num = 0;
+
+#ifdef SB_NO_BLUETOOTH
+    LOGGER_FMT_ERROR("Built without bluetooth, so the inverters in %s can't be read", fname);
+    return NULL;
+#endif
+    if((fp = fopen(fname, "r")) == NULL){
+	LOGGER_FMT_ERROR("Could not open inverter list %s", fname);
+	return NULL;
+    }
+    // count them, leaving out the blank lines and comments, then read them
+    while(fgets(line, sizeof(line), fp) != NULL){
+	if(line[strspn(line, " \t\r\n")] != '\x0' && line[strspn(line, " \t")] != '#')
+	    lines++;
+    }
+    if((inv = arena_alloc((lines ? lines : 1) * sizeof(*inv))) == NULL){
+	LOGGER_ERROR("out of memory");
+	fclose(fp);
+	return NULL;
+    }
+    rewind(fp);
+    *n = 0;
+    while(*n < lines && fgets(line, sizeof(line), fp) != NULL){
+	line_num++;
+	if(line[strspn(line, " \t\r\n")] == '\x0' || line[strspn(line, " \t")] == '#')
+	    continue;
+	if(sscanf(line, "%17s %11s", addr, ser) != 2 ||
+	   parse_hex_bytes(addr, bt_addr, sizeof(bt_addr)) < 0 || parse_hex_bytes(ser, serial, sizeof(serial)) < 0){
+	    LOGGER_FMT_ERROR("%s line %i: expecting bluetooth address and serial number", fname, line_num);
+	    arena_free(inv);
+	    fclose(fp);
+	    return NULL;
+	}
+#ifndef SB_NO_BLUETOOTH
+	transport_init_rfcomm(&inv[*n].tr, addr);
+#endif
+	session_init(&inv[*n].s, &inv[*n].tr, bt_addr, serial, prog);
+	inv[*n].s.net = net;
+	inv[*n].s.display = display_flag;
+	inv[*n].s.pipeline_depth = pipelineDepth;
+	inv[*n].s.resend_ms = resendMs;
+	(*n)++;
+    }
+    fclose(fp);
+    if(*n == 0){
+	LOGGER_FMT_ERROR("no inverters listed in %s", fname);
+	arena_free(inv);
+	return NULL;
+    }
+    return inv;
+}
+
+/**
+ * Read all of the passed inverters at once, displaying the results of each, preceded by its
+ * address. In daemon mode this is repeated when the passed schedule says to, until SIGTERM or
+ * SIGINT has been received.
+ * @return 0 if all of the inverters were read, or the daemon was stopped, -1 otherwise
+ */
+int run_sweep(sweep_inverter_t *inv, int n, int daemon_flag, sched_t *sc)
+{
+    time_t next_poll = monotonic_sec();
+    int32_t power;
+    int i, n_done;
+
+    for(;;){
+	for(i=0;i<n;i++)
+	    trace_start(&inv[i].s);
+	n_done = sweep_run(inv, n);
+	for(i=0;i<n;i++)
+	    trace_show(&inv[i].s, inv[i].tr.addr, !daemon_flag);
+	traceRequested = 0;
+	if(metrics != NULL){
+	    for(i=0;i<n;i++)
+		metrics_update(metrics, &inv[i].s, inv[i].state == SWEEP_DONE, inv[i].elapsed_ms / 1000.0);
+	    metrics_publish(metrics);
+	}
+	power = 0;
+	for(i=0;i<n;i++){
+	    if(inv[i].state != SWEEP_DONE)
+		continue;
+	    power += total_power(&inv[i].s);
+	    if(!inv[i].s.net)
+		printf("%s ", inv[i].tr.addr);
+	    display_session(&inv[i].s);
+	    store_session(&inv[i].s);
+	    publish_session(&inv[i].s);
+	    upload_session(&inv[i].s);
+	}
+	if(!daemon_flag || stopRequested){
+	    close_stores();
+	    close_upload();
+	    mem_show(1);
+	    return !daemon_flag && n_done != n ? -1 : 0;
+	}
+	mem_show(0);
+	// wait until it's time for the next poll, the inverters having been read if any of them were
+	next_poll += sched_next(sc, time(NULL), n_done > 0, power);
+	wait_poll(&next_poll);
+    }
+}
+
+//! archive_fn_t: display a record of the archive, and append it to the store passed, if any
+void archive_record(const sma_archive_rec_t *rec, void *arg)
+{
+    store_t *st = arg;
+    sma_values_t v;
+
+    printf("%u,%llu\n", rec->time, (unsigned long long)rec->total_wh);
+    if(st != NULL){
+	sma_values_clear(&v);
+	sma_value_set(&v, SMA_VAL_TOTAL_WH, rec->total_wh);
+	store_append(st, rec->time, &v);
+    }
+}
+
+/**
+ * Download the passed archive of the inverter, from the passed time or the saved cursor, up to now
+ * @param s The session, not connected
+ * @param a Where the download is kept track of
+ * @param cmd SMA_CMD_ARCHIVE_DAY or SMA_CMD_ARCHIVE_MONTH
+ * @param from Unix time of the first record wanted, 0 to carry on from the cursor
+ * @param cursorFName File holding the cursor, NULL to use the default if there's a store
+ * @return 0 on success, -1 on error
+ */
+int run_archive(sb_session_t *s, archive_t *a, uint32_t cmd, uint32_t from, char *cursorFName)
+{
+    const char *kind = cmd == SMA_CMD_ARCHIVE_MONTH ? "month" : "day";
+    char name[32], path[STORE_PATH_MAX];
+    uint32_t now = time(NULL);
+    store_t st, *stp = NULL;
+    int ret = -1;
+
+    snprintf(name, sizeof(name), "%u-%s", sma_get_u32(s->serial), kind);
+    if(cursorFName == NULL && storeDir != NULL){
+	snprintf(path, sizeof(path), "%s/%s.cursor", storeDir, name);
+	cursorFName = path;
+    }
+    if(from == 0 && (cursorFName == NULL || archive_load_cursor(cursorFName, &from) <= 0))
+	from = now - (cmd == SMA_CMD_ARCHIVE_MONTH ? 365 : 1) * 86400;
+    if(storeDir != NULL){
+	if(store_open(&st, storeDir, name, storeBudget, 0) < 0)
+	    return -1;
+	stp = &st;
+    }
+    LOGGER_FMT_INFO("downloading the %s archive from %u", kind, from);
+    archive_init(a, cmd, from, now, archive_record, stp);
+    a->cursor_path = cursorFName;
+    trace_start(s);
+    if(session_connect(s) == 0 && session_archive(s, a) == 0){
+	cache_session(s);
+	ret = 0;
+    }
+    fflush(stdout);
+    trace_show(s, NULL, 1);
+    session_close(s);
+    if(stp != NULL)
+	store_close(stp);
+    mem_show(1);
+    return ret;
+}
+
+/**
+ * Display the latest values published in shared memory by another sbread, as specified by display_flag
+ * @param name The segment's name
+ * @param serialStr The serial number of the inverter whose values are displayed as hex digits,
+ * or NULL to display those of each inverter, preceded by its serial number
+ * @return 0 on success, -1 if the values could not be read
+ */
+int run_shm_read(const char *name, const char *serialStr)
+{
+    unsigned char serial[4];
+    shm_reading_t r;
+    shm_t seg;
+    int i, n, ret = 0;
+
+    if(serialStr != NULL && parse_hex_bytes(serialStr, serial, sizeof(serial)) < 0){
+	LOGGER_FMT_ERROR("Bad serial number %s", serialStr);
+	return -1;
+    }
+    if(shm_open_reader(&seg, name) < 0){
+	LOGGER_FMT_ERROR("Could not open %s: %s", name, errno == EPROTO ? "no values published" : strerror(errno));
+	return -1;
+    }
+    if(serialStr != NULL){
+	if((i = shm_find(&seg, sma_get_u32(serial))) < 0 || shm_read(&seg, i, &r) < 0){
+	    LOGGER_FMT_ERROR("no values of %s published in %s", serialStr, name);
+	    ret = -1;
+	}else{
+	    display_results(&r.values);
+	}
+	shm_close(&seg);
+	return ret;
+    }
+    n = shm_count(&seg);
+    for(i=0;i<n;i++){
+	if(shm_read(&seg, i, &r) < 0){
+	    ret = -1;
+	    continue;
+	}
+	printf("%u ", r.serial);
+	display_results(&r.values);
+    }
+    shm_close(&seg);
+    return ret;
+}
+
+//! display info on the parameters of the query subcommand
+void query_usage(char* exePath)
+{
+    fprintf(stderr,"Usage: %s query -store dir -serial XX:XX:XX:XX [-archive day|month] [-from time] [-to time] [-step N] [-json] [-v]\nWhere:\n",basename(exePath));
+    fprintf(stderr,"\t-store    the directory in which the readings were stored with -store\n");
+    fprintf(stderr,"\t-serial   the serial number of the inverter converted to hexidecimal, as when reading it\n");
+    fprintf(stderr,"\t-archive  query the records downloaded from the inverter's day or month archive, rather than the readings\n");
+    fprintf(stderr,"\t-from     start of the readings wanted, as a unix time or YYYY-MM-DD[THH:MM[:SS]] UTC. Default a day ago\n");
+    fprintf(stderr,"\t-to       end of the readings wanted, default now\n");
+    fprintf(stderr,"\t-step     seconds of readings in each line, default 3600. The steps start at a multiple of this, local time.\n");
+    fprintf(stderr,"\t-json     display the results as a JSON array rather than as CSV\n");
+    fprintf(stderr,"\tEach step with readings is displayed as its start time, the number of power readings, the minimum,\n\tmaximum and average power (W) and the energy produced (Wh).\n\n");
+}
+
+/**
+ * Parse a time given to the query subcommand
+ * @param str Unix time, or YYYY-MM-DD, YYYY-MM-DDTHH:MM or YYYY-MM-DDTHH:MM:SS, UTC
+ * @param t Set to the unix time
+ * @return 0 on success, -1 if str is not of the expected form
+ */
+int parse_time(const char *str, uint32_t *t)
+{
+    struct tm tm;
+    int n = 0, fields;
+
+    if(str[0] != '\x0' && strspn(str, "0123456789") == strlen(str)){
+	*t = strtoul(str, NULL, 10);
+	return 0;
+    }
+    memset(&tm, 0, sizeof(tm));
+    fields = sscanf(str, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n);
+    if(fields == 3 && str[n] == 'T'){
+	str += n + 1;
+	n = 0;
+	fields = sscanf(str, "%2d:%2d%n:%2d%n", &tm.tm_hour, &tm.tm_min, &n, &tm.tm_sec, &n);
+	if(fields < 2)
+	    return -1;
+    }else if(fields != 3){
+	return -1;
+    }
+    if(str[n] != '\x0')
+	return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *t = timegm(&tm);
+    return 0;
+}
+
+//! whether query results are displayed as JSON, and the separator before the next
+struct query_out {
+    int json;
+    const char *sep;
+};
+
+//! display the readings of one step of a query
+void display_step(const rollup_bucket_t *b, void *arg)
+{
+    struct query_out *out = arg;
+    char avg[16] = "";
+
+    if(b->n)
+	snprintf(avg, sizeof(avg), "%.1f", (double)b->sum_w / b->n);
+    if(!out->json){
+	if(b->n)
+	    printf("%u,%u,%i,%i,%s,%u\n", b->start, b->n, b->min_w, b->max_w, avg, b->wh);
+	else
+	    printf("%u,0,,,,%u\n", b->start, b->wh);
+	return;
+    }
+    if(b->n)
+	printf("%s\n  {\"time\":%u,\"readings\":%u,\"min_w\":%i,\"max_w\":%i,\"avg_w\":%s,\"wh\":%u}",
+	       out->sep, b->start, b->n, b->min_w, b->max_w, avg, b->wh);
+    else
+	printf("%s\n  {\"time\":%u,\"readings\":0,\"min_w\":null,\"max_w\":null,\"avg_w\":null,\"wh\":%u}",
+	       out->sep, b->start, b->wh);
+    out->sep = ",";
+}
+
+/**
+ * The query subcommand: display the stored readings of an inverter over a range of time, as
+ * the minimum, maximum and average power and the energy produced in each step
+ * @return 0 on success, -1 on error
+ */
+int run_query(int argc, char **argv)
+{
+    char *dir = NULL, *serialStr = NULL, *kind = NULL, name[32];
+    unsigned char serial[4];
+    uint32_t to = time(NULL), from = 0, step = 3600;
+    int have_from = 0, i, tier;
+    struct query_out out = { 0, "" };
+    store_t st;
+
+    for(i=2;i<argc;i++){
+	if(strcmp(argv[i],"-store")==0 && i+1<argc){
+	    dir=argv[++i];
+	}else if(strcmp(argv[i],"-serial")==0 && i+1<argc){
+	    serialStr=argv[++i];
+	}else if(strcmp(argv[i],"-from")==0 && i+1<argc && parse_time(argv[i+1], &from)==0){
+	    have_from=1;
+	    i++;
+	}else if(strcmp(argv[i],"-to")==0 && i+1<argc && parse_time(argv[i+1], &to)==0){
+	    i++;
+	}else if(strcmp(argv[i],"-step")==0 && i+1<argc && atoi(argv[i+1])>0){
+	    step=atoi(argv[++i]);
+	}else if(strcmp(argv[i],"-archive")==0 && i+1<argc &&
+		 (strcmp(argv[i+1],"day")==0 || strcmp(argv[i+1],"month")==0)){
+	    kind=argv[++i];
+	}else if(strcmp(argv[i],"-json")==0){
+	    out.json=1;
+	}else if(strcmp(argv[i],"-v")==0){
+	    LOGGER_SET_LEVEL(LOGGER_LEVEL_INFO);
+	}else{
+	    query_usage(argv[0]);
+	    return -1;
+	}
+    }
+    if(dir == NULL || serialStr == NULL || parse_hex_bytes(serialStr, serial, sizeof(serial)) < 0){
+	query_usage(argv[0]);
+	return -1;
+    }
+    if(!have_from)
+	from = to > 86400 ? to - 86400 : 0;
+
+    if(kind != NULL)
+	snprintf(name, sizeof(name), "%u-%s", sma_get_u32(serial), kind);
+    else
+	snprintf(name, sizeof(name), "%u", sma_get_u32(serial));
+    if(store_open(&st, dir, name, 0, 0) < 0)
+	return -1;
+    if(out.json)
+	printf("[");
+    else
+	printf("time,readings,min_w,max_w,avg_w,wh\n");
+    tier = store_query(&st, from, to, step, display_step, &out);
+    if(out.json)
+	printf("\n]\n");
+    if(tier > 0)
+	LOGGER_FMT_INFO("answered from the %us rollups", tier);
+    else
+	LOGGER_INFO("answered from the readings");
+    store_close(&st);
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
     LOGGER_SET_LEVEL(LOGGER_LEVEL_ERROR);
 
-    // pointer to config file
-    FILE *fp;
+    // subcommands
+    if(argc > 1 && strcmp(argv[1],"query")==0)
+	return run_query(argc, argv);
 
-    // buffer for reading character from socket
-    // XXX and possibly other stuff
-    unsigned char buf[1024];
-    // Received bytes unescaped and are stored here
-    unsigned char received[1024];
+    // the compiled script
+    script_prog_t prog;
+    // the session with the inverter
+    sb_session_t session;
+    trace_t *trace = NULL;
+    char *metricsAddr = NULL;
+    //! shared memory segment to publish the values in, or to read them from with shm_read set
+    char *shmName = NULL;
+    int shm_read_flag = 0;
+    //! where the readings are uploaded to, NULL if they're not, and the spool file
+    char *uploadURL = NULL;
+    char *spoolFName = UPLOAD_SPOOL_DEFAULT;
+    int uploadFormat = UPLOAD_FORMAT_FORM;
     int i;
-    int ret,found=0;
 
     //! bluetooth address of inverter as string. eg 00:80:25:A6:77:60
     char sbAddrStr[18]={'\x0'};
     //! serial number of inverter as hex string. eg sn: 2130248863 -> 7e:f9:04:9f
     char sbSerialStr[18]={'\x0'};
     
-    char line[400];
-
     //! bluetooth address of the inverter in binary
-    char sb_bt_addr[6] = { 0 };
-    //! our bluetooth address in binary
-    char our_bt_addr[6] = { 0 };
+    unsigned char sb_bt_addr[6] = { 0 };
     //! inverter serial number - converted to sequence of hex bytes
-    char serial[4] = { 0 };
+    unsigned char serial[4] = { 0 };
+
+    //! flag to indicate that we are to keep polling rather than exit after the first reading
+    int daemon_flag = 0;
+    //! seconds between polls in daemon mode, the longest with -adaptive, and the shortest, 0 if not adaptive
+    unsigned interval = 60;
+    unsigned min_interval = 0;
+    //! when to poll in daemon mode
+    sched_t sched;
+    //! latitude,longitude of the inverters, NULL to poll them at night too
+    char *location = NULL;
+
+    //! the connection to the inverter
+    transport_t transport;
+    //! host:port of bluetooth to IP bridge, NULL to connect directly
+    char *tcpAddr = NULL;
+    //! recorded session to be replayed, NULL to connect to the inverter
+    char *replayFName = NULL;
+    int replay_fast = 0;
+    //! file to record the session to, NULL if not recording
+    char *recordFName = NULL;
+    //! file listing the inverters to be read at once, NULL to read the one given by -address
+    char *invFName = NULL;
+    //! flag to indicate that every inverter in the net of the one connected to is to be read
+    int net_flag = 0;
+    //! archive to be downloaded, 0 to read the current values
+    uint32_t archive_cmd = 0;
+    //! start of the archive download, 0 to carry on from the cursor
+    uint32_t archive_from = 0;
+    //! file holding the archive cursor, NULL for the default
+    char *cursorFName = NULL;
    
-    char *lineread;
-    char tt[10] = {48,48,48,48,48,48,48,48,48,48}; 
-    char ti[3];	
-    char pac[2];
-    char tot[2];
-
-    // bluetooth channel as returned from the sb
-    char chan[1];
-    char rowres[10];
-    int rr;
-
-    // current power being produced
-    int currentpower;
-    // day's total energy produced
-    float dtotal;
-
-    // zero the buffer
-    memset(buf,0,1024);
-    // zero received buffer
-    memset(received,0,1024);
-    
     // process command line arguments
     for (i=1;i<argc;i++){
 	// inverter bt address XX:XX:XX:XX:XX:XX
 	if (strcmp(argv[i],"-address")==0){
 	    i++;
-	    if (i<argc){
+	    if (i<argc && strlen(argv[i])<sizeof(sbAddrStr)){
 		strcpy(sbAddrStr,argv[i]);
 	    }else{
 		usage(argv[0]);
@@ -217,7 +910,7 @@ int main(int argc, char **argv)
 	// inverter serial number as hex digits XX:XX:XX:XX
 	if (strcmp(argv[i],"-serial")==0){
 	    i++;
-	    if (i<argc){
+	    if (i<argc && strlen(argv[i])<sizeof(sbSerialStr)){
 		strcpy(sbSerialStr,argv[i]);
 	    }else{
 		usage(argv[0]);
@@ -232,6 +925,16 @@ int main(int argc, char **argv)
 	if (strcmp(argv[i],"-vv")==0){
 	    LOGGER_SET_LEVEL(LOGGER_LEVEL_DEBUG);
 	}
+	// list of inverters
+	if(strcmp(argv[i],"-inverters")==0){
+	    i++;
+	    if(i<argc){
+		invFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
 	// script file
 	if(strcmp(argv[i],"-script")==0){
 	    i++;
@@ -251,6 +954,217 @@ int main(int argc, char **argv)
 	if (strcmp(argv[i],"-b")==0){
 	    display_flag=DISPLAY_BOTH;
 	}
+	// display every value
+	if (strcmp(argv[i],"-all")==0){
+	    display_flag=DISPLAY_ALL;
+	}
+	// every inverter in the net
+	if (strcmp(argv[i],"-net")==0){
+	    net_flag=1;
+	}
+	// requests sent before waiting for replies, with -all
+	if (strcmp(argv[i],"-pipeline")==0){
+	    i++;
+	    if(i<argc && atoi(argv[i])>0 && atoi(argv[i])<=SESSION_MAX_PENDING){
+		pipelineDepth=atoi(argv[i]);
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// wait before a request is sent again
+	if (strcmp(argv[i],"-resend")==0){
+	    i++;
+	    if(i<argc && atoi(argv[i])>=0){
+		resendMs=atoi(argv[i]);
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// keep polling
+	if (strcmp(argv[i],"-daemon")==0){
+	    daemon_flag=1;
+	}
+	// seconds between polls
+	if (strcmp(argv[i],"-interval")==0){
+	    i++;
+	    if(i<argc && atoi(argv[i])>0){
+		interval=atoi(argv[i]);
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// poll as often as every so many seconds while the power is changing
+	if (strcmp(argv[i],"-adaptive")==0){
+	    i++;
+	    if(i<argc && atoi(argv[i])>0){
+		min_interval=atoi(argv[i]);
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// don't poll at night
+	if (strcmp(argv[i],"-location")==0){
+	    i++;
+	    if(i<argc){
+		location=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// transport
+	if (strcmp(argv[i],"-tcp")==0){
+	    i++;
+	    if(i<argc && strlen(argv[i])<TRANSPORT_ADDR_MAX){
+		tcpAddr=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if (strcmp(argv[i],"-replay")==0){
+	    i++;
+	    if(i<argc && strlen(argv[i])<TRANSPORT_ADDR_MAX){
+		replayFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if (strcmp(argv[i],"-replay-fast")==0){
+	    replay_fast=1;
+	}
+	if (strcmp(argv[i],"-record")==0){
+	    i++;
+	    if(i<argc){
+		recordFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// store of readings
+	if (strcmp(argv[i],"-store")==0){
+	    i++;
+	    if(i<argc){
+		storeDir=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if (strcmp(argv[i],"-store-budget")==0){
+	    i++;
+	    if(i<argc && atoi(argv[i])>0){
+		storeBudget=(size_t)atoi(argv[i])*1024;
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// archive download
+	if (strcmp(argv[i],"-archive")==0){
+	    i++;
+	    if(i<argc && strcmp(argv[i],"day")==0){
+		archive_cmd=SMA_CMD_ARCHIVE_DAY;
+	    }else if(i<argc && strcmp(argv[i],"month")==0){
+		archive_cmd=SMA_CMD_ARCHIVE_MONTH;
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if (strcmp(argv[i],"-from")==0){
+	    i++;
+	    if(i>=argc || parse_time(argv[i], &archive_from) < 0){
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if (strcmp(argv[i],"-cursor")==0){
+	    i++;
+	    if(i<argc){
+		cursorFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// trace the steps of each session
+	if(strcmp(argv[i],"-trace")==0){
+	    i++;
+	    if(i<argc && strcmp(argv[i],"run")==0){
+		traceShow=TRACE_SHOW_RUNS;
+	    }else if(i<argc && strcmp(argv[i],"hist")==0){
+		traceShow=TRACE_SHOW_HIST;
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// serve metrics
+	if(strcmp(argv[i],"-metrics")==0){
+	    i++;
+	    if(i<argc){
+		metricsAddr=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// publish the values in shared memory, or read those published
+	if(strcmp(argv[i],"-shm")==0 || strcmp(argv[i],"-shm-read")==0){
+	    shm_read_flag=strcmp(argv[i],"-shm-read")==0;
+	    shmName=SHM_NAME_DEFAULT;
+	    if(i+1<argc && argv[i+1][0]=='/')
+		shmName=argv[++i];
+	}
+	// session cache
+	if(strcmp(argv[i],"-cache")==0){
+	    i++;
+	    if(i<argc){
+		cacheFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// upload the readings
+	if(strcmp(argv[i],"-upload")==0){
+	    i++;
+	    if(i<argc){
+		uploadURL=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	if(strcmp(argv[i],"-upload-format")==0){
+	    i++;
+	    if(i<argc && (strcmp(argv[i],"form")==0 || strcmp(argv[i],"lines")==0)){
+		uploadFormat=strcmp(argv[i],"lines")==0 ? UPLOAD_FORMAT_LINES : UPLOAD_FORMAT_FORM;
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
+	// show the memory used
+	if(strcmp(argv[i],"-mem")==0){
+	    memShow=1;
+	}
+	if(strcmp(argv[i],"-spool")==0){
+	    i++;
+	    if(i<argc){
+		spoolFName=argv[i];
+	    }else{
+		usage(argv[0]);
+		return(-1);
+	    }
+	}
 	// help/usage
 	if(strcmp(argv[i],"-h")==0){
 	    i++;
@@ -260,6 +1174,111 @@ int main(int argc, char **argv)
 	    }
 	}
     }
+    // reading the values published by another sbread needs no connection
+    if(shm_read_flag)
+	return run_shm_read(shmName, sbSerialStr[0]!='\x0' ? sbSerialStr : NULL);
+    // from here on the log of a daemon or of many inverters is written from a background thread, so
+    // as not to hold up the reads
+    if(daemon_flag || net_flag || invFName != NULL)
+	logger_async_start();
+    // the trace histograms and the memory used are shown on SIGUSR1, the daemon never reaching the end
+    if((traceShow || memShow) && daemon_flag)
+	signal(SIGUSR1, report_signal);
+    // a daemon stops on SIGTERM or SIGINT, cutting short its sleep, and exits as at the end of a run so
+    // that the log, stores and spool are flushed
+    if(daemon_flag){
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+    }
+    // so is the schedule
+    if((min_interval || location != NULL) && (!daemon_flag || archive_cmd)){
+	usage(argv[0]);
+	return(-1);
+    }
+    sched_init(&sched, min_interval ? min_interval : interval, interval);
+    if(location != NULL && sched_set_location(&sched, location) < 0){
+	LOGGER_FMT_ERROR("Expecting -location latitude,longitude in degrees, eg -33.87,151.21, not %s", location);
+	return -1;
+    }
+    // the metrics are only of use to a daemon, being served between polls
+    if(metricsAddr != NULL){
+	if(!daemon_flag || archive_cmd){
+	    usage(argv[0]);
+	    return(-1);
+	}
+	if((metrics = arena_alloc(sizeof(*metrics))) == NULL || metrics_start(metrics, metricsAddr) < 0){
+	    LOGGER_FMT_ERROR("Could not serve metrics on %s", metricsAddr);
+	    return -1;
+	}
+    }
+    // as are the values published in shared memory, being the latest
+    if(shmName != NULL){
+	if(!daemon_flag || archive_cmd){
+	    usage(argv[0]);
+	    return(-1);
+	}
+	if((shm = arena_alloc(sizeof(*shm))) == NULL || shm_create(shm, shmName) < 0){
+	    LOGGER_FMT_ERROR("Could not publish the values in %s: %s", shmName,
+			     errno == EWOULDBLOCK ? "another sbread is publishing in it" : strerror(errno));
+	    return -1;
+	}
+    }
+    // the readings are spooled, and in daemon mode sent from a background thread as they're read
+    if(uploadURL != NULL){
+	if(archive_cmd){
+	    usage(argv[0]);
+	    return(-1);
+	}
+	if((uploader = arena_alloc(sizeof(*uploader))) == NULL || upload_open(uploader, uploadURL, spoolFName, 0, uploadFormat) < 0){
+	    LOGGER_FMT_ERROR("Could not upload the readings to %s", uploadURL);
+	    return -1;
+	}
+	if(daemon_flag && upload_start(uploader) < 0)
+	    return -1;
+    }
+
+    // read many inverters at once, each over its own rfcomm connection
+    if(invFName != NULL){
+	sweep_inverter_t *inv;
+	int n, ret;
+	if(tcpAddr != NULL || replayFName != NULL || recordFName != NULL || archive_cmd || cacheFName != NULL){
+	    usage(argv[0]);
+	    return(-1);
+	}
+	LOGGER_FMT_INFO("Reading script from:     %s", scriptFName);
+	if(script_load(scriptFName, &prog) < 0){
+	    return -1;
+	}
+	if((inv = read_inverters(invFName, &prog, net_flag, &n)) == NULL){
+	    script_free(&prog);
+	    return -1;
+	}
+	if(traceShow){
+	    if((trace = arena_alloc(n * sizeof(*trace))) == NULL){
+		LOGGER_ERROR("out of memory");
+		arena_free(inv);
+		script_free(&prog);
+		return -1;
+	    }
+	    for(i=0;i<n;i++){
+		trace_init(&trace[i]);
+		inv[i].s.trace = &trace[i];
+	    }
+	}
+	if(alloc_stores(n * (net_flag ? SESSION_MAX_NODES : 1)) < 0)
+	    return -1;
+	// all that is kept has been allocated, from here on nothing more is
+	arena_seal();
+	ret = run_sweep(inv, n, daemon_flag, &sched);
+	arena_free(trace);
+	arena_free(inv);
+	script_free(&prog);
+	return ret;
+    }
 
     // check that required parameters were present, or show usage and exit
     if(sbAddrStr[0]=='\x0' || sbSerialStr[0]=='\x0'){
@@ -270,266 +1289,110 @@ int main(int argc, char **argv)
     LOGGER_FMT_INFO("Inverter address:       %s",sbAddrStr);
     LOGGER_FMT_INFO("Inverter serial number: %s",sbSerialStr);
 
-    // open the config file
+    // convert address - note that inverter protocol uses LSB first
+    if(parse_hex_bytes(sbAddrStr, sb_bt_addr, sizeof(sb_bt_addr)) < 0 ||
+       parse_hex_bytes(sbSerialStr, serial, sizeof(serial)) < 0){
+	usage(argv[0]);
+	return(-1);
+    }
+#ifdef SB_NO_BLUETOOTH
+    if(tcpAddr == NULL && replayFName == NULL){
+	LOGGER_ERROR("Built without bluetooth, the inverter can only be read with -tcp or -replay");
+	return -1;
+    }
+#endif
+
+    // load the compiled script, compiling it if need be
     LOGGER_FMT_INFO("Reading script from:     %s", scriptFName);
-    if( (fp=fopen(scriptFName,"r"))==NULL){
-	LOGGER_FMT_ERROR("Could not open script file: %s: %s\n",scriptFName,strerror(errno));
+    if(script_load(scriptFName, &prog) < 0){
 	return -1;
     }
-   
-    // -----------------------------------------------------------------
-    // setup socket
-    struct sockaddr_rc addr = { 0 };
-    int sb_sock;
-    
-    sb_sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-    // set the connection parameters (who to connect to)
-    addr.rc_family = AF_BLUETOOTH;
-    addr.rc_channel = (uint8_t) 1;
-    str2ba( sbAddrStr, &addr.rc_bdaddr );
-    // connect to server
-    if ( connect(sb_sock, (struct sockaddr *)&addr, sizeof(addr)) <0){
-	printf("Error connecting to %s\n",sbAddrStr);
+    if(replayFName != NULL)
+	transport_init_replay(&transport, replayFName, replay_fast);
+#ifndef SB_NO_BLUETOOTH
+    else if(tcpAddr == NULL)
+	transport_init_rfcomm(&transport, sbAddrStr);
+#endif
+    else
+	transport_init_tcp(&transport, tcpAddr);
+    if(recordFName != NULL && transport_record(&transport, recordFName) < 0){
 	return -1;
     }
-    
-    // set up socket for select with timeout
-    struct timeval tv;
-    fd_set readfds;
-    
-    tv.tv_sec = sb_sock_read_timeout_sec; // set timeout of reading to 5 seconds
-    tv.tv_usec = 0;
-    FD_ZERO(&readfds);
-    FD_SET(sb_sock, &readfds);
-    // -----------------------------------------------------------------
-    
-    // convert address - note that inverter protocol uses LSB first
-    sb_bt_addr[5] = conv(strtok(sbAddrStr,":"));
-    sb_bt_addr[4] = conv(strtok(NULL,":"));
-    sb_bt_addr[3] = conv(strtok(NULL,":"));
-    sb_bt_addr[2] = conv(strtok(NULL,":"));
-    sb_bt_addr[1] = conv(strtok(NULL,":"));
-    sb_bt_addr[0] = conv(strtok(NULL,":"));
-    
-    // convert serial
-    serial[3] = conv(strtok(sbSerialStr,":"));
-    serial[2] = conv(strtok(NULL,":"));
-    serial[1] = conv(strtok(NULL,":"));
-    serial[0] = conv(strtok(NULL,":"));
-
-    // Count of the script file line number being processed
-    unsigned script_line_num=0;
-    // flag used to indicate to script loop that further processiing is not required
-    char done_flag=0;
-
-    // loop thru script file
-    while (!done_flag && !feof(fp)){
-	script_line_num++;
-	//read line from script file
-	if (fgets(line,400,fp) != NULL){
-	   LOGGER_FMT_DEBUG("script[%u] '%s'", script_line_num, line);
-
-	   lineread = strtok(line," ;");
-	   if(!strcmp(lineread,"R")){		// The script file R indicates that we are to wait to receive data from sb
-	       
-	       cc = 0; // char count
-	       do{
-		   // read line data from script file, and make up data in fl, being the data that
-		   // we are expecting to receive from sb
-		   lineread = strtok(NULL," ;");
-		   switch(select_str(lineread)) {
-		       case 0: // $END
-			   //do nothing
-			   break;			
-		       case 1: // $ADDR
-			   for (i=0;i<6;i++){
-			       fl[cc] = sb_bt_addr[i];
-			       cc++;
-			   }
-			   break;	
-		       case 7: // $ADD2
-			   for (i=0;i<6;i++){
-			       fl[cc] = our_bt_addr[i];
-			       cc++;
-			   }
-			   break;	
-		       case 3: // $SER
-			   for (i=0;i<4;i++){
-			       fl[cc] = serial[i];
-			       cc++;
-			   }
-			   break;	
-		       case 8: // $CHAN
-			   fl[cc] = chan[0];
-			   cc++;
-			   break;
-		       default :
-			   fl[cc] = conv(lineread);
-			   cc++;
-		   }
-	       } while (strcmp(lineread,"$END"));
-
-	       // fl now contains the data that we are expecting to receive from sb, and cc is the number of 
-	       // characters inf fl
-	       log_data_debug("waiting for: ",fl,cc);
-	       LOGGER_FMT_DEBUG("matching on %i chars",cc);
-	       found = 0;
-
-	       do {
-		   // read from socket or timeout
-		   int bytes_read=0;
-		   memset(received,0,sizeof(received) );
-
-		   select(sb_sock+1, &readfds, NULL, NULL, &tv);
-		   if (FD_ISSET(sb_sock, &readfds)){   
-		       // data is available to be read from socket
-		       if( (bytes_read = recv(sb_sock, buf, sizeof(buf), 0))==-1){
-			   // error reading
-			   LOGGER_FMT_ERROR("Could not read from socket: %s\n",strerror(errno));
-			   return -1;
-		       }
-		       LOGGER_FMT_DEBUG("received %i bytes", bytes_read);
-		       log_data_debug("received:    ", buf, bytes_read);
-		   } else {
-		       LOGGER_ERROR("Timeout reading bluetooth socket");
-		       return -1;
-		   }
-		   if ( bytes_read > 0){
-		       // copy and unescape the data read from socket in buf[] into received[]
-		       rr = 0; // count of number of bytes copied into received[]
-		       for (i=0;i<bytes_read;i++){ //start copy the rec buffer in to received
-			   if (buf[i] == 0x7d){ //did we receive the escape char
-			       switch (buf[i+1]){   // act depending on the char after the escape char
-				   case 0x5e :
-				       received[rr] = 0x7e;
-				       break;
-				   case 0x5d :
-				       received[rr] = 0x7d;
-				       break;
-				   default :
-				       received[rr] = buf[i+1] ^ 0x20;
-				       break;
-			       }
-			       i++;
-			   } else  {
-			       received[rr] = buf[i];
-			   }
-			   rr++;
-		       }
-		   }	
-		   // check to see if received data matches the data that we are waiting form
-		   if (memcmp(fl,received,cc) == 0){
-		       found = 1;
-		       LOGGER_DEBUG("found");
-		   }
-	       }while (found == 0);
-	   }
-	   // send the data read from the script file to sb
-	   if(!strcmp(lineread,"S")){		//See if line is something we need to send
-	       cc = 0;
-	       do{
-		   time_t curtime;
-		   lineread = strtok(NULL," ;");
-		   switch(select_str(lineread)) {
-		       case 0: // $END
-			   //do nothing
-			   break;			
-		       case 1: // $ADDR
-			   for (i=0;i<6;i++){
-			       fl[cc] = sb_bt_addr[i];
-			       cc++;
-			   }
-			   break;
-		       case 7: // $ADD2
-			   for (i=0;i<6;i++){
-			       fl[cc] = our_bt_addr[i];
-			       cc++;
-			   }
-			   break;
-		       case 2: // $TIME	
-			   // get unix time and convert
-			   curtime= time(NULL);  //get time in seconds since epoch (1/1/1970)	
-			   sprintf(tt,"%X",(int)curtime); //convert to a hex in a string
-			   for (i=9;i>0;i=i-2){ //change order and convert to integer
-			       ti[1] = tt[i];
-			       ti[0] = tt[i-1];	
-			       ti[2] = 0;
-			       fl[cc] = conv(ti);
-			       cc++;		
-			   }
-			   break;
-		       case 4: //$crc
-			   tryfcs16(fl+19, cc -19);
-			   break;
-		       case 8: // $CHAN
-			   fl[cc] = chan[0];
-			   cc++;
-			   break;
-		       default :
-			   fl[cc] = conv(lineread);
-			   cc++;
-		   }
-	       } while (strcmp(lineread,"$END"));
-	       log_data_debug("send ", fl,cc);
-	       // write data to socket
-	       if(write(sb_sock,fl,cc)==-1){
-		   LOGGER_FMT_ERROR("Could not write to socket: %s\n",strerror(errno));
-		   return -1;
-	       }
-	   }
-	   
-	   if(!strcmp(lineread,"E")){		//See if line is something we need to extract
-	       LOGGER_DEBUG("Extracting");
-	       cc = 0;
-	       do{
-		   lineread = strtok(NULL," ;");
-		   switch(select_str(lineread)) {
-		       case 5: // extract current power
-			   memcpy(pac,received+67,2);
-			   currentpower = (pac[1] * 256) + pac[0];
-			   LOGGER_FMT_INFO("power (W): %i",currentpower);
-			   // -b or -d flag was not specified (ie only power is required), then our work is done
-			   if(display_flag==DISPLAY_POWER){
-			       done_flag=1;
-			   }
-			   break;
-		       case 6: // extract total energy collected today
-			   memcpy(tot,received+83,2);
-			   dtotal = (tot[1] * 256) + tot[0];
-			   dtotal = dtotal / 1000;
-			   LOGGER_FMT_INFO("energy_today (kWh): %.2f",dtotal);
-			   break;		
-		       case 7: // extract 2nd address, ie our address
-			   memcpy(our_bt_addr,received+26,6);
-			   LOGGER_INFO("got our bt address: ");
-			   break;
-		       case 8: // extract bluetooth channel
-			   memcpy(chan,received+22,1);
-			   LOGGER_FMT_INFO("bluetooth channel: %i",chan[0]);
-			   break;
-		   }				
-	       } while (strcmp(lineread,"$END"));
-	   } 
-
-	} else 	{
-	    // there was an error reading line from script file
-	    LOGGER_FMT_ERROR("Failed to read line from script file at line %u", script_line_num);
+    session_init(&session, &transport, sb_bt_addr, serial, &prog);
+    session.net = net_flag;
+    session.display = display_flag;
+    session.pipeline_depth = pipelineDepth;
+    session.resend_ms = resendMs;
+    if(cacheFName != NULL)
+	session_cache_load(&session, cacheFName);
+    if(traceShow){
+	if((trace = arena_alloc(sizeof(*trace))) == NULL){
+	    LOGGER_ERROR("out of memory");
+	    script_free(&prog);
+	    return -1;
 	}
+	trace_init(trace);
+	session.trace = trace;
     }
-   
+
+    if(archive_cmd){
+	archive_t *a;
+	int ret;
+	if(net_flag || daemon_flag){
+	    usage(argv[0]);
+	    return(-1);
+	}
+	if((a = arena_alloc(sizeof(*a))) == NULL){
+	    LOGGER_ERROR("out of memory");
+	    return -1;
+	}
+	arena_seal();
+	ret = run_archive(&session, a, archive_cmd, archive_from, cursorFName);
+	arena_free(a);
+	script_free(&prog);
+	return ret;
+    }
+    if(alloc_stores(net_flag ? SESSION_MAX_NODES : 1) < 0)
+	return -1;
+    arena_seal();
+
+    if(daemon_flag){
+	if(prog.hdr->query_start == prog.hdr->n_ops && display_flag != DISPLAY_ALL && !net_flag){
+	    LOGGER_FMT_ERROR("script %s has no query section, ie no E $POW or E $DTOT lines", scriptFName);
+	    return -1;
+	}
+	run_daemon(&session, &sched);
+	close_stores();
+	close_upload();
+	mem_show(1);
+	script_free(&prog);
+	return 0;
+    }
+
+    trace_start(&session);
+    if(session_connect(&session) < 0 || session_logon_and_query(&session) < 0){
+	trace_show(&session, NULL, 1);
+	session_close(&session);
+	// the readings of earlier runs may still be sent
+	close_upload();
+	mem_show(1);
+	script_free(&prog);
+	return -1;
+    }
+    trace_show(&session, NULL, 1);
+    cache_session(&session);
     // display results
-    if(display_flag== DISPLAY_BOTH)
-	printf("%i,%.2f\n",currentpower,dtotal);
-    else if(display_flag== DISPLAY_POWER)
-	printf("%i\n",currentpower);
-    else if(display_flag== DISPLAY_ENERGY)
-	printf("%.2f\n",dtotal);
+    display_session(&session);
+    store_session(&session);
+    upload_session(&session);
+    close_stores();
+    close_upload();
+    mem_show(1);
 
-   // close script file
-   fclose(fp);
+   // release the compiled script
+   script_free(&prog);
 
    // close socket
-   close(sb_sock);
+   session_close(&session);
    return 0;
 }
-
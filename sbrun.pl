@@ -3,7 +3,12 @@
 # Copyright Stephen Stebbing 2014.
 #
 # This script runs the sbread utility to read the power data from a sunnyboy 
-# solar inverter and then uses the curl utility to submit the data to a webserver.
+# solar inverter and submit the data to a webserver.
+#
+# sbread spools each reading to $spoolFile and POSTs it to $powerURL, along
+# with any readings left in the spool by earlier runs while the webserver
+# couldn't be reached. Each reading is POSTed as form data with its power,
+# eg powernow=3077, as report.php expects.
 #
 # Please ensure that the address and serial number for the inverter are set
 # in the config section below. 
@@ -11,8 +16,15 @@
 # serial number to the required hex string.
 #
 # Note that sometimes the sbread script fails (suspected due to low bluetooth
-# signal strength). This script attempts to run sbread $retries number of times
-# before failing.
+# signal strength). sbread sends a request again when its reply is lost, and
+# reconnects should the link die part way through, so is only run again, up to
+# $retries times, when it can't set up the link at all.
+#
+# Rather than running this from cron, sbread can be left running as a daemon,
+# which retries by itself and can also poll faster while the power is changing
+# and not at all at night, eg
+#   sbread -address ... -serial ... -b -upload $powerURL -spool $spoolFile \
+#     -daemon -interval 300 -adaptive 15 -location -33.87,151.21
 #
 # On success, 0 is returned. On failure a message is written and return
 # value is non-zero
@@ -28,39 +40,25 @@ my $sbSerial='7E:F9:04:9F';
 my $powerURL="http://ss.com/solar/report.php";
 # ------------------------------------------------------------------------
 # config - generally doesn't need to change
-# path to the curl utility
-my $curlUtil='/usr/bin/curl';
+# readings not yet sent are kept here, put it on flash to keep them across reboots
+my $spoolFile='/tmp/sbread.spool';
 # path to the sbread utility
 my $sbreadUtil='/usr/local/bin/sbread';
 # number of retries to get a valid response from sbread
-my $retries=6;
+my $retries=3;
 # number of seconds to delay between retries
 my $retryDelaySec=5;
 # ------------------------------------------------------------------------
-my $sbreadCmd="$sbreadUtil -address $sbAddr -serial $sbSerial -b";
-# curl command for sending power report, this is run thru sprintf to set the power value
-my $curlCmd="$curlUtil --data \"powernow=%d\" $powerURL";
-
-
-sub sendPowerData($)
-{
-  my $cc=sprintf($curlCmd,shift);
-  system($cc);
-  if($? != 0){
-    die "Curl failed: $cc";
-  }
-}
+my $sbreadCmd="$sbreadUtil -address $sbAddr -serial $sbSerial -b -upload $powerURL -spool $spoolFile";
 
 
 # try to run sbread up to $retries times
 for(my $i=0; $i<$retries; ++$i){
 #  print "trying $i...\n";
-  my $reading=`$sbreadCmd`;
+  # the reading is uploaded by sbread, or kept for the next run if it can't be
+  `$sbreadCmd`;
   if($?==0){
     # success
-    # reading is eg '1234,3.4' being power, energy-today
-    $reading =~ s/,.*$//;
-    sendPowerData($reading);
     exit 0;
   }
   sleep($retryDelaySec);
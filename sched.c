@@ -0,0 +1,135 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// When to poll in daemon mode, see sched.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "sched.h"
+
+//! seconds in a day, and the shift of local mean solar time from UTC a degree of longitude makes
+#define SCHED_DAY_SEC 86400
+#define SCHED_DEG_SEC 240
+//! zenith of the sun's centre at sunrise and sunset, allowing for refraction and the size of its disc
+#define SCHED_ZENITH  90.833
+#define SCHED_RAD(deg) ((deg) * M_PI / 180)
+
+void sched_init(sched_t *sc, unsigned min_sec, unsigned max_sec)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->min_sec = min_sec;
+    sc->max_sec = max_sec > min_sec ? max_sec : min_sec;
+    sc->interval = sc->min_sec;
+    sc->last_power = -1;
+    sc->seed = time(NULL) ^ getpid();
+}
+
+int sched_set_location(sched_t *sc, const char *lat_lon)
+{
+    double lat, lon;
+    char end;
+
+    if (sscanf(lat_lon, "%lf,%lf%c", &lat, &lon, &end) != 2 || lat < -90 || lat > 90 || lon < -180 || lon > 180)
+	return -1;
+    sc->lat = lat;
+    sc->lon = lon;
+    sc->located = 1;
+    return 0;
+}
+
+int sched_sun(double lat, double lon, time_t t, time_t *rise, time_t *set)
+{
+    // the day by local mean solar time, which starts at UTC midnight less the longitude's shift
+    time_t day = t + (time_t)(lon * SCHED_DEG_SEC);
+    time_t midnight = day - day % SCHED_DAY_SEC;
+    struct tm tm;
+    double g, eqtime, decl, phi, c, ha;
+
+    gmtime_r(&midnight, &tm);
+    // fractional year at noon, radians
+    g = 2 * M_PI / 365 * tm.tm_yday;
+    // equation of time, minutes, and the sun's declination, radians
+    eqtime = 229.18 * (0.000075 + 0.001868 * cos(g) - 0.032077 * sin(g) - 0.014615 * cos(2 * g) - 0.040849 * sin(2 * g));
+    decl = 0.006918 - 0.399912 * cos(g) + 0.070257 * sin(g) - 0.006758 * cos(2 * g) + 0.000907 * sin(2 * g) -
+	0.002697 * cos(3 * g) + 0.00148 * sin(3 * g);
+    // the sun's hour angle at sunrise
+    phi = SCHED_RAD(lat);
+    c = cos(SCHED_RAD(SCHED_ZENITH)) / (cos(phi) * cos(decl)) - tan(phi) * tan(decl);
+    if (c > 1)
+	return -1;
+    if (c < -1)
+	return 1;
+    ha = acos(c) * 180 / M_PI;
+    // in minutes from UTC midnight, which may fall the day before or after
+    *rise = midnight + (time_t)((720 - 4 * (lon + ha) - eqtime) * 60);
+    *set = midnight + (time_t)((720 - 4 * (lon - ha) - eqtime) * 60);
+    return 0;
+}
+
+unsigned sched_asleep(const sched_t *sc, time_t t)
+{
+    time_t rise, set, next = t;
+    int i, ret;
+
+    if (!sc->located)
+	return 0;
+    // today, then the following days until the sun rises, as it may not in the polar night
+    for (i = 0; i < 366; i++, next += SCHED_DAY_SEC){
+	if ((ret = sched_sun(sc->lat, sc->lon, next, &rise, &set)) > 0)
+	    return i == 0 ? 0 : next - t;
+	if (ret < 0)
+	    continue;
+	rise -= SCHED_TWILIGHT_SEC;
+	set += SCHED_TWILIGHT_SEC;
+	if (t < rise)
+	    return rise - t;
+	if (t <= set)
+	    return 0;
+    }
+    return 0;
+}
+
+unsigned sched_next(sched_t *sc, time_t now, int ok, int32_t power)
+{
+    unsigned wait, asleep;
+
+    if (!ok){
+	// back off, cutting the wait by up to half at random
+	wait = SCHED_RETRY_MIN_SEC << (sc->failures < 16 ? sc->failures : 16);
+	if (wait > sc->max_sec)
+	    wait = sc->max_sec;
+	wait -= rand_r(&sc->seed) % (wait / 2 + 1);
+	sc->failures++;
+    } else {
+	int32_t change = abs(power - sc->last_power);
+	int32_t steady = sc->last_power * SCHED_CHANGE_PCT / 100;
+	if (steady < SCHED_CHANGE_W)
+	    steady = SCHED_CHANGE_W;
+	if (sc->last_power < 0 || change > steady)
+	    sc->interval = sc->min_sec;
+	else if ((sc->interval *= 2) > sc->max_sec)
+	    sc->interval = sc->max_sec;
+	sc->last_power = power;
+	sc->failures = 0;
+	wait = sc->interval;
+    }
+    // not at night
+    sc->dormant = 0;
+    if ((asleep = sched_asleep(sc, now + wait)) > 0){
+	LOGGER_FMT_INFO("the inverters are asleep, polling again in %u s", wait + asleep);
+	wait += asleep;
+	sc->dormant = 1;
+	sc->interval = sc->min_sec;
+	sc->last_power = -1;
+	sc->failures = 0;
+    }
+    return wait;
+}
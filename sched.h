@@ -0,0 +1,113 @@
+#ifndef SCHED_H
+#define SCHED_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// When to poll in daemon mode, for sbread -interval, -adaptive and -location.
+//
+// Polls that succeed are made every max_sec seconds, or with -adaptive as often
+// as every min_sec seconds while the AC power is changing: while it changes
+// between polls by more than SCHED_CHANGE_PCT percent, or SCHED_CHANGE_W W if
+// that's more, they're min_sec apart, and while it's steady the interval doubles
+// after each poll up to max_sec.
+//
+// After a poll fails the next is made after a wait that doubles with each
+// failure in a row, from SCHED_RETRY_MIN_SEC up to max_sec. Each wait is cut by
+// up to half at random, so that sbreads sharing the air don't retry in step.
+//
+// Given the location of the inverters no polls are made from sunset until
+// sunrise, widened by SCHED_TWILIGHT_SEC, when the inverters are asleep and
+// would only time out. The times of sunset and sunrise are worked out with the
+// NOAA's approximate equations, which are good to a minute or two away from
+// the poles.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+#include <time.h>
+
+//! change in power between polls, as a percentage of it or in W if that's more, over which it's taken to be changing
+#define SCHED_CHANGE_PCT    5
+#define SCHED_CHANGE_W      50
+//! wait after the first failure
+#define SCHED_RETRY_MIN_SEC 5
+//! seconds before sunrise and after sunset during which the polls carry on
+#define SCHED_TWILIGHT_SEC  1800
+
+typedef struct {
+    //! shortest and longest interval between polls that succeed, the same unless adaptive
+    unsigned min_sec;
+    unsigned max_sec;
+    //! flag set if the location is known, and it in degrees, north and east being positive
+    int located;
+    double lat;
+    double lon;
+    //! the interval after the last poll that succeeded
+    unsigned interval;
+    //! AC power read by the last poll that succeeded, -1 if none since waking
+    int32_t last_power;
+    //! polls that have failed in a row
+    unsigned failures;
+    //! flag set by sched_next() if the next poll has been put off until sunrise
+    int dormant;
+    //! state of the jitter's random numbers
+    unsigned seed;
+} sched_t;
+
+/**
+ * Initialise the passed schedule, with no location
+ *
+ * @param sc The schedule
+ * @param min_sec Shortest interval between polls, the same as max_sec for a fixed interval
+ * @param max_sec Longest interval between polls
+ */
+void sched_init(sched_t *sc, unsigned min_sec, unsigned max_sec);
+
+/**
+ * Set the location of the inverters, so that they're not polled at night
+ *
+ * @param sc The schedule
+ * @param lat_lon Latitude and longitude in degrees, north and east positive, eg -33.87,151.21
+ *
+ * @return 0 on success, -1 if lat_lon is not of that form
+ */
+int sched_set_location(sched_t *sc, const char *lat_lon);
+
+/**
+ * Work out how long to wait before the next poll
+ *
+ * @param sc The schedule
+ * @param now Unix time of the poll just made
+ * @param ok Flag to indicate whether the poll succeeded
+ * @param power AC power read by the poll, in total if more than one inverter was read
+ *
+ * @return Seconds from the start of the poll just made to the next, sc->dormant being set if it has
+ * been put off until sunrise
+ */
+unsigned sched_next(sched_t *sc, time_t now, int ok, int32_t power);
+
+/**
+ * Return the number of seconds until the inverters wake, ie until sunrise less SCHED_TWILIGHT_SEC,
+ * if they're asleep at the passed time
+ *
+ * @return The seconds, 0 if they're awake or the location isn't known
+ */
+unsigned sched_asleep(const sched_t *sc, time_t t);
+
+/**
+ * Work out the times of sunrise and sunset on the day at the passed place, by local solar time,
+ * that the passed time falls in
+ *
+ * @param lat Latitude in degrees, north positive
+ * @param lon Longitude in degrees, east positive
+ * @param t Unix time
+ * @param rise Set to the unix time of sunrise
+ * @param set Set to the unix time of sunset
+ *
+ * @return 0 on success, 1 if the sun doesn't set that day, -1 if it doesn't rise, in which cases
+ * rise and set are not set
+ */
+int sched_sun(double lat, double lon, time_t t, time_t *rise, time_t *set);
+
+#endif
@@ -0,0 +1,475 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Compiler for the sbread script file, see script.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "script.h"
+
+//! These are the 'macro' strings that may be contained in the script file, indexed by SCRIPT_EL_xxx
+static const char *accepted_strings[] = {
+"$END",
+"$ADDR",
+"$TIME",
+"$SER",
+"$CRC",
+"$POW",
+"$DTOT",
+"$ADD2",
+"$CHAN"
+};
+
+//! offset and length within the received frame of the fields that E lines may extract, indexed by SCRIPT_EL_xxx.
+//! $POW and $DTOT are looked up by object id in the data records of the reply (see sma.h), their offsets
+//! being where they are found in the replies to the queries in sbread.script
+static const struct {
+    uint16_t off;
+    uint16_t len;
+} extract_fields[] = {
+    [SCRIPT_EL_POW]  = { 67, 2 },
+    [SCRIPT_EL_DTOT] = { 83, 2 },
+    [SCRIPT_EL_ADD2] = { 26, 6 },
+    [SCRIPT_EL_CHAN] = { 22, 1 },
+};
+
+//! characters that separate the tokens of a script line
+#define SCRIPT_DELIMS " ;\t\r\n"
+
+//! value of each character as a hex digit, those that are not hex digits being left at 0
+static const unsigned char hex_val[256] = {
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15
+};
+
+int script_hex_byte(const char *s)
+{
+    if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+	return -1;
+    return (hex_val[(unsigned char)s[0]] << 4) | hex_val[(unsigned char)s[1]];
+}
+
+//! return the index of the passed string in accepted_strings[], or -1 if not there
+static int select_str(const char *s)
+{
+    size_t i;
+    for (i=0; i < sizeof(accepted_strings)/sizeof(*accepted_strings);i++)
+	if (!strcmp(s, accepted_strings[i])) return (int)i;
+    return -1;
+}
+
+//! growable arrays used while compiling
+typedef struct {
+    script_op_t *ops;
+    uint32_t n_ops;
+    //! index of the most recent S line op
+    uint32_t last_send;
+    //! index of the line op that starts the query section, or UINT32_MAX if not yet found
+    uint32_t query_start;
+    //! index of the line op that starts the logon, or UINT32_MAX if not yet found
+    uint32_t logon_start;
+    //! flag to indicate that $CHAN or $ADD2 has been extracted
+    int link_extracted;
+    //! index of the first S line op since the last R line op, UINT32_MAX if none, and flag set if it and
+    //! those after it may all be sent again
+    uint32_t group_start;
+    int group_resend;
+    uint32_t ops_size;
+    unsigned char *pool;
+    uint32_t pool_len;
+    uint32_t pool_size;
+} script_build_t;
+
+//! append an op, returning its index or -1 on failure
+static int add_op(script_build_t *b, uint8_t code, uint16_t n, uint16_t off, uint16_t line)
+{
+    if (b->n_ops == b->ops_size) {
+	uint32_t size = b->ops_size ? b->ops_size * 2 : 64;
+	script_op_t *ops = realloc(b->ops, size * sizeof(*ops));
+	if (ops == NULL)
+	    return -1;
+	b->ops = ops;
+	b->ops_size = size;
+    }
+    script_op_t *op = &b->ops[b->n_ops];
+    op->code = code;
+    op->flags = 0;
+    op->n = n;
+    op->off = off;
+    op->line = line;
+    return b->n_ops++;
+}
+
+//! append a byte to the pool, returning 0 on success or -1 on failure
+static int add_byte(script_build_t *b, unsigned char c)
+{
+    if (b->pool_len == b->pool_size) {
+	uint32_t size = b->pool_size ? b->pool_size * 2 : 1024;
+	unsigned char *pool = realloc(b->pool, size);
+	if (pool == NULL)
+	    return -1;
+	b->pool = pool;
+	b->pool_size = size;
+    }
+    b->pool[b->pool_len++] = c;
+    return 0;
+}
+
+/**
+ * Compile one R, S or E line of the script. strtok() has already returned the first token.
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+static int compile_line(script_build_t *b, uint8_t code, unsigned line_num)
+{
+    char *tok;
+    int line_idx = add_op(b, code, 0, 0, line_num);
+    // length of the frame being described by the line
+    unsigned frame_len = 0;
+    // index of the BYTES op that the next literal byte may be appended to, -1 if none
+    int run_idx = -1;
+    // the level 1 command, as far as it's given by literal bytes
+    unsigned l1_cmd = 0;
+
+    if (line_idx < 0)
+	goto nomem;
+    if (code == SCRIPT_OP_SEND)
+	b->last_send = line_idx;
+    while ((tok = strtok(NULL, SCRIPT_DELIMS)) != NULL) {
+	int m = select_str(tok);
+	if (m == SCRIPT_EL_END)
+	    break;
+	if (code == SCRIPT_OP_EXTRACT) {
+	    switch (m) {
+		case SCRIPT_EL_POW:
+		case SCRIPT_EL_DTOT:
+		    if (b->query_start == UINT32_MAX)
+			b->query_start = b->last_send;
+		    // fall through
+		case SCRIPT_EL_ADD2:
+		case SCRIPT_EL_CHAN:
+		    b->link_extracted |= m == SCRIPT_EL_ADD2 || m == SCRIPT_EL_CHAN;
+		    if (add_op(b, m, extract_fields[m].len, extract_fields[m].off, line_num) < 0)
+			goto nomem;
+		    break;
+		default:
+		    LOGGER_FMT_ERROR("script line %u: can not extract '%s'", line_num, tok);
+		    return -1;
+	    }
+	    continue;
+	}
+	if (m < 0) {
+	    // literal byte
+	    int c = script_hex_byte(tok);
+	    if (c < 0 || tok[2] != '\0') {
+		LOGGER_FMT_ERROR("script line %u: bad token '%s'", line_num, tok);
+		return -1;
+	    }
+	    if (run_idx < 0) {
+		// the offset of a run in the pool must fit in its op
+		if (b->pool_len > UINT16_MAX) {
+		    LOGGER_FMT_ERROR("script line %u: more than %u bytes in the script", line_num, UINT16_MAX);
+		    return -1;
+		}
+		if ((run_idx = add_op(b, SCRIPT_EL_BYTES, 0, b->pool_len, line_num)) < 0)
+		    goto nomem;
+	    }
+	    if (add_byte(b, c) < 0)
+		goto nomem;
+	    if (frame_len == SCRIPT_L1_CMD_OFF || frame_len == SCRIPT_L1_CMD_OFF + 1)
+		l1_cmd |= c << 8 * (frame_len - SCRIPT_L1_CMD_OFF);
+	    // the 0x7e that starts a level 2 packet, just before the crc'd data, marks the first S line of the logon
+	    if (code == SCRIPT_OP_SEND && frame_len == SCRIPT_CRC_START - 1 && c == 0x7e && b->logon_start == UINT32_MAX)
+		b->logon_start = b->link_extracted ? line_idx : 0;
+	    b->ops[run_idx].n++;
+	    frame_len++;
+	} else {
+	    unsigned len;
+	    uint16_t off = 0;
+	    switch (m) {
+		case SCRIPT_EL_ADDR:
+		case SCRIPT_EL_ADD2:
+		    len = 6;
+		    break;
+		case SCRIPT_EL_SER:
+		    len = 4;
+		    break;
+		case SCRIPT_EL_CHAN:
+		    len = 1;
+		    break;
+		case SCRIPT_EL_TIME:
+		case SCRIPT_EL_CRC:
+		    if (code != SCRIPT_OP_SEND) {
+			LOGGER_FMT_ERROR("script line %u: '%s' is only allowed in S lines", line_num, tok);
+			return -1;
+		    }
+		    if (m == SCRIPT_EL_TIME) {
+			len = SCRIPT_TIME_LEN;
+		    } else {
+			if (frame_len < SCRIPT_CRC_START) {
+			    LOGGER_FMT_ERROR("script line %u: '%s' before start of crc'd data", line_num, tok);
+			    return -1;
+			}
+			len = 2;
+			off = SCRIPT_CRC_START;
+		    }
+		    break;
+		default:
+		    LOGGER_FMT_ERROR("script line %u: '%s' is not allowed in %c lines", line_num, tok, code);
+		    return -1;
+	    }
+	    if (add_op(b, m, len, off, line_num) < 0)
+		goto nomem;
+	    run_idx = -1;
+	    frame_len += len;
+	}
+	if (frame_len > SCRIPT_FRAME_MAX) {
+	    LOGGER_FMT_ERROR("script line %u: frame longer than %u bytes", line_num, SCRIPT_FRAME_MAX);
+	    return -1;
+	}
+    }
+    if (tok == NULL) {
+	LOGGER_FMT_ERROR("script line %u: missing $END", line_num);
+	return -1;
+    }
+    b->ops[line_idx].n = b->n_ops - line_idx - 1;
+    // the requests that the next R line's frame replies to, and whether they may be sent again
+    if (code == SCRIPT_OP_SEND) {
+	if (b->group_start == UINT32_MAX) {
+	    b->group_start = line_idx;
+	    b->group_resend = 1;
+	}
+	b->group_resend &= l1_cmd == SCRIPT_L1_CMD_L2 || l1_cmd == SCRIPT_L1_CMD_QUERY;
+    } else if (code == SCRIPT_OP_RECV) {
+	if (b->group_start != UINT32_MAX && b->group_resend && b->group_start <= UINT16_MAX) {
+	    b->ops[line_idx].flags |= SCRIPT_FLAG_RESEND;
+	    b->ops[line_idx].off = b->group_start;
+	}
+	b->group_start = UINT32_MAX;
+    }
+    return 0;
+
+ nomem:
+    LOGGER_FMT_ERROR("script line %u: out of memory", line_num);
+    return -1;
+}
+
+int script_compile(const char *fname, script_prog_t *prog)
+{
+    FILE *fp;
+    struct stat st;
+    char line[SCRIPT_LINE_MAX];
+    unsigned line_num = 0;
+    script_build_t b = { .query_start = UINT32_MAX, .logon_start = UINT32_MAX, .group_start = UINT32_MAX };
+    int ret = -1;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+	LOGGER_FMT_ERROR("Could not open script file: %s: %s", fname, strerror(errno));
+	return -1;
+    }
+    if (fstat(fileno(fp), &st) < 0) {
+	LOGGER_FMT_ERROR("Could not stat script file: %s: %s", fname, strerror(errno));
+	goto done;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	char *tok;
+	line_num++;
+	LOGGER_FMT_DEBUG("script[%u] '%s'", line_num, line);
+	if ((tok = strtok(line, SCRIPT_DELIMS)) == NULL)
+	    continue;
+	if (!strcmp(tok, "R") || !strcmp(tok, "S") || !strcmp(tok, "E")) {
+	    if (compile_line(&b, tok[0], line_num) < 0)
+		goto done;
+	} else {
+	    LOGGER_FMT_DEBUG("script[%u] ignored", line_num);
+	}
+    }
+    if (ferror(fp)) {
+	LOGGER_FMT_ERROR("Failed to read line from script file at line %u", line_num + 1);
+	goto done;
+    }
+
+    // assemble header, ops and pool into the one block
+    size_t ops_len = b.n_ops * sizeof(script_op_t);
+    size_t len = sizeof(script_header_t) + ops_len + b.pool_len;
+    unsigned char *mem = malloc(len);
+    if (mem == NULL) {
+	LOGGER_ERROR("script: out of memory");
+	goto done;
+    }
+    script_header_t *hdr = (script_header_t *)mem;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SCRIPT_MAGIC;
+    hdr->version = SCRIPT_VERSION;
+    hdr->n_ops = b.n_ops;
+    hdr->pool_len = b.pool_len;
+    hdr->query_start = b.query_start == UINT32_MAX ? b.n_ops : b.query_start;
+    hdr->logon_start = b.logon_start == UINT32_MAX || b.logon_start > hdr->query_start ? 0 : b.logon_start;
+    hdr->src_mtime = st.st_mtime;
+    hdr->src_size = st.st_size;
+    memcpy(mem + sizeof(*hdr), b.ops, ops_len);
+    memcpy(mem + sizeof(*hdr) + ops_len, b.pool, b.pool_len);
+
+    prog->mem = mem;
+    prog->mem_len = len;
+    prog->mapped = 0;
+    prog->hdr = hdr;
+    prog->ops = (const script_op_t *)(mem + sizeof(*hdr));
+    prog->pool = mem + sizeof(*hdr) + ops_len;
+    LOGGER_FMT_INFO("compiled script %s: %u ops, %u literal bytes", fname, b.n_ops, b.pool_len);
+    ret = 0;
+
+ done:
+    free(b.ops);
+    free(b.pool);
+    fclose(fp);
+    return ret;
+}
+
+int script_save(const script_prog_t *prog, const char *cache_fname)
+{
+    // write to a temporary file then rename it so that a reader never sees a partial file
+    char tmp_fname[SCRIPT_LINE_MAX];
+    int fd;
+
+    if ((size_t)snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", cache_fname) >= sizeof(tmp_fname))
+	return -1;
+    if ((fd = open(tmp_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	LOGGER_FMT_WARN("Could not create script cache file: %s: %s", tmp_fname, strerror(errno));
+	return -1;
+    }
+    if (write(fd, prog->mem, prog->mem_len) != (ssize_t)prog->mem_len) {
+	LOGGER_FMT_WARN("Could not write script cache file: %s: %s", tmp_fname, strerror(errno));
+	close(fd);
+	unlink(tmp_fname);
+	return -1;
+    }
+    close(fd);
+    if (rename(tmp_fname, cache_fname) < 0) {
+	LOGGER_FMT_WARN("Could not rename script cache file: %s: %s", tmp_fname, strerror(errno));
+	unlink(tmp_fname);
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check that the passed block of memory holds a well formed program, compiled from
+ * a script file with the passed stat details, and if so set up prog to point into it.
+ *
+ * @return 0 if the program is valid, -1 otherwise
+ */
+static int script_validate(const void *mem, size_t len, const struct stat *st, script_prog_t *prog)
+{
+    const script_header_t *hdr = mem;
+    uint32_t i;
+
+    if (len < sizeof(*hdr) || hdr->magic != SCRIPT_MAGIC || hdr->version != SCRIPT_VERSION)
+	return -1;
+    if (hdr->src_mtime != st->st_mtime || hdr->src_size != st->st_size)
+	return -1;
+    if (len != sizeof(*hdr) + (size_t)hdr->n_ops * sizeof(script_op_t) + hdr->pool_len)
+	return -1;
+
+    const script_op_t *ops = (const script_op_t *)((const unsigned char *)mem + sizeof(*hdr));
+    // the query section and the logon must start at line ops
+    int query_ok = hdr->query_start == hdr->n_ops;
+    int logon_ok = hdr->logon_start == 0;
+    for (i = 0; i < hdr->n_ops; ) {
+	if (i == hdr->query_start)
+	    query_ok = 1;
+	if (i == hdr->logon_start)
+	    logon_ok = 1;
+	// every line op must be followed by its elements, and every literal run must lie within the pool
+	if (ops[i].code != SCRIPT_OP_RECV && ops[i].code != SCRIPT_OP_SEND && ops[i].code != SCRIPT_OP_EXTRACT)
+	    return -1;
+	uint32_t end = i + 1 + ops[i].n;
+	if (end > hdr->n_ops)
+	    return -1;
+	// the requests of an R line must start at an S line before it
+	if ((ops[i].flags & SCRIPT_FLAG_RESEND) && (ops[i].code != SCRIPT_OP_RECV || ops[i].off >= i ||
+						    ops[ops[i].off].code != SCRIPT_OP_SEND))
+	    return -1;
+	// length of the frame that the line describes, which must fit in the frame buffer
+	uint32_t frame_len = 0;
+	int extract = ops[i].code == SCRIPT_OP_EXTRACT;
+	for (i++; i < end; i++) {
+	    if (ops[i].code == SCRIPT_EL_BYTES && (uint32_t)ops[i].off + ops[i].n > hdr->pool_len)
+		return -1;
+	    if (extract && (uint32_t)ops[i].off + ops[i].n > SCRIPT_FRAME_MAX)
+		return -1;
+	    if (!extract && (frame_len += ops[i].n) > SCRIPT_FRAME_MAX)
+		return -1;
+	}
+    }
+    if (!query_ok || !logon_ok)
+	return -1;
+    prog->mem = (void *)mem;
+    prog->mem_len = len;
+    prog->hdr = hdr;
+    prog->ops = ops;
+    prog->pool = (const unsigned char *)(ops + hdr->n_ops);
+    return 0;
+}
+
+int script_load(const char *fname, script_prog_t *prog)
+{
+    char cache_fname[SCRIPT_LINE_MAX];
+    struct stat st, cst;
+    int fd;
+
+    if (stat(fname, &st) < 0) {
+	LOGGER_FMT_ERROR("Could not open script file: %s: %s", fname, strerror(errno));
+	return -1;
+    }
+    if ((size_t)snprintf(cache_fname, sizeof(cache_fname), "%s%s", fname, SCRIPT_CACHE_SUFFIX) >= sizeof(cache_fname))
+	return script_compile(fname, prog);
+
+    // try the cache file first
+    if ((fd = open(cache_fname, O_RDONLY)) >= 0) {
+	if (fstat(fd, &cst) == 0 && cst.st_size > 0) {
+	    void *mem = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (mem != MAP_FAILED) {
+		if (script_validate(mem, cst.st_size, &st, prog) == 0) {
+		    close(fd);
+		    prog->mapped = 1;
+		    LOGGER_FMT_DEBUG("using compiled script %s", cache_fname);
+		    return 0;
+		}
+		munmap(mem, cst.st_size);
+	    }
+	}
+	close(fd);
+	LOGGER_FMT_INFO("script cache %s is stale or invalid", cache_fname);
+    }
+
+    if (script_compile(fname, prog) < 0)
+	return -1;
+    script_save(prog, cache_fname);
+    return 0;
+}
+
+void script_free(script_prog_t *prog)
+{
+    if (prog->mem == NULL)
+	return;
+    if (prog->mapped)
+	munmap(prog->mem, prog->mem_len);
+    else
+	free(prog->mem);
+    prog->mem = NULL;
+}
@@ -0,0 +1,175 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Compiler for the sbread script file.
+//
+// The text script (R, S and E lines) is compiled into a flat array of ops:
+// each script line becomes a line op followed by its element ops, being runs
+// of literal bytes, placeholders for the values that are only known at run time
+// ($ADDR, $ADD2, $SER, $CHAN, $TIME, $CRC) and, for E lines, the fields that are
+// to be extracted from the last received frame.
+//
+// The ops from query_start on are the query section of the script, being the part
+// that may be re-run on an already logged on connection. Those before logon_start
+// set up the bluetooth link, which may be skipped when its channel and our address
+// are known from an earlier session (see session_cache_load()).
+//
+// The S lines before each R line, since the R line before it, are the requests
+// that the R line's frame replies to. If each of them is a level 2 packet or a
+// query of the link, rather than the reply to the inverter's hello that sets up
+// the link, they may be sent again should the reply not come, which the R line
+// op is flagged with.
+//
+// The compiled program is position independent (header, ops, byte pool) so that
+// it can be saved to a cache file next to the script and simply mmap'd on
+// later runs.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+
+//! 'SBSC' - magic number at start of compiled script cache file
+#define SCRIPT_MAGIC     0x43534253
+//! version of the compiled format, bump whenever script_op_t or script_header_t change
+#define SCRIPT_VERSION   4
+//! suffix appended to the script file name to give the name of the cache file
+#define SCRIPT_CACHE_SUFFIX ".bin"
+
+//! maximum length of a line in the script file
+#define SCRIPT_LINE_MAX  400
+//! maximum length of a frame that may be built from a script line, may be set at compile time
+#ifndef SCRIPT_FRAME_MAX
+#define SCRIPT_FRAME_MAX 1024
+#endif
+
+// line op codes, one of these starts each compiled script line
+#define SCRIPT_OP_RECV     'R'
+#define SCRIPT_OP_SEND     'S'
+#define SCRIPT_OP_EXTRACT  'E'
+
+// element op codes. Apart from SCRIPT_EL_BYTES these are the indexes of the
+// corresponding macro strings in the script file, eg $ADDR
+#define SCRIPT_EL_END    0
+#define SCRIPT_EL_ADDR   1
+#define SCRIPT_EL_TIME   2
+#define SCRIPT_EL_SER    3
+#define SCRIPT_EL_CRC    4
+#define SCRIPT_EL_POW    5
+#define SCRIPT_EL_DTOT   6
+#define SCRIPT_EL_ADD2   7
+#define SCRIPT_EL_CHAN   8
+//! a run of literal bytes held in the program's byte pool
+#define SCRIPT_EL_BYTES  0xff
+
+//! offset into a frame at which the data covered by $CRC starts
+#define SCRIPT_CRC_START 19
+//! number of bytes emitted for $TIME: a zero byte followed by the unix time, LSB first
+#define SCRIPT_TIME_LEN  5
+//! offset into a frame of its level 1 command, and the commands of the S lines that may be sent again:
+//! those holding a level 2 packet, and queries of the link
+#define SCRIPT_L1_CMD_OFF   16
+#define SCRIPT_L1_CMD_L2    0x0001
+#define SCRIPT_L1_CMD_QUERY 0x0003
+
+//! flag of an R line op whose requests may be sent again, the first of them being at op index off
+#define SCRIPT_FLAG_RESEND 0x01
+
+//! A single compiled op.
+typedef struct {
+    //! SCRIPT_OP_xxx for a line op, SCRIPT_EL_xxx for an element op
+    uint8_t  code;
+    //! line op: SCRIPT_FLAG_xxx
+    uint8_t  flags;
+    //! line op: number of element ops that follow. BYTES: length of the run. E line element: length of field
+    uint16_t n;
+    //! BYTES: offset into byte pool. CRC: frame offset at which crc'd data starts. E line element: frame offset of field.
+    //! R line op flagged SCRIPT_FLAG_RESEND: index of the first S line op of its requests
+    uint16_t off;
+    //! line number in the script file that this op was compiled from
+    uint16_t line;
+} script_op_t;
+
+//! Header at the start of a compiled program
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    //! number of entries in the ops array
+    uint32_t n_ops;
+    //! number of bytes in the byte pool
+    uint32_t pool_len;
+    //! index of the line op that starts the query section, ie the S line whose reply is the
+    //! first to have $POW or $DTOT extracted from it. n_ops if there is no query section
+    uint32_t query_start;
+    //! index of the line op that starts the logon, ie the first S line whose frame holds a level 2
+    //! packet, the lines before it setting up the link and extracting $CHAN or $ADD2. 0 if there is
+    //! no such line or nothing is extracted before it
+    uint32_t logon_start;
+    //! modification time and size of the script file that was compiled, used to detect a stale cache
+    int64_t  src_mtime;
+    int64_t  src_size;
+} script_header_t;
+
+//! A compiled script, either malloc'd or mmap'd from the cache file
+typedef struct {
+    const script_header_t *hdr;
+    //! the ops, hdr->n_ops of them
+    const script_op_t *ops;
+    //! literal bytes referenced by SCRIPT_EL_BYTES ops
+    const unsigned char *pool;
+    //! the memory holding header, ops and pool
+    void *mem;
+    size_t mem_len;
+    //! flag indicating that mem is mmap'd rather than malloc'd
+    int mapped;
+} script_prog_t;
+
+/**
+ * Load the compiled program for the passed script file. The cache file is mmap'd if it
+ * is present and up to date, otherwise the script is compiled and the cache file written.
+ * Failure to write the cache file is not an error.
+ *
+ * @param fname Path of the script file
+ * @param prog The program, should be freed with script_free()
+ *
+ * @return 0 on success, -1 on error
+ */
+int script_load(const char *fname, script_prog_t *prog);
+
+/**
+ * Compile the passed script file
+ *
+ * @param fname Path of the script file
+ * @param prog The compiled program, should be freed with script_free()
+ *
+ * @return 0 on success, -1 on error, in which case the error has been logged
+ */
+int script_compile(const char *fname, script_prog_t *prog);
+
+/**
+ * Write the compiled program to the passed cache file
+ *
+ * @param prog The compiled program
+ * @param cache_fname Path of the cache file
+ *
+ * @return 0 on success, -1 on error
+ */
+int script_save(const script_prog_t *prog, const char *cache_fname);
+
+//! release the memory held by the passed program
+void script_free(script_prog_t *prog);
+
+/**
+ * Convert two hex digits to their value
+ *
+ * @param s Pointer to the two hex digits, upper or lower case
+ *
+ * @return The value 0-255, or -1 if s does not start with two hex digits
+ */
+int script_hex_byte(const char *s);
+
+#endif
@@ -0,0 +1,1139 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// A session with an inverter, see session.h
+//
+// Derived from on orignal code by Wim Hofman,
+// See http://www.on4akh.be/SMA-read.html
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "codec.h"
+#include "crc.h"
+#include "frame.h"
+#include "session.h"
+#include "sma.h"
+
+/**
+ * Make room for n more bytes at the end of the frame being made up in s->frame
+ *
+ * @return Where they go, or NULL if they don't fit, which has been logged
+ */
+static unsigned char *session_frame_put(sb_session_t *s, size_t n)
+{
+    unsigned char *p = s->frame + s->frame_len;
+
+    if (n > sizeof(s->frame) - s->frame_len){
+	LOGGER_FMT_ERROR("script line %u: frame longer than %u bytes", s->script_line_num, (unsigned)sizeof(s->frame));
+	return NULL;
+    }
+    s->frame_len += n;
+    return p;
+}
+
+/**
+ * Calculate the crc of the len bytes at cp, appending it to the session's frame
+ *
+ * @return 0 on success, -1 if it doesn't fit
+ */
+static int tryfcs16(sb_session_t *s, unsigned char *cp, int len)
+{
+    uint16_t trialfcs;
+    unsigned char *p;
+
+    LOGGER_DATA_DEBUG("String to calculate FCS ", cp, len);
+    trialfcs = crc_calc_crc( CRC_PPPINITFCS16, cp, len );
+    trialfcs ^= 0xffff;               /* complement */
+    if ((p = session_frame_put(s, 2)) == NULL)
+	return -1;
+    p[0] = (trialfcs & 0x00ff);       /* least significant byte first */
+    p[1] = ((trialfcs >> 8) & 0x00ff);
+    LOGGER_FMT_DEBUG("FCS = %02x%02x", trialfcs & 0x00ff, (trialfcs >> 8) & 0x00ff);
+    return 0;
+}
+
+void session_init(sb_session_t *s, transport_t *tr, const unsigned char *sb_bt_addr,
+		  const unsigned char *serial, const script_prog_t *prog)
+{
+    memset(s, 0, sizeof(*s));
+    s->tr = tr;
+    memcpy(s->sb_bt_addr, sb_bt_addr, sizeof(s->sb_bt_addr));
+    memcpy(s->serial, serial, sizeof(s->serial));
+    s->prog = prog;
+    s->display = DISPLAY_POWER;
+    s->timeout_sec = SESSION_TIMEOUT_SEC;
+    s->pipeline_depth = SESSION_MAX_PENDING;
+    s->discover_ms = SESSION_DISCOVER_MS;
+    s->resend_ms = SESSION_RESEND_MS;
+    s->reconnects = SESSION_RECONNECTS;
+}
+
+int session_connect(sb_session_t *s)
+{
+    int ret;
+
+    frame_ring_init(&s->rx);
+    s->connects++;
+    if (s->trace)
+	trace_begin(s->trace, TRACE_CONNECT, 0);
+    ret = transport_connect(s->tr);
+    if (s->trace)
+	trace_end(s->trace, ret < 0);
+    return ret;
+}
+
+int session_connect_start(sb_session_t *s)
+{
+    frame_ring_init(&s->rx);
+    s->connects++;
+    return transport_connect_start(s->tr);
+}
+
+void session_close(sb_session_t *s)
+{
+    transport_close(s->tr);
+}
+
+/**
+ * Make up the frame for the passed R or S line op in s->frame: for R lines being the data that we are
+ * expecting to receive from sb, for S lines the data to be sent to sb. s->frame_len is set to its length.
+ * Each element is checked to fit, whatever the compiled script says its length is.
+ *
+ * @return 0 on success, -1 if the frame is too long, which has been logged
+ */
+static int session_build_frame(sb_session_t *s, const script_op_t *op)
+{
+    const script_op_t *el = op + 1;
+    const script_op_t *el_end = el + op->n;
+    unsigned char *p;
+    int i;
+
+    s->frame_len = 0;
+    for (; el < el_end; el++){
+	switch(el->code) {
+	    case SCRIPT_EL_BYTES:
+		if ((p = session_frame_put(s, el->n)) == NULL)
+		    return -1;
+		memcpy(p, s->prog->pool+el->off, el->n);
+		break;
+	    case SCRIPT_EL_ADDR:
+		if ((p = session_frame_put(s, 6)) == NULL)
+		    return -1;
+		memcpy(p, s->sb_bt_addr, 6);
+		break;
+	    case SCRIPT_EL_ADD2:
+		if ((p = session_frame_put(s, 6)) == NULL)
+		    return -1;
+		memcpy(p, s->our_bt_addr, 6);
+		break;
+	    case SCRIPT_EL_SER:
+		if ((p = session_frame_put(s, 4)) == NULL)
+		    return -1;
+		memcpy(p, s->serial, 4);
+		break;
+	    case SCRIPT_EL_CHAN:
+		if ((p = session_frame_put(s, 1)) == NULL)
+		    return -1;
+		*p = s->chan;
+		break;
+	    case SCRIPT_EL_TIME: {
+		// unix time, LSB first, preceded by a zero byte
+		uint32_t curtime = (uint32_t)time(NULL);
+		if ((p = session_frame_put(s, 5)) == NULL)
+		    return -1;
+		*p++ = 0;
+		for (i=0;i<4;i++){
+		    *p++ = curtime & 0xff;
+		    curtime >>= 8;
+		}
+		break;
+	    }
+	    case SCRIPT_EL_CRC:
+		if (el->off <= s->frame_len && tryfcs16(s, s->frame+el->off, s->frame_len - el->off) < 0)
+		    return -1;
+		break;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Escape the level 2 part of the frame in s->frame, if there is one, and send it to sb.
+ * The length and checksum in the level 1 header are updated if escaping changed the length.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_send_frame(sb_session_t *s)
+{
+    const unsigned char *out = s->frame;
+    size_t len = s->frame_len;
+
+    LOGGER_DATA_DEBUG("send ", s->frame,s->frame_len);
+    // the level 2 part is between the 0x7e at the end of the level 1 header and the 0x7e at the end of the frame
+    if (s->frame_len > FRAME_L1_HEADER_LEN + 1 && s->frame[FRAME_L1_HEADER_LEN] == FRAME_SOF && s->frame[s->frame_len-1] == FRAME_SOF){
+	size_t start = FRAME_L1_HEADER_LEN + 1;
+	len = start + codec_escape(s->tx + start, s->frame + start, s->frame_len - 1 - start);
+	if (len != s->frame_len - 1){
+	    memcpy(s->tx, s->frame, start);
+	    s->tx[len++] = FRAME_SOF;
+	    s->tx[1] = len & 0xff;
+	    s->tx[2] = (len >> 8) & 0xff;
+	    s->tx[3] = s->tx[0] ^ s->tx[1] ^ s->tx[2];
+	    out = s->tx;
+	    LOGGER_DATA_DEBUG("escaped ", s->tx, len);
+	} else {
+	    len = s->frame_len;
+	}
+    }
+    // write data to socket
+    return transport_write(s->tr, out, len);
+}
+
+/**
+ * Read whatever is available from the transport into the receive ring, waiting until the passed deadline
+ *
+ * @return The number of bytes read, 0 on timeout, -1 on error
+ */
+static ssize_t session_recv(sb_session_t *s, int64_t deadline)
+{
+    size_t space;
+    unsigned char *p;
+    ssize_t bytes_read;
+
+    // read straight into the ring
+    p = frame_ring_space(&s->rx, &space);
+    bytes_read = transport_read(s->tr, p, space, deadline);
+    if (s->trace)
+	trace_read(s->trace, bytes_read > 0 ? bytes_read : 0);
+    if (bytes_read <= 0)
+	return bytes_read;
+    LOGGER_FMT_DEBUG("received %i bytes", (int)bytes_read);
+    LOGGER_DATA_DEBUG("received:    ", p, bytes_read);
+    frame_ring_commit(&s->rx, bytes_read);
+    return bytes_read;
+}
+
+/**
+ * Note the packet id of the frame just sent from s->frame, if it's a level 2 packet, as one that the
+ * reply being waited for may have
+ */
+static void session_sent(sb_session_t *s)
+{
+    if (s->frame_len < SMA_L2_DATA_OFF || s->frame[FRAME_L1_HEADER_LEN] != FRAME_SOF)
+	return;
+    if (s->n_sent_ids < SESSION_MAX_GROUP)
+	s->sent_ids[s->n_sent_ids] = sma_get_u16(s->frame + SMA_L2_PKT_ID_OFF) | SMA_PKT_ID_FLAG;
+    s->n_sent_ids++;
+}
+
+/**
+ * Check whether the frame in s->received may be the reply to the requests sent since the last reply.
+ * Once a request has been sent again a late reply to it, which has the packet id of an earlier request
+ * of the script, may come while waiting for the reply to the next.
+ *
+ * @return 1 if it may, 0 if not
+ */
+static int session_reply_to_sent(const sb_session_t *s)
+{
+    uint16_t id;
+    int i;
+
+    if (!s->resending || s->n_sent_ids == 0 || s->n_sent_ids > SESSION_MAX_GROUP ||
+	s->received_len < SMA_L2_DATA_OFF || s->received[FRAME_L1_HEADER_LEN] != FRAME_SOF)
+	return 1;
+    id = sma_get_u16(s->received + SMA_L2_PKT_ID_OFF) | SMA_PKT_ID_FLAG;
+    for (i = 0; i < s->n_sent_ids && s->sent_ids[i] != id; i++)
+	;
+    return i < s->n_sent_ids;
+}
+
+/**
+ * Look through the frames received from sb for one matching the s->frame_len bytes in s->frame. The frame is left in
+ * s->received. Frames that do not match are discarded, frames following the matching one are left in the ring.
+ *
+ * @return 1 if a matching frame was found, 0 otherwise
+ */
+static int session_match_frame(sb_session_t *s)
+{
+    // check each whole frame received to see if it matches the data that we are waiting for
+    while ((s->received_len = frame_next(&s->rx, s->received, sizeof(s->received))) > 0){
+	if (s->received_len >= s->frame_len && memcmp(s->frame,s->received,s->frame_len) == 0){
+	    // a damaged reply is as good as none, the values extracted from it can't be trusted. The fcs of a packet
+	    // split over several frames is in the last of them, so can't be checked in the first
+	    if (s->received_len > FRAME_L1_HEADER_LEN + 1 && s->received[FRAME_L1_HEADER_LEN] == FRAME_SOF &&
+		!sma_packet_part(s->received, s->received_len) && !sma_check_fcs(s->received, s->received_len)){
+		LOGGER_ERROR("dropped a reply with a bad fcs");
+		s->bad_fcs++;
+		continue;
+	    }
+	    if (!session_reply_to_sent(s)){
+		LOGGER_DATA_DEBUG("late reply: ", s->received, s->received_len);
+		continue;
+	    }
+	    LOGGER_DEBUG("found");
+	    return 1;
+	}
+	LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+    }
+    return 0;
+}
+
+/**
+ * Extract the fields of the passed E line op from the last frame received. $POW and $DTOT are
+ * taken from the data records in the frame, which are decoded into s->values.
+ *
+ * @return 1 if there is nothing further to be extracted for s->display, 0 otherwise, -1 on error
+ */
+static int session_extract(sb_session_t *s, const script_op_t *op)
+{
+    const script_op_t *el = op + 1;
+    const script_op_t *el_end = el + op->n;
+    // flag to indicate that the data records in the frame have been decoded
+    int decoded = 0;
+    int done = 0;
+
+    LOGGER_DEBUG("Extracting");
+    for (; el < el_end; el++){
+	if ((el->code == SCRIPT_EL_POW || el->code == SCRIPT_EL_DTOT) && !decoded){
+	    int n = sma_decode(s->received, s->received_len, &s->values);
+	    if (n < 0){
+		LOGGER_FMT_ERROR("script line %u: reply holds no data records", op->line);
+		return -1;
+	    }
+	    LOGGER_FMT_DEBUG("decoded %i data records", n);
+	    decoded = 1;
+	}
+	switch(el->code) {
+	    case SCRIPT_EL_POW: // extract current power
+		if (!(s->values.have & SMA_HAVE(SMA_VAL_AC_POWER))){
+		    LOGGER_FMT_ERROR("script line %u: reply holds no AC power", op->line);
+		    return -1;
+		}
+		s->currentpower = s->values.ac_power;
+		LOGGER_FMT_INFO("power (W): %i",s->currentpower);
+		// -b or -d flag was not specified (ie only power is required), then our work is done
+		if(s->display==DISPLAY_POWER){
+		    done=1;
+		}
+		break;
+	    case SCRIPT_EL_DTOT: // extract total energy collected today
+		if (!(s->values.have & SMA_HAVE(SMA_VAL_DAY_WH))){
+		    LOGGER_FMT_ERROR("script line %u: reply holds no energy today", op->line);
+		    return -1;
+		}
+		s->dtotal = s->values.day_wh / 1000.0;
+		LOGGER_FMT_INFO("energy_today (kWh): %.2f",s->dtotal);
+		break;
+	    case SCRIPT_EL_ADD2: // extract 2nd address, ie our address
+		if (el->off + 6 > s->received_len){
+		    LOGGER_FMT_ERROR("script line %u: reply too short to hold our address", op->line);
+		    return -1;
+		}
+		memcpy(s->our_bt_addr,s->received+el->off,6);
+		LOGGER_INFO("got our bt address: ");
+		break;
+	    case SCRIPT_EL_CHAN: // extract bluetooth channel
+		if (el->off >= s->received_len){
+		    LOGGER_FMT_ERROR("script line %u: reply too short to hold the channel", op->line);
+		    return -1;
+		}
+		s->chan = s->received[el->off];
+		LOGGER_FMT_INFO("bluetooth channel: %i",s->chan);
+		break;
+	}
+    }
+    return done;
+}
+
+/**
+ * Work out when the wait for the reply to a request is over: when it's time to send the request again,
+ * or to give up on the reply
+ *
+ * @param resend Flag set if the request may be sent again
+ * @param resent The number of times it has been sent again
+ * @param give_up The time, as transport_now_ms(), by which the reply must come however often it's sent
+ *
+ * @return The time, as transport_now_ms()
+ */
+static int64_t session_due(const sb_session_t *s, int resend, unsigned resent, int64_t give_up)
+{
+    int64_t due;
+
+    if (!resend || s->resend_ms == 0)
+	return give_up;
+    due = transport_now_ms() + ((int64_t)s->resend_ms << (resent < 16 ? resent : 16));
+    return due < give_up ? due : give_up;
+}
+
+/**
+ * Send again the requests that the reply the passed R line op waits for is to, as far back as the op
+ * that session_start() started at, and wait for it a while longer
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_resend(sb_session_t *s, const script_op_t *op)
+{
+    uint32_t i = op->off > s->op_start ? op->off : s->op_start;
+
+    s->n_sent_ids = 0;
+    for (; i < s->op_idx; i += 1 + s->prog->ops[i].n){
+	const script_op_t *req = &s->prog->ops[i];
+	if (req->code != SCRIPT_OP_SEND)
+	    continue;
+	LOGGER_FMT_INFO("script line %u: no reply yet, sending line %u again", op->line, req->line);
+	if (session_build_frame(s, req) < 0 || session_send_frame(s) < 0)
+	    return -1;
+	session_sent(s);
+    }
+    s->resending = 1;
+    s->resends++;
+    s->resent++;
+    if (s->trace)
+	trace_resend(s->trace);
+    s->deadline = session_due(s, 1, s->resent, s->give_up);
+    return 0;
+}
+
+//! range of the packet ids given to the requests made by session_query_all()
+#define SESSION_PKT_ID_FIRST 0x0100
+#define SESSION_PKT_ID_LAST  0x7fff
+
+//! the query that identifies the inverters in the net
+static const sma_query_t session_ident_query = { SMA_CMD_IDENT, 0, 0 };
+
+/**
+ * Send the passed query with the next packet id
+ *
+ * @param dst SUSyID and serial number of the inverter the query is for, NULL for any
+ *
+ * @return The packet id, with SMA_PKT_ID_FLAG set, or -1 on error
+ */
+static int session_send_query(sb_session_t *s, const unsigned char *dst, const sma_query_t *q)
+{
+    // keep clear of the fixed packet ids used by the script, so a late reply to it can't be taken for ours
+    if (++s->pkt_id > SESSION_PKT_ID_LAST || s->pkt_id < SESSION_PKT_ID_FIRST)
+	s->pkt_id = SESSION_PKT_ID_FIRST;
+    s->frame_len = sma_build_query(s->frame, s->our_bt_addr, dst, s->pkt_id, q);
+    if (session_send_frame(s) < 0)
+	return -1;
+    return s->pkt_id | SMA_PKT_ID_FLAG;
+}
+
+/**
+ * Send the next of the queries of session_query_all(), filling in p with what its reply is to
+ * be matched on
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_send_next_query(sb_session_t *s, session_pending_t *p)
+{
+    const unsigned char *dst = NULL;
+    int ret;
+
+    p->q = &sma_all_queries[s->next_query % sma_n_all_queries];
+    p->values = &s->values;
+    if (s->net){
+	sb_node_t *node = &s->nodes[s->next_query / sma_n_all_queries];
+	dst = node->addr;
+	p->values = &node->values;
+    }
+    p->dst = dst;
+    s->next_query++;
+    if ((ret = session_send_query(s, dst, p->q)) < 0)
+	return -1;
+    p->id = ret;
+    p->resent = 0;
+    p->give_up = transport_now_ms() + s->timeout_sec * 1000;
+    p->deadline = session_due(s, 1, 0, p->give_up);
+    return 0;
+}
+
+/**
+ * Send the passed query of session_query_all() again, with the same packet id, as its reply hasn't come
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_resend_query(sb_session_t *s, session_pending_t *p)
+{
+    LOGGER_FMT_INFO("query %08x: no reply yet to packet %04x, sending it again", p->q->cmd, p->id);
+    s->frame_len = sma_build_query(s->frame, s->our_bt_addr, p->dst, p->id & ~SMA_PKT_ID_FLAG, p->q);
+    if (session_send_frame(s) < 0)
+	return -1;
+    s->resends++;
+    if (s->trace)
+	trace_resend(s->trace);
+    p->deadline = session_due(s, 1, ++p->resent, p->give_up);
+    return 0;
+}
+
+/**
+ * Route the frame in s->received to the pending request whose reply it is, by its packet id,
+ * decoding its data records into s->values
+ *
+ * @return The index in s->pending of the request whose reply the frame completes, s->n_pending
+ * if it completes none
+ */
+static int session_route_reply(sb_session_t *s)
+{
+    const unsigned char *r = s->received;
+    const session_pending_t *p;
+    uint16_t id;
+    int i, n;
+
+    if (s->received_len < SMA_L2_DATA_OFF || r[FRAME_L1_HEADER_LEN] != FRAME_SOF){
+	LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+	return s->n_pending;
+    }
+    if (!sma_packet_part(r, s->received_len) && !sma_check_fcs(r, s->received_len)){
+	LOGGER_FMT_ERROR("dropped packet %04x with a bad fcs", sma_get_u16(r + SMA_L2_PKT_ID_OFF));
+	s->bad_fcs++;
+	return s->n_pending;
+    }
+    id = sma_get_u16(r + SMA_L2_PKT_ID_OFF);
+    for (i = 0; i < s->n_pending && s->pending[i].id != id; i++)
+	;
+    p = &s->pending[i];
+    if (i == s->n_pending || sma_get_u32(r + SMA_L2_CMD_OFF) != (p->q->cmd | SMA_CMD_REPLY)){
+	LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+	return s->n_pending;
+    }
+    if (sma_get_u16(r + SMA_L2_ERROR_OFF) != 0){
+	// eg the inverter has no such objects
+	LOGGER_FMT_INFO("query %08x: error %04x", p->q->cmd, sma_get_u16(r + SMA_L2_ERROR_OFF));
+	return i;
+    }
+    n = sma_decode(r, s->received_len, p->values);
+    LOGGER_FMT_DEBUG("query %08x: decoded %i data records", p->q->cmd, n);
+    return sma_get_u16(r + SMA_L2_FRAGMENT_OFF) == 0 ? i : s->n_pending;
+}
+
+/**
+ * Run the queries of sma_all_queries[] as far as possible without waiting, keeping up to
+ * s->pipeline_depth of them awaiting replies
+ *
+ * @return SESSION_DONE, SESSION_WAIT or -1 on error, as session_step()
+ */
+static int session_step_query_all(sb_session_t *s)
+{
+    int depth = s->pipeline_depth < 1 ? 1 : s->pipeline_depth > SESSION_MAX_PENDING ? SESSION_MAX_PENDING : s->pipeline_depth;
+    int n_queries = sma_n_all_queries * (s->net ? s->n_nodes : 1);
+    int i;
+
+    for(;;){
+	// keep the pipeline full
+	while (s->n_pending < depth && s->next_query < n_queries){
+	    if (session_send_next_query(s, &s->pending[s->n_pending++]) < 0)
+		return -1;
+	}
+	if (s->n_pending == 0)
+	    break;
+	if ((s->received_len = frame_next(&s->rx, s->received, sizeof(s->received))) > 0){
+	    if ((i = session_route_reply(s)) < s->n_pending)
+		s->pending[i] = s->pending[--s->n_pending];
+	    continue;
+	}
+	// wait for the request that is due first
+	s->deadline = s->pending[0].deadline;
+	for (i = 1; i < s->n_pending; i++){
+	    if (s->pending[i].deadline < s->deadline)
+		s->deadline = s->pending[i].deadline;
+	}
+	if (transport_now_ms() < s->deadline)
+	    return SESSION_WAIT;
+	for (i = 0; s->pending[i].deadline != s->deadline; i++)
+	    ;
+	if (s->deadline < s->pending[i].give_up){
+	    if (session_resend_query(s, &s->pending[i]) < 0)
+		return -1;
+	    continue;
+	}
+	LOGGER_FMT_ERROR("query %08x: no reply to packet %04x", s->pending[i].q->cmd, s->pending[i].id);
+	s->timeouts++;
+	s->link_lost = 1;
+	return -1;
+    }
+    s->deadline = 0;
+    s->query_all = 0;
+    s->currentpower = s->values.ac_power;
+    s->dtotal = s->values.day_wh / 1000.0;
+    return SESSION_DONE;
+}
+
+/**
+ * Add the inverter that sent the identification reply in s->received to s->nodes, if it is not
+ * already there
+ */
+static void session_add_node(sb_session_t *s)
+{
+    const unsigned char *addr = s->received + SMA_L2_SRC_OFF;
+    sb_node_t *node;
+    int i;
+
+    for (i = 0; i < s->n_nodes && memcmp(s->nodes[i].addr, addr, 6) != 0; i++)
+	;
+    if (i < s->n_nodes)
+	return;
+    if (s->n_nodes == SESSION_MAX_NODES){
+	LOGGER_FMT_WARN("more than %i inverters in the net, ignoring serial %08x", SESSION_MAX_NODES, sma_get_u32(addr + 2));
+	return;
+    }
+    node = &s->nodes[s->n_nodes++];
+    // the level 1 source, ie the inverter's own bluetooth address
+    memcpy(node->bt_addr, s->received + 4, 6);
+    memcpy(node->addr, addr, 6);
+    sma_values_clear(&node->values);
+    LOGGER_FMT_INFO("found inverter SUSyID %u serial %u", sma_get_u16(addr), sma_get_u32(addr + 2));
+}
+
+/**
+ * Identify the inverters in the net: broadcast the identification query, then collect the
+ * replies until s->discover_ms has passed
+ *
+ * @return SESSION_DONE, SESSION_WAIT or -1 on error, as session_step()
+ */
+static int session_step_discover(sb_session_t *s)
+{
+    const unsigned char *r = s->received;
+    int ret;
+
+    if (s->discover_end == 0){
+	s->n_nodes = 0;
+	if ((ret = session_send_query(s, NULL, &session_ident_query)) < 0)
+	    return -1;
+	s->discover_id = ret;
+	s->discover_end = transport_now_ms() + s->discover_ms;
+    }
+    while ((s->received_len = frame_next(&s->rx, s->received, sizeof(s->received))) > 0){
+	if (s->received_len >= SMA_L2_DATA_OFF && r[FRAME_L1_HEADER_LEN] == FRAME_SOF &&
+	    sma_get_u16(r + SMA_L2_PKT_ID_OFF) == s->discover_id &&
+	    sma_get_u32(r + SMA_L2_CMD_OFF) == (SMA_CMD_IDENT | SMA_CMD_REPLY))
+	    session_add_node(s);
+	else
+	    LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+    }
+    if (transport_now_ms() < s->discover_end){
+	s->deadline = s->discover_end;
+	return SESSION_WAIT;
+    }
+    s->deadline = 0;
+    s->discover = 0;
+    if (s->n_nodes == 0){
+	LOGGER_ERROR("no inverters identified themselves");
+	return -1;
+    }
+    LOGGER_FMT_INFO("%i inverters in the net", s->n_nodes);
+    return SESSION_DONE;
+}
+
+/**
+ * Download s->archive as far as possible without waiting, keeping up to s->pipeline_depth of its
+ * chunks awaiting replies
+ *
+ * @return SESSION_DONE, SESSION_WAIT or -1 on error, as session_step()
+ */
+static int session_step_archive(sb_session_t *s)
+{
+    int depth = s->pipeline_depth < 1 ? 1 : s->pipeline_depth > ARCHIVE_MAX_CHUNKS ? ARCHIVE_MAX_CHUNKS : s->pipeline_depth;
+    archive_t *a = s->archive;
+    const unsigned char *r = s->received;
+    archive_chunk_t *c;
+    int i, ret;
+
+    for(;;){
+	// keep the pipeline full, including chunks to be asked for again
+	while ((c = archive_next(a, depth)) != NULL){
+	    sma_query_t q = { a->cmd, c->start, c->end };
+	    if ((ret = session_send_query(s, NULL, &q)) < 0)
+		return -1;
+	    c->id = ret;
+	    c->state = ARCHIVE_WAIT;
+	    c->deadline = transport_now_ms() + s->timeout_sec * 1000;
+	}
+	if (archive_finished(a))
+	    break;
+	if ((s->received_len = frame_next(&s->rx, s->received, sizeof(s->received))) > 0){
+	    if (s->received_len < SMA_L2_DATA_OFF || r[FRAME_L1_HEADER_LEN] != FRAME_SOF ||
+		sma_get_u32(r + SMA_L2_CMD_OFF) != (a->cmd | SMA_CMD_REPLY)){
+		LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+		continue;
+	    }
+	    if (!sma_packet_part(r, s->received_len) && !sma_check_fcs(r, s->received_len)){
+		a->bad_fcs++;
+		s->bad_fcs++;
+		LOGGER_FMT_INFO("archive: dropped packet %04x with a bad fcs", sma_get_u16(r + SMA_L2_PKT_ID_OFF));
+		if (archive_damaged(a, sma_get_u16(r + SMA_L2_PKT_ID_OFF)) < 0)
+		    return -1;
+		continue;
+	    }
+	    if ((c = archive_find(a, sma_get_u16(r + SMA_L2_PKT_ID_OFF))) == NULL){
+		LOGGER_DATA_DEBUG("discarded:   ", s->received, s->received_len);
+		continue;
+	    }
+	    if (archive_put(a, c, r, s->received_len) < 0){
+		if (archive_retry(a, c) < 0)
+		    return -1;
+	    } else if (c->state == ARCHIVE_WAIT)
+		c->deadline = transport_now_ms() + s->timeout_sec * 1000;
+	    continue;
+	}
+	// wait for the chunk whose next packet is due first
+	c = NULL;
+	for (i = 0; i < ARCHIVE_MAX_CHUNKS; i++){
+	    if (a->chunks[i].state == ARCHIVE_WAIT && (c == NULL || a->chunks[i].deadline < c->deadline))
+		c = &a->chunks[i];
+	}
+	if (c == NULL)
+	    break;
+	s->deadline = c->deadline;
+	if (transport_now_ms() < s->deadline)
+	    return SESSION_WAIT;
+	LOGGER_FMT_INFO("archive %u: no reply to packet %04x", c->start, c->id);
+	s->timeouts++;
+	if (archive_retry(a, c) < 0)
+	    return -1;
+    }
+    LOGGER_FMT_INFO("archive: %u packets with a bad fcs, %u chunks asked for again", a->bad_fcs, a->retries);
+    s->deadline = 0;
+    s->archive = NULL;
+    return SESSION_DONE;
+}
+
+void session_start(sb_session_t *s, uint32_t from, uint32_t to, int query_all)
+{
+    int i;
+
+    s->op_start = from;
+    s->op_idx = from;
+    s->op_end = to;
+    s->n_sent_ids = 0;
+    s->resending = 0;
+    s->link_lost = 0;
+    s->query_all = query_all;
+    s->n_pending = 0;
+    s->next_query = 0;
+    s->deadline = 0;
+    s->discover = 0;
+    s->discover_end = 0;
+    sma_values_clear(&s->values);
+    for (i = 0; i < s->n_nodes; i++)
+	sma_values_clear(&s->nodes[i].values);
+}
+
+/**
+ * Run the ops and phases started by session_start(), as session_step(), marking the start of
+ * each in s->trace, if set
+ */
+static int session_steps(sb_session_t *s)
+{
+    const script_prog_t *prog = s->prog;
+    // flag used to indicate to script loop that further processiing is not required
+    int done_flag;
+
+    // loop thru compiled script
+    while (s->op_idx < s->op_end){
+	// the line op, which is followed by its elements
+	const script_op_t *op = &prog->ops[s->op_idx];
+	s->script_line_num = op->line;
+	if (s->trace)
+	    trace_begin(s->trace, op->code, op->line);
+	if (s->deadline == 0)
+	    LOGGER_FMT_DEBUG("script[%u] %c", s->script_line_num, op->code);
+
+	switch(op->code){
+	    case SCRIPT_OP_RECV:        // The script file R indicates that we are to wait to receive data from sb
+		if (session_build_frame(s, op) < 0)
+		    return -1;
+		if (s->deadline == 0){
+		    // s->frame now contains the data that we are expecting to receive from sb, and s->frame_len is
+		    // the number of characters in it
+		    LOGGER_DATA_DEBUG("waiting for: ", s->frame,s->frame_len);
+		    LOGGER_FMT_DEBUG("matching on %i chars",s->frame_len);
+		    s->resent = 0;
+		    s->give_up = transport_now_ms() + s->timeout_sec * 1000;
+		    s->deadline = session_due(s, op->flags & SCRIPT_FLAG_RESEND, 0, s->give_up);
+		}
+		if (!session_match_frame(s)){
+		    if (transport_now_ms() < s->deadline)
+			return SESSION_WAIT;
+		    if (s->deadline < s->give_up){
+			// the frame waited for is made up again after sending the requests
+			if (session_resend(s, op) < 0)
+			    return -1;
+			continue;
+		    }
+		    LOGGER_ERROR("Timeout reading bluetooth socket");
+		    s->timeouts++;
+		    s->link_lost = 1;
+		    return -1;
+		}
+		s->deadline = 0;
+		s->n_sent_ids = 0;
+		break;
+	    case SCRIPT_OP_SEND:        // send the data made up from the script to sb
+		if (session_build_frame(s, op) < 0 || session_send_frame(s) < 0)
+		    return -1;
+		session_sent(s);
+		break;
+	    case SCRIPT_OP_EXTRACT:     // extract data from the last frame received
+		if ((done_flag = session_extract(s, op)) < 0)
+		    return -1;
+		if (done_flag){
+		    s->op_idx = s->op_end;
+		    continue;
+		}
+		break;
+	}
+	s->op_idx += 1 + op->n;
+    }
+    if (s->discover){
+	int ret;
+	if (s->trace)
+	    trace_begin(s->trace, TRACE_DISCOVER, 0);
+	if ((ret = session_step_discover(s)) != SESSION_DONE)
+	    return ret;
+    }
+    if (s->query_all){
+	int ret;
+	if (s->trace)
+	    trace_begin(s->trace, TRACE_QUERY_ALL, 0);
+	if ((ret = session_step_query_all(s)) != SESSION_DONE)
+	    return ret;
+    }
+    if (s->archive){
+	if (s->trace)
+	    trace_begin(s->trace, TRACE_ARCHIVE, 0);
+	return session_step_archive(s);
+    }
+    return SESSION_DONE;
+}
+
+int session_step(sb_session_t *s)
+{
+    int ret = session_steps(s);
+
+    // the last step is over once the session is done, or has failed
+    if (s->trace && ret != SESSION_WAIT)
+	trace_end(s->trace, ret < 0);
+    return ret;
+}
+
+int session_input(sb_session_t *s)
+{
+    return session_recv(s, 0) < 0 ? -1 : 0;
+}
+
+/**
+ * Run what was started by session_start() to completion, waiting for replies as need be
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_wait(sb_session_t *s)
+{
+    int ret;
+
+    // a timeout is picked up by session_step()
+    while ((ret = session_step(s)) == SESSION_WAIT){
+	if (session_recv(s, s->deadline) < 0){
+	    s->link_lost = 1;
+	    return -1;
+	}
+    }
+    return ret;
+}
+
+//! the index of the op that the script is started at: the logon if the link values are cached
+static uint32_t session_first_op(const sb_session_t *s)
+{
+    return s->cached ? s->prog->hdr->logon_start : 0;
+}
+
+/**
+ * Carry on over a new connection with what was started by session_start(), which failed in the query
+ * section as the link was lost: reconnect and run the script up to the query section again, then carry
+ * on from the requests whose reply didn't come, or start the phases that follow the script again,
+ * keeping what has already been read
+ *
+ * @return 0 on success, -1 if the link couldn't be set up again
+ */
+static int session_recover(sb_session_t *s)
+{
+    const script_op_t *op = &s->prog->ops[s->op_idx];
+    uint32_t query_start = s->prog->hdr->query_start;
+    uint32_t from = s->op_idx, to = s->op_end;
+    int query_all = s->query_all, discover = s->discover;
+
+    // from the first of the requests whose reply didn't come
+    if (s->op_idx < s->op_end)
+	from = op->code == SCRIPT_OP_RECV && (op->flags & SCRIPT_FLAG_RESEND) && op->off > query_start ? op->off : query_start;
+    LOGGER_FMT_INFO("lost the link at script line %u, reconnecting", s->script_line_num);
+    s->recoveries++;
+    session_close(s);
+    if (session_connect(s) < 0)
+	return -1;
+    s->op_start = s->op_idx = session_first_op(s);
+    s->op_end = query_start;
+    s->query_all = s->discover = 0;
+    s->n_pending = 0;
+    s->deadline = 0;
+    s->n_sent_ids = 0;
+    s->resending = 0;
+    s->link_lost = 0;
+    if (session_wait(s) < 0)
+	return -1;
+    s->op_start = s->op_idx = from;
+    s->op_end = to;
+    s->query_all = query_all;
+    s->next_query = 0;
+    s->discover = discover;
+    s->discover_end = 0;
+    s->n_sent_ids = 0;
+    return 0;
+}
+
+/**
+ * Run what was started by session_start() to completion as session_wait(), carrying on over a new
+ * connection up to s->reconnects times should the link be lost in the query section
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_finish(sb_session_t *s)
+{
+    int reconnects = s->reconnects;
+    int ret;
+
+    // the query section being the script from query_start, and the phases that follow it
+    while ((ret = session_wait(s)) < 0 && s->link_lost && s->archive == NULL && s->prog->hdr->query_start > 0 &&
+	   (s->op_idx >= s->prog->hdr->query_start || s->op_idx == s->op_end) && reconnects-- > 0){
+	if (session_recover(s) < 0)
+	    return -1;
+    }
+    return ret;
+}
+
+int session_run(sb_session_t *s, uint32_t from, uint32_t to)
+{
+    session_start(s, from, to, 0);
+    return session_finish(s);
+}
+
+int session_query_all(sb_session_t *s)
+{
+    session_start(s, 0, 0, 1);
+    return session_finish(s);
+}
+
+/**
+ * Check whether what was started at the logon, with the cached link values, failed before the end of
+ * the script, as when the inverter doesn't take the logon on a link that hasn't been set up. If so
+ * the values are dropped and the session reconnected, to be started again with the whole script.
+ *
+ * @param ret What session_finish() returned
+ *
+ * @return 1 if the session is to be started again, 0 if not
+ */
+static int session_retry_uncached(sb_session_t *s, int ret)
+{
+    if (ret == 0 || !s->cached || s->prog->hdr->logon_start == 0 || s->op_idx >= s->op_end)
+	return 0;
+    LOGGER_FMT_INFO("the logon with the cached link values failed at script line %u, setting up the link", s->script_line_num);
+    s->cached = 0;
+    session_close(s);
+    return session_connect(s) == 0;
+}
+
+void session_start_logon_and_query(sb_session_t *s)
+{
+    int query_all = s->display == DISPLAY_ALL || s->net;
+
+    session_start(s, session_first_op(s), query_all ? s->prog->hdr->query_start : s->prog->hdr->n_ops, query_all);
+    s->discover = s->net;
+}
+
+int session_logon_and_query(sb_session_t *s)
+{
+    int ret;
+
+    session_start_logon_and_query(s);
+    if (session_retry_uncached(s, ret = session_finish(s))){
+	session_start_logon_and_query(s);
+	ret = session_finish(s);
+    }
+    return ret;
+}
+
+int session_archive(sb_session_t *s, archive_t *a)
+{
+    int ret;
+
+    session_start(s, session_first_op(s), s->prog->hdr->query_start, 0);
+    s->archive = a;
+    if (session_retry_uncached(s, ret = session_finish(s))){
+	session_start(s, 0, s->prog->hdr->query_start, 0);
+	s->archive = a;
+	ret = session_finish(s);
+    }
+    s->archive = NULL;
+    return ret;
+}
+
+//! a line of the session cache file: the inverter's address and serial number, the channel and our
+//! address, each as given on the command line, and the unix time they were last confirmed
+#define SESSION_CACHE_FMT "%02X:%02X:%02X:%02X:%02X:%02X %02X:%02X:%02X:%02X %02X %02X:%02X:%02X:%02X:%02X:%02X %u\n"
+
+//! the link values of an inverter, as kept in the session cache file, the addresses LSB first
+typedef struct {
+    unsigned char sb_bt_addr[6];
+    unsigned char serial[4];
+    unsigned char chan;
+    unsigned char our_bt_addr[6];
+    uint32_t confirmed;
+} session_cache_t;
+
+//! parse a line of the session cache file into c, returning 0 on success, -1 if it isn't of the expected form
+static int session_cache_parse(const char *line, session_cache_t *c)
+{
+    unsigned a[6], ser[4], ch, our[6];
+    int i;
+
+    if (sscanf(line, "%x:%x:%x:%x:%x:%x %x:%x:%x:%x %x %x:%x:%x:%x:%x:%x %u", &a[5], &a[4], &a[3], &a[2], &a[1], &a[0],
+	       &ser[3], &ser[2], &ser[1], &ser[0], &ch, &our[5], &our[4], &our[3], &our[2], &our[1], &our[0], &c->confirmed) != 18)
+	return -1;
+    for (i = 0; i < 6; i++){
+	c->sb_bt_addr[i] = a[i];
+	c->our_bt_addr[i] = our[i];
+    }
+    for (i = 0; i < 4; i++)
+	c->serial[i] = ser[i];
+    c->chan = ch;
+    return 0;
+}
+
+/**
+ * Read the passed session cache file
+ *
+ * @param c Where the inverters' link values are written
+ *
+ * @return The number of inverters read, 0 if there's no such file
+ */
+static int session_cache_read(const char *path, session_cache_t *c)
+{
+    char line[128];
+    FILE *fp;
+    int n = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return 0;
+    while (n < SESSION_CACHE_MAX && fgets(line, sizeof(line), fp) != NULL){
+	if (session_cache_parse(line, &c[n]) == 0)
+	    n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+int session_cache_load(sb_session_t *s, const char *path)
+{
+    session_cache_t c[SESSION_CACHE_MAX];
+    uint32_t now = time(NULL);
+    int i, n = session_cache_read(path, c);
+
+    s->cached = 0;
+    for (i = 0; i < n; i++){
+	if (memcmp(c[i].sb_bt_addr, s->sb_bt_addr, 6) != 0 || memcmp(c[i].serial, s->serial, 4) != 0)
+	    continue;
+	if (c[i].confirmed > now || now - c[i].confirmed > SESSION_CACHE_MAX_AGE){
+	    LOGGER_FMT_INFO("cached link values of %s are too old", s->tr->addr);
+	    return 0;
+	}
+	s->chan = c[i].chan;
+	memcpy(s->our_bt_addr, c[i].our_bt_addr, 6);
+	s->cached = s->prog->hdr->logon_start != 0;
+	LOGGER_FMT_INFO("using the cached link values of %s, channel %i", s->tr->addr, s->chan);
+	return s->cached;
+    }
+    return 0;
+}
+
+int session_cache_save(const sb_session_t *s, const char *path)
+{
+    session_cache_t c[SESSION_CACHE_MAX];
+    char tmp[256];
+    FILE *fp;
+    int i, n = session_cache_read(path, c);
+
+    for (i = 0; i < n && memcmp(c[i].sb_bt_addr, s->sb_bt_addr, 6) != 0; i++)
+	;
+    if (i == n){
+	// make room by dropping the least recently confirmed
+	if (n == SESSION_CACHE_MAX){
+	    int j;
+	    for (i = 0, j = 1; j < n; j++){
+		if (c[j].confirmed < c[i].confirmed)
+		    i = j;
+	    }
+	} else {
+	    n++;
+	}
+    }
+    memcpy(c[i].sb_bt_addr, s->sb_bt_addr, 6);
+    memcpy(c[i].serial, s->serial, 4);
+    c[i].chan = s->chan;
+    memcpy(c[i].our_bt_addr, s->our_bt_addr, 6);
+    c[i].confirmed = time(NULL);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL){
+	LOGGER_FMT_ERROR("Could not write %s: %s", tmp, strerror(errno));
+	return -1;
+    }
+    for (i = 0; i < n; i++){
+	const unsigned char *a = c[i].sb_bt_addr, *ser = c[i].serial, *our = c[i].our_bt_addr;
+	fprintf(fp, SESSION_CACHE_FMT, a[5], a[4], a[3], a[2], a[1], a[0], ser[3], ser[2], ser[1], ser[0], c[i].chan,
+		our[5], our[4], our[3], our[2], our[1], our[0], c[i].confirmed);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) < 0){
+	LOGGER_FMT_ERROR("Could not save the session cache to %s: %s", path, strerror(errno));
+	unlink(tmp);
+	return -1;
+    }
+    return 0;
+}
+
+int session_query(sb_session_t *s)
+{
+    if (s->display == DISPLAY_ALL || s->net)
+	return session_query_all(s);
+    return session_run(s, s->prog->hdr->query_start, s->prog->hdr->n_ops);
+}
+
+int session_poll(sb_session_t *s, int *logged_on)
+{
+    int ret;
+
+    if (*logged_on)
+	ret = session_query(s);
+    else {
+	LOGGER_FMT_INFO("connecting to %s", s->tr->addr);
+	ret = session_connect(s);
+	if (ret == 0)
+	    ret = session_logon_and_query(s);
+	if (ret == 0)
+	    ret = 1;
+    }
+    if (ret < 0){
+	// reconnect on the next poll
+	*logged_on = 0;
+	session_close(s);
+	return -1;
+    }
+    *logged_on = 1;
+    return ret;
+}
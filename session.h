@@ -0,0 +1,350 @@
+#ifndef SESSION_H
+#define SESSION_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// A session with an inverter: the connection to it together with the
+// values negotiated and extracted while running the compiled script over it.
+//
+// A reply that doesn't come within resend_ms of its request being sent has the
+// request sent again, with twice the wait each time, until timeout_sec has
+// passed, if the request may be (see SCRIPT_FLAG_RESEND), as may those of
+// session_query_all(). A late reply to a request that was sent again is told
+// from the next by its packet id. Should the link be lost, as when the connection
+// is closed or a reply doesn't come however often asked for, part way through
+// the query section, session_logon_and_query() and session_query() reconnect and
+// run the logon again, then carry on from the request whose reply didn't come,
+// up to reconnects times.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "archive.h"
+#include "frame.h"
+#include "script.h"
+#include "sma.h"
+#include "trace.h"
+#include "transport.h"
+
+// flag to indicate whether instantaneous power, energy so far today, or both should be displayed,
+// and so read by the session
+#define DISPLAY_POWER     0
+#define DISPLAY_ENERGY    1
+#define DISPLAY_BOTH      2
+// display every value that the inverter has, fetched with the queries in sma_all_queries[]
+#define DISPLAY_ALL       3
+
+// default timeout in seconds for reading from socket
+#define SESSION_TIMEOUT_SEC 7
+// most requests that session_query_all() has awaiting replies at once
+#define SESSION_MAX_PENDING 8
+// most inverters in the bluetooth net that a session can talk to
+#define SESSION_MAX_NODES 16
+// default milliseconds that session_logon_and_query() waits for the inverters in the net to identify themselves
+#define SESSION_DISCOVER_MS 2000
+// default milliseconds waited for a reply before its request is sent again, the wait doubling each time
+#define SESSION_RESEND_MS 1000
+// default number of times the link is reconnected to carry on after it is lost
+#define SESSION_RECONNECTS 1
+// most requests of the script, sent one after another, that one reply is waited for to
+#define SESSION_MAX_GROUP 4
+
+// seconds for which the link values kept by session_cache_save() are used, since they were last confirmed
+#define SESSION_CACHE_MAX_AGE 86400
+// most inverters kept in a session cache file
+#define SESSION_CACHE_MAX     64
+
+// values returned by session_step()
+#define SESSION_DONE      0
+#define SESSION_WAIT      1
+
+//! an inverter in the bluetooth net of the one connected to, found by identifying them all
+typedef struct {
+    //! bluetooth address, LSB first
+    unsigned char bt_addr[6];
+    //! SUSyID and serial number, LSB first, to which its requests are addressed
+    unsigned char addr[6];
+    //! its values, from the last session_query_all()
+    sma_values_t values;
+} sb_node_t;
+
+//! a request made by session_query_all() that is awaiting its reply
+typedef struct {
+    const sma_query_t *q;
+    //! SUSyID and serial number of the inverter it was sent to, NULL for any
+    const unsigned char *dst;
+    //! where the values in the reply are stored
+    sma_values_t *values;
+    //! the packet id, with SMA_PKT_ID_FLAG set, that the reply will have
+    uint16_t id;
+    //! times it has been sent again
+    uint8_t resent;
+    //! time, as transport_now_ms(), by which the whole reply is due before the request is sent again,
+    //! and by which it must have been received
+    int64_t deadline;
+    int64_t give_up;
+} session_pending_t;
+
+typedef struct {
+    //! bluetooth address of the inverter in binary, LSB first
+    unsigned char sb_bt_addr[6];
+    //! our bluetooth address in binary, as reported by the inverter
+    unsigned char our_bt_addr[6];
+    //! inverter serial number - converted to sequence of hex bytes, LSB first
+    unsigned char serial[4];
+    //! bluetooth channel as returned from the sb
+    unsigned char chan;
+    //! flag to indicate that chan and our_bt_addr were loaded by session_cache_load(), so that the script
+    //! is started at its logon, skipping the setting up of the link
+    int cached;
+    //! the connection to the inverter
+    transport_t *tr;
+    //! the compiled script
+    const script_prog_t *prog;
+    //! what is read, DISPLAY_xxx, by default DISPLAY_POWER
+    uint8_t display;
+    //! timeout in seconds for each reply, by default SESSION_TIMEOUT_SEC
+    uint8_t timeout_sec;
+    //! number of requests that session_query_all() sends before waiting for their replies, 1 for one
+    //! at a time, by default SESSION_MAX_PENDING
+    uint8_t pipeline_depth;
+    //! milliseconds that session_logon_and_query() waits for the inverters in the net to identify
+    //! themselves, by default SESSION_DISCOVER_MS
+    unsigned discover_ms;
+    //! milliseconds waited for a reply before its request is sent again, by default SESSION_RESEND_MS,
+    //! 0 to never send it again
+    unsigned resend_ms;
+    //! times the link is reconnected to carry on after it is lost, by default SESSION_RECONNECTS
+    uint8_t reconnects;
+    //! script file line number being processed, for logging
+    unsigned script_line_num;
+    //! the frame being sent or being waited for, unescaped, and its length
+    unsigned char frame[SCRIPT_FRAME_MAX];
+    int frame_len;
+    //! bytes read from the socket, from which frames are cut
+    frame_ring_t rx;
+    //! the frame being sent, escaped
+    unsigned char tx[2 * SCRIPT_FRAME_MAX];
+    //! The last frame received, unescaped
+    unsigned char received[FRAME_MAX_LEN];
+    //! length of the frame in received
+    size_t received_len;
+    //! the values decoded from the data records of the replies to the queries
+    sma_values_t values;
+    //! packet id of the last level 2 request made by session_query_all(), each request has its own
+    uint16_t pkt_id;
+    //! what session_start() started: the index of the op it started at, of the next op to run, and of
+    //! the op to stop at
+    uint32_t op_start;
+    uint32_t op_idx;
+    uint32_t op_end;
+    //! packet ids of the level 2 requests of the script sent since the last reply was received
+    uint16_t sent_ids[SESSION_MAX_GROUP];
+    int n_sent_ids;
+    //! times the requests the reply is being waited for to have been sent again, and the time, as
+    //! transport_now_ms(), by which the reply must come however often they're sent
+    unsigned resent;
+    int64_t give_up;
+    //! flag set once a request has been sent again since session_start(), so that a late reply to it
+    //! may yet come
+    int resending;
+    //! flag set if the link has been lost, ie the connection was closed or a reply didn't come in time
+    int link_lost;
+    //! flag to indicate that the ops are to be followed by the queries of session_query_all()
+    int query_all;
+    //! the queries awaiting replies, and the index of the next to be sent, counting through
+    //! sma_all_queries[] for each node in turn
+    session_pending_t pending[SESSION_MAX_PENDING];
+    int n_pending;
+    int next_query;
+    //! flag to indicate that every inverter in the net is to be queried, each through the one connection
+    int net;
+    //! the inverters in the net, if net is set
+    sb_node_t nodes[SESSION_MAX_NODES];
+    int n_nodes;
+    //! flag to indicate that the ops are to be followed by identifying the inverters in the net
+    int discover;
+    //! packet id of the identification request, and when to stop waiting for replies to it
+    uint16_t discover_id;
+    int64_t discover_end;
+    //! the archive being downloaded once the ops have been run, NULL for none
+    archive_t *archive;
+    //! counts, since session_init(), of the connections made, of replies not received in time,
+    //! of frames dropped as their fcs was bad, of requests sent again, and of the times the session
+    //! carried on over a new connection after the link was lost
+    uint32_t connects;
+    uint32_t timeouts;
+    uint32_t bad_fcs;
+    uint32_t resends;
+    uint32_t recoveries;
+    //! where the time of each step of the session is traced, NULL for none
+    trace_t *trace;
+    //! time, as transport_now_ms(), by which the frame being waited for is due, 0 if not waiting
+    int64_t deadline;
+    //! current power being produced (W)
+    int currentpower;
+    //! day's total energy produced (kWh)
+    float dtotal;
+} sb_session_t;
+
+/**
+ * Initialise the passed session. The session is not connected, and reads as DISPLAY_POWER with
+ * the default timeouts, resends and reconnects, which may be changed before it is run.
+ *
+ * @param s The session
+ * @param tr The transport over which the session is to be run
+ * @param sb_bt_addr The same address in binary, LSB first
+ * @param serial The inverter serial number in binary, LSB first
+ * @param prog The compiled script
+ */
+void session_init(sb_session_t *s, transport_t *tr, const unsigned char *sb_bt_addr,
+		  const unsigned char *serial, const script_prog_t *prog);
+
+/**
+ * Connect the session to the inverter
+ *
+ * @return 0 on success, -1 on error, in which case the error has been logged
+ */
+int session_connect(sb_session_t *s);
+
+/**
+ * Start connecting the session to the inverter without waiting, see transport_connect_start()
+ *
+ * @return 0 if connected, 1 if the connection is being made, -1 on error, which has been logged
+ */
+int session_connect_start(sb_session_t *s);
+
+//! close the session's connection, if open
+void session_close(sb_session_t *s);
+
+/**
+ * Start running the ops of the compiled script from op index 'from' up until 'to', optionally
+ * followed by the queries of session_query_all(). Nothing is sent until session_step() is called.
+ * The values are cleared.
+ *
+ * @param s The connected session
+ * @param from Index of the line op to start at
+ * @param to Index of the op to stop at
+ * @param query_all Flag, non zero to follow the ops with session_query_all()
+ */
+void session_start(sb_session_t *s, uint32_t from, uint32_t to, int query_all);
+
+/**
+ * Carry on with what session_start() started as far as can be done without waiting for data from
+ * the inverter. This lets many sessions be run at once from one event loop: call session_input()
+ * when the transport's socket is readable, then session_step() again, or call session_step() once
+ * s->deadline has passed, upon which it sends the request again, fails with a timeout or, while
+ * identifying the inverters in the net, carries on with those that replied. The link is not
+ * reconnected should it be lost, s->link_lost being set.
+ *
+ * @return SESSION_DONE when finished, SESSION_WAIT if waiting for data, which is due by s->deadline,
+ * or -1 on error, in which case the error has been logged
+ */
+int session_step(sb_session_t *s);
+
+/**
+ * Read whatever data the transport has available, without waiting, for session_step()
+ *
+ * @return 0 on success, -1 on error or if the connection was closed
+ */
+int session_input(sb_session_t *s);
+
+/**
+ * Run the ops of the compiled script from op index 'from' up until 'to', or until there
+ * is nothing further to be extracted for s->display
+ *
+ * @param s The connected session
+ * @param from Index of the line op to start at
+ * @param to Index of the op to stop at, usually prog->hdr->n_ops
+ *
+ * @return 0 on success, -1 on error, in which case the error has been logged
+ */
+int session_run(sb_session_t *s, uint32_t from, uint32_t to);
+
+/**
+ * Query a logged on session for every value, using the queries in sma_all_queries[], one
+ * frame each with the reply collected from however many packets it is split over.
+ * The values are left in s->values or, if s->net is set, the queries are made of each
+ * inverter in s->nodes, addressed to it, with the values left in its node.
+ *
+ * Up to s->pipeline_depth queries are sent back to back, each with its own packet id, and each
+ * reply is routed to its query by the id, so a poll costs about one round trip rather than one
+ * per query. Each query must be answered within s->timeout_sec of being sent.
+ *
+ * @return 0 on success, -1 on error
+ */
+int session_query_all(sb_session_t *s);
+
+/**
+ * Run the whole script on a connected session: log on to the inverter, then query it.
+ * If s->display is DISPLAY_ALL, only the logon section of the script is run, followed by
+ * session_query_all(). If s->net is set the same is done, with the inverters in the net
+ * identified in between: the script's logon is broadcast so logs on to all of them.
+ *
+ * @return 0 on success, -1 on error
+ */
+int session_logon_and_query(sb_session_t *s);
+
+//! start, as session_start(), what session_logon_and_query() runs
+void session_start_logon_and_query(sb_session_t *s);
+
+/**
+ * Run the logon section of the script on a connected session, then download the passed archive.
+ *
+ * Up to s->pipeline_depth chunks of the archive are asked for back to back, and the packets of
+ * their replies are routed to them by packet id. Packets with a bad fcs are dropped, and a chunk
+ * that has a packet missing or damaged, or whose next packet isn't received within
+ * s->timeout_sec, is asked for again (see archive_damaged()).
+ *
+ * @return 0 on success, -1 on error, in which case the records up to a->cursor have been handed on
+ */
+int session_archive(sb_session_t *s, archive_t *a);
+
+/**
+ * Load the link values of the session's inverter, ie the bluetooth channel and our address, as kept
+ * in the passed cache file by session_cache_save(), if they were confirmed within
+ * SESSION_CACHE_MAX_AGE. Once loaded, the script is started at its logon (see
+ * script_header_t.logon_start) rather than at the start. Should the inverter not take the logon,
+ * session_logon_and_query() and session_archive() reconnect and run the whole script.
+ *
+ * @param s The session
+ * @param path The cache file
+ *
+ * @return 1 if the values were loaded, 0 if there are none for the inverter or they are too old
+ */
+int session_cache_load(sb_session_t *s, const char *path);
+
+/**
+ * Keep the link values of the session's inverter in the passed cache file, confirmed now, along with
+ * those of the other inverters in it. The file is replaced in one go so that it's never left half written.
+ *
+ * @param s The session, which has run its script
+ * @param path The cache file
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int session_cache_save(const sb_session_t *s, const char *path);
+
+/**
+ * Run only the query section of the script on an already logged on session, or
+ * session_query_all() if s->display is DISPLAY_ALL or s->net is set
+ *
+ * @return 0 on success, -1 on error
+ */
+int session_query(sb_session_t *s);
+
+/**
+ * Poll the inverter as sbread -daemon does, keeping the session logged on between polls: if it is,
+ * only the query section of the script is run by session_query(), else the session connects and runs
+ * the whole script. After an error the connection is closed, to be reopened by the next poll.
+ *
+ * @param s The session
+ * @param logged_on Flag, non zero if the session is logged on, 0 to start with, updated
+ *
+ * @return 1 if the session logged on and was queried, 0 if it was queried, -1 on error
+ */
+int session_poll(sb_session_t *s, int *logged_on);
+
+#endif
@@ -0,0 +1,193 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The latest readings of each inverter in shared memory, see shm.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+//! make the passed slot's sequence number odd, before its reading is written
+static void shm_write_begin(shm_slot_t *slot)
+{
+    // (seq + 1) | 1 rather than seq + 1 so that a slot left odd by a publisher that died is still changed
+    __atomic_store_n(&slot->seq, (slot->seq + 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+//! make the passed slot's sequence number even, once its reading has been written
+static void shm_write_end(shm_slot_t *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+int shm_create(shm_t *shm, const char *name)
+{
+    shm_segment_t *seg;
+    int fd, err, i;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0644)) < 0)
+	return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || ftruncate(fd, sizeof(*seg)) < 0)
+	goto fail;
+    if ((seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	goto fail;
+    if (seg->magic == SHM_MAGIC && seg->version == SHM_VERSION && seg->slot_size == sizeof(shm_slot_t) &&
+	seg->n_slots <= SHM_MAX_INVERTERS){
+	// keep the readings, bar any left half written by a publisher that died
+	for (i = 0; i < seg->n_slots; i++){
+	    if (seg->slots[i].seq & 1){
+		shm_write_begin(&seg->slots[i]);
+		seg->slots[i].reading.values.have = 0;
+		shm_write_end(&seg->slots[i]);
+	    }
+	}
+    } else {
+	// new, or of another layout so that no reader can be using it
+	__atomic_store_n(&seg->magic, 0, __ATOMIC_RELEASE);
+	memset(seg, 0, sizeof(*seg));
+	seg->version = SHM_VERSION;
+	seg->slot_size = sizeof(shm_slot_t);
+	__atomic_store_n(&seg->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    seg->pid = getpid();
+    shm->seg = seg;
+    shm->fd = fd;
+    return 0;
+
+ fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+int shm_publish(shm_t *shm, uint32_t serial, uint32_t time, const sma_values_t *v)
+{
+    shm_segment_t *seg = shm->seg;
+    shm_slot_t *slot;
+    int i;
+
+    if ((i = shm_find(shm, serial)) < 0){
+	if (seg->n_slots == SHM_MAX_INVERTERS){
+	    errno = ENOSPC;
+	    return -1;
+	}
+	// the slot is filled in before it's counted, so readers never see it empty
+	i = seg->n_slots;
+	slot = &seg->slots[i];
+	shm_write_begin(slot);
+	slot->reading.serial = serial;
+	slot->reading.time = time;
+	slot->reading.values = *v;
+	shm_write_end(slot);
+	__atomic_store_n(&seg->n_slots, i + 1, __ATOMIC_RELEASE);
+	return 0;
+    }
+    slot = &seg->slots[i];
+    shm_write_begin(slot);
+    slot->reading.time = time;
+    slot->reading.values = *v;
+    shm_write_end(slot);
+    return 0;
+}
+
+int shm_open_reader(shm_t *shm, const char *name)
+{
+    shm_segment_t *seg;
+    struct stat st;
+    int fd, err;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+	return -1;
+    if (fstat(fd, &st) < 0)
+	goto fail;
+    if (st.st_size < sizeof(*seg)){
+	errno = EPROTO;
+	goto fail;
+    }
+    if ((seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	goto fail;
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || seg->version != SHM_VERSION ||
+	seg->slot_size != sizeof(shm_slot_t)){
+	munmap(seg, sizeof(*seg));
+	errno = EPROTO;
+	goto fail;
+    }
+    shm->seg = seg;
+    shm->fd = fd;
+    return 0;
+
+ fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+int shm_count(const shm_t *shm)
+{
+    uint32_t n = __atomic_load_n(&shm->seg->n_slots, __ATOMIC_ACQUIRE);
+
+    return n < SHM_MAX_INVERTERS ? n : SHM_MAX_INVERTERS;
+}
+
+int shm_find(const shm_t *shm, uint32_t serial)
+{
+    int i, n = shm_count(shm);
+
+    // the serial number of a slot is set before it's counted and never changes
+    for (i = 0; i < n; i++){
+	if (shm->seg->slots[i].reading.serial == serial)
+	    return i;
+    }
+    return -1;
+}
+
+int shm_read(const shm_t *shm, int i, shm_reading_t *r)
+{
+    const shm_slot_t *slot;
+    uint32_t seq;
+    int tries;
+
+    if (i < 0 || i >= shm_count(shm)){
+	errno = ENOENT;
+	return -1;
+    }
+    slot = &shm->seg->slots[i];
+    for (tries = 0; tries < SHM_READ_TRIES; tries++){
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1){
+	    // the publisher takes well under a microsecond to write a reading, so it has been preempted
+	    sched_yield();
+	    continue;
+	}
+	memcpy(r, (const void *)&slot->reading, sizeof(*r));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+	    return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+void shm_close(shm_t *shm)
+{
+    if (shm->seg != NULL)
+	munmap(shm->seg, sizeof(*shm->seg));
+    if (shm->fd >= 0)
+	close(shm->fd);
+    shm->seg = NULL;
+    shm->fd = -1;
+}
@@ -0,0 +1,129 @@
+#ifndef SHM_H
+#define SHM_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The latest readings of each inverter, published by sbread -daemon -shm in a
+// POSIX shared memory segment for other programs on the same host to read,
+// without each of them having to connect to the inverters.
+//
+// The segment holds a slot for each inverter, added when it is first
+// published and kept for the life of the segment, so that a reader can look an
+// inverter up once and keep its index. Each slot is guarded by a seqlock: the
+// publisher makes the slot's sequence number odd while it writes the reading
+// and even again after, and a reader copies the reading, retrying if the
+// sequence number was odd or changed meanwhile. So readers take no locks and
+// never hold up the publisher, which is the only writer.
+//
+// The reader side is built on its own as libsbshm.a, needing only this header,
+// sma.h and -lrt.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "sma.h"
+
+//! the segment published by default
+#define SHM_NAME_DEFAULT   "/sbread"
+//! marks a segment that has been set up, "SBSH"
+#define SHM_MAGIC          0x48534253
+//! changed whenever the layout of the segment changes
+#define SHM_VERSION        1
+//! most inverters whose readings are published
+#define SHM_MAX_INVERTERS  64
+//! times a reader retries a slot being written before giving up, as when the publisher died in the midst of it
+#define SHM_READ_TRIES     1000
+
+//! a reading of an inverter, as published
+typedef struct {
+    //! the inverter's serial number, 0 for none
+    uint32_t serial;
+    //! unix time of the poll that read it
+    uint32_t time;
+    sma_values_t values;
+} shm_reading_t;
+
+//! a slot, given a cache line of its own so that writing one doesn't disturb readers of the others
+typedef struct {
+    //! odd while the reading is being written
+    uint32_t seq;
+    shm_reading_t reading;
+} __attribute__((aligned(64))) shm_slot_t;
+
+//! the segment
+typedef struct {
+    //! SHM_MAGIC once the segment has been set up, and the layout, checked by readers
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    //! process id of the last publisher
+    uint32_t pid;
+    //! number of slots used, which only grows
+    uint32_t n_slots;
+    shm_slot_t slots[SHM_MAX_INVERTERS];
+} shm_segment_t;
+
+//! a segment, as mapped by the publisher or a reader
+typedef struct {
+    shm_segment_t *seg;
+    int fd;
+} shm_t;
+
+/**
+ * Create the passed segment, or take over the one left by the last publisher, whose readings are
+ * kept. Only one process may publish to a segment at a time.
+ *
+ * @param shm The segment
+ * @param name The segment's name, eg SHM_NAME_DEFAULT
+ *
+ * @return 0 on success, -1 on error with errno set, EWOULDBLOCK if another process is publishing to it
+ */
+int shm_create(shm_t *shm, const char *name);
+
+/**
+ * Publish a reading of an inverter, replacing the last one
+ *
+ * @param shm The segment, as created by shm_create()
+ * @param serial The inverter's serial number
+ * @param time Unix time of the poll
+ * @param v The values read
+ *
+ * @return 0 on success, -1 with errno ENOSPC if there's no slot left for a new inverter
+ */
+int shm_publish(shm_t *shm, uint32_t serial, uint32_t time, const sma_values_t *v);
+
+/**
+ * Map the passed segment for reading
+ *
+ * @param shm The segment
+ * @param name The segment's name
+ *
+ * @return 0 on success, -1 on error with errno set, ENOENT if there's no such segment and EPROTO if
+ * it hasn't been set up or is of another layout
+ */
+int shm_open_reader(shm_t *shm, const char *name);
+
+//! return the number of inverters published
+int shm_count(const shm_t *shm);
+
+//! return the index of the inverter with the passed serial number, which stays the same, or -1 if it isn't published
+int shm_find(const shm_t *shm, uint32_t serial);
+
+/**
+ * Read the latest reading of an inverter
+ *
+ * @param shm The segment
+ * @param i The inverter's index, 0 to shm_count() - 1
+ * @param r Set to the reading
+ *
+ * @return 0 on success, -1 with errno ENOENT if there's no such inverter, or EAGAIN if its slot was
+ * being written throughout SHM_READ_TRIES tries
+ */
+int shm_read(const shm_t *shm, int i, shm_reading_t *r);
+
+//! unmap the passed segment, which is left for the next publisher or reader
+void shm_close(shm_t *shm);
+
+#endif
@@ -0,0 +1,858 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Simulator of the inverter, see sim.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "crc.h"
+#include "frame.h"
+#include "logger.h"
+#include "sim.h"
+#include "sma.h"
+
+//! the inverter that sbread.script was recorded from, and the address that it gave the client
+static const unsigned char sim_sb_bt_addr[6] = { 0x60, 0x77, 0xa6, 0x25, 0x80, 0x00 };
+static const unsigned char sim_our_bt_addr[6] = { 0x1d, 0x7e, 0x3c, 0x13, 0x15, 0x00 };
+static const unsigned char sim_serial[4] = { 0x9f, 0x04, 0xf9, 0x7e };
+//! SUSyID of the inverter
+#define SIM_SUSYID 0x008a
+
+//! number of connections served, which are numbered from 1, and of the logons received on them
+static unsigned sim_connects = 0;
+static unsigned sim_logons = 0;
+
+//! return a hash of x, whose bits are as good as random
+static uint32_t sim_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+//! state of one simulated connection
+typedef struct {
+    const sim_config_t *cfg;
+    int fd;
+    //! bytes received, from which frames are cut
+    frame_ring_t rx;
+    //! the frame being built from the script
+    unsigned char fl[SCRIPT_FRAME_MAX];
+    //! flags, one per byte of fl, set for the bytes of a received frame that are to be checked
+    unsigned char care[SCRIPT_FRAME_MAX];
+    //! the frame being sent, escaped, or the frame received, unescaped
+    unsigned char buf[2 * FRAME_MAX_LEN];
+    //! the start of the last level 2 request received, up to its data records, which the reply is made from
+    unsigned char req[SMA_L2_DATA_OFF];
+    //! time, as sim_now_us(), that the bytes holding the frame being answered were received
+    int64_t rx_us;
+    //! count of the archive packets sent
+    unsigned archive_packets;
+    //! flag to indicate that a logon on a link that hasn't been set up was ignored, as is all that follows
+    int rejected;
+    //! count of the frames received, and of those in the query section, and the connection's number,
+    //! from which the frames lost are picked
+    unsigned frames;
+    unsigned query_frames;
+    unsigned conn_num;
+} sim_conn_t;
+
+//! return the monotonic time in microseconds
+static int64_t sim_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t sim_archive_wh(const sim_config_t *cfg, unsigned k, uint32_t t)
+{
+    return cfg->values.total_wh + k + t / 60;
+}
+
+void sim_config_init(sim_config_t *cfg, const script_prog_t *prog)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->prog = prog;
+    memcpy(cfg->sb_bt_addr, sim_sb_bt_addr, sizeof(cfg->sb_bt_addr));
+    memcpy(cfg->our_bt_addr, sim_our_bt_addr, sizeof(cfg->our_bt_addr));
+    memcpy(cfg->serial, sim_serial, sizeof(cfg->serial));
+    cfg->chan = 1;
+    cfg->net_size = 1;
+    cfg->timeout_ms = 10000;
+    cfg->l1_max = SIM_L1_MAX;
+
+    sma_values_t *v = &cfg->values;
+    v->have = SMA_HAVE(SMA_VAL_COUNT) - 1;
+    v->ac_power = 3077;
+    v->ac_phase_power[0] = 1027;
+    v->ac_phase_power[1] = 1024;
+    v->ac_phase_power[2] = 1026;
+    v->ac_voltage[0] = 23412;
+    v->ac_voltage[1] = 23388;
+    v->ac_voltage[2] = 23450;
+    v->ac_current[0] = 4386;
+    v->ac_current[1] = 4378;
+    v->ac_current[2] = 4375;
+    v->grid_freq = 5002;
+    v->dc_power[0] = 1650;
+    v->dc_power[1] = 1562;
+    v->dc_voltage[0] = 38520;
+    v->dc_voltage[1] = 37940;
+    v->dc_current[0] = 4283;
+    v->dc_current[1] = 4117;
+    v->total_wh = 21843211;
+    v->day_wh = 13400;
+    v->op_time = 41539221;
+    v->feed_in_time = 39872116;
+}
+
+/**
+ * Make up the frame for the passed R or S line op in c->fl, flagging in c->care the bytes that
+ * a received frame is to be checked against
+ *
+ * @return The length of the frame
+ */
+static size_t sim_build_frame(sim_conn_t *c, const script_op_t *op)
+{
+    const sim_config_t *cfg = c->cfg;
+    const script_op_t *el = op + 1;
+    const script_op_t *el_end = el + op->n;
+    size_t len = 0;
+
+    for (; el < el_end; el++) {
+	const unsigned char *src = NULL;
+	switch (el->code) {
+	    case SCRIPT_EL_BYTES:
+		src = cfg->prog->pool + el->off;
+		break;
+	    case SCRIPT_EL_ADDR:
+		src = cfg->sb_bt_addr;
+		break;
+	    case SCRIPT_EL_ADD2:
+		src = cfg->our_bt_addr;
+		break;
+	    case SCRIPT_EL_SER:
+		src = cfg->serial;
+		break;
+	    case SCRIPT_EL_CHAN:
+		src = &cfg->chan;
+		break;
+	}
+	if (src != NULL) {
+	    memcpy(c->fl + len, src, el->n);
+	    memset(c->care + len, 1, el->n);
+	} else {
+	    // $TIME and $CRC, which can't be known in advance
+	    memset(c->fl + len, 0, el->n);
+	    memset(c->care + len, 0, el->n);
+	}
+	len += el->n;
+    }
+    // the length and checksum depend on how the frame was escaped
+    if (len >= 4)
+	memset(c->care + 1, 0, 3);
+    return len;
+}
+
+/**
+ * Append the data records holding the values that the passed E line op extracts with $POW and $DTOT
+ * to the frame of len bytes in c->fl, preceded by the level 2 packet header of the reply to the last
+ * request received. The part of the header given by the script line is left as it is.
+ *
+ * @return The length of the frame
+ */
+static size_t sim_put_records(sim_conn_t *c, const script_op_t *op, size_t len)
+{
+    const sim_config_t *cfg = c->cfg;
+    const script_op_t *el = op + 1;
+    const script_op_t *el_end = el + op->n;
+    unsigned char hdr[SMA_L2_DATA_OFF];
+    unsigned char *p = c->fl + SMA_L2_DATA_OFF;
+    uint32_t now = time(NULL);
+    uint32_t n = 0;
+
+    if (len > SMA_L2_DATA_OFF)
+	return len;
+    for (; el < el_end; el++) {
+	switch (el->code) {
+	    case SCRIPT_EL_POW:
+		p += sma_put_record(p, 1, SMA_OBJ_AC_POWER, now, cfg->values.ac_power);
+		n++;
+		break;
+	    case SCRIPT_EL_DTOT:
+		p += sma_put_record(p, 1, SMA_OBJ_TOTAL_WH, now, cfg->values.total_wh);
+		p += sma_put_record(p, 1, SMA_OBJ_DAY_WH, now, cfg->values.day_wh);
+		n += 2;
+		break;
+	}
+    }
+    if (n == 0)
+	return len;
+
+    memset(hdr, 0, sizeof(hdr));
+    hdr[FRAME_L1_HEADER_LEN] = FRAME_SOF;
+    sma_put_u32(hdr + SMA_L2_SIG_OFF, 0x656003ff);
+    hdr[SMA_L2_LEN_OFF] = SMA_L2_HEADER_WORDS + (p - c->fl - SMA_L2_DATA_OFF) / 4;
+    hdr[SMA_L2_CTRL_OFF] = 0x90;
+    // to whoever sent the request, from us
+    memcpy(hdr + SMA_L2_DST_OFF, c->req + SMA_L2_SRC_OFF, 6);
+    // control 2, as in the replies in sbread.script
+    hdr[SMA_L2_DST_OFF + 7] = 0xa0;
+    sma_put_u16(hdr + SMA_L2_SRC_OFF, SIM_SUSYID);
+    memcpy(hdr + SMA_L2_SRC_OFF + 2, cfg->serial, 4);
+    memcpy(hdr + SMA_L2_PKT_ID_OFF, c->req + SMA_L2_PKT_ID_OFF, 2);
+    memcpy(hdr + SMA_L2_CMD_OFF, c->req + SMA_L2_CMD_OFF, 4);
+    hdr[SMA_L2_CMD_OFF] |= 0x01;
+    sma_put_u32(hdr + SMA_L2_FIRST_OFF, 0);
+    sma_put_u32(hdr + SMA_L2_LAST_OFF, n - 1);
+    memcpy(c->fl + len, hdr + len, sizeof(hdr) - len);
+    return p - c->fl;
+}
+
+//! set the fields that the passed E line op extracts from the level 1 header, return the length of the frame
+static size_t sim_set_fields(sim_conn_t *c, const script_op_t *op, size_t len)
+{
+    const sim_config_t *cfg = c->cfg;
+    const script_op_t *el = op + 1;
+    const script_op_t *el_end = el + op->n;
+
+    for (; el < el_end; el++) {
+	if (el->code != SCRIPT_EL_ADD2 && el->code != SCRIPT_EL_CHAN)
+	    continue;
+	if (el->off > len)
+	    memset(c->fl + len, 0, el->off - len);
+	if (el->code == SCRIPT_EL_ADD2)
+	    memcpy(c->fl + el->off, cfg->our_bt_addr, el->n);
+	else
+	    c->fl[el->off] = cfg->chan;
+	if (el->off + el->n > len)
+	    len = el->off + el->n;
+    }
+    return len;
+}
+
+/**
+ * Escape the level 2 part of the len bytes in c->fl, which end at the fcs, into c->buf,
+ * and close it with the end of frame marker
+ *
+ * @return Length of the escaped frame
+ */
+static size_t sim_escape(sim_conn_t *c, size_t len)
+{
+    size_t start = FRAME_L1_HEADER_LEN + 1;
+    size_t n;
+
+    memcpy(c->buf, c->fl, start);
+    n = start + codec_escape(c->buf + start, c->fl + start, len - start);
+    c->buf[n++] = FRAME_SOF;
+    return n;
+}
+
+//! append the fcs to the len bytes in c->fl, then escape them into c->buf, returning the escaped length
+static size_t sim_put_fcs(sim_conn_t *c, size_t len)
+{
+    uint16_t fcs = crc_calc_crc(CRC_PPPINITFCS16, c->fl + SCRIPT_CRC_START, len - SCRIPT_CRC_START) ^ 0xffff;
+    c->fl[len] = fcs & 0xff;
+    c->fl[len + 1] = fcs >> 8;
+    return sim_escape(c, len + 2);
+}
+
+/**
+ * Pad the level 2 packet of len bytes in c->fl with zeros to the length given in its header, then
+ * if it isn't too long for a frame of want bytes, with copies of its last data record until it is.
+ * Then append its fcs and escape it into c->buf.
+ *
+ * @return Length of the escaped frame
+ */
+static size_t sim_build_packet(sim_conn_t *c, size_t len, size_t want)
+{
+    size_t words = len > SMA_L2_LEN_OFF ? c->fl[SMA_L2_LEN_OFF] : 0;
+    size_t end;
+
+    if (len > SMA_L2_LEN_OFF + 4 * words)
+	words = (len - SMA_L2_LEN_OFF + 3) / 4;
+    // with its fcs and the closing 0x7e. The records of a packet are all the same length, so it's
+    // made longer by whole records
+    if (SMA_L2_LEN_OFF + 4 * words + 3 <= want && len > SMA_L2_DATA_OFF) {
+	uint32_t first = sma_get_u32(c->fl + SMA_L2_FIRST_OFF);
+	uint32_t n = sma_get_u32(c->fl + SMA_L2_LAST_OFF) - first + 1;
+	size_t rec = n ? (len - SMA_L2_DATA_OFF) / n : 0;
+	for (; rec && len + 3 <= want && len + rec + 2 <= sizeof(c->fl); len += rec, n++)
+	    memcpy(c->fl + len, c->fl + len - rec, rec);
+	sma_put_u32(c->fl + SMA_L2_LAST_OFF, first + n - 1);
+	words = (len - SMA_L2_LEN_OFF + 3) / 4;
+    }
+    while (SMA_L2_LEN_OFF + 4 * words + 3 <= want)
+	words++;
+    if (SMA_L2_LEN_OFF + 4 * words + 2 > sizeof(c->fl))
+	words = (sizeof(c->fl) - 2 - SMA_L2_LEN_OFF) / 4;
+    end = SMA_L2_LEN_OFF + 4 * words;
+    if (len < end)
+	memset(c->fl + len, 0, end - len);
+    c->fl[SMA_L2_LEN_OFF] = words;
+    return sim_put_fcs(c, end);
+}
+
+/**
+ * Make up the frame to be sent for the passed R line op in c->buf, escaped and with its level 1
+ * header length and checksum set. If the line's level 1 command is SMA_L1_CMD_L2_PART, the frame
+ * is only the first part of the reply, so the whole level 2 packet is made up, to be split over
+ * several frames by sim_send_split().
+ *
+ * @param first Set to the length of the first frame, less than the length returned if the reply is
+ * to be split
+ *
+ * @return The length of the frame, or of the whole reply if it is to be split
+ */
+static size_t sim_build_reply(sim_conn_t *c, const script_op_t *op, const script_op_t *op_end, size_t *first)
+{
+    const script_op_t *next = op + 1 + op->n;
+    size_t len = sim_build_frame(c, op);
+    size_t want, n;
+    int i;
+
+    *first = 0;
+
+    if (len < 4)
+	return 0;
+    want = c->fl[1] | (c->fl[2] << 8);
+    if (want > FRAME_MAX_LEN)
+	want = FRAME_MAX_LEN;
+    if (next < op_end && next->code == SCRIPT_OP_EXTRACT) {
+	len = sim_set_fields(c, next, len);
+	len = sim_put_records(c, next, len);
+    }
+
+    if (len <= FRAME_L1_HEADER_LEN || c->fl[FRAME_L1_HEADER_LEN] != FRAME_SOF) {
+	// level 1 only, no escaping
+	if (len < want) {
+	    memset(c->fl + len, 0, want - len);
+	    len = want;
+	}
+	memcpy(c->buf, c->fl, len);
+	n = len;
+    } else if (c->fl[len - 1] == FRAME_SOF) {
+	// the line gives the whole frame, fcs and all
+	n = sim_escape(c, len - 1);
+    } else if (sma_get_u16(c->fl + 16) == SMA_L1_CMD_L2_PART) {
+	*first = want;
+	return sim_build_packet(c, len, want);
+    } else {
+	// pad the frame until, with its fcs, it escapes to the length in the header
+	size_t start = len;
+	for (n = 0; len + 2 < sizeof(c->fl); len++) {
+	    n = sim_put_fcs(c, len);
+	    if (n >= want)
+		break;
+	    c->fl[len] = 0;
+	}
+	// the fcs may have needed escaping, overshooting by a byte, so try other values for the last padding byte
+	for (i = 1; n > want && len > start && i < 0x100; i++) {
+	    c->fl[len - 1] = i;
+	    n = sim_put_fcs(c, len);
+	}
+    }
+    if (n != want)
+	LOGGER_FMT_WARN("sim: script line %u: frame is %u bytes rather than %u", op->line, (unsigned)n, (unsigned)want);
+    c->buf[1] = n & 0xff;
+    c->buf[2] = (n >> 8) & 0xff;
+    c->buf[3] = c->buf[0] ^ c->buf[1] ^ c->buf[2];
+    *first = n;
+    return n;
+}
+
+/**
+ * Send the len bytes in buf, once the configured delay has passed since the frame being
+ * answered was received, and in fragments if configured
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_write(sim_conn_t *c, const unsigned char *buf, size_t len)
+{
+    size_t frag = c->cfg->frag ? c->cfg->frag : len;
+    size_t done = 0;
+
+    if (c->cfg->delay_us) {
+	int64_t wait = c->rx_us + c->cfg->delay_us - sim_now_us();
+	if (wait > 0)
+	    usleep(wait);
+    }
+    while (done < len) {
+	size_t n = len - done < frag ? len - done : frag;
+	ssize_t ret = send(c->fd, buf + done, n, MSG_NOSIGNAL);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EPIPE || errno == ECONNRESET)
+		return 1;
+	    LOGGER_FMT_ERROR("sim: send failed: %s", strerror(errno));
+	    return -1;
+	}
+	done += ret;
+    }
+    return 0;
+}
+
+/**
+ * Send the escaped level 2 packet of len bytes in c->buf split over several level 1 frames, as the
+ * inverter sends one too long for a frame: the first of first bytes, then the rest in frames of at
+ * most l1_max bytes, each with the level 1 header of the first. The level 1 command of each but the
+ * last is SMA_L1_CMD_L2_PART.
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_send_split(sim_conn_t *c, size_t len, size_t first, size_t l1_max)
+{
+    unsigned char frame[FRAME_MAX_LEN];
+    size_t done = first, n = first;
+    int ret;
+
+    memcpy(frame, c->buf, first);
+    for (;;) {
+	sma_put_u16(frame + 16, done < len ? SMA_L1_CMD_L2_PART : SMA_L1_CMD_L2);
+	frame[1] = n & 0xff;
+	frame[2] = (n >> 8) & 0xff;
+	frame[3] = frame[0] ^ frame[1] ^ frame[2];
+	if ((ret = sim_write(c, frame, n)) != 0 || done == len)
+	    return ret;
+	n = len - done < l1_max - FRAME_L1_HEADER_LEN ? len - done : l1_max - FRAME_L1_HEADER_LEN;
+	// an escaped byte is sent in the same frame as its escape
+	if (done + n < len && c->buf[done + n - 1] == CODEC_ESC)
+	    n--;
+	memcpy(frame + FRAME_L1_HEADER_LEN, c->buf + done, n);
+	done += n;
+	n += FRAME_L1_HEADER_LEN;
+    }
+}
+
+//! send the reply for the passed R line op
+static int sim_send(sim_conn_t *c, const script_op_t *op, const script_op_t *op_end)
+{
+    size_t first, len = sim_build_reply(c, op, op_end, &first);
+
+    if (first < len)
+	return sim_send_split(c, len, first, c->cfg->l1_max ? c->cfg->l1_max : first);
+    return sim_write(c, c->buf, len);
+}
+
+//! set up the level 2 header of the reply to the query in c->req, from inverter k of the net
+static void sim_reply_header(sim_conn_t *c, unsigned k, const sma_query_t *q, sma_packet_t *pkt)
+{
+    const sim_config_t *cfg = c->cfg;
+
+    memset(pkt, 0, sizeof(*pkt));
+    memcpy(pkt->bt_src, cfg->sb_bt_addr, 6);
+    pkt->bt_src[0] += k;
+    memcpy(pkt->bt_dst, cfg->our_bt_addr, 6);
+    memcpy(pkt->dst, c->req + SMA_L2_SRC_OFF, 6);
+    sma_put_u16(pkt->src, SIM_SUSYID);
+    memcpy(pkt->src + 2, cfg->serial, 4);
+    pkt->src[2] += k;
+    pkt->ctrl = 0x90;
+    pkt->ctrl2 = 0xa000;
+    pkt->pkt_id = sma_get_u16(c->req + SMA_L2_PKT_ID_OFF);
+    pkt->cmd = q->cmd | SMA_CMD_REPLY;
+}
+
+/**
+ * Finish the frame of len bytes, up to the end of its data records, in c->fl and send it
+ *
+ * @param corrupt Flag, non zero to damage a byte of the frame after its fcs has been worked out
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_send_packet(sim_conn_t *c, size_t len, int corrupt)
+{
+    len = sma_finish_frame(c->fl, len);
+    if (corrupt)
+	c->fl[SMA_L2_DATA_OFF] ^= 0x01;
+    len = sim_escape(c, len - 1);
+    if (c->cfg->l1_max && len > c->cfg->l1_max)
+	return sim_send_split(c, len, c->cfg->l1_max, c->cfg->l1_max);
+    c->buf[1] = len & 0xff;
+    c->buf[2] = (len >> 8) & 0xff;
+    c->buf[3] = c->buf[0] ^ c->buf[1] ^ c->buf[2];
+    return sim_write(c, c->buf, len);
+}
+
+/**
+ * Answer the archive query in q as inverter k of the net, with a record for every step of the
+ * archive in the range asked for up to now, newest first, SIM_ARCHIVE_RECS to a packet
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_answer_archive(sim_conn_t *c, unsigned k, const sma_query_t *q)
+{
+    const sim_config_t *cfg = c->cfg;
+    uint32_t step = q->cmd == SMA_CMD_ARCHIVE_MONTH ? SMA_ARCHIVE_MONTH_STEP : SMA_ARCHIVE_DAY_STEP;
+    uint32_t now = time(NULL), first, last, t;
+    sma_packet_t pkt;
+    int n, ret;
+
+    sim_reply_header(c, k, q, &pkt);
+    first = q->first + (step - q->first % step) % step;
+    last = q->last < now ? q->last : now;
+    last -= last % step;
+    n = first <= last ? (last - first) / step + 1 : 0;
+    if (n == 0)
+	pkt.error = 0x0015;
+    t = last;
+    do {
+	int m = n < SIM_ARCHIVE_RECS ? n : SIM_ARCHIVE_RECS;
+	size_t len;
+	n -= m;
+	pkt.first = 0;
+	pkt.last = m ? m - 1 : 0;
+	pkt.fragment = (n + SIM_ARCHIVE_RECS - 1) / SIM_ARCHIVE_RECS;
+	len = sma_put_header(c->fl, &pkt);
+	for (; m > 0; m--, t -= step){
+	    sma_put_u32(c->fl + len, t);
+	    sma_put_u64(c->fl + len + 4, sim_archive_wh(cfg, k, t));
+	    len += SMA_ARCHIVE_REC_LEN;
+	}
+	// the last packet of a reply is left alone, as its loss would only show as a timeout
+	c->archive_packets++;
+	if ((ret = sim_send_packet(c, len, cfg->corrupt && pkt.fragment && c->archive_packets % cfg->corrupt == 0)) != 0)
+	    return ret;
+    } while (n > 0);
+    return 0;
+}
+
+/**
+ * Answer the query in q as inverter k of the net, from the simulated values, with as many packets
+ * as cfg->max_records makes it. The header of the query is in c->req.
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_answer_as(sim_conn_t *c, unsigned k, const sma_query_t *q)
+{
+    const sim_config_t *cfg = c->cfg;
+    sma_item_t items[SMA_VAL_COUNT];
+    sma_values_t v = cfg->values;
+    sma_packet_t pkt;
+    uint32_t now = time(NULL);
+    int n = 0, per, i, ret;
+
+    if (q->cmd == SMA_CMD_ARCHIVE_DAY || q->cmd == SMA_CMD_ARCHIVE_MONTH)
+	return sim_answer_archive(c, k, q);
+    v.ac_power += k;
+    sim_reply_header(c, k, q, &pkt);
+    if (q->cmd != SMA_CMD_IDENT) {
+	n = sma_select(&v, q, items, SMA_VAL_COUNT);
+	// no such objects
+	if (n == 0)
+	    pkt.error = 0x0015;
+    }
+
+    per = cfg->max_records ? (int)cfg->max_records : SMA_VAL_COUNT;
+    i = 0;
+    do {
+	int m = n - i < per ? n - i : per;
+	size_t len;
+
+	pkt.first = i;
+	pkt.last = m ? i + m - 1 : i;
+	pkt.fragment = (n - i - m + per - 1) / per;
+	len = sma_put_header(c->fl, &pkt);
+	for (; m > 0; m--, i++)
+	    len += sma_put_record(c->fl + len, items[i].cls, items[i].obj, now, items[i].value);
+	if ((ret = sim_send_packet(c, len, 0)) != 0)
+	    return ret;
+    } while (i < n);
+    return 0;
+}
+
+/**
+ * Answer the query, unescaped in c->buf, as each inverter of the net that it is addressed to
+ *
+ * @return 0 on success, 1 if the client has closed the connection, -1 on error
+ */
+static int sim_answer(sim_conn_t *c)
+{
+    const sim_config_t *cfg = c->cfg;
+    static const unsigned char broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    unsigned char addr[6];
+    sma_query_t q;
+    unsigned k;
+    int ret;
+
+    memcpy(c->req, c->buf, sizeof(c->req));
+    q.cmd = sma_get_u32(c->req + SMA_L2_CMD_OFF);
+    q.first = sma_get_u32(c->req + SMA_L2_FIRST_OFF);
+    q.last = sma_get_u32(c->req + SMA_L2_LAST_OFF);
+    sma_put_u16(addr, SIM_SUSYID);
+    memcpy(addr + 2, cfg->serial, 4);
+    for (k = 0; k < (cfg->net_size ? cfg->net_size : 1); k++, addr[2]++) {
+	if (memcmp(c->req + SMA_L2_DST_OFF, broadcast, 6) != 0 && memcmp(c->req + SMA_L2_DST_OFF, addr, 6) != 0)
+	    continue;
+	if ((ret = sim_answer_as(c, k, &q)) != 0)
+	    return ret;
+    }
+    return 0;
+}
+
+//! flag to indicate whether the len byte frame in c->buf is a query, that sim_answer() can reply to
+static int sim_is_query(const sim_conn_t *c, size_t len)
+{
+    const unsigned char *p = c->buf;
+    return len >= SMA_L2_DATA_OFF && p[FRAME_L1_HEADER_LEN] == FRAME_SOF && p[SMA_L2_CMD_OFF] == 0x00 &&
+	p[SMA_L2_CMD_OFF + 1] == 0x02;
+}
+
+/**
+ * Check the len byte frame in c->buf against the passed S line op
+ *
+ * @param want Set to the length of the frame expected
+ *
+ * @return The index of the first byte that differs, len if the frame is the one expected
+ */
+static size_t sim_match(sim_conn_t *c, const script_op_t *op, size_t len, size_t *want)
+{
+    size_t i;
+
+    // sim_answer() overwrites c->fl, so the frame is made up afresh each time
+    *want = sim_build_frame(c, op);
+    for (i = 0; len == *want && i < len && (!c->care[i] || c->buf[i] == c->fl[i]); i++)
+	;
+    return len == *want ? i : 0;
+}
+
+/**
+ * Find the S line op that the len byte frame in c->buf is, from the passed op up to the passed end
+ *
+ * @param to_recv Flag, non zero to stop at the first R line op
+ *
+ * @return The op, NULL if none
+ */
+static const script_op_t *sim_find_request(sim_conn_t *c, const script_op_t *from, const script_op_t *to, int to_recv,
+					   size_t len)
+{
+    size_t want;
+
+    for (; from < to && !(to_recv && from->code == SCRIPT_OP_RECV); from += 1 + from->n) {
+	if (from->code == SCRIPT_OP_SEND && sim_match(c, from, len, &want) == len && len == want)
+	    return from;
+    }
+    return NULL;
+}
+
+/**
+ * Wait for the frame described by the passed S line op and check it, answering any other queries
+ * received in the meantime. Before the logon, the first S line of the logon is also taken, as
+ * sent by a session that skips setting up the link, unless cfg->reject_shortcut is set, and in
+ * the query section those after it, as sent by a session carrying on over a new connection from
+ * where the link was lost. Frames are ignored as cfg->drop and cfg->fade say, as are those of
+ * the S lines before the passed one, as sent again, and those after it up to the next R line,
+ * the frame of the passed one having been lost.
+ *
+ * @param skip Set to the S line op received, if another than the passed one
+ *
+ * @return 0 on success, 2 if the S line op in skip was received instead, 1 if the client has
+ * closed the connection, -1 on error or timeout
+ */
+static int sim_recv(sim_conn_t *c, const script_op_t *op, const script_op_t **skip)
+{
+    const script_prog_t *prog = c->cfg->prog;
+    const script_op_t *logon = prog->hdr->logon_start ? &prog->ops[prog->hdr->logon_start] : NULL;
+    const script_op_t *next = op + 1 + op->n, *op_end = prog->ops + prog->hdr->n_ops;
+    size_t want, len, i, logon_want;
+    int ret;
+
+    *skip = NULL;
+    for (;;) {
+	while ((len = frame_next(&c->rx, c->buf, sizeof(c->buf))) == 0) {
+	    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+	    size_t space;
+	    unsigned char *p = frame_ring_space(&c->rx, &space);
+	    ssize_t n;
+
+	    while ((ret = poll(&pfd, 1, c->cfg->timeout_ms)) < 0 && errno == EINTR)
+		;
+	    if (ret <= 0) {
+		LOGGER_FMT_ERROR("sim: script line %u: %s", op->line, ret ? strerror(errno) : "timeout");
+		return -1;
+	    }
+	    if ((n = recv(c->fd, p, space, 0)) <= 0)
+		return n == 0 || errno == ECONNRESET ? 1 : -1;
+	    frame_ring_commit(&c->rx, n);
+	    c->rx_us = sim_now_us();
+	}
+	if (c->rejected)
+	    continue;
+	c->frames++;
+	if (op >= &prog->ops[prog->hdr->query_start])
+	    c->query_frames++;
+	if ((c->cfg->drop && sim_hash(c->conn_num * 0x10000 + c->frames) % c->cfg->drop == 0) ||
+	    (c->cfg->fade && c->query_frames >= c->cfg->fade)) {
+	    LOGGER_FMT_DEBUG("sim: script line %u: lost a frame", op->line);
+	    continue;
+	}
+	if ((i = sim_match(c, op, len, &want)) == len && len == want)
+	    break;
+	if (logon != NULL && op < logon && sim_match(c, logon, len, &logon_want) == len && len == logon_want) {
+	    if (!c->cfg->reject_shortcut) {
+		*skip = logon;
+		break;
+	    }
+	    LOGGER_FMT_INFO("sim: script line %u: ignoring a logon on a link that hasn't been set up", op->line);
+	    c->rejected = 1;
+	    continue;
+	}
+	if (op >= &prog->ops[prog->hdr->query_start] && (*skip = sim_find_request(c, next, op_end, 0, len)) != NULL) {
+	    LOGGER_FMT_DEBUG("sim: script line %u: carrying on from script line %u", op->line, (*skip)->line);
+	    break;
+	}
+	if (!sim_is_query(c, len)) {
+	    if (sim_find_request(c, prog->ops, op, 0, len) != NULL || sim_find_request(c, next, op_end, 1, len) != NULL) {
+		LOGGER_FMT_DEBUG("sim: script line %u: ignoring another request", op->line);
+		continue;
+	    }
+	    if (len != want)
+		LOGGER_FMT_ERROR("sim: script line %u: received %u byte frame, expected %u", op->line, (unsigned)len, (unsigned)want);
+	    else
+		LOGGER_FMT_ERROR("sim: script line %u: received frame differs at byte %u", op->line, (unsigned)i);
+	    return -1;
+	}
+	if ((ret = sim_answer(c)) != 0)
+	    return ret;
+    }
+    if (len >= SMA_L2_DATA_OFF && c->buf[FRAME_L1_HEADER_LEN] == FRAME_SOF)
+	memcpy(c->req, c->buf, sizeof(c->req));
+    if ((*skip != NULL ? *skip : op) == logon)
+	__atomic_add_fetch(&sim_logons, 1, __ATOMIC_RELAXED);
+    return *skip != NULL ? 2 : 0;
+}
+
+void sim_counts(unsigned *connects, unsigned *logons)
+{
+    *connects = __atomic_load_n(&sim_connects, __ATOMIC_RELAXED);
+    *logons = __atomic_load_n(&sim_logons, __ATOMIC_RELAXED);
+}
+
+int sim_serve(int fd, const sim_config_t *cfg)
+{
+    const script_prog_t *prog = cfg->prog;
+    const script_op_t *op_end = prog->ops + prog->hdr->n_ops;
+    sim_conn_t *c = malloc(sizeof(*c));
+    uint32_t op_idx = 0;
+    int ret = 0;
+
+    if (c == NULL) {
+	LOGGER_ERROR("sim: out of memory");
+	close(fd);
+	return -1;
+    }
+    c->cfg = cfg;
+    c->fd = fd;
+    c->archive_packets = 0;
+    c->rejected = 0;
+    c->frames = 0;
+    c->query_frames = 0;
+    // a different run of losses on each connection
+    c->conn_num = __atomic_add_fetch(&sim_connects, 1, __ATOMIC_RELAXED);
+    memset(c->req, 0, sizeof(c->req));
+    frame_ring_init(&c->rx);
+    // the first frame is sent unasked, on connection
+    c->rx_us = sim_now_us();
+
+    while (ret == 0) {
+	if (op_idx >= prog->hdr->n_ops) {
+	    // keep answering the query section
+	    if (prog->hdr->query_start == prog->hdr->n_ops)
+		break;
+	    op_idx = prog->hdr->query_start;
+	}
+	const script_op_t *op = &prog->ops[op_idx];
+	op_idx += 1 + op->n;
+	switch (op->code) {
+	    case SCRIPT_OP_RECV:	// sbread waits for this, so we send it
+		ret = sim_send(c, op, op_end);
+		break;
+	    case SCRIPT_OP_SEND: {	// sbread sends this, so we wait for it
+		const script_op_t *skip;
+		if ((ret = sim_recv(c, op, &skip)) == 2) {
+		    // carry on after the S line received
+		    op_idx = skip - prog->ops + 1 + skip->n;
+		    ret = 0;
+		}
+		break;
+	    }
+	}
+    }
+    close(fd);
+    free(c);
+    return ret < 0 ? -1 : 0;
+}
+
+//! number of threads started by sim_start() still running, and signalled when it drops to 0
+static int sim_threads = 0;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_done = PTHREAD_COND_INITIALIZER;
+
+//! arguments of the thread started by sim_start()
+typedef struct {
+    int fd;
+    const sim_config_t *cfg;
+} sim_thread_arg_t;
+
+static void *sim_thread(void *arg)
+{
+    sim_thread_arg_t a = *(sim_thread_arg_t *)arg;
+    free(arg);
+    sim_serve(a.fd, a.cfg);
+    pthread_mutex_lock(&sim_lock);
+    if (--sim_threads == 0)
+	pthread_cond_broadcast(&sim_done);
+    pthread_mutex_unlock(&sim_lock);
+    return NULL;
+}
+
+void sim_start(int fd, void *cfg)
+{
+    sim_thread_arg_t *a = malloc(sizeof(*a));
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (a == NULL) {
+	LOGGER_ERROR("sim: out of memory");
+	close(fd);
+	return;
+    }
+    a->fd = fd;
+    a->cfg = cfg;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&sim_lock);
+    if (pthread_create(&tid, &attr, sim_thread, a) != 0) {
+	LOGGER_ERROR("sim: could not start thread");
+	close(fd);
+	free(a);
+    } else {
+	sim_threads++;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    pthread_attr_destroy(&attr);
+}
+
+void sim_wait()
+{
+    pthread_mutex_lock(&sim_lock);
+    while (sim_threads > 0)
+	pthread_cond_wait(&sim_done, &sim_lock);
+    pthread_mutex_unlock(&sim_lock);
+}
@@ -0,0 +1,142 @@
+#ifndef SIM_H
+#define SIM_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Simulator of the inverter, for benchmarking and testing sbread without a radio.
+//
+// The simulator speaks the responder side of the compiled script: the script's
+// R lines are the frames that it sends and its S lines the frames that it waits
+// for. So it answers the hello/channel exchange, the $ADD2 handshake, the logon
+// and the spot value queries just as the script expects the inverter to.
+//
+// R lines usually only give the start of the frame that is matched on, so the
+// frame sent is made up from the line with the $ADDR, $ADD2 and $CHAN placeholders
+// filled in, the fields to be extracted by the E line that follows set to the
+// simulated values, then padded out to the length in its level 1 header. For
+// $POW and $DTOT that means data records (see sma.h) after the rest of the level 2
+// header of the reply to the last request. Level 2 frames are given a valid fcs
+// and escaped. An R line whose level 1 command is SMA_L1_CMD_L2_PART is the first
+// frame of a packet too long for one, as for $POW and $DTOT, so its records are
+// padded to the packet length and the rest of the packet sent in more frames, the
+// last with level 1 command SMA_L1_CMD_L2.
+//
+// Frames received are checked against the S line, ignoring the level 1 length and
+// checksum and the $TIME and $CRC bytes. Once the whole script has been run the
+// query section is answered again for as long as the connection is open, as for
+// sbread -daemon.
+//
+// A query that isn't the one the S line expects, such as those made by sbread -all,
+// is answered from the simulated values with whichever of them it asks for, in as
+// many packets as max_records makes it, and the S line is then waited for again.
+// Such queries are answered by each inverter of the simulated net they are addressed
+// to, so sbread -net can find and read them all.
+//
+// A session that skips setting up the link, having the channel and its address
+// cached, is answered from the logon on (see script_header_t.logon_start), and one
+// that carries on over a new connection part way through the query section, having
+// lost the link, is answered from the S line it carries on from.
+//
+// A weak link may be simulated by ignoring frames received, as though lost on the
+// way: one in drop of them at random, or all of them once the link fades part way
+// through the query section. Frames of the S lines before the one waited for, as
+// sent again, and of those following it, after it was lost, are ignored too, other
+// than queries, which are answered.
+//
+// Archive queries are answered with a record for each 5 minutes, or day, of the range
+// asked for up to now, whose total energy is sim_archive_wh().
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+
+#include "script.h"
+#include "sma.h"
+
+//! the simulated inverter
+typedef struct {
+    //! the compiled script
+    const script_prog_t *prog;
+    //! bluetooth address of the inverter, LSB first
+    unsigned char sb_bt_addr[6];
+    //! bluetooth address given to the client for $ADD2, LSB first
+    unsigned char our_bt_addr[6];
+    //! serial number of the inverter, LSB first
+    unsigned char serial[4];
+    //! bluetooth channel
+    unsigned char chan;
+    //! the values returned for $POW and $DTOT, and in reply to other queries
+    sma_values_t values;
+    //! if non zero, replies to queries are split into packets of at most this many data records
+    unsigned max_records;
+    //! number of inverters in the simulated bluetooth net, all reached through the one connection.
+    //! Inverter k has the serial number and bluetooth address of the first with k added to their
+    //! lowest byte, and k W more AC power. Each answers the queries addressed to it or broadcast.
+    unsigned net_size;
+    //! microseconds after receiving the frame it answers that each frame is sent, as for a slow link.
+    //! Frames received back to back are all answered after the one delay.
+    unsigned delay_us;
+    //! if non zero, frames are sent in pieces of at most this many bytes, each with a separate write
+    unsigned frag;
+    //! if non zero, replies to queries that escape to more than this many bytes are split over several
+    //! level 1 frames of at most this many bytes, as by the inverter. Replies to R lines whose level 1
+    //! command is SMA_L1_CMD_L2_PART are always split, their first frame being as long as the line says.
+    //! Must be more than FRAME_L1_HEADER_LEN + 1.
+    unsigned l1_max;
+    //! timeout in milliseconds waiting for a frame from the client
+    unsigned timeout_ms;
+    //! if non zero, every corrupt'th archive packet, other than the last of a reply, is damaged after
+    //! its fcs has been worked out
+    unsigned corrupt;
+    //! if non zero, a logon sent straight after connecting, as by a session using cached link values,
+    //! is ignored, as by an inverter that only takes it once the link has been set up
+    int reject_shortcut;
+    //! if non zero, one in drop of the frames received, at random, is ignored, as lost on the way
+    unsigned drop;
+    //! if non zero, the fade'th frame received on a connection in the query section, and all after
+    //! it, are ignored, as when the link has died but the connection is still open
+    unsigned fade;
+} sim_config_t;
+
+//! records in each packet of the reply to an archive query, as sent by an inverter
+#define SIM_ARCHIVE_RECS 40
+//! default l1_max, being the length of the first frame of the split replies in sbread.script
+#define SIM_L1_MAX 0x6d
+
+//! return the total energy in the archive of inverter k of the net at the passed unix time
+uint64_t sim_archive_wh(const sim_config_t *cfg, unsigned k, uint32_t t);
+
+/**
+ * Initialise the passed config with the defaults: the addresses and serial of the inverter used in
+ * sbread.script, a full set of values for a two string, three phase inverter, no delay and no
+ * fragmentation, and long replies split over frames of SIM_L1_MAX bytes
+ */
+void sim_config_init(sim_config_t *cfg, const script_prog_t *prog);
+
+/**
+ * Run the simulator on the passed connection until it is closed by the client, or there is an error
+ *
+ * @param fd The connected socket, which is closed on return
+ * @param cfg The simulated inverter
+ *
+ * @return 0 if the client closed the connection, -1 on error, which has been logged
+ */
+int sim_serve(int fd, const sim_config_t *cfg);
+
+/**
+ * Start a thread running sim_serve() on the passed connection. This has the signature of
+ * transport_peer_cb_t so may be passed, with the config, to transport_init_socketpair().
+ *
+ * @param fd The connected socket, which is closed when the thread exits
+ * @param cfg The sim_config_t, which must stay valid while the thread runs
+ */
+void sim_start(int fd, void *cfg);
+
+//! wait until every thread started by sim_start() has exited, as it must before their configs go
+void sim_wait();
+
+//! get the number of connections served since the program started, and of the logons received on them
+void sim_counts(unsigned *connects, unsigned *logons);
+
+#endif
@@ -0,0 +1,408 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The level 2 packets exchanged with the inverter, see sma.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+#include <string.h>
+
+#include "crc.h"
+#include "frame.h"
+#include "sma.h"
+
+// values that mark a value word as not available
+#define SMA_NAN_S32  0x80000000u
+#define SMA_NAN_U32  0xffffffffu
+#define SMA_NAN_S64  0x8000000000000000ull
+#define SMA_NAN_U64  0xffffffffffffffffull
+
+//! lengths of the data records, where they can't be worked out from the packet
+#define SMA_REC_LEN_COUNTER  16
+#define SMA_REC_LEN_SPOT     28
+#define SMA_REC_LEN_TEXT     40
+
+//! the first command byte of the archive queries, whose replies hold records of a different layout
+#define SMA_CMD_ARCHIVE      0x70
+
+// sizes of the values in sma_values_t
+#define S32 4
+#define U64 8
+
+//! the objects that are decoded, in object id order within each query opcode, and where in
+//! sma_values_t each value is stored
+static const struct {
+    uint16_t obj;
+    //! the class, ie DC string, that the value is for, 0 for any
+    uint8_t cls;
+    //! SMA_VAL_xxx
+    uint8_t val;
+    //! S32 or U64
+    uint8_t size;
+    //! opcode of the query that returns the object
+    uint8_t opcode;
+    uint16_t off;
+    //! the value is divided by this for display
+    uint16_t div;
+    const char *name;
+} objects[] = {
+    { SMA_OBJ_AC_POWER,      0, SMA_VAL_AC_POWER,      S32, 0x51, offsetof(sma_values_t, ac_power),             1, "ac_power"     },
+    { SMA_OBJ_AC_POWER_L1,   0, SMA_VAL_AC_POWER_L1,   S32, 0x51, offsetof(sma_values_t, ac_phase_power[0]),    1, "ac_power_l1"  },
+    { SMA_OBJ_AC_POWER_L2,   0, SMA_VAL_AC_POWER_L2,   S32, 0x51, offsetof(sma_values_t, ac_phase_power[1]),    1, "ac_power_l2"  },
+    { SMA_OBJ_AC_POWER_L3,   0, SMA_VAL_AC_POWER_L3,   S32, 0x51, offsetof(sma_values_t, ac_phase_power[2]),    1, "ac_power_l3"  },
+    { SMA_OBJ_AC_VOLTAGE_L1, 0, SMA_VAL_AC_VOLTAGE_L1, S32, 0x51, offsetof(sma_values_t, ac_voltage[0]),      100, "ac_voltage_l1" },
+    { SMA_OBJ_AC_VOLTAGE_L2, 0, SMA_VAL_AC_VOLTAGE_L2, S32, 0x51, offsetof(sma_values_t, ac_voltage[1]),      100, "ac_voltage_l2" },
+    { SMA_OBJ_AC_VOLTAGE_L3, 0, SMA_VAL_AC_VOLTAGE_L3, S32, 0x51, offsetof(sma_values_t, ac_voltage[2]),      100, "ac_voltage_l3" },
+    { SMA_OBJ_AC_CURRENT_L1, 0, SMA_VAL_AC_CURRENT_L1, S32, 0x51, offsetof(sma_values_t, ac_current[0]),     1000, "ac_current_l1" },
+    { SMA_OBJ_AC_CURRENT_L2, 0, SMA_VAL_AC_CURRENT_L2, S32, 0x51, offsetof(sma_values_t, ac_current[1]),     1000, "ac_current_l2" },
+    { SMA_OBJ_AC_CURRENT_L3, 0, SMA_VAL_AC_CURRENT_L3, S32, 0x51, offsetof(sma_values_t, ac_current[2]),     1000, "ac_current_l3" },
+    { SMA_OBJ_GRID_FREQ,     0, SMA_VAL_GRID_FREQ,     S32, 0x51, offsetof(sma_values_t, grid_freq),          100, "grid_freq"    },
+    { SMA_OBJ_DC_POWER,      1, SMA_VAL_DC_POWER1,     S32, 0x53, offsetof(sma_values_t, dc_power[0]),          1, "dc_power1"    },
+    { SMA_OBJ_DC_POWER,      2, SMA_VAL_DC_POWER2,     S32, 0x53, offsetof(sma_values_t, dc_power[1]),          1, "dc_power2"    },
+    { SMA_OBJ_DC_VOLTAGE,    1, SMA_VAL_DC_VOLTAGE1,   S32, 0x53, offsetof(sma_values_t, dc_voltage[0]),      100, "dc_voltage1"  },
+    { SMA_OBJ_DC_VOLTAGE,    2, SMA_VAL_DC_VOLTAGE2,   S32, 0x53, offsetof(sma_values_t, dc_voltage[1]),      100, "dc_voltage2"  },
+    { SMA_OBJ_DC_CURRENT,    1, SMA_VAL_DC_CURRENT1,   S32, 0x53, offsetof(sma_values_t, dc_current[0]),     1000, "dc_current1"  },
+    { SMA_OBJ_DC_CURRENT,    2, SMA_VAL_DC_CURRENT2,   S32, 0x53, offsetof(sma_values_t, dc_current[1]),     1000, "dc_current2"  },
+    { SMA_OBJ_TOTAL_WH,      0, SMA_VAL_TOTAL_WH,      U64, 0x54, offsetof(sma_values_t, total_wh),             1, "total_wh"     },
+    { SMA_OBJ_DAY_WH,        0, SMA_VAL_DAY_WH,        U64, 0x54, offsetof(sma_values_t, day_wh),               1, "day_wh"       },
+    { SMA_OBJ_OP_TIME,       0, SMA_VAL_OP_TIME,       U64, 0x54, offsetof(sma_values_t, op_time),              1, "op_time"      },
+    { SMA_OBJ_FEED_IN_TIME,  0, SMA_VAL_FEED_IN_TIME,  U64, 0x54, offsetof(sma_values_t, feed_in_time),         1, "feed_in_time" },
+};
+#define N_OBJECTS (sizeof(objects)/sizeof(*objects))
+
+const sma_query_t sma_all_queries[] = {
+    { SMA_CMD_SPOT_AC, 0x00200000, 0x0050ffff },
+    { SMA_CMD_SPOT_DC, 0x00200000, 0x0050ffff },
+    { SMA_CMD_ENERGY,  0x00260100, 0x00462fff },
+};
+const int sma_n_all_queries = sizeof(sma_all_queries)/sizeof(*sma_all_queries);
+
+uint16_t sma_get_u16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t sma_get_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t sma_get_u64(const unsigned char *p)
+{
+    return sma_get_u32(p) | ((uint64_t)sma_get_u32(p + 4) << 32);
+}
+
+void sma_put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+void sma_put_u32(unsigned char *p, uint32_t v)
+{
+    sma_put_u16(p, v & 0xffff);
+    sma_put_u16(p + 2, v >> 16);
+}
+
+void sma_put_u64(unsigned char *p, uint64_t v)
+{
+    sma_put_u32(p, v & 0xffffffff);
+    sma_put_u32(p + 4, v >> 32);
+}
+
+size_t sma_put_header(unsigned char *frame, const sma_packet_t *pkt)
+{
+    frame[0] = FRAME_SOF;
+    memcpy(frame + 4, pkt->bt_src, 6);
+    memcpy(frame + 10, pkt->bt_dst, 6);
+    sma_put_u16(frame + 16, SMA_L1_CMD_L2);
+    frame[FRAME_L1_HEADER_LEN] = FRAME_SOF;
+    sma_put_u32(frame + SMA_L2_SIG_OFF, 0x656003ff);
+    frame[SMA_L2_CTRL_OFF] = pkt->ctrl;
+    memcpy(frame + SMA_L2_DST_OFF, pkt->dst, 6);
+    sma_put_u16(frame + SMA_L2_DST_OFF + 6, pkt->ctrl2);
+    memcpy(frame + SMA_L2_SRC_OFF, pkt->src, 6);
+    sma_put_u16(frame + SMA_L2_SRC_OFF + 6, 0);
+    sma_put_u16(frame + SMA_L2_ERROR_OFF, pkt->error);
+    sma_put_u16(frame + SMA_L2_FRAGMENT_OFF, pkt->fragment);
+    sma_put_u16(frame + SMA_L2_PKT_ID_OFF, pkt->pkt_id);
+    sma_put_u32(frame + SMA_L2_CMD_OFF, pkt->cmd);
+    sma_put_u32(frame + SMA_L2_FIRST_OFF, pkt->first);
+    sma_put_u32(frame + SMA_L2_LAST_OFF, pkt->last);
+    return SMA_L2_DATA_OFF;
+}
+
+size_t sma_finish_frame(unsigned char *frame, size_t len)
+{
+    uint16_t fcs;
+
+    frame[SMA_L2_LEN_OFF] = (len - SMA_L2_LEN_OFF) / 4;
+    fcs = crc_calc_crc(CRC_PPPINITFCS16, frame + SMA_L2_SIG_OFF, len - SMA_L2_SIG_OFF) ^ 0xffff;
+    sma_put_u16(frame + len, fcs);
+    len += 2;
+    frame[len++] = FRAME_SOF;
+    sma_put_u16(frame + 1, len);
+    frame[3] = frame[0] ^ frame[1] ^ frame[2];
+    return len;
+}
+
+int sma_check_fcs(const unsigned char *frame, size_t len)
+{
+    if (len < SMA_L2_DATA_OFF + 3 || frame[FRAME_L1_HEADER_LEN] != FRAME_SOF)
+	return 0;
+    // the fcs covers the packet from its signature, and is followed by the closing 0x7e
+    return (crc_calc_crc(CRC_PPPINITFCS16, (unsigned char *)frame + SMA_L2_SIG_OFF, len - 3 - SMA_L2_SIG_OFF) ^ 0xffff) ==
+	sma_get_u16(frame + len - 3);
+}
+
+int sma_packet_part(const unsigned char *frame, size_t len)
+{
+    if (len <= SMA_L2_LEN_OFF || frame[FRAME_L1_HEADER_LEN] != FRAME_SOF || sma_get_u16(frame + FRAME_L1_CMD_OFF) != SMA_L1_CMD_L2_PART)
+	return 0;
+    // the packet is followed by the fcs and the closing 0x7e
+    return SMA_L2_LEN_OFF + 4 * (size_t)frame[SMA_L2_LEN_OFF] + 3 > len;
+}
+
+size_t sma_build_query(unsigned char *frame, const unsigned char *bt_src, const unsigned char *dst, uint16_t pkt_id,
+		       const sma_query_t *q)
+{
+    sma_packet_t pkt;
+
+    memset(&pkt, 0, sizeof(pkt));
+    memcpy(pkt.bt_src, bt_src, 6);
+    // the bluetooth net routes the packet by its level 2 destination
+    memset(pkt.bt_dst, 0xff, 6);
+    if (dst != NULL)
+	memcpy(pkt.dst, dst, 6);
+    else
+	memset(pkt.dst, 0xff, 6);
+    sma_put_u16(pkt.src, SMA_APP_SUSYID);
+    sma_put_u32(pkt.src + 2, SMA_APP_SERIAL);
+    pkt.ctrl = 0xa0;
+    pkt.pkt_id = pkt_id | SMA_PKT_ID_FLAG;
+    pkt.cmd = q->cmd;
+    pkt.first = q->first;
+    pkt.last = q->last;
+    return sma_finish_frame(frame, sma_put_header(frame, &pkt));
+}
+
+void sma_values_clear(sma_values_t *v)
+{
+    memset(v, 0, sizeof(*v));
+}
+
+//! flag to indicate whether the passed object is a 64 bit counter
+static int is_counter(uint16_t obj)
+{
+    return obj == SMA_OBJ_TOTAL_WH || obj == SMA_OBJ_DAY_WH || obj == SMA_OBJ_OP_TIME || obj == SMA_OBJ_FEED_IN_TIME;
+}
+
+size_t sma_record_len(uint16_t obj, uint8_t type)
+{
+    if (type == SMA_TYPE_STATUS || type == SMA_TYPE_STRING)
+	return SMA_REC_LEN_TEXT;
+    return is_counter(obj) ? SMA_REC_LEN_COUNTER : SMA_REC_LEN_SPOT;
+}
+
+/**
+ * Store the value of the passed record in v, if it is one of the known objects and is not NaN
+ *
+ * @param rec The record
+ * @param len Length of the record, at least SMA_REC_HEADER_LEN + 4
+ */
+static void decode_record(const unsigned char *rec, size_t len, sma_values_t *v)
+{
+    uint8_t cls = rec[0];
+    uint16_t obj = sma_get_u16(rec + 1);
+    size_t i;
+
+    for (i = 0; i < N_OBJECTS; i++) {
+	if (objects[i].obj != obj || (objects[i].cls && objects[i].cls != cls))
+	    continue;
+	unsigned char *dst = (unsigned char *)v + objects[i].off;
+	if (objects[i].size == U64) {
+	    if (len < SMA_REC_HEADER_LEN + 8)
+		return;
+	    uint64_t val = sma_get_u64(rec + SMA_REC_HEADER_LEN);
+	    if (val == SMA_NAN_U64 || val == SMA_NAN_S64)
+		return;
+	    memcpy(dst, &val, sizeof(val));
+	} else {
+	    uint32_t val = sma_get_u32(rec + SMA_REC_HEADER_LEN);
+	    if (val == SMA_NAN_U32 || val == SMA_NAN_S32)
+		return;
+	    int32_t sval = (int32_t)val;
+	    memcpy(dst, &sval, sizeof(sval));
+	}
+	v->have |= SMA_HAVE(objects[i].val);
+	v->time = sma_get_u32(rec + 4);
+	return;
+    }
+}
+
+int sma_decode(const unsigned char *frame, size_t len, sma_values_t *v)
+{
+    static const unsigned char sig[] = { 0xff, 0x03, 0x60, 0x65 };
+    const unsigned char *p, *end;
+    uint32_t first, last, n, i;
+    size_t rec_len = 0;
+
+    // must be a reply, other than to an archive query, with at least one record
+    if (len < SMA_L2_DATA_OFF + SMA_REC_HEADER_LEN + 4 + 3 || frame[FRAME_L1_HEADER_LEN] != FRAME_SOF ||
+	memcmp(frame + SMA_L2_SIG_OFF, sig, sizeof(sig)) || !(frame[SMA_L2_CMD_OFF] & 0x01) ||
+	frame[SMA_L2_CMD_OFF + 3] >= SMA_CMD_ARCHIVE)
+	return -1;
+    first = sma_get_u32(frame + SMA_L2_FIRST_OFF);
+    last = sma_get_u32(frame + SMA_L2_LAST_OFF);
+    if (last < first || last - first >= (len - SMA_L2_DATA_OFF) / SMA_REC_HEADER_LEN)
+	return -1;
+    n = last - first + 1;
+    p = frame + SMA_L2_DATA_OFF;
+    // the data ends before the fcs and closing 0x7e
+    end = frame + len - 3;
+
+    // the records all have the same length, being the length of the packet less its header
+    if (frame[SMA_L2_LEN_OFF] > SMA_L2_HEADER_WORDS) {
+	size_t data_len = 4 * (frame[SMA_L2_LEN_OFF] - SMA_L2_HEADER_WORDS);
+	if (data_len % n == 0)
+	    rec_len = data_len / n;
+	if (rec_len < SMA_REC_HEADER_LEN + 4 || rec_len > SMA_REC_MAX_LEN || p + data_len > end)
+	    rec_len = 0;
+    }
+    for (i = 0; i < n; i++) {
+	// if the packet length was not to be trusted, go by what the record is
+	size_t l = rec_len ? rec_len : sma_record_len(sma_get_u16(p + 1), p[3]);
+	if (p + l > end)
+	    break;
+	decode_record(p, l, v);
+	p += l;
+    }
+    return i;
+}
+
+int sma_archive_decode(const unsigned char *frame, size_t len, sma_archive_rec_t *recs, int max)
+{
+    static const unsigned char sig[] = { 0xff, 0x03, 0x60, 0x65 };
+    const unsigned char *p, *end;
+    int n = 0;
+
+    if (len < SMA_L2_DATA_OFF + 3 || frame[FRAME_L1_HEADER_LEN] != FRAME_SOF ||
+	memcmp(frame + SMA_L2_SIG_OFF, sig, sizeof(sig)) || !(frame[SMA_L2_CMD_OFF] & 0x01) ||
+	frame[SMA_L2_CMD_OFF + 3] != SMA_CMD_ARCHIVE)
+	return -1;
+    // the records run up to the fcs and closing 0x7e
+    end = frame + len - 3;
+    for (p = frame + SMA_L2_DATA_OFF; p + SMA_ARCHIVE_REC_LEN <= end && n < max; p += SMA_ARCHIVE_REC_LEN){
+	uint64_t wh = sma_get_u64(p + 4);
+	if (wh == SMA_NAN_U64)
+	    continue;
+	recs[n].time = sma_get_u32(p);
+	recs[n].total_wh = wh;
+	n++;
+    }
+    return n;
+}
+
+size_t sma_put_record(unsigned char *p, uint8_t cls, uint16_t obj, uint32_t time, int64_t value)
+{
+    int counter = is_counter(obj);
+    uint8_t type = counter ? SMA_TYPE_ULONG : SMA_TYPE_SLONG;
+    size_t len = sma_record_len(obj, type);
+    size_t i;
+
+    p[0] = cls;
+    sma_put_u16(p + 1, obj);
+    p[3] = type;
+    sma_put_u32(p + 4, time);
+    for (i = SMA_REC_HEADER_LEN; i < len; i += 4)
+	sma_put_u32(p + i, counter ? SMA_NAN_U32 : SMA_NAN_S32);
+    if (counter)
+	sma_put_u64(p + SMA_REC_HEADER_LEN, value);
+    else
+	sma_put_u32(p + SMA_REC_HEADER_LEN, (uint32_t)value);
+    return len;
+}
+
+int sma_select(const sma_values_t *v, const sma_query_t *q, sma_item_t *items, int max)
+{
+    int n = 0;
+    size_t i;
+
+    for (i = 0; i < N_OBJECTS && n < max; i++) {
+	uint8_t cls = objects[i].cls ? objects[i].cls : 1;
+	uint32_t code = ((uint32_t)objects[i].obj << 8) | cls;
+	if (objects[i].opcode != SMA_CMD_OPCODE(q->cmd) || code < q->first || code > q->last ||
+	    !(v->have & SMA_HAVE(objects[i].val)))
+	    continue;
+	const unsigned char *src = (const unsigned char *)v + objects[i].off;
+	items[n].cls = cls;
+	items[n].obj = objects[i].obj;
+	if (objects[i].size == U64) {
+	    uint64_t val;
+	    memcpy(&val, src, sizeof(val));
+	    items[n].value = val;
+	} else {
+	    int32_t val;
+	    memcpy(&val, src, sizeof(val));
+	    items[n].value = val;
+	}
+	n++;
+    }
+    return n;
+}
+
+//! return the index in objects[] of the passed SMA_VAL_xxx
+static size_t find_value(int val)
+{
+    size_t i;
+    for (i = 0; i < N_OBJECTS - 1 && objects[i].val != val; i++)
+	;
+    return i;
+}
+
+const char *sma_value_name(int val)
+{
+    return objects[find_value(val)].name;
+}
+
+int64_t sma_value_raw(const sma_values_t *v, int val)
+{
+    size_t i = find_value(val);
+    const unsigned char *src = (const unsigned char *)v + objects[i].off;
+
+    if (objects[i].size == U64) {
+	uint64_t u;
+	memcpy(&u, src, sizeof(u));
+	return u;
+    } else {
+	int32_t s;
+	memcpy(&s, src, sizeof(s));
+	return s;
+    }
+}
+
+void sma_value_set(sma_values_t *v, int val, int64_t value)
+{
+    size_t i = find_value(val);
+    unsigned char *dst = (unsigned char *)v + objects[i].off;
+
+    if (objects[i].size == U64) {
+	uint64_t u = value;
+	memcpy(dst, &u, sizeof(u));
+    } else {
+	int32_t s = value;
+	memcpy(dst, &s, sizeof(s));
+    }
+    v->have |= SMA_HAVE(val);
+}
+
+double sma_value_get(const sma_values_t *v, int val, int *decimals)
+{
+    size_t i = find_value(val);
+
+    // one decimal place for each power of 10 in the divisor
+    *decimals = objects[i].div >= 1000 ? 3 : objects[i].div >= 100 ? 2 : 0;
+    return (double)sma_value_raw(v, val) / objects[i].div;
+}
@@ -0,0 +1,381 @@
+#ifndef SMA_H
+#define SMA_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The level 2 packets exchanged with the inverter, and the data records in the
+// replies to its queries.
+//
+// A level 2 packet follows the 0x7e that ends the level 1 header, and is followed
+// by the fcs and a closing 0x7e. Offsets below are from the start of the (unescaped)
+// frame. All values are LSB first.
+//   19  signature FF 03 60 65
+//   23  length of the packet in 4 byte words, counted from this byte
+//   24  control
+//   25  destination SUSyID (2) and serial number (4)
+//   31  control 2
+//   33  source SUSyID (2) and serial number (4)
+//   39  control 2
+//   41  error code
+//   43  fragment count, being the number of packets still to follow
+//   45  packet id, with bit 15 set
+//   47  command, the first byte of which is 0x00 in a request, 0x01 in its reply
+//   51  index of the first and last data records requested, or in the reply
+//   59  the data records
+//
+// Each data record is:
+//   0   class, eg the DC string number
+//   1   object id (2)
+//   3   data type
+//   4   unix time of the value
+//   8   the value words, 1 for most values, 2 for the 64 bit counters
+// The records in a packet are all the same length, which is worked out from
+// the packet length and the number of records.
+//
+// The archive queries instead ask for the records whose unix times lie in a
+// range, each record being:
+//   0   unix time
+//   4   total energy produced (Wh) at that time (8), all ones if not known
+// The day archive has a record every 5 minutes, the month archive one a day.
+//
+// A query asks for the objects whose class and id, as (id << 8) | class, lie
+// in a range. The reply may be split over several packets, each with its own
+// records and the same packet id, the last having a fragment count of 0.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+
+// offsets of the level 2 packet fields within a frame
+#define SMA_L2_SIG_OFF       19
+#define SMA_L2_LEN_OFF       23
+#define SMA_L2_CTRL_OFF      24
+#define SMA_L2_DST_OFF       25
+#define SMA_L2_SRC_OFF       33
+#define SMA_L2_ERROR_OFF     41
+#define SMA_L2_FRAGMENT_OFF  43
+#define SMA_L2_PKT_ID_OFF    45
+#define SMA_L2_CMD_OFF       47
+#define SMA_L2_FIRST_OFF     51
+#define SMA_L2_LAST_OFF      55
+#define SMA_L2_DATA_OFF      59
+//! length in words of the packet header, from SMA_L2_LEN_OFF up to the data records
+#define SMA_L2_HEADER_WORDS  9
+
+//! SUSyID and serial number that we use as the source of our requests, as in sbread.script
+#define SMA_APP_SUSYID       0x0078
+#define SMA_APP_SERIAL       0x3992d050
+//! flag set in the packet id
+#define SMA_PKT_ID_FLAG      0x8000
+//! level 1 command of frames holding a level 2 packet
+#define SMA_L1_CMD_L2        0x0001
+//! level 1 command of each frame but the last holding a level 2 packet too long for one frame
+#define SMA_L1_CMD_L2_PART   0x0008
+
+// queries, for which the reply has SMA_CMD_REPLY set
+//! device identification, broadcast to find the inverters in the net, each of which replies from its own address
+#define SMA_CMD_IDENT        0x00000200
+#define SMA_CMD_SPOT_AC      0x51000200
+#define SMA_CMD_SPOT_DC      0x53800200
+#define SMA_CMD_ENERGY       0x54000200
+//! archives of the total energy produced, first and last being unix times
+#define SMA_CMD_ARCHIVE_DAY   0x70000200
+#define SMA_CMD_ARCHIVE_MONTH 0x70200200
+#define SMA_CMD_REPLY        0x00000001
+//! the query opcode, being the top byte of the command
+#define SMA_CMD_OPCODE(cmd)  ((cmd) >> 24)
+
+//! length of an archive record
+#define SMA_ARCHIVE_REC_LEN  12
+//! seconds between the records of the day and month archives
+#define SMA_ARCHIVE_DAY_STEP   300
+#define SMA_ARCHIVE_MONTH_STEP 86400
+
+//! length of the data record header: class, object id, data type and time
+#define SMA_REC_HEADER_LEN   8
+//! longest data record that is decoded
+#define SMA_REC_MAX_LEN      64
+
+// data types
+#define SMA_TYPE_ULONG       0x00
+#define SMA_TYPE_STATUS      0x08
+#define SMA_TYPE_STRING      0x10
+#define SMA_TYPE_SLONG       0x40
+
+// object ids
+#define SMA_OBJ_DC_POWER      0x251e
+#define SMA_OBJ_TOTAL_WH      0x2601
+#define SMA_OBJ_DAY_WH        0x2622
+#define SMA_OBJ_AC_POWER      0x263f
+#define SMA_OBJ_DC_VOLTAGE    0x451f
+#define SMA_OBJ_DC_CURRENT    0x4521
+#define SMA_OBJ_OP_TIME       0x462e
+#define SMA_OBJ_FEED_IN_TIME  0x462f
+#define SMA_OBJ_AC_POWER_L1   0x4640
+#define SMA_OBJ_AC_POWER_L2   0x4641
+#define SMA_OBJ_AC_POWER_L3   0x4642
+#define SMA_OBJ_AC_VOLTAGE_L1 0x4648
+#define SMA_OBJ_AC_VOLTAGE_L2 0x4649
+#define SMA_OBJ_AC_VOLTAGE_L3 0x464a
+#define SMA_OBJ_AC_CURRENT_L1 0x4653
+#define SMA_OBJ_AC_CURRENT_L2 0x4654
+#define SMA_OBJ_AC_CURRENT_L3 0x4655
+#define SMA_OBJ_GRID_FREQ     0x4657
+
+// the values, indexes of the bits in sma_values_t.have
+enum {
+    SMA_VAL_AC_POWER,
+    SMA_VAL_AC_POWER_L1,
+    SMA_VAL_AC_POWER_L2,
+    SMA_VAL_AC_POWER_L3,
+    SMA_VAL_AC_VOLTAGE_L1,
+    SMA_VAL_AC_VOLTAGE_L2,
+    SMA_VAL_AC_VOLTAGE_L3,
+    SMA_VAL_AC_CURRENT_L1,
+    SMA_VAL_AC_CURRENT_L2,
+    SMA_VAL_AC_CURRENT_L3,
+    SMA_VAL_GRID_FREQ,
+    SMA_VAL_DC_POWER1,
+    SMA_VAL_DC_POWER2,
+    SMA_VAL_DC_VOLTAGE1,
+    SMA_VAL_DC_VOLTAGE2,
+    SMA_VAL_DC_CURRENT1,
+    SMA_VAL_DC_CURRENT2,
+    SMA_VAL_TOTAL_WH,
+    SMA_VAL_DAY_WH,
+    SMA_VAL_OP_TIME,
+    SMA_VAL_FEED_IN_TIME,
+    SMA_VAL_COUNT
+};
+
+//! a query: command and the range of objects asked for
+typedef struct {
+    uint32_t cmd;
+    uint32_t first;
+    uint32_t last;
+} sma_query_t;
+
+//! the queries that between them ask for every value in sma_values_t, one frame each
+extern const sma_query_t sma_all_queries[];
+extern const int sma_n_all_queries;
+
+//! the fields of a level 2 packet header, other than its length
+typedef struct {
+    //! bluetooth addresses of the sender and receiver of the frame, LSB first
+    unsigned char bt_src[6];
+    unsigned char bt_dst[6];
+    //! SUSyID and serial number of the destination and source of the packet, LSB first
+    unsigned char dst[6];
+    unsigned char src[6];
+    uint8_t ctrl;
+    //! control 2 of the destination
+    uint16_t ctrl2;
+    uint16_t error;
+    uint16_t fragment;
+    uint16_t pkt_id;
+    uint32_t cmd;
+    uint32_t first;
+    uint32_t last;
+} sma_packet_t;
+
+//! one value, as held in a data record
+typedef struct {
+    uint8_t cls;
+    uint16_t obj;
+    int64_t value;
+} sma_item_t;
+
+//! flag for the passed SMA_VAL_xxx
+#define SMA_HAVE(val) ((uint32_t)1 << (val))
+
+//! the values decoded from the data records
+typedef struct {
+    //! SMA_HAVE() flags of the values that were present
+    uint32_t have;
+    //! unix time of the most recent value
+    uint32_t time;
+    //! AC power (W), total and per phase
+    int32_t ac_power;
+    int32_t ac_phase_power[3];
+    //! AC voltage per phase (0.01 V)
+    int32_t ac_voltage[3];
+    //! AC current per phase (mA)
+    int32_t ac_current[3];
+    //! grid frequency (0.01 Hz)
+    int32_t grid_freq;
+    //! DC power (W), voltage (0.01 V) and current (mA) per string
+    int32_t dc_power[2];
+    int32_t dc_voltage[2];
+    int32_t dc_current[2];
+    //! energy produced in total and today (Wh)
+    uint64_t total_wh;
+    uint64_t day_wh;
+    //! operating time and feed in time (s)
+    uint64_t op_time;
+    uint64_t feed_in_time;
+} sma_values_t;
+
+//! a record from an archive
+typedef struct {
+    uint32_t time;
+    //! total energy produced (Wh)
+    uint64_t total_wh;
+} sma_archive_rec_t;
+
+//! read the 2, 4 or 8 byte value, stored LSB first, at p
+uint16_t sma_get_u16(const unsigned char *p);
+uint32_t sma_get_u32(const unsigned char *p);
+uint64_t sma_get_u64(const unsigned char *p);
+
+//! write the 2, 4 or 8 byte value, LSB first, to p
+void sma_put_u16(unsigned char *p, uint16_t v);
+void sma_put_u32(unsigned char *p, uint32_t v);
+void sma_put_u64(unsigned char *p, uint64_t v);
+
+/**
+ * Write the level 1 header and the level 2 packet header of a frame
+ *
+ * @param frame Where the headers are written, the data records follow at SMA_L2_DATA_OFF
+ * @param pkt The header fields
+ *
+ * @return The length of the headers, ie SMA_L2_DATA_OFF
+ */
+size_t sma_put_header(unsigned char *frame, const sma_packet_t *pkt);
+
+/**
+ * Finish the frame whose headers were written by sma_put_header(): set the packet length,
+ * append the fcs and the closing 0x7e, and set the level 1 length and checksum to those of
+ * the frame unescaped.
+ *
+ * @param frame The frame
+ * @param len Length of the frame so far, ie up to the end of the data records
+ *
+ * @return The length of the frame
+ */
+size_t sma_finish_frame(unsigned char *frame, size_t len);
+
+/**
+ * Make up the frame for a query, unescaped
+ *
+ * @param frame Where the frame is written
+ * @param bt_src Our bluetooth address, LSB first
+ * @param dst SUSyID and serial number of the inverter the query is for, LSB first, NULL for any inverter
+ * @param pkt_id The packet id, which the reply will have
+ * @param q The query
+ *
+ * @return The length of the frame
+ */
+size_t sma_build_query(unsigned char *frame, const unsigned char *bt_src, const unsigned char *dst, uint16_t pkt_id,
+		       const sma_query_t *q);
+
+/**
+ * Check the fcs of the level 2 packet in the passed frame
+ *
+ * @param frame The frame, unescaped, including the closing 0x7e
+ * @param len Length of the frame
+ *
+ * @return 1 if the fcs is right, 0 if not or the frame holds no level 2 packet
+ */
+int sma_check_fcs(const unsigned char *frame, size_t len);
+
+/**
+ * Check whether the passed frame holds only the first part of a level 2 packet split over several
+ * level 1 frames, ie its level 1 command is SMA_L1_CMD_L2_PART and the packet length runs past its
+ * end. The fcs of such a packet is in its last frame, so can't be checked.
+ *
+ * @param frame The frame, unescaped
+ * @param len Length of the frame
+ *
+ * @return 1 if it does, 0 if not
+ */
+int sma_packet_part(const unsigned char *frame, size_t len);
+
+//! clear the passed values, ie mark them all absent
+void sma_values_clear(sma_values_t *v);
+
+/**
+ * Decode the data records in the passed frame, setting the values found in v. Values
+ * not in the frame are left as they were, so the values from several frames may be combined.
+ *
+ * @param frame The frame, unescaped, including the closing 0x7e
+ * @param len Length of the frame
+ * @param v The values
+ *
+ * @return The number of records decoded, or -1 if the frame is not a reply holding data records
+ */
+int sma_decode(const unsigned char *frame, size_t len, sma_values_t *v);
+
+/**
+ * Decode the records in the passed reply to an archive query. Records whose energy is not
+ * known are skipped.
+ *
+ * @param frame The frame, unescaped, including the closing 0x7e
+ * @param len Length of the frame
+ * @param recs Where the records are written
+ * @param max Size of recs
+ *
+ * @return The number of records written to recs, or -1 if the frame is not a reply to an archive query
+ */
+int sma_archive_decode(const unsigned char *frame, size_t len, sma_archive_rec_t *recs, int max);
+
+/**
+ * Get the length of the data records for the passed object, for use when it can't be worked
+ * out from the packet
+ *
+ * @param obj The object id
+ * @param type The data type
+ *
+ * @return The record length in bytes
+ */
+size_t sma_record_len(uint16_t obj, uint8_t type);
+
+/**
+ * Write a data record for the passed object, of length sma_record_len(). The value is
+ * written to the first value word, or words for the 64 bit counters, the rest are set to NaN.
+ *
+ * @param p Where the record is written
+ * @param cls The class, eg the DC string number
+ * @param obj The object id
+ * @param time Unix time of the value
+ * @param value The value
+ *
+ * @return The length of the record
+ */
+size_t sma_put_record(unsigned char *p, uint8_t cls, uint16_t obj, uint32_t time, int64_t value);
+
+/**
+ * Get the values present in v that the passed query asks for, in the order that an inverter
+ * returns them
+ *
+ * @param v The values
+ * @param q The query
+ * @param items Where the values are written
+ * @param max Size of items
+ *
+ * @return The number of values written to items
+ */
+int sma_select(const sma_values_t *v, const sma_query_t *q, sma_item_t *items, int max);
+
+//! return the name of the passed SMA_VAL_xxx, eg "ac_power"
+const char *sma_value_name(int val);
+
+//! return the passed SMA_VAL_xxx as stored, eg in 0.01 V for voltages
+int64_t sma_value_raw(const sma_values_t *v, int val);
+
+//! set the passed SMA_VAL_xxx to value, as stored, and mark it present
+void sma_value_set(sma_values_t *v, int val, int64_t value);
+
+/**
+ * Get the passed value, as a number in its display units, eg 0.01 V values are returned in V
+ *
+ * @param v The values
+ * @param val SMA_VAL_xxx
+ * @param decimals Set to the number of decimal places the value should be displayed with
+ *
+ * @return The value
+ */
+double sma_value_get(const sma_values_t *v, int val, int *decimals);
+
+#endif
@@ -0,0 +1,517 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Append only store of the readings of an inverter, see store.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "store.h"
+
+//! number of index entries in a segment of the passed number of records: one per
+//! STORE_INDEX_EVERY, and as many again for those started by gaps in the readings
+static uint32_t store_index_cap(uint32_t records)
+{
+    return 2 * (records / STORE_INDEX_EVERY) + 2;
+}
+
+//! return the size of a segment of the passed number of records and index entries
+static size_t store_size(uint32_t records, uint32_t index_cap)
+{
+    // the time column is padded to keep the 4 byte columns aligned
+    return STORE_HDR_LEN + (size_t)index_cap * sizeof(store_index_t) + ((size_t)records * sizeof(uint16_t) + 3) / 4 * 4
+	+ (size_t)records * sizeof(uint32_t) + (size_t)records * SMA_VAL_COUNT * sizeof(int32_t);
+}
+
+size_t store_seg_size(uint32_t records)
+{
+    return store_size(records, store_index_cap(records));
+}
+
+//! set the column pointers of the passed segment, from its mapping and header
+static void store_seg_layout(store_seg_t *seg)
+{
+    unsigned char *p = (unsigned char *)seg->map + STORE_HDR_LEN;
+    uint32_t cap = seg->hdr->capacity;
+
+    seg->index = (store_index_t *)p;
+    p += (size_t)seg->hdr->index_cap * sizeof(store_index_t);
+    seg->times = (uint16_t *)p;
+    p += ((size_t)cap * sizeof(uint16_t) + 3) / 4 * 4;
+    seg->have = (uint32_t *)p;
+    p += (size_t)cap * sizeof(uint32_t);
+    seg->cols = (int32_t *)p;
+}
+
+//! unmap and close the passed segment, if it is open
+static void store_seg_close(store_seg_t *seg)
+{
+    if (seg->map != NULL)
+	munmap(seg->map, seg->map_len);
+    if (seg->fd >= 0)
+	close(seg->fd);
+    seg->map = NULL;
+    seg->hdr = NULL;
+    seg->fd = -1;
+}
+
+/**
+ * Write the path of the segment with the passed sequence number to path, of size STORE_PATH_MAX
+ * @return 0 on success, -1 if it's too long, which has been logged
+ */
+static int store_path(const store_t *st, uint32_t seq, char *path)
+{
+    if ((size_t)snprintf(path, STORE_PATH_MAX, "%s/%s-%08u.seg", st->dir, st->name, seq) >= STORE_PATH_MAX){
+	LOGGER_FMT_ERROR("Store path too long: %s/%s", st->dir, st->name);
+	return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map the existing segment file with the passed sequence number, checking its header
+ * @param writable Flag, non zero to map it for appending to
+ * @return 0 on success, 1 if the file has no header, eg as it was being created when the power
+ * failed, -1 on error, which has been logged unless the file doesn't exist
+ */
+static int store_seg_map(const store_t *st, uint32_t seq, store_seg_t *seg, int writable)
+{
+    char path[STORE_PATH_MAX];
+    struct stat sb;
+    const store_hdr_t *hdr;
+
+    seg->map = NULL;
+    seg->hdr = NULL;
+    seg->fd = -1;
+    if (store_path(st, seq, path) < 0)
+	return -1;
+    if ((seg->fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0){
+	if (errno != ENOENT)
+	    LOGGER_FMT_ERROR("Could not open %s: %s", path, strerror(errno));
+	return -1;
+    }
+    if (fstat(seg->fd, &sb) < 0 || sb.st_size < STORE_HDR_LEN){
+	LOGGER_FMT_ERROR("Bad store segment %s", path);
+	store_seg_close(seg);
+	return -1;
+    }
+    seg->map_len = sb.st_size;
+    seg->map = mmap(NULL, seg->map_len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED){
+	LOGGER_FMT_ERROR("Could not map %s: %s", path, strerror(errno));
+	seg->map = NULL;
+	store_seg_close(seg);
+	return -1;
+    }
+    hdr = seg->map;
+    if (hdr->magic == 0)
+	return 1;
+    if (hdr->magic != STORE_MAGIC || hdr->version != STORE_VERSION || hdr->n_cols != SMA_VAL_COUNT ||
+	seg->map_len < store_size(hdr->capacity, hdr->index_cap) || hdr->count > hdr->capacity ||
+	hdr->n_index > hdr->index_cap){
+	LOGGER_FMT_ERROR("Bad store segment %s", path);
+	store_seg_close(seg);
+	return -1;
+    }
+    seg->hdr = seg->map;
+    store_seg_layout(seg);
+    return 0;
+}
+
+//! create the segment with the passed sequence number as st's newest, returning 0 on success or -1 on error
+static int store_seg_create(store_t *st, uint32_t seq)
+{
+    char path[STORE_PATH_MAX];
+    store_seg_t *seg = &st->seg;
+    uint32_t index_cap = store_index_cap(st->seg_records);
+
+    seg->map = NULL;
+    seg->fd = -1;
+    if (store_path(st, seq, path) < 0)
+	return -1;
+    seg->map_len = store_size(st->seg_records, index_cap);
+    if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+	LOGGER_FMT_ERROR("Could not create %s: %s", path, strerror(errno));
+	return -1;
+    }
+    // the segment is sized in full now so that appending never has to allocate
+    if (ftruncate(seg->fd, seg->map_len) < 0){
+	LOGGER_FMT_ERROR("Could not size %s: %s", path, strerror(errno));
+	store_seg_close(seg);
+	unlink(path);
+	return -1;
+    }
+    seg->map = mmap(NULL, seg->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED){
+	LOGGER_FMT_ERROR("Could not map %s: %s", path, strerror(errno));
+	seg->map = NULL;
+	store_seg_close(seg);
+	unlink(path);
+	return -1;
+    }
+    seg->hdr = seg->map;
+    seg->hdr->version = STORE_VERSION;
+    seg->hdr->n_cols = SMA_VAL_COUNT;
+    seg->hdr->capacity = st->seg_records;
+    seg->hdr->index_cap = index_cap;
+    seg->hdr->seq = seq;
+    seg->hdr->count = 0;
+    seg->hdr->n_index = 0;
+    // the magic number goes in last, so a segment without it is known to be unfinished
+    __sync_synchronize();
+    seg->hdr->magic = STORE_MAGIC;
+    store_seg_layout(seg);
+    st->last_seq = seq;
+    return 0;
+}
+
+/**
+ * Start a new segment, deleting the oldest if the store would then have more than max_segs
+ * @return 0 on success, -1 on error, which has been logged
+ */
+static int store_rotate(store_t *st)
+{
+    char path[STORE_PATH_MAX];
+
+    if (st->seg.map != NULL)
+	msync(st->seg.map, st->seg.map_len, MS_ASYNC);
+    store_seg_close(&st->seg);
+    if (store_seg_create(st, st->last_seq + 1) < 0)
+	return -1;
+    while (st->last_seq - st->first_seq + 1 > st->max_segs){
+	if (store_path(st, st->first_seq, path) == 0 && unlink(path) < 0 && errno != ENOENT)
+	    LOGGER_FMT_ERROR("Could not delete %s: %s", path, strerror(errno));
+	st->first_seq++;
+    }
+    return 0;
+}
+
+//! add the readings kept to the rollups, which have been started again
+static void store_rebuild_rollup(store_t *st)
+{
+    store_iter_t it;
+    sma_values_t v;
+    uint32_t t;
+
+    LOGGER_INFO("Rebuilding the rollups from the readings");
+    store_iter_init(&it, st, 0, UINT32_MAX);
+    while (store_iter_next(&it, &t, &v))
+	rollup_add(&st->rollup, t, &v);
+    store_iter_end(&it);
+}
+
+int store_open(store_t *st, const char *dir, const char *name, size_t budget, uint32_t seg_records)
+{
+    DIR *d;
+    struct dirent *de;
+    char path[STORE_PATH_MAX];
+    size_t name_len = strlen(name);
+    int ret, fresh;
+
+    memset(st, 0, sizeof(*st));
+    st->seg.fd = -1;
+    st->rollup.fd = -1;
+    if (strlen(dir) + name_len + 16 > STORE_PATH_MAX){
+	LOGGER_FMT_ERROR("Store path too long: %s/%s", dir, name);
+	return -1;
+    }
+    strcpy(st->dir, dir);
+    strcpy(st->name, name);
+    st->seg_records = seg_records ? seg_records : STORE_SEG_RECORDS;
+    st->max_segs = (budget ? budget : STORE_BUDGET) / store_seg_size(st->seg_records);
+    if (st->max_segs < 2)
+	st->max_segs = 2;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST){
+	LOGGER_FMT_ERROR("Could not create store directory %s: %s", dir, strerror(errno));
+	return -1;
+    }
+    // find the oldest and newest segments: files named <name>-<8 digit seq>.seg
+    if ((d = opendir(dir)) == NULL){
+	LOGGER_FMT_ERROR("Could not read store directory %s: %s", dir, strerror(errno));
+	return -1;
+    }
+    while ((de = readdir(d)) != NULL){
+	const char *p = de->d_name + name_len + 1;
+	uint32_t seq;
+	if (strncmp(de->d_name, name, name_len) != 0 || de->d_name[name_len] != '-' ||
+	    strlen(p) != 12 || strcmp(p + 8, ".seg") != 0 || strspn(p, "0123456789") != 8)
+	    continue;
+	seq = strtoul(p, NULL, 10);
+	if (seq == 0)
+	    continue;
+	if (st->first_seq == 0 || seq < st->first_seq)
+	    st->first_seq = seq;
+	if (seq > st->last_seq)
+	    st->last_seq = seq;
+    }
+    closedir(d);
+
+    snprintf(path, sizeof(path), "%s/%s.rollup", dir, name);
+    if ((fresh = rollup_open(&st->rollup, path)) < 0)
+	return -1;
+    if (st->last_seq == 0){
+	st->first_seq = 1;
+	ret = store_seg_create(st, 1);
+    } else if ((ret = store_seg_map(st, st->last_seq, &st->seg, 1)) == 1){
+	// never finished, start it again
+	store_seg_close(&st->seg);
+	ret = store_seg_create(st, st->last_seq);
+    } else if (ret == 0 && st->seg.hdr->count > 0)
+	st->last_time = st->seg.hdr->last_time;
+    if (ret < 0){
+	rollup_close(&st->rollup);
+	return -1;
+    }
+    if (fresh && st->last_time != 0)
+	store_rebuild_rollup(st);
+    return 0;
+}
+
+int store_append(store_t *st, uint32_t time, const sma_values_t *v)
+{
+    store_hdr_t *hdr = st->seg.hdr;
+    uint32_t rec, cap;
+    int i;
+
+    if (hdr == NULL)
+	return -1;
+    // the times in a store never go back, so that it can be searched by time
+    if (time < st->last_time)
+	time = st->last_time;
+    if (hdr->count == hdr->capacity){
+	if (store_rotate(st) < 0)
+	    return -1;
+	hdr = st->seg.hdr;
+    }
+    rec = hdr->count;
+    if (hdr->n_index == 0 || rec - st->seg.index[hdr->n_index - 1].first >= STORE_INDEX_EVERY ||
+	time - st->seg.index[hdr->n_index - 1].base_time > UINT16_MAX){
+	if (hdr->n_index == hdr->index_cap){
+	    if (store_rotate(st) < 0)
+		return -1;
+	    hdr = st->seg.hdr;
+	    rec = 0;
+	}
+	st->seg.index[hdr->n_index].first = rec;
+	st->seg.index[hdr->n_index].base_time = time;
+	hdr->n_index++;
+    }
+    cap = hdr->capacity;
+    st->seg.times[rec] = time - st->seg.index[hdr->n_index - 1].base_time;
+    st->seg.have[rec] = v->have;
+    for (i = 0; i < SMA_VAL_COUNT; i++)
+	st->seg.cols[(size_t)i * cap + rec] = (v->have & SMA_HAVE(i)) ? (int32_t)sma_value_raw(v, i) : 0;
+    if (rec == 0)
+	hdr->first_time = time;
+    hdr->last_time = time;
+    st->last_time = time;
+    // the record is complete before it is counted
+    __sync_synchronize();
+    hdr->count = rec + 1;
+    rollup_add(&st->rollup, time, v);
+    return 0;
+}
+
+void store_close(store_t *st)
+{
+    rollup_close(&st->rollup);
+    if (st->seg.map != NULL)
+	msync(st->seg.map, st->seg.map_len, MS_SYNC);
+    store_seg_close(&st->seg);
+}
+
+//! move the passed position to the first record of its segment at or after from
+static void store_iter_seek(store_iter_t *it, uint32_t from)
+{
+    const store_seg_t *seg = &it->seg;
+    uint32_t count = seg->hdr->count, lo = 0, hi;
+
+    it->rec = 0;
+    it->entry = 0;
+    if (count == 0 || seg->hdr->last_time < from){
+	it->rec = count;
+	return;
+    }
+    // the last index entry, of those covering a record, whose base time is not after from
+    hi = seg->hdr->n_index;
+    while (hi > 0 && seg->index[hi - 1].first >= count)
+	hi--;
+    while (hi - lo > 1){
+	uint32_t mid = lo + (hi - lo) / 2;
+	if (seg->index[mid].base_time <= from)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    it->entry = lo;
+    it->rec = seg->index[lo].first;
+    while (it->rec < count && seg->index[it->entry].base_time + seg->times[it->rec] < from){
+	it->rec++;
+	if (it->entry + 1 < seg->hdr->n_index && seg->index[it->entry + 1].first == it->rec)
+	    it->entry++;
+    }
+}
+
+//! the segment being read, if it's not the store's own newest segment
+static int store_iter_mapped(const store_iter_t *it)
+{
+    return it->seg.map != NULL && it->seg.map != it->st->seg.map;
+}
+
+void store_iter_init(store_iter_t *it, const store_t *st, uint32_t from, uint32_t to)
+{
+    memset(it, 0, sizeof(*it));
+    it->st = st;
+    it->seg.fd = -1;
+    it->seq = st->first_seq;
+    it->from = from;
+    it->to = to;
+}
+
+int store_iter_next(store_iter_t *it, uint32_t *time, sma_values_t *v)
+{
+    const store_t *st = it->st;
+    uint32_t t, have, cap;
+    int i;
+
+    for (;;){
+	if (it->seq == 0 || it->seq > st->last_seq)
+	    return 0;
+	if (it->seg.hdr == NULL){
+	    if (it->seq == st->last_seq)
+		it->seg = st->seg;
+	    else if (store_seg_map(st, it->seq, &it->seg, 0) != 0){
+		// deleted since, or never finished
+		store_seg_close(&it->seg);
+		it->seq++;
+		continue;
+	    }
+	    store_iter_seek(it, it->from);
+	}
+	if (it->rec < it->seg.hdr->count)
+	    break;
+	store_iter_end(it);
+	it->seq++;
+    }
+    if (it->entry + 1 < it->seg.hdr->n_index && it->seg.index[it->entry + 1].first == it->rec)
+	it->entry++;
+    t = it->seg.index[it->entry].base_time + it->seg.times[it->rec];
+    if (t > it->to){
+	store_iter_end(it);
+	it->seq = 0;
+	return 0;
+    }
+    cap = it->seg.hdr->capacity;
+    have = it->seg.have[it->rec];
+    sma_values_clear(v);
+    for (i = 0; i < SMA_VAL_COUNT; i++){
+	if (!(have & SMA_HAVE(i)))
+	    continue;
+	int32_t value = it->seg.cols[(size_t)i * cap + it->rec];
+	// the counters are unsigned
+	sma_value_set(v, i, i >= SMA_VAL_TOTAL_WH ? (int64_t)(uint32_t)value : value);
+    }
+    v->time = t;
+    *time = t;
+    it->rec++;
+    return 1;
+}
+
+void store_iter_end(store_iter_t *it)
+{
+    if (store_iter_mapped(it))
+	store_seg_close(&it->seg);
+    it->seg.map = NULL;
+    it->seg.hdr = NULL;
+    it->seg.fd = -1;
+}
+
+//! answer store_query() from the passed rollup tier
+static void store_query_rollup(const store_t *st, int tier, uint32_t from, uint32_t to, uint32_t step,
+			       store_query_fn_t fn, void *arg)
+{
+    uint32_t tier_step = st->rollup.hdr->tiers[tier].step, w, t;
+    rollup_bucket_t b;
+
+    for (w = rollup_align(&st->rollup, from, step); w <= to; w += step){
+	rollup_bucket_clear(&b, w);
+	for (t = w; t - w < step; t += tier_step){
+	    const rollup_bucket_t *tb = rollup_find(&st->rollup, tier, t);
+	    if (tb != NULL)
+		rollup_bucket_merge(&b, tb);
+	}
+	if (b.n || b.wh)
+	    fn(&b, arg);
+	if (w > UINT32_MAX - step)
+	    break;
+    }
+}
+
+//! answer store_query() from the readings themselves
+static void store_query_readings(const store_t *st, uint32_t from, uint32_t to, uint32_t step,
+				 store_query_fn_t fn, void *arg)
+{
+    store_iter_t it;
+    rollup_hdr_t last;
+    rollup_bucket_t b, reading;
+    sma_values_t v;
+    uint32_t t;
+
+    // the energy of the first reading isn't known, there being no reading before it
+    memset(&last, 0, sizeof(last));
+    from = rollup_align(&st->rollup, from, step);
+    rollup_bucket_clear(&b, from);
+    // the step holding to is answered in full, as it is from the rollups
+    to = rollup_align(&st->rollup, to, step);
+    to = to > UINT32_MAX - step ? UINT32_MAX : to + step - 1;
+    store_iter_init(&it, st, from, to);
+    while (store_iter_next(&it, &t, &v)){
+	if (rollup_align(&st->rollup, t, step) != b.start){
+	    if (b.n || b.wh)
+		fn(&b, arg);
+	    rollup_bucket_clear(&b, rollup_align(&st->rollup, t, step));
+	}
+	rollup_bucket_clear(&reading, 0);
+	reading.wh = rollup_energy(&last, t, &v);
+	if (v.have & SMA_HAVE(SMA_VAL_AC_POWER)){
+	    reading.n = 1;
+	    reading.min_w = reading.max_w = reading.sum_w = v.ac_power;
+	}
+	rollup_bucket_merge(&b, &reading);
+    }
+    store_iter_end(&it);
+    if (b.n || b.wh)
+	fn(&b, arg);
+}
+
+int store_query(const store_t *st, uint32_t from, uint32_t to, uint32_t step, store_query_fn_t fn, void *arg)
+{
+    int tier;
+
+    if (step == 0)
+	return -1;
+    // nothing after the last reading
+    if (to > st->last_time)
+	to = st->last_time;
+    if (from > to)
+	return 0;
+    if ((tier = rollup_tier_for(&st->rollup, rollup_align(&st->rollup, from, step), step)) < 0){
+	store_query_readings(st, from, to, step, fn, arg);
+	return 0;
+    }
+    store_query_rollup(st, tier, from, to, step, fn, arg);
+    return st->rollup.hdr->tiers[tier].step;
+}
@@ -0,0 +1,210 @@
+#ifndef STORE_H
+#define STORE_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Append only store of the readings of an inverter, kept on the router's flash.
+//
+// The readings of each inverter are kept in a series of segment files in the
+// store directory, named <name>-<seq>.seg with seq counting up from 1. Each
+// segment holds a fixed number of records, is sized in full when it is created
+// and is mmap'd, so appending a reading is just a copy of its values into the
+// mapping. Once a segment is full the next is started and, if that would go over
+// the store's budget, the oldest is deleted.
+//
+// A segment is laid out in columns, each record taking one slot in each:
+//   header   store_hdr_t, padded to STORE_HDR_LEN
+//   index    store_index_t for every STORE_INDEX_EVERY records: the first record
+//            it covers and its base time. An entry is also started whenever a
+//            record's time is too far from the base time to fit its offset.
+//   time     uint16_t seconds from the base time of the record's index entry
+//   have     uint32_t SMA_HAVE() flags of the values present in the record
+//   values   int32_t, one column per SMA_VAL_xxx. The 64 bit counters are stored
+//            unsigned in 32 bits, enough for 4 GWh or 136 years
+//
+// The count in the header is updated last, so a reading is either wholly in the
+// segment or not at all. The first record at or after a time is found by binary
+// search of the index, followed by a scan of at most STORE_INDEX_EVERY records.
+//
+// The rollups of the readings, see rollup.h, are kept beside the segments and
+// updated as each reading is appended. A query over a range of time in steps of
+// a few minutes or more is answered from the coarsest rollup that fits, so its
+// cost doesn't depend on how many readings there are.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rollup.h"
+#include "sma.h"
+
+//! 'SBTS' - magic number at the start of a segment
+#define STORE_MAGIC        0x53544253
+//! version of the segment layout, bump whenever it changes
+#define STORE_VERSION      1
+//! length of the segment header, the index follows
+#define STORE_HDR_LEN      64
+//! a new index entry is started after this many records
+#define STORE_INDEX_EVERY  64
+//! records in each segment by default, about 4 days of readings a minute apart
+#define STORE_SEG_RECORDS  6144
+//! bytes of flash that the segments of each inverter may take up by default
+#define STORE_BUDGET       (4 * 1024 * 1024)
+//! longest path of a segment file
+#define STORE_PATH_MAX     256
+
+//! header at the start of each segment
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    //! number of value columns
+    uint16_t n_cols;
+    //! number of records the segment has room for
+    uint32_t capacity;
+    //! number of index entries the segment has room for
+    uint32_t index_cap;
+    //! sequence number of the segment
+    uint32_t seq;
+    //! number of records in the segment, updated after each record has been written
+    volatile uint32_t count;
+    //! number of index entries in use
+    volatile uint32_t n_index;
+    //! unix time of the first and last records
+    uint32_t first_time;
+    uint32_t last_time;
+} store_hdr_t;
+
+//! an entry in the index of a segment
+typedef struct {
+    //! number of the first record covered by the entry
+    uint32_t first;
+    //! unix time from which the time offsets of the records it covers are counted
+    uint32_t base_time;
+} store_index_t;
+
+//! a segment, mapped
+typedef struct {
+    int fd;
+    void *map;
+    size_t map_len;
+    store_hdr_t *hdr;
+    store_index_t *index;
+    uint16_t *times;
+    uint32_t *have;
+    //! the value columns, each of hdr->capacity values
+    int32_t *cols;
+} store_seg_t;
+
+//! the store of one inverter
+typedef struct {
+    //! directory and name of the segment files
+    char dir[STORE_PATH_MAX];
+    char name[STORE_PATH_MAX];
+    //! number of records in each new segment
+    uint32_t seg_records;
+    //! most segment files kept
+    uint32_t max_segs;
+    //! sequence numbers of the oldest and newest segments
+    uint32_t first_seq;
+    uint32_t last_seq;
+    //! unix time of the last record appended
+    uint32_t last_time;
+    //! the newest segment, to which records are appended
+    store_seg_t seg;
+    //! the rollups of the readings
+    rollup_t rollup;
+} store_t;
+
+//! position when reading a range of records from a store
+typedef struct {
+    const store_t *st;
+    //! the segment being read, sequence number and mapping
+    uint32_t seq;
+    store_seg_t seg;
+    //! the next record, and the index entry that covers it
+    uint32_t rec;
+    uint32_t entry;
+    //! unix times of the first and last records wanted
+    uint32_t from;
+    uint32_t to;
+} store_iter_t;
+
+/**
+ * Open the store of the named inverter, creating the directory's first segment for it if need be
+ *
+ * @param st The store
+ * @param dir Directory holding the segment files
+ * @param name Name of the inverter, eg its serial number, from which the file names are made
+ * @param budget Most bytes that the segment files may take up, 0 for STORE_BUDGET. At least two
+ * segments are kept.
+ * @param seg_records Number of records in each new segment, 0 for STORE_SEG_RECORDS
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int store_open(store_t *st, const char *dir, const char *name, size_t budget, uint32_t seg_records);
+
+/**
+ * Append a reading to the store
+ *
+ * @param st The store
+ * @param time Unix time of the reading. A time earlier than the last reading's, eg after the clock
+ * has been set back, is stored as the last reading's.
+ * @param v The values, of which those present are stored
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int store_append(store_t *st, uint32_t time, const sma_values_t *v);
+
+//! close the store, flushing the newest segment
+void store_close(store_t *st);
+
+//! return the size in bytes of a segment of the passed number of records
+size_t store_seg_size(uint32_t records);
+
+/**
+ * Start reading the records of an open store whose times are in a range
+ *
+ * @param it Where the position is kept
+ * @param st The store
+ * @param from Unix time of the first record wanted
+ * @param to Unix time of the last record wanted
+ */
+void store_iter_init(store_iter_t *it, const store_t *st, uint32_t from, uint32_t to);
+
+/**
+ * Read the next record in the range
+ *
+ * @param it The position, from store_iter_init()
+ * @param time Set to the unix time of the record
+ * @param v Set to the values of the record
+ *
+ * @return 1 if a record was read, 0 at the end of the range
+ */
+int store_iter_next(store_iter_t *it, uint32_t *time, sma_values_t *v);
+
+//! finish reading, releasing the segment being read
+void store_iter_end(store_iter_t *it);
+
+//! called by store_query() with the readings of each step
+typedef void (*store_query_fn_t)(const rollup_bucket_t *b, void *arg);
+
+/**
+ * Get the minimum, maximum and average power and the energy produced in each step of a range of time.
+ * The steps are aligned to a multiple of their length in the local time of the rollups, see
+ * rollup_align(), and each that overlaps the range is answered in full. The answer is taken from the
+ * coarsest rollup whose buckets fit evenly in a step, or if there's none, from the readings themselves.
+ *
+ * @param st The store
+ * @param from Unix time of the start of the range
+ * @param to Unix time of the end of the range
+ * @param step Length of each step in seconds
+ * @param fn Called with the readings of each step that has any, in order of time
+ * @param arg Passed to fn
+ *
+ * @return The step of the rollup used, 0 if the readings were used, or -1 if step is 0
+ */
+int store_query(const store_t *st, uint32_t from, uint32_t to, uint32_t step, store_query_fn_t fn, void *arg);
+
+#endif
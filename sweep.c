@@ -0,0 +1,176 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Polling of many inverters at once, see sweep.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "sweep.h"
+
+//! most events handled per call to epoll_wait()
+#define SWEEP_MAX_EVENTS 16
+
+//! finish with the passed inverter, closing its connection
+static void sweep_finish(int epfd, sweep_inverter_t *inv, int state)
+{
+    if (inv->tr.fd >= 0)
+	epoll_ctl(epfd, EPOLL_CTL_DEL, inv->tr.fd, NULL);
+    session_close(&inv->s);
+    inv->state = state;
+    inv->elapsed_ms = transport_now_ms() - inv->start_ms;
+}
+
+//! step the session of the passed inverter, finishing with it if it is done or has failed
+static void sweep_step(int epfd, sweep_inverter_t *inv)
+{
+    int ret = session_step(&inv->s);
+
+    if (ret == SESSION_DONE)
+	sweep_finish(epfd, inv, SWEEP_DONE);
+    else if (ret < 0){
+	LOGGER_FMT_ERROR("%s: failed at script line %u", inv->tr.addr, inv->s.script_line_num);
+	sweep_finish(epfd, inv, SWEEP_FAILED);
+    }
+}
+
+//! start logging on to the passed inverter, once connected
+static void sweep_logon(int epfd, sweep_inverter_t *inv)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = inv;
+    if (epoll_ctl(epfd, inv->state == SWEEP_CONNECTING ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, inv->tr.fd, &ev) < 0){
+	LOGGER_FMT_ERROR("%s: epoll_ctl failed: %s", inv->tr.addr, strerror(errno));
+	sweep_finish(epfd, inv, SWEEP_FAILED);
+	return;
+    }
+    inv->state = SWEEP_RUNNING;
+    session_start_logon_and_query(&inv->s);
+    sweep_step(epfd, inv);
+}
+
+//! start connecting to the passed inverter
+static void sweep_connect(int epfd, sweep_inverter_t *inv)
+{
+    struct epoll_event ev = { 0 };
+    int ret;
+
+    inv->state = SWEEP_IDLE;
+    inv->start_ms = transport_now_ms();
+    if ((ret = session_connect_start(&inv->s)) < 0){
+	sweep_finish(epfd, inv, SWEEP_FAILED);
+	return;
+    }
+    if (inv->tr.fd < 0){
+	LOGGER_FMT_ERROR("%s: the %s transport can't be swept", inv->tr.addr, inv->tr.ops->name);
+	sweep_finish(epfd, inv, SWEEP_FAILED);
+	return;
+    }
+    if (ret == 0){
+	sweep_logon(epfd, inv);
+	return;
+    }
+    // wait for the socket to become writable, ie connected
+    ev.events = EPOLLOUT;
+    ev.data.ptr = inv;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, inv->tr.fd, &ev) < 0){
+	LOGGER_FMT_ERROR("%s: epoll_ctl failed: %s", inv->tr.addr, strerror(errno));
+	sweep_finish(epfd, inv, SWEEP_FAILED);
+	return;
+    }
+    inv->state = SWEEP_CONNECTING;
+    inv->connect_deadline = transport_now_ms() + SWEEP_CONNECT_TIMEOUT_SEC * 1000;
+}
+
+//! handle an event on the socket of the passed inverter
+static void sweep_event(int epfd, sweep_inverter_t *inv)
+{
+    if (inv->state == SWEEP_CONNECTING){
+	if (transport_connect_finish(&inv->tr) < 0)
+	    sweep_finish(epfd, inv, SWEEP_FAILED);
+	else
+	    sweep_logon(epfd, inv);
+    } else if (inv->state == SWEEP_RUNNING){
+	if (session_input(&inv->s) < 0)
+	    sweep_finish(epfd, inv, SWEEP_FAILED);
+	else
+	    sweep_step(epfd, inv);
+    }
+}
+
+//! return the deadline of the passed inverter, INT64_MAX if it is finished
+static int64_t sweep_deadline(const sweep_inverter_t *inv)
+{
+    if (inv->state == SWEEP_CONNECTING)
+	return inv->connect_deadline;
+    if (inv->state == SWEEP_RUNNING)
+	return inv->s.deadline;
+    return INT64_MAX;
+}
+
+int sweep_run(sweep_inverter_t *inv, int n)
+{
+    struct epoll_event events[SWEEP_MAX_EVENTS];
+    int epfd, i, n_done = 0;
+
+    if ((epfd = epoll_create(SWEEP_MAX_EVENTS)) < 0){
+	LOGGER_FMT_ERROR("epoll_create failed: %s", strerror(errno));
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+	sweep_connect(epfd, &inv[i]);
+
+    for(;;){
+	int64_t now, next = INT64_MAX;
+	int n_events, wait_ms;
+
+	for (i = 0; i < n; i++){
+	    if (sweep_deadline(&inv[i]) < next)
+		next = sweep_deadline(&inv[i]);
+	}
+	if (next == INT64_MAX)
+	    break;
+	now = transport_now_ms();
+	wait_ms = next > now ? next - now : 0;
+	if ((n_events = epoll_wait(epfd, events, SWEEP_MAX_EVENTS, wait_ms)) < 0){
+	    if (errno == EINTR)
+		continue;
+	    LOGGER_FMT_ERROR("epoll_wait failed: %s", strerror(errno));
+	    break;
+	}
+	for (i = 0; i < n_events; i++)
+	    sweep_event(epfd, events[i].data.ptr);
+
+	// those whose time is up
+	now = transport_now_ms();
+	for (i = 0; i < n; i++){
+	    if (sweep_deadline(&inv[i]) > now)
+		continue;
+	    if (inv[i].state == SWEEP_CONNECTING){
+		LOGGER_FMT_ERROR("Timeout connecting to %s", inv[i].tr.addr);
+		inv[i].s.timeouts++;
+		sweep_finish(epfd, &inv[i], SWEEP_FAILED);
+	    } else {
+		// which sends the request again or, once the wait for its reply is over, fails it
+		sweep_step(epfd, &inv[i]);
+	    }
+	}
+    }
+    for (i = 0; i < n; i++){
+	if (inv[i].state != SWEEP_DONE && inv[i].state != SWEEP_FAILED)
+	    sweep_finish(epfd, &inv[i], SWEEP_FAILED);
+	if (inv[i].state == SWEEP_DONE)
+	    n_done++;
+    }
+    close(epfd);
+    return n_done;
+}
@@ -0,0 +1,59 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Polling of many inverters at once from one process.
+//
+// Each inverter has its own transport and session. The connections are started
+// without waiting and each session is run as a state machine, see session_step(),
+// from a single epoll loop: a session is stepped when its socket becomes readable
+// or its deadline passes. So one slow or out of range inverter holds up none of
+// the others, and a sweep takes about as long as the slowest inverter rather than
+// the sum of them all.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include "session.h"
+#include "transport.h"
+
+// states of an inverter in a sweep
+#define SWEEP_IDLE        0
+#define SWEEP_CONNECTING  1
+#define SWEEP_RUNNING     2
+#define SWEEP_DONE        3
+#define SWEEP_FAILED      4
+
+//! seconds allowed for connecting to each inverter
+#define SWEEP_CONNECT_TIMEOUT_SEC 20
+
+//! one of the inverters in a sweep
+typedef struct {
+    //! the connection to the inverter
+    transport_t tr;
+    //! the session with the inverter, run over tr
+    sb_session_t s;
+    //! SWEEP_xxx
+    int state;
+    //! time, as transport_now_ms(), by which the connection must have been made
+    int64_t connect_deadline;
+    //! time, as transport_now_ms(), at which the inverter's sweep started, and the time it took, ms
+    int64_t start_ms;
+    int64_t elapsed_ms;
+} sweep_inverter_t;
+
+/**
+ * Connect to, log on to and query each of the passed inverters, all at once, as session_connect()
+ * then session_logon_and_query() would one at a time. The connections are closed on return.
+ * Only the socket based transports can be swept.
+ *
+ * @param inv The inverters, each with tr and s initialised, s to use tr
+ * @param n Number of inverters
+ *
+ * @return The number of inverters that were read, each of which has state SWEEP_DONE, the rest
+ * SWEEP_FAILED, or -1 if the sweep couldn't be run at all. Errors have been logged.
+ */
+int sweep_run(sweep_inverter_t *inv, int n);
+
+#endif
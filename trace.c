@@ -0,0 +1,187 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Tracing of where the time of a session goes, see trace.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+int64_t trace_now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_init(trace_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->run_start_us = trace_now_us();
+}
+
+void trace_run(trace_t *t)
+{
+    trace_end(t, 0);
+    t->n_events = 0;
+    t->run_start_us = trace_now_us();
+    t->runs++;
+}
+
+//! the index of the passed step in t->steps, added if it's new, or -1 if there's no room
+static int trace_find(trace_t *t, int code, unsigned line)
+{
+    int i;
+
+    for (i = 0; i < t->n_steps; i++){
+	if (t->steps[i].code == code && t->steps[i].line == line)
+	    return i;
+    }
+    if (t->n_steps == TRACE_MAX_STEPS)
+	return -1;
+    t->steps[i].code = code;
+    t->steps[i].line = line;
+    return t->n_steps++;
+}
+
+void trace_begin(trace_t *t, int code, unsigned line)
+{
+    trace_event_t *e;
+    int step;
+
+    if (t->open){
+	const trace_step_t *st = &t->steps[t->events[t->n_events - 1].step];
+	if (st->code == code && st->line == line)
+	    return;
+    }
+    trace_end(t, 0);
+    if (t->n_events == TRACE_MAX_EVENTS || (step = trace_find(t, code, line)) < 0)
+	return;
+    e = &t->events[t->n_events++];
+    memset(e, 0, sizeof(*e));
+    e->step = step;
+    t->open_us = trace_now_us();
+    e->start_us = t->open_us - t->run_start_us;
+    t->open = 1;
+}
+
+//! the bucket of the histograms holding the passed latency
+static int trace_bucket(uint32_t us)
+{
+    int k, b;
+
+    if (us < 1)
+	return 0;
+    k = 31 - __builtin_clz(us);
+    // the upper half of the octave from 2^k is that above 2^k * sqrt(2)
+    b = 2 * k + ((uint64_t)us * us >= (uint64_t)1 << (2 * k + 1));
+    return b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1;
+}
+
+//! the upper bound of the passed bucket, us
+static double trace_bucket_us(int b)
+{
+    return (b & 1) ? (double)(1u << (b / 2 + 1)) : (1u << (b / 2)) * 1.41421356;
+}
+
+void trace_end(trace_t *t, int failed)
+{
+    trace_event_t *e;
+    trace_step_t *st;
+
+    if (!t->open)
+	return;
+    t->open = 0;
+    e = &t->events[t->n_events - 1];
+    e->us = trace_now_us() - t->open_us;
+    e->failed = failed;
+    st = &t->steps[e->step];
+    st->count++;
+    st->failed += failed != 0;
+    st->sum_us += e->us;
+    st->bytes += e->bytes;
+    st->reads += e->reads;
+    st->resends += e->resends;
+    if (e->us > st->max_us)
+	st->max_us = e->us;
+    st->hist[trace_bucket(e->us)]++;
+}
+
+void trace_read(trace_t *t, size_t bytes)
+{
+    if (!t->open)
+	return;
+    t->events[t->n_events - 1].reads++;
+    t->events[t->n_events - 1].bytes += bytes;
+}
+
+void trace_resend(trace_t *t)
+{
+    if (t->open)
+	t->events[t->n_events - 1].resends++;
+}
+
+//! write the name of the passed step, padded to the same width for them all
+static void trace_name(const trace_step_t *st, FILE *fp)
+{
+    switch (st->code){
+	case TRACE_CONNECT:   fprintf(fp, "%-10s", "connect"); break;
+	case TRACE_DISCOVER:  fprintf(fp, "%-10s", "discover"); break;
+	case TRACE_QUERY_ALL: fprintf(fp, "%-10s", "query all"); break;
+	case TRACE_ARCHIVE:   fprintf(fp, "%-10s", "archive"); break;
+	default:              fprintf(fp, "%c line %-3u", st->code, st->line); break;
+    }
+}
+
+void trace_dump(const trace_t *t, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "trace: run %u\nstep        start ms    time ms  bytes  reads\n", t->runs);
+    for (i = 0; i < t->n_events; i++){
+	const trace_event_t *e = &t->events[i];
+	trace_name(&t->steps[e->step], fp);
+	fprintf(fp, " %10.3f %10.3f %6u %6u", e->start_us / 1e3, e->us / 1e3, e->bytes, e->reads);
+	if (e->resends)
+	    fprintf(fp, "  resent %u", e->resends);
+	fprintf(fp, "%s\n", e->failed ? "  failed" : "");
+    }
+}
+
+//! the latency, us, below which the passed fraction of the runs of a step fell, to the bucket
+static double trace_percentile(const trace_step_t *st, double frac)
+{
+    uint32_t n = 0, want = st->count * frac;
+    int b;
+
+    for (b = 0; b < TRACE_BUCKETS - 1; b++){
+	if ((n += st->hist[b]) > want)
+	    break;
+    }
+    return trace_bucket_us(b) < st->max_us ? trace_bucket_us(b) : st->max_us;
+}
+
+void trace_print(const trace_t *t, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "trace: %u runs\nstep         count failed   mean ms    p50 ms    p90 ms    p99 ms    max ms   bytes  reads resent\n",
+	    t->runs);
+    for (i = 0; i < t->n_steps; i++){
+	const trace_step_t *st = &t->steps[i];
+	if (st->count == 0)
+	    continue;
+	trace_name(st, fp);
+	fprintf(fp, " %7u %6u %9.3f %9.3f %9.3f %9.3f %9.3f %7.1f %6.1f %6.2f\n", st->count, st->failed,
+		st->sum_us / 1e3 / st->count, trace_percentile(st, 0.5) / 1e3, trace_percentile(st, 0.9) / 1e3,
+		trace_percentile(st, 0.99) / 1e3, st->max_us / 1e3, (double)st->bytes / st->count,
+		(double)st->reads / st->count, (double)st->resends / st->count);
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef TRACE_H
+#define TRACE_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Tracing of where the time of a session goes: connecting, each S, R and E line
+// of the script, and the phases that follow the script, ie identifying the
+// inverters in the net, the queries of -all and archive downloads.
+//
+// The session (see session.h) marks the start and end of each of these steps,
+// and the reads and resent requests made during them. Each run of a session,
+// as started with trace_run(), is kept as a list of its steps with their times,
+// bytes, reads and resends, to be shown with trace_dump(). Across runs the
+// latency of each step is added to a histogram, shown with trace_print(),
+// together with the number of times it failed.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdio.h>
+
+// steps other than the lines of the script, whose step is their SCRIPT_OP_xxx code and line number
+#define TRACE_CONNECT     'C'
+#define TRACE_DISCOVER    'D'
+#define TRACE_QUERY_ALL   'Q'
+#define TRACE_ARCHIVE     'A'
+
+//! most steps kept track of, being the lines of the script and the other steps
+#define TRACE_MAX_STEPS   64
+//! most steps kept of a run
+#define TRACE_MAX_EVENTS  128
+//! buckets of the latency histograms, each sqrt(2) times the width of the one before, from 1us
+//! to 2^(TRACE_BUCKETS/2) us, ie 16s
+#define TRACE_BUCKETS     48
+
+//! a step, with its latency histogram
+typedef struct {
+    //! SCRIPT_OP_xxx or TRACE_xxx, and the script line number
+    int code;
+    unsigned line;
+    //! number of times run, and of those that failed, eg timed out
+    uint32_t count;
+    uint32_t failed;
+    //! totals over the times run
+    uint64_t sum_us;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t resends;
+    uint32_t max_us;
+    uint32_t hist[TRACE_BUCKETS];
+} trace_step_t;
+
+//! a step as run
+typedef struct {
+    //! index in trace_t.steps
+    int step;
+    //! start from the start of the run, and duration, us
+    uint32_t start_us;
+    uint32_t us;
+    uint32_t bytes;
+    uint32_t reads;
+    uint32_t resends;
+    int failed;
+} trace_event_t;
+
+typedef struct {
+    //! start of the current run, us on the monotonic clock
+    int64_t run_start_us;
+    //! number of runs
+    uint32_t runs;
+    //! the steps of the current run, the last being open while open is set
+    trace_event_t events[TRACE_MAX_EVENTS];
+    int n_events;
+    int open;
+    //! start of the open step, us on the monotonic clock
+    int64_t open_us;
+    trace_step_t steps[TRACE_MAX_STEPS];
+    int n_steps;
+} trace_t;
+
+//! return the current value of the monotonic clock in microseconds
+int64_t trace_now_us();
+
+//! initialise the passed trace, which has no runs
+void trace_init(trace_t *t);
+
+//! start a new run, forgetting the steps of the last
+void trace_run(trace_t *t);
+
+/**
+ * Start the passed step, ending any other that is open. If the step is already open, as when it is
+ * continued after waiting for input, nothing is done.
+ *
+ * @param t The trace
+ * @param code SCRIPT_OP_xxx or TRACE_xxx
+ * @param line The script line number, 0 for the other steps
+ */
+void trace_begin(trace_t *t, int code, unsigned line);
+
+/**
+ * End the open step, if any, adding its latency to its histogram
+ *
+ * @param t The trace
+ * @param failed Non zero if the step failed
+ */
+void trace_end(trace_t *t, int failed);
+
+//! count a read of the passed number of bytes, 0 on timeout, made during the open step
+void trace_read(trace_t *t, size_t bytes);
+
+//! count the requests of the open step being sent again, as none came within the wait for them
+void trace_resend(trace_t *t);
+
+//! write the steps of the current run, one to a line
+void trace_dump(const trace_t *t, FILE *fp);
+
+//! write the latency percentiles, failures, mean bytes, reads and resends of each step over all of the runs
+void trace_print(const trace_t *t, FILE *fp);
+
+#endif
@@ -0,0 +1,451 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The connection over which frames are exchanged with the inverter, see transport.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#ifndef SB_NO_BLUETOOTH
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "transport.h"
+
+//! 'SBRC' - magic number at the start of a recorded session
+#define RECORD_MAGIC "SBRC"
+//! record direction markers
+#define RECORD_IN   'I'
+#define RECORD_OUT  'O'
+//! length of the header of each record: direction, time in ms (4 bytes LSB first), length (2 bytes LSB first)
+#define RECORD_HEADER_LEN 7
+
+int64_t transport_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//! initialise the parts of the transport common to all back ends
+static void transport_init(transport_t *t, const transport_ops_t *ops, const char *addr)
+{
+    memset(t, 0, sizeof(*t));
+    t->ops = ops;
+    t->fd = -1;
+    strncpy(t->addr, addr, sizeof(t->addr) - 1);
+}
+
+// -----------------------------------------------------------------------------
+// operations common to the socket based back ends
+
+//! read from the socket, waiting until the deadline
+static ssize_t sock_read(transport_t *t, void *buf, size_t len, int64_t deadline)
+{
+    struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+    int64_t wait_ms = deadline - transport_now_ms();
+    ssize_t n;
+    int ret;
+
+    if (wait_ms < 0)
+	wait_ms = 0;
+    while ((ret = poll(&pfd, 1, wait_ms)) < 0 && errno == EINTR)
+	;
+    if (ret < 0) {
+	LOGGER_FMT_ERROR("%s: poll failed: %s", t->addr, strerror(errno));
+	return -1;
+    }
+    if (ret == 0)
+	return 0;
+    if ((n = recv(t->fd, buf, len, 0)) <= 0) {
+	// error reading, or connection closed
+	LOGGER_FMT_ERROR("Could not read from %s: %s", t->addr, n ? strerror(errno) : "connection closed");
+	return -1;
+    }
+    return n;
+}
+
+static ssize_t sock_write(transport_t *t, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+	ssize_t n = send(t->fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    LOGGER_FMT_ERROR("Could not write to %s: %s", t->addr, strerror(errno));
+	    return -1;
+	}
+	done += n;
+    }
+    return len;
+}
+
+/**
+ * Connect the socket t->fd to the passed address. If t->connect_nowait is set the connect is
+ * only started, and t->connecting is set if it has yet to complete.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int sock_connect(transport_t *t, const struct sockaddr *addr, socklen_t len)
+{
+    if (t->connect_nowait)
+	fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+    if (connect(t->fd, addr, len) == 0)
+	return 0;
+    if (t->connect_nowait && errno == EINPROGRESS) {
+	t->connecting = 1;
+	return 0;
+    }
+    return -1;
+}
+
+static void sock_close(transport_t *t)
+{
+    if (t->fd >= 0) {
+	close(t->fd);
+	t->fd = -1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// rfcomm
+#ifndef SB_NO_BLUETOOTH
+static int rfcomm_connect(transport_t *t)
+{
+    struct sockaddr_rc addr = { 0 };
+
+    if ((t->fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM)) < 0) {
+	LOGGER_FMT_ERROR("Could not create socket: %s", strerror(errno));
+	return -1;
+    }
+    // set the connection parameters (who to connect to)
+    addr.rc_family = AF_BLUETOOTH;
+    addr.rc_channel = (uint8_t) 1;
+    str2ba( t->addr, &addr.rc_bdaddr );
+    // connect to server
+    if (sock_connect(t, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	LOGGER_FMT_ERROR("Error connecting to %s: %s", t->addr, strerror(errno));
+	sock_close(t);
+	return -1;
+    }
+    return 0;
+}
+
+static const transport_ops_t rfcomm_ops = {
+    "rfcomm", rfcomm_connect, sock_read, sock_write, sock_close
+};
+
+void transport_init_rfcomm(transport_t *t, const char *bt_addr)
+{
+    transport_init(t, &rfcomm_ops, bt_addr);
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// tcp
+static int tcp_connect(transport_t *t)
+{
+    char host[TRANSPORT_ADDR_MAX];
+    struct addrinfo hints = { 0 }, *res, *ai;
+    char *port;
+    int ret, one = 1;
+
+    strcpy(host, t->addr);
+    if ((port = strrchr(host, ':')) == NULL) {
+	LOGGER_FMT_ERROR("Bad tcp address, expecting host:port: %s", t->addr);
+	return -1;
+    }
+    *port++ = '\0';
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+	LOGGER_FMT_ERROR("Could not resolve %s: %s", t->addr, gai_strerror(ret));
+	return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+	if ((t->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	if (sock_connect(t, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	sock_close(t);
+    }
+    freeaddrinfo(res);
+    if (t->fd < 0) {
+	LOGGER_FMT_ERROR("Error connecting to %s: %s", t->addr, strerror(errno));
+	return -1;
+    }
+    // frames are small and each is written in one go, don't delay them
+    setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static const transport_ops_t tcp_ops = {
+    "tcp", tcp_connect, sock_read, sock_write, sock_close
+};
+
+void transport_init_tcp(transport_t *t, const char *host_port)
+{
+    transport_init(t, &tcp_ops, host_port);
+}
+
+// -----------------------------------------------------------------------------
+// socketpair
+static int socketpair_connect(transport_t *t)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	LOGGER_FMT_ERROR("Could not create socketpair: %s", strerror(errno));
+	return -1;
+    }
+    t->fd = sv[0];
+    t->peer_cb(sv[1], t->peer_arg);
+    return 0;
+}
+
+static const transport_ops_t socketpair_ops = {
+    "socketpair", socketpair_connect, sock_read, sock_write, sock_close
+};
+
+void transport_init_socketpair(transport_t *t, transport_peer_cb_t peer_cb, void *arg)
+{
+    transport_init(t, &socketpair_ops, "socketpair");
+    t->peer_cb = peer_cb;
+    t->peer_arg = arg;
+}
+
+// -----------------------------------------------------------------------------
+// replay of a recorded session
+
+//! return the 4 byte value, stored LSB first, at p
+static uint32_t get_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int replay_connect(transport_t *t)
+{
+    char magic[4];
+
+    if ((t->replay_fp = fopen(t->addr, "rb")) == NULL) {
+	LOGGER_FMT_ERROR("Could not open recorded session: %s: %s", t->addr, strerror(errno));
+	return -1;
+    }
+    if (fread(magic, 1, sizeof(magic), t->replay_fp) != sizeof(magic) || memcmp(magic, RECORD_MAGIC, sizeof(magic))) {
+	LOGGER_FMT_ERROR("Not a recorded session: %s", t->addr);
+	fclose(t->replay_fp);
+	t->replay_fp = NULL;
+	return -1;
+    }
+    t->replay_len = t->replay_pos = 0;
+    t->replay_sent_rec_ms = 0;
+    t->replay_sent_ms = transport_now_ms();
+    return 0;
+}
+
+/**
+ * Read records from the recording until a received one, which is left in replay_buf
+ *
+ * @return 0 on success, -1 at the end of the recording or on error
+ */
+static int replay_next(transport_t *t)
+{
+    unsigned char hdr[RECORD_HEADER_LEN];
+
+    for (;;) {
+	if (fread(hdr, 1, sizeof(hdr), t->replay_fp) != sizeof(hdr)) {
+	    LOGGER_FMT_INFO("%s: end of recorded session", t->addr);
+	    return -1;
+	}
+	uint32_t rec_ms = get_u32(hdr + 1);
+	uint16_t len = hdr[5] | (hdr[6] << 8);
+	if (len > sizeof(t->replay_buf) || fread(t->replay_buf, 1, len, t->replay_fp) != len) {
+	    LOGGER_FMT_ERROR("%s: bad record in recorded session", t->addr);
+	    return -1;
+	}
+	if (hdr[0] == RECORD_OUT) {
+	    // data that was sent, received data is delivered relative to this
+	    t->replay_sent_rec_ms = rec_ms;
+	} else if (hdr[0] == RECORD_IN && len > 0) {
+	    t->replay_len = len;
+	    t->replay_pos = 0;
+	    t->replay_due_ms = t->replay_sent_ms;
+	    if (rec_ms > t->replay_sent_rec_ms)
+		t->replay_due_ms += rec_ms - t->replay_sent_rec_ms;
+	    return 0;
+	}
+    }
+}
+
+static ssize_t replay_read(transport_t *t, void *buf, size_t len, int64_t deadline)
+{
+    if (t->replay_pos == t->replay_len && replay_next(t) < 0)
+	return -1;
+    if (!t->replay_fast) {
+	// wait until the data is due, or the deadline
+	int64_t now = transport_now_ms();
+	int64_t until = t->replay_due_ms < deadline ? t->replay_due_ms : deadline;
+	if (until > now)
+	    usleep((until - now) * 1000);
+	if (t->replay_due_ms > deadline)
+	    return 0;
+    }
+    size_t n = t->replay_len - t->replay_pos;
+    if (n > len)
+	n = len;
+    memcpy(buf, t->replay_buf + t->replay_pos, n);
+    t->replay_pos += n;
+    return n;
+}
+
+static ssize_t replay_write(transport_t *t, const void *buf, size_t len)
+{
+    // the data is discarded, it's the time it was sent that matters
+    t->replay_sent_ms = transport_now_ms();
+    return len;
+}
+
+static void replay_close(transport_t *t)
+{
+    if (t->replay_fp != NULL) {
+	fclose(t->replay_fp);
+	t->replay_fp = NULL;
+    }
+}
+
+static const transport_ops_t replay_ops = {
+    "replay", replay_connect, replay_read, replay_write, replay_close
+};
+
+void transport_init_replay(transport_t *t, const char *fname, int fast)
+{
+    transport_init(t, &replay_ops, fname);
+    t->replay_fast = fast;
+}
+
+// -----------------------------------------------------------------------------
+// recording
+
+int transport_record(transport_t *t, const char *fname)
+{
+    if ((t->record_fp = fopen(fname, "wb")) == NULL) {
+	LOGGER_FMT_ERROR("Could not create recording: %s: %s", fname, strerror(errno));
+	return -1;
+    }
+    fwrite(RECORD_MAGIC, 1, 4, t->record_fp);
+    t->record_start_ms = transport_now_ms();
+    return 0;
+}
+
+//! append a record of the passed data to the recording
+static void record(transport_t *t, char dir, const void *buf, size_t len)
+{
+    unsigned char hdr[RECORD_HEADER_LEN];
+    uint32_t ms = transport_now_ms() - t->record_start_ms;
+    const unsigned char *p = buf;
+
+    // data longer than a record is split over several
+    do {
+	size_t n = len > TRANSPORT_RECORD_MAX ? TRANSPORT_RECORD_MAX : len;
+	hdr[0] = dir;
+	hdr[1] = ms;
+	hdr[2] = ms >> 8;
+	hdr[3] = ms >> 16;
+	hdr[4] = ms >> 24;
+	hdr[5] = n;
+	hdr[6] = n >> 8;
+	fwrite(hdr, 1, sizeof(hdr), t->record_fp);
+	fwrite(p, 1, n, t->record_fp);
+	p += n;
+	len -= n;
+    } while (len > 0);
+    fflush(t->record_fp);
+}
+
+// -----------------------------------------------------------------------------
+
+int transport_connect(transport_t *t)
+{
+    transport_close(t);
+    LOGGER_FMT_DEBUG("connecting to %s via %s", t->addr, t->ops->name);
+    t->connect_nowait = 0;
+    t->connecting = 0;
+    return t->ops->connect(t);
+}
+
+int transport_connect_start(transport_t *t)
+{
+    int ret;
+
+    transport_close(t);
+    LOGGER_FMT_DEBUG("starting to connect to %s via %s", t->addr, t->ops->name);
+    t->connect_nowait = 1;
+    t->connecting = 0;
+    ret = t->ops->connect(t);
+    t->connect_nowait = 0;
+    if (ret < 0)
+	return -1;
+    if (t->connecting)
+	return 1;
+    return transport_connect_finish(t);
+}
+
+int transport_connect_finish(transport_t *t)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    t->connecting = 0;
+    if (t->fd < 0)
+	return 0;
+    if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	err = errno;
+    if (err != 0) {
+	LOGGER_FMT_ERROR("Error connecting to %s: %s", t->addr, strerror(err));
+	transport_close(t);
+	return -1;
+    }
+    // reads wait with poll(), and frames are small enough to be written in one go
+    fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) & ~O_NONBLOCK);
+    return 0;
+}
+
+ssize_t transport_read(transport_t *t, void *buf, size_t len, int64_t deadline)
+{
+    ssize_t n = t->ops->read(t, buf, len, deadline);
+    if (n > 0) {
+	t->bytes_in += n;
+	t->reads++;
+	if (t->record_fp != NULL)
+	    record(t, RECORD_IN, buf, n);
+    }
+    return n;
+}
+
+int transport_write(transport_t *t, const void *buf, size_t len)
+{
+    if (t->ops->write(t, buf, len) < 0)
+	return -1;
+    t->bytes_out += len;
+    if (t->record_fp != NULL)
+	record(t, RECORD_OUT, buf, len);
+    return 0;
+}
+
+void transport_close(transport_t *t)
+{
+    t->ops->close(t);
+}
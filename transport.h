@@ -0,0 +1,165 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// The connection over which frames are exchanged with the inverter.
+//
+// A transport has connect, read-with-deadline, write and close operations, and
+// one of these back ends:
+//   rfcomm     - bluetooth RFCOMM socket to the inverter, as normally used
+//   tcp        - TCP connection, eg to a bluetooth to IP bridge
+//   socketpair - unix socketpair, the other end of which is handed to an in process
+//                simulator of the inverter
+//   replay     - replays the data received in a session previously recorded with
+//                transport_record(), either with the original delays or as fast as possible
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+//! length of the longest address string held by a transport
+#define TRANSPORT_ADDR_MAX 256
+//! the most data held in one record of a recorded session
+#define TRANSPORT_RECORD_MAX 4096
+
+typedef struct transport transport_t;
+
+//! the operations of a transport back end
+typedef struct {
+    //! name of the back end
+    const char *name;
+    //! connect, return 0 on success, -1 on error
+    int (*connect)(transport_t *t);
+    //! read up to len bytes, waiting until deadline. Return bytes read, 0 on timeout, -1 on error or closed
+    ssize_t (*read)(transport_t *t, void *buf, size_t len, int64_t deadline);
+    //! write len bytes, return len on success, -1 on error
+    ssize_t (*write)(transport_t *t, const void *buf, size_t len);
+    //! close, if connected
+    void (*close)(transport_t *t);
+} transport_ops_t;
+
+//! callback passed the other end of a socketpair transport each time it connects
+typedef void (*transport_peer_cb_t)(int peer_fd, void *arg);
+
+struct transport {
+    const transport_ops_t *ops;
+    //! the connected socket, -1 when not connected
+    int fd;
+    //! flag to tell the connect operation of a socket back end to only start connecting
+    int connect_nowait;
+    //! flag set by the connect operation if the connection has been started but not yet made
+    int connecting;
+    //! the address connected to: bluetooth address, host:port, or replay file name
+    char addr[TRANSPORT_ADDR_MAX];
+    //! socketpair: called with the other end of the pair on connect
+    transport_peer_cb_t peer_cb;
+    void *peer_arg;
+    //! replay: the recorded session
+    FILE *replay_fp;
+    //! replay: flag to indicate that the data is to be delivered as fast as possible
+    int replay_fast;
+    //! replay: time, relative to the start of the recording, of the last data sent
+    uint32_t replay_sent_rec_ms;
+    //! replay: time at which the last data was sent
+    int64_t replay_sent_ms;
+    //! replay: the current received record, of which bytes from replay_pos on have not yet been delivered
+    unsigned char replay_buf[TRANSPORT_RECORD_MAX];
+    uint16_t replay_len;
+    uint16_t replay_pos;
+    //! replay: time at which the current received record is to be delivered
+    int64_t replay_due_ms;
+    //! recording: the file being recorded to, NULL if not recording
+    FILE *record_fp;
+    //! recording: time at which recording started
+    int64_t record_start_ms;
+    //! count of bytes read and written
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    //! count of calls to read that returned data
+    uint32_t reads;
+};
+
+//! return the current value of the monotonic clock in milliseconds, deadlines are in these units
+int64_t transport_now_ms();
+
+#ifndef SB_NO_BLUETOOTH
+//! initialise t as an RFCOMM transport to the passed bluetooth address, eg 00:80:25:A6:77:60
+void transport_init_rfcomm(transport_t *t, const char *bt_addr);
+#endif
+
+//! initialise t as a TCP transport to the passed host:port
+void transport_init_tcp(transport_t *t, const char *host_port);
+
+/**
+ * Initialise t as a unix socketpair transport
+ *
+ * @param t The transport
+ * @param peer_cb Called with the other end of the socketpair each time the transport connects,
+ * the callback is responsible for closing it
+ * @param arg Passed to peer_cb
+ */
+void transport_init_socketpair(transport_t *t, transport_peer_cb_t peer_cb, void *arg);
+
+/**
+ * Initialise t as a transport that replays a recorded session
+ *
+ * @param t The transport
+ * @param fname File holding the recording
+ * @param fast Flag, non zero to deliver the recorded data as fast as possible rather
+ * than with the recorded delays
+ */
+void transport_init_replay(transport_t *t, const char *fname, int fast);
+
+/**
+ * Record all data read and written by the transport to the passed file, for later replay
+ *
+ * @return 0 on success, -1 on error
+ */
+int transport_record(transport_t *t, const char *fname);
+
+//! connect the transport, return 0 on success, -1 on error, which has been logged
+int transport_connect(transport_t *t);
+
+/**
+ * Start connecting the transport without waiting for the connection to be made, for running
+ * many connections from one event loop. Only the socket based back ends wait to connect, so
+ * the others are connected on return.
+ *
+ * @return 0 if connected, 1 if the connection is being made, in which case wait for t->fd to
+ * become writable then call transport_connect_finish(), or -1 on error, which has been logged
+ */
+int transport_connect_start(transport_t *t);
+
+/**
+ * Finish a connection started by transport_connect_start(), once t->fd has become writable
+ *
+ * @return 0 if connected, -1 if the connection failed, which has been logged
+ */
+int transport_connect_finish(transport_t *t);
+
+/**
+ * Read whatever data is available, waiting until the deadline for some to arrive
+ *
+ * @param t The transport
+ * @param buf Where the data is written
+ * @param len Size of buf
+ * @param deadline Value of transport_now_ms() after which to give up waiting
+ *
+ * @return The number of bytes read, 0 on timeout, -1 on error or if the connection was closed
+ */
+ssize_t transport_read(transport_t *t, void *buf, size_t len, int64_t deadline);
+
+//! write the passed data, return 0 on success, -1 on error, which has been logged
+int transport_write(transport_t *t, const void *buf, size_t len);
+
+//! close the transport, if connected
+void transport_close(transport_t *t);
+
+//! return non zero if the transport is connected
+#define TRANSPORT_CONNECTED(t) ((t)->fd >= 0 || (t)->replay_fp != NULL)
+
+#endif
@@ -0,0 +1,600 @@
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Store and forward upload of the readings to a web server, see upload.h
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "logger.h"
+#include "upload.h"
+
+//! offset in the spool file of the passed reading
+#define UPLOAD_OFFSET(u, num) (UPLOAD_HDR_LEN + (off_t)((num) - (u)->hdr.first) * sizeof(upload_rec_t))
+
+//! split the passed url into the host, port and path, returning -1 if it isn't http://host[:port][/path]
+static int upload_parse_url(upload_t *u, const char *url)
+{
+    const char *host, *path, *colon;
+    size_t len;
+
+    if (strncmp(url, "http://", 7) != 0)
+	return -1;
+    host = url + 7;
+    if ((path = strchr(host, '/')) == NULL)
+	path = host + strlen(host);
+    colon = memchr(host, ':', path - host);
+    len = (colon != NULL ? colon : path) - host;
+    if (len == 0 || len >= sizeof(u->host))
+	return -1;
+    memcpy(u->host, host, len);
+    u->host[len] = '\x0';
+    if (colon != NULL){
+	len = path - colon - 1;
+	if (len == 0 || len >= sizeof(u->port))
+	    return -1;
+	memcpy(u->port, colon + 1, len);
+	u->port[len] = '\x0';
+    } else
+	strcpy(u->port, "80");
+    if (strlen(path) >= sizeof(u->path))
+	return -1;
+    strcpy(u->path, *path ? path : "/");
+    return 0;
+}
+
+//! write the header of the spool file
+static int upload_write_hdr(upload_t *u)
+{
+    if (pwrite(u->spool_fd, &u->hdr, sizeof(u->hdr), 0) != sizeof(u->hdr)){
+	LOGGER_FMT_ERROR("upload: could not write %s: %s", u->spool_path, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+//! open the spool file, carrying on with the readings in it, or starting it afresh if there's none
+static int upload_spool_open(upload_t *u)
+{
+    struct stat st;
+    uint32_t n;
+
+    if ((u->spool_fd = open(u->spool_path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(u->spool_fd, &st) < 0){
+	LOGGER_FMT_ERROR("upload: could not open %s: %s", u->spool_path, strerror(errno));
+	return -1;
+    }
+    if (st.st_size >= UPLOAD_HDR_LEN && pread(u->spool_fd, &u->hdr, sizeof(u->hdr), 0) == sizeof(u->hdr) &&
+	u->hdr.magic == UPLOAD_MAGIC && u->hdr.version == UPLOAD_VERSION && u->hdr.rec_size == sizeof(upload_rec_t)){
+	// a record left half written is dropped
+	n = (st.st_size - UPLOAD_HDR_LEN) / sizeof(upload_rec_t);
+	u->next = u->hdr.first + n;
+	if (u->hdr.sent - u->hdr.first > n)
+	    u->hdr.sent = u->hdr.first;
+	if (ftruncate(u->spool_fd, UPLOAD_OFFSET(u, u->next)) < 0 || upload_write_hdr(u) < 0)
+	    return -1;
+	if (u->next != u->hdr.sent)
+	    LOGGER_FMT_INFO("upload: %u readings in %s still to be sent", u->next - u->hdr.sent, u->spool_path);
+	return 0;
+    }
+    if (st.st_size > 0)
+	LOGGER_FMT_WARN("upload: %s is not a spool file of this version, starting it afresh", u->spool_path);
+    memset(&u->hdr, 0, sizeof(u->hdr));
+    u->hdr.magic = UPLOAD_MAGIC;
+    u->hdr.version = UPLOAD_VERSION;
+    u->hdr.rec_size = sizeof(upload_rec_t);
+    u->next = 0;
+    if (ftruncate(u->spool_fd, 0) < 0 || ftruncate(u->spool_fd, UPLOAD_HDR_LEN) < 0){
+	LOGGER_FMT_ERROR("upload: could not write %s: %s", u->spool_path, strerror(errno));
+	return -1;
+    }
+    return upload_write_hdr(u);
+}
+
+int upload_open(upload_t *u, const char *url, const char *spool_path, size_t budget, int format)
+{
+    pthread_condattr_t attr;
+
+    memset(u, 0, sizeof(*u));
+    u->format = format;
+    u->spool_fd = -1;
+    u->sock = -1;
+    u->backoff_min_ms = UPLOAD_BACKOFF_MIN_MS;
+    if (upload_parse_url(u, url) < 0){
+	LOGGER_FMT_ERROR("upload: expecting a url of the form http://host[:port][/path], not %s", url);
+	return -1;
+    }
+    if (strlen(spool_path) >= sizeof(u->spool_path) - 4){
+	LOGGER_FMT_ERROR("upload: spool file path too long: %s", spool_path);
+	return -1;
+    }
+    strcpy(u->spool_path, spool_path);
+    u->max_recs = (budget ? budget : UPLOAD_BUDGET) / sizeof(upload_rec_t);
+    if (u->max_recs < 2 * UPLOAD_BATCH)
+	u->max_recs = 2 * UPLOAD_BATCH;
+    if (upload_spool_open(u) < 0){
+	if (u->spool_fd >= 0)
+	    close(u->spool_fd);
+	return -1;
+    }
+    // allocated now, before the first poll, so that in the fixed footprint build it need never grow
+    if ((u->body = arena_alloc(UPLOAD_BODY_SIZE)) == NULL){
+	LOGGER_ERROR("upload: out of memory");
+	close(u->spool_fd);
+	return -1;
+    }
+    u->body_size = UPLOAD_BODY_SIZE;
+    pthread_mutex_init(&u->lock, NULL);
+    // the backoff is timed by the monotonic clock, so that setting the time doesn't upset it
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&u->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+/**
+ * Make room in the full spool file by copying the readings not yet sent to a new one, first
+ * dropping the oldest of them if they would leave it more than 7/8 full
+ * @return 0 on success, -1 on error, which has been logged
+ */
+static int upload_spool_trim(upload_t *u)
+{
+    char tmp[UPLOAD_SPOOL_MAX + 4];
+    upload_rec_t buf[UPLOAD_BATCH];
+    upload_spool_hdr_t hdr;
+    uint32_t keep = u->next - u->hdr.sent, i, n;
+    int fd;
+
+    if (keep > u->max_recs - u->max_recs / 8){
+	n = keep - (u->max_recs - u->max_recs / 8);
+	LOGGER_FMT_WARN("upload: %s is full, dropping the oldest %u readings not yet sent", u->spool_path, n);
+	u->hdr.sent += n;
+	u->dropped += n;
+	keep -= n;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", u->spool_path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+	LOGGER_FMT_ERROR("upload: could not create %s: %s", tmp, strerror(errno));
+	return -1;
+    }
+    hdr = u->hdr;
+    hdr.first = hdr.sent;
+    if (ftruncate(fd, UPLOAD_HDR_LEN) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+	goto fail;
+    for (i = 0; i < keep; i += n){
+	n = keep - i < UPLOAD_BATCH ? keep - i : UPLOAD_BATCH;
+	if (pread(u->spool_fd, buf, n * sizeof(*buf), UPLOAD_OFFSET(u, hdr.first + i)) != n * sizeof(*buf) ||
+	    pwrite(fd, buf, n * sizeof(*buf), UPLOAD_HDR_LEN + (off_t)i * sizeof(*buf)) != n * sizeof(*buf))
+	    goto fail;
+    }
+    if (rename(tmp, u->spool_path) < 0)
+	goto fail;
+    close(u->spool_fd);
+    u->spool_fd = fd;
+    u->hdr = hdr;
+    return 0;
+
+ fail:
+    LOGGER_FMT_ERROR("upload: could not write %s: %s", tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+int upload_append(upload_t *u, uint32_t serial, uint32_t time, const sma_values_t *v)
+{
+    upload_rec_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.serial = serial;
+    rec.time = time;
+    rec.values = *v;
+    pthread_mutex_lock(&u->lock);
+    if (u->next - u->hdr.first >= u->max_recs && upload_spool_trim(u) < 0){
+	pthread_mutex_unlock(&u->lock);
+	return -1;
+    }
+    if (pwrite(u->spool_fd, &rec, sizeof(rec), UPLOAD_OFFSET(u, u->next)) != sizeof(rec)){
+	LOGGER_FMT_ERROR("upload: could not write %s: %s", u->spool_path, strerror(errno));
+	pthread_mutex_unlock(&u->lock);
+	return -1;
+    }
+    u->next++;
+    pthread_cond_signal(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return 0;
+}
+
+uint32_t upload_pending(upload_t *u)
+{
+    uint32_t n;
+
+    pthread_mutex_lock(&u->lock);
+    n = u->next - u->hdr.sent;
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+//! append to the request body as printf() would, growing it as need be
+static int upload_printf(upload_t *u, size_t *len, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    for (;;){
+	va_start(args, fmt);
+	n = vsnprintf(u->body + *len, u->body_size - *len, fmt, args);
+	va_end(args);
+	if (n < 0)
+	    return -1;
+	if (*len + n < u->body_size){
+	    *len += n;
+	    return 0;
+	}
+	char *body = arena_realloc(u->body, u->body_size * 2 + n + 1);
+	if (body == NULL)
+	    return -1;
+	u->body = body;
+	u->body_size = u->body_size * 2 + n + 1;
+    }
+}
+
+//! render the first n readings of the batch as the request body, setting len to its length
+static int upload_render(upload_t *u, int n, size_t *len)
+{
+    int i, val, decimals;
+
+    *len = 0;
+    if (u->format == UPLOAD_FORMAT_FORM)
+	return upload_printf(u, len, "powernow=%i", u->batch[0].values.ac_power);
+    for (i = 0; i < n; i++){
+	const upload_rec_t *rec = &u->batch[i];
+	if (upload_printf(u, len, "serial=%u&time=%u", rec->serial, rec->time) < 0)
+	    return -1;
+	for (val = 0; val < SMA_VAL_COUNT; val++){
+	    if (!(rec->values.have & SMA_HAVE(val)))
+		continue;
+	    double value = sma_value_get(&rec->values, val, &decimals);
+	    if (upload_printf(u, len, "&%s=%.*f", sma_value_name(val), decimals, value) < 0)
+		return -1;
+	}
+	if (upload_printf(u, len, "\n") < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+//! close the connection to the server, if it's open
+static void upload_disconnect(upload_t *u)
+{
+    if (u->sock >= 0)
+	close(u->sock);
+    u->sock = -1;
+}
+
+//! connect to the server
+static int upload_connect(upload_t *u)
+{
+    struct addrinfo hints = { 0 }, *res, *ai;
+    struct timeval tv = { UPLOAD_IO_TIMEOUT_SEC, 0 };
+    int fd = -1, ret;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((ret = getaddrinfo(u->host, u->port, &hints, &res)) != 0){
+	LOGGER_FMT_ERROR("upload: could not resolve %s: %s", u->host, gai_strerror(ret));
+	return -1;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next){
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+	    continue;
+	// the send timeout also bounds the connect
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0){
+	LOGGER_FMT_ERROR("upload: could not connect to %s:%s: %s", u->host, u->port, strerror(errno));
+	return -1;
+    }
+    u->sock = fd;
+    u->connects++;
+    LOGGER_FMT_DEBUG("upload: connected to %s:%s", u->host, u->port);
+    return 0;
+}
+
+//! send all of the passed buffers over the connection
+static int upload_send(int fd, struct iovec *iov, int n_iov)
+{
+    struct msghdr msg = { 0 };
+    ssize_t n;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    while (msg.msg_iovlen > 0){
+	if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) <= 0)
+	    return -1;
+	while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len){
+	    n -= msg.msg_iov->iov_len;
+	    msg.msg_iov++;
+	    msg.msg_iovlen--;
+	}
+	if (msg.msg_iovlen > 0){
+	    msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+	    msg.msg_iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Read the response to a request, closing the connection unless the server keeps it open
+ * @param u The uploader
+ * @param got_any Set if any of the response was read
+ * @return The status of the response, or -1 on error
+ */
+static int upload_response(upload_t *u, int *got_any)
+{
+    char buf[UPLOAD_RESPONSE_MAX + 1], *end, *line;
+    size_t len = 0;
+    ssize_t n;
+    long remain = -1;
+    int minor, status, keep;
+
+    *got_any = 0;
+    buf[0] = '\x0';
+    while ((end = strstr(buf, "\r\n\r\n")) == NULL){
+	if (len == UPLOAD_RESPONSE_MAX){
+	    errno = EMSGSIZE;
+	    return -1;
+	}
+	if ((n = recv(u->sock, buf + len, UPLOAD_RESPONSE_MAX - len, 0)) <= 0){
+	    if (n == 0)
+		errno = ECONNRESET;
+	    return -1;
+	}
+	*got_any = 1;
+	len += n;
+	buf[len] = '\x0';
+    }
+    if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2){
+	errno = EPROTO;
+	return -1;
+    }
+    keep = minor >= 1;
+    for (line = strstr(buf, "\r\n") + 2; line < end + 2; line = strstr(line, "\r\n") + 2){
+	if (strncasecmp(line, "Content-Length:", 15) == 0)
+	    remain = strtol(line + 15, NULL, 10);
+	else if (strncasecmp(line, "Connection:", 11) == 0){
+	    if (strncasecmp(line + 11 + strspn(line + 11, " \t"), "close", 5) == 0)
+		keep = 0;
+	    else if (strncasecmp(line + 11 + strspn(line + 11, " \t"), "keep-alive", 10) == 0)
+		keep = 1;
+	} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+	    remain = -1;
+    }
+    if (status == 204 || status == 304)
+	remain = 0;
+    if (remain < 0){
+	// the end of the body is only known by the server closing the connection, which isn't waited for
+	upload_disconnect(u);
+	return status;
+    }
+    // the body isn't wanted, but is read so the next response can be
+    remain -= len - (end + 4 - buf);
+    while (remain > 0){
+	if ((n = recv(u->sock, buf, remain < UPLOAD_RESPONSE_MAX ? remain : UPLOAD_RESPONSE_MAX, 0)) <= 0){
+	    keep = 0;
+	    break;
+	}
+	remain -= n;
+    }
+    if (!keep)
+	upload_disconnect(u);
+    return status;
+}
+
+/**
+ * POST the request body, of the passed length, over the connection to the server, connecting
+ * if need be
+ * @return The status of the response, or -1 on error, which has been logged
+ */
+static int upload_post(upload_t *u, size_t len)
+{
+    char hdr[UPLOAD_PATH_MAX + UPLOAD_HOST_MAX + 128];
+    struct iovec iov[2];
+    int hdr_len, tries, reused, got_any = 0, status;
+
+    hdr_len = snprintf(hdr, sizeof(hdr), "POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: sbread\r\n"
+		       "Content-Type: %s\r\nContent-Length: %lu\r\n\r\n", u->path, u->host,
+		       u->format == UPLOAD_FORMAT_FORM ? "application/x-www-form-urlencoded" : "text/plain", (unsigned long)len);
+    for (tries = 0; tries < 2; tries++){
+	reused = u->sock >= 0;
+	if (!reused && upload_connect(u) < 0)
+	    return -1;
+	// the header and body go in one send, so as not to be held up waiting for the header to be acked
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdr_len;
+	iov[1].iov_base = u->body;
+	iov[1].iov_len = len;
+	if (upload_send(u->sock, iov, 2) == 0 && (status = upload_response(u, &got_any)) >= 0)
+	    return status;
+	upload_disconnect(u);
+	// a connection kept open may have been closed by the server meanwhile, so that's tried again afresh
+	if (!reused || got_any)
+	    break;
+	LOGGER_FMT_DEBUG("upload: connection to %s closed, reconnecting", u->host);
+    }
+    LOGGER_FMT_ERROR("upload: POST to %s:%s%s failed: %s", u->host, u->port, u->path, strerror(errno));
+    return -1;
+}
+
+/**
+ * POST the first n readings of the batch, unless there's nothing of them to send
+ * @return 0 once the server has taken them, -1 on error, which has been logged
+ */
+static int upload_post_batch(upload_t *u, uint32_t n)
+{
+    size_t len;
+    int status;
+
+    if (u->format == UPLOAD_FORMAT_FORM && !(u->batch[0].values.have & SMA_HAVE(SMA_VAL_AC_POWER))){
+	LOGGER_DEBUG("upload: skipped a reading without the AC power");
+	return 0;
+    }
+    if (upload_render(u, n, &len) < 0){
+	LOGGER_ERROR("upload: out of memory");
+	return -1;
+    }
+    if ((status = upload_post(u, len)) < 0){
+	u->failures++;
+	return -1;
+    }
+    if (status / 100 != 2){
+	LOGGER_FMT_ERROR("upload: %s:%s%s answered with status %i", u->host, u->port, u->path, status);
+	u->failures++;
+	return -1;
+    }
+    u->posts++;
+    u->uploaded += n;
+    LOGGER_FMT_DEBUG("upload: sent %u readings", n);
+    return 0;
+}
+
+/**
+ * Send the next batch of readings, taking them off the spool once the server has taken them
+ * @return 1 if a batch was sent, 0 if there was none to send, -1 on error, which has been logged
+ */
+static int upload_send_batch(upload_t *u)
+{
+    uint32_t first, n, batch = u->format == UPLOAD_FORMAT_LINES ? UPLOAD_BATCH : 1;
+    ssize_t got;
+
+    pthread_mutex_lock(&u->lock);
+    first = u->hdr.sent;
+    n = u->next - first < batch ? u->next - first : batch;
+    got = n ? pread(u->spool_fd, u->batch, n * sizeof(*u->batch), UPLOAD_OFFSET(u, first)) : 0;
+    pthread_mutex_unlock(&u->lock);
+    if (n == 0)
+	return 0;
+    if (got != n * sizeof(*u->batch)){
+	LOGGER_FMT_ERROR("upload: could not read %s: %s", u->spool_path, got < 0 ? strerror(errno) : "too short");
+	return -1;
+    }
+    if (upload_post_batch(u, n) < 0)
+	return -1;
+
+    // readings may have been dropped to make room meanwhile
+    pthread_mutex_lock(&u->lock);
+    if ((int32_t)(first + n - u->hdr.sent) > 0)
+	u->hdr.sent = first + n;
+    if (u->hdr.sent == u->next){
+	// all sent, so the file is emptied
+	u->hdr.first = u->next;
+	if (ftruncate(u->spool_fd, UPLOAD_HDR_LEN) < 0)
+	    LOGGER_FMT_ERROR("upload: could not truncate %s: %s", u->spool_path, strerror(errno));
+    }
+    upload_write_hdr(u);
+    pthread_mutex_unlock(&u->lock);
+    return 1;
+}
+
+int upload_flush(upload_t *u)
+{
+    int ret;
+
+    while ((ret = upload_send_batch(u)) > 0)
+	;
+    return ret;
+}
+
+//! the background thread, sending the readings as they're appended and backing off after an error
+static void *upload_thread(void *arg)
+{
+    upload_t *u = arg;
+    struct timespec ts;
+    int ret;
+
+    pthread_mutex_lock(&u->lock);
+    while (!u->stop){
+	if (u->next == u->hdr.sent){
+	    pthread_cond_wait(&u->cond, &u->lock);
+	    continue;
+	}
+	pthread_mutex_unlock(&u->lock);
+	ret = upload_send_batch(u);
+	pthread_mutex_lock(&u->lock);
+	if (ret >= 0){
+	    u->backoff_ms = 0;
+	    continue;
+	}
+	u->backoff_ms = u->backoff_ms ? u->backoff_ms * 2 : u->backoff_min_ms;
+	if (u->backoff_ms > UPLOAD_BACKOFF_MAX_MS)
+	    u->backoff_ms = UPLOAD_BACKOFF_MAX_MS;
+	LOGGER_FMT_INFO("upload: trying again in %u ms, %u readings to be sent", u->backoff_ms, u->next - u->hdr.sent);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += u->backoff_ms / 1000;
+	ts.tv_nsec += (u->backoff_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	// readings appended meanwhile wait for the backoff too
+	while (!u->stop && pthread_cond_timedwait(&u->cond, &u->lock, &ts) != ETIMEDOUT)
+	    ;
+    }
+    pthread_mutex_unlock(&u->lock);
+    return NULL;
+}
+
+int upload_start(upload_t *u)
+{
+    if (pthread_create(&u->thread, NULL, upload_thread, u) != 0){
+	LOGGER_ERROR("upload: could not start the upload thread");
+	return -1;
+    }
+    u->running = 1;
+    LOGGER_FMT_INFO("uploading readings to %s:%s%s", u->host, u->port, u->path);
+    return 0;
+}
+
+void upload_close(upload_t *u)
+{
+    if (u->running){
+	pthread_mutex_lock(&u->lock);
+	u->stop = 1;
+	pthread_cond_signal(&u->cond);
+	pthread_mutex_unlock(&u->lock);
+	pthread_join(u->thread, NULL);
+	u->running = 0;
+    }
+    upload_disconnect(u);
+    if (u->spool_fd >= 0)
+	close(u->spool_fd);
+    u->spool_fd = -1;
+    arena_free(u->body);
+    u->body = NULL;
+    pthread_mutex_destroy(&u->lock);
+    pthread_cond_destroy(&u->cond);
+}
@@ -0,0 +1,199 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+// -----------------------------------------------------------------------------
+// Copyright telecnatron.com. 2014.
+// $Id: $
+//
+// Store and forward upload of the readings to a web server, for sbread -upload.
+//
+// Each reading is first appended to a spool file, then POSTed to the server
+// over one HTTP/1.1 connection, which is kept open between POSTs. A batch is only taken off the spool once the server has
+// answered it with a 2xx status, so readings taken while the server can't be
+// reached are kept, and sent once it can be, across restarts of sbread. A
+// reading may be sent twice if sbread dies between the server's answer and the
+// spool being updated, so the server should ignore a reading of an inverter at
+// a time it already has.
+//
+// By default each reading is POSTed on its own, as form data with its AC power,
+//   powernow=3077
+// which is what sbrun.pl sent with curl, and report.php reads. A reading
+// without the AC power is taken off the spool without being sent. With
+// UPLOAD_FORMAT_LINES the readings are POSTed in batches of up to UPLOAD_BATCH
+// instead, the body being text, one reading per line, each line being the
+// reading as form data, eg
+//   serial=2130248863&time=1412345678&ac_power=3077&day_wh=13400
+// with the values present named and scaled as by sbread -all.
+//
+// The spool file is an upload_spool_hdr_t, padded to UPLOAD_HDR_LEN, followed
+// by fixed size upload_rec_t records. Every reading appended is numbered, and
+// the header holds the numbers of the first reading in the file and of the
+// next to be sent. When all of the readings in the file have been sent it is
+// truncated, and if it grows to its budget the readings already sent are
+// dropped from the front of it, followed if need be by the oldest not yet sent.
+//
+// In daemon mode the batches are sent from a background thread, which on an
+// error waits before trying again, doubling the wait each time from
+// UPLOAD_BACKOFF_MIN_MS up to UPLOAD_BACKOFF_MAX_MS. Otherwise upload_flush()
+// sends what it can before sbread exits, and what it can't is left for the
+// next run.
+//
+// This code is released to the public domain.
+// -----------------------------------------------------------------------------
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sma.h"
+
+//! 'SBUP' - magic number at the start of the spool file
+#define UPLOAD_MAGIC          0x50554253
+//! version of the spool file layout, bump whenever it changes
+#define UPLOAD_VERSION        1
+//! length of the spool file header, the records follow
+#define UPLOAD_HDR_LEN        64
+//! the spool file used by default
+#define UPLOAD_SPOOL_DEFAULT  "/tmp/sbread.spool"
+//! bytes the spool file may take up by default, about a week of readings a minute apart
+#define UPLOAD_BUDGET         (1024 * 1024)
+//! formats of the request body: the AC power of a reading as form data, or a batch of readings, a line each
+#define UPLOAD_FORMAT_FORM    0
+#define UPLOAD_FORMAT_LINES   1
+//! most readings in each POST with UPLOAD_FORMAT_LINES, fewer in the fixed footprint build, see arena.h, to keep down the size of the body
+#ifdef SB_ARENA_INVERTERS
+#define UPLOAD_BATCH          16
+#else
+#define UPLOAD_BATCH          64
+#endif
+//! most bytes of a reading as a line of the body: its serial number and time, and each of its values
+//! named in fewer than 32 characters, at most 20 digits with a sign, point and decimals
+#define UPLOAD_LINE_MAX       (64 + SMA_VAL_COUNT * 64)
+//! bytes the body is allocated with to begin with, and grown from as need be. In the fixed footprint
+//! build it can't be grown so is allocated at the most it can need.
+#ifdef SB_ARENA_INVERTERS
+#define UPLOAD_BODY_SIZE      (UPLOAD_BATCH * UPLOAD_LINE_MAX)
+#else
+#define UPLOAD_BODY_SIZE      4096
+#endif
+//! longest host, port and path of the url
+#define UPLOAD_HOST_MAX       128
+#define UPLOAD_PORT_MAX       8
+#define UPLOAD_PATH_MAX       256
+//! longest path of the spool file
+#define UPLOAD_SPOOL_MAX      256
+//! most bytes of a response's status line and headers read
+#define UPLOAD_RESPONSE_MAX   2048
+//! seconds allowed for connecting to the server, sending a batch and reading each part of the response
+#define UPLOAD_IO_TIMEOUT_SEC 10
+//! wait after the first error before trying again, and the most it is doubled to
+#define UPLOAD_BACKOFF_MIN_MS 5000
+#define UPLOAD_BACKOFF_MAX_MS 600000
+
+//! a reading, as spooled
+typedef struct {
+    //! the inverter's serial number
+    uint32_t serial;
+    //! unix time of the reading
+    uint32_t time;
+    sma_values_t values;
+} upload_rec_t;
+
+//! header at the start of the spool file
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    //! size of each record
+    uint16_t rec_size;
+    //! number of the first reading in the file
+    uint32_t first;
+    //! number of the next reading to be sent
+    uint32_t sent;
+} upload_spool_hdr_t;
+
+typedef struct {
+    //! the server, and the path posted to
+    char host[UPLOAD_HOST_MAX];
+    char port[UPLOAD_PORT_MAX];
+    char path[UPLOAD_PATH_MAX];
+    //! format of the request body, UPLOAD_FORMAT_FORM or UPLOAD_FORMAT_LINES
+    int format;
+    //! the spool file, and its header as last written
+    char spool_path[UPLOAD_SPOOL_MAX];
+    int spool_fd;
+    upload_spool_hdr_t hdr;
+    //! number of the next reading to be appended
+    uint32_t next;
+    //! most readings the spool file may hold
+    uint32_t max_recs;
+    //! held while using the spool file
+    pthread_mutex_t lock;
+    //! signalled when a reading is appended, or the background thread is to stop
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    //! the connection to the server, -1 if not connected
+    int sock;
+    //! wait after the first error, as UPLOAD_BACKOFF_MIN_MS, and after the last
+    uint32_t backoff_min_ms;
+    uint32_t backoff_ms;
+    //! counters: POSTs answered with a 2xx status, failed POSTs, connections made, readings sent and
+    //! readings dropped as the spool file was full
+    uint32_t posts;
+    uint32_t failures;
+    uint32_t connects;
+    uint32_t uploaded;
+    uint32_t dropped;
+    //! the batch being sent, and the request it is rendered into, only used by the sender
+    upload_rec_t batch[UPLOAD_BATCH];
+    char *body;
+    size_t body_size;
+} upload_t;
+
+/**
+ * Open the spool file, creating it if need be, ready to upload the readings in it and those
+ * appended to the passed url
+ *
+ * @param u The uploader
+ * @param url Where the readings are POSTed, http://host[:port][/path]
+ * @param spool_path The spool file, eg UPLOAD_SPOOL_DEFAULT
+ * @param budget Most bytes the spool file may take up, 0 for UPLOAD_BUDGET
+ * @param format Format of the request body, UPLOAD_FORMAT_FORM or UPLOAD_FORMAT_LINES
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int upload_open(upload_t *u, const char *url, const char *spool_path, size_t budget, int format);
+
+/**
+ * Append a reading to the spool file, and wake the background thread if it's running
+ *
+ * @param u The uploader
+ * @param serial The inverter's serial number
+ * @param time Unix time of the reading
+ * @param v The values read
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int upload_append(upload_t *u, uint32_t serial, uint32_t time, const sma_values_t *v);
+
+//! return the number of readings in the spool file not yet sent
+uint32_t upload_pending(upload_t *u);
+
+/**
+ * Send the readings not yet sent, until all have been sent or one fails. Not to be
+ * called while the background thread is running.
+ *
+ * @return 0 once all have been sent, -1 if a batch failed, which has been logged
+ */
+int upload_flush(upload_t *u);
+
+/**
+ * Start sending the readings from a background thread, as they are appended
+ *
+ * @return 0 on success, -1 on error, which has been logged
+ */
+int upload_start(upload_t *u);
+
+//! stop the background thread if it's running, and close the connection and the spool file
+void upload_close(upload_t *u);
+
+#endif